@@ -14,7 +14,7 @@
 
 using namespace std;
 
-unsigned char fixedIV[] =
+const unsigned char SWPfixedIV[] =
 {34, 145, 42, 12, 56, 13, 111, 100, 98, 6, 2, 63, 88, 4, 22, 74};
 
 static string iv_det;
@@ -92,11 +92,10 @@ SWP::encryptSym(const string & key, const string & val, const string & iv)
 
     auto result = vector<unsigned char>(newlen);
 
-    unsigned char * newiv = new unsigned char[iv.length()];
-    memcpy(newiv, iv.c_str(), iv.length());
+    auto newiv = vector<unsigned char>(iv.begin(), iv.end());
 
     AES_cbc_encrypt((const unsigned char *)val2.c_str(), &result[0], newlen, &aes_key,
-                    newiv, AES_ENCRYPT);
+                    &newiv[0], AES_ENCRYPT);
 
     return string((char*)&result[0], newlen);
 }
@@ -113,15 +112,14 @@ SWP::decryptSym(const string & key, const string & ciph, const string & iv)
     AES_set_decrypt_key((const unsigned char *)key.c_str(), AES_BLOCK_BITS, &aes_key);
 
     unsigned int ciphlen = ciph.length();
-    auto result = new unsigned char[ciphlen];
+    auto result = vector<unsigned char>(ciphlen);
 
-    unsigned char * newiv = new unsigned char[iv.length()];
-    memcpy(newiv, iv.c_str(), iv.length());
+    auto newiv = vector<unsigned char>(iv.begin(), iv.end());
 
-    AES_cbc_encrypt((const unsigned char*)ciph.c_str(), result, ciphlen, &aes_key,
-                    newiv, AES_DECRYPT);
+    AES_cbc_encrypt((const unsigned char*)ciph.c_str(), &result[0], ciphlen, &aes_key,
+                    &newiv[0], AES_DECRYPT);
 
-    return unpad(string((const char *)result, ciphlen));
+    return unpad(string((const char *)&result[0], ciphlen));
 
 }
 
@@ -148,10 +146,10 @@ SWP::decryptSym(const string & key, const string & ciph)
 string
 SWP::random(unsigned int nobytes)
 {
-    unsigned char * bin = new unsigned char[nobytes];
-    RAND_bytes(bin, nobytes);
+    auto bin = vector<unsigned char>(nobytes);
+    RAND_bytes(&bin[0], nobytes);
 
-    return string((const char *)bin, nobytes);
+    return string((const char *)&bin[0], nobytes);
 }
 
 /**************************** SWP ****************/
@@ -163,7 +161,7 @@ SWP::SWPHalfEncrypt(const string & key, string word, string & ciph,
                     string & wordKey)
 {
     //encryption of word E[W_i]
-    string IV((const char *)fixedIV, AES_BLOCK_SIZE);
+    string IV((const char *)SWPfixedIV, AES_BLOCK_SIZE);
     ciph = encryptSym(key, word, IV);
 
     //L_i and R_i
@@ -187,11 +185,11 @@ bytewise_xor(const string & a, const string & b) {
 
     unsigned int len = a.length();
 
-    char * res = new char[len];
+    string res(len, 0);
     for (unsigned int i = 0; i < len; i++) {
 	res[i] = a[i] xor b[i];
     }
-    return string(res, len);
+    return res;
 }
 
 string
@@ -301,7 +299,7 @@ SWP::SWPdecrypt(const string & key, const string & word, unsigned int index)
 
     string R_i = bytewise_xor(func, word.substr(SWPr, SWPm));
 
-    return decryptSym(key, L_i + R_i, string((const char *)fixedIV, AES_BLOCK_SIZE));
+    return decryptSym(key, L_i + R_i, string((const char *)SWPfixedIV, AES_BLOCK_SIZE));
 
 }
 
@@ -31,6 +31,9 @@ const unsigned int SWPm = 4; //the rate of false positives when searching is
 const unsigned int SWP_SALT_LEN = 8; //the size of salt in bytes
 const unsigned int SWPr = SWPCiphSize - SWPm;
 
+// The IV under which a word is first encrypted, E[W_i].
+extern const unsigned char SWPfixedIV[AES_BLOCK_SIZE];
+
 typedef struct Token {
     std::string ciph;
     std::string wordKey;
@@ -0,0 +1,333 @@
+#include <crypto/aes_cmc.hh>
+#include <crypto/aesni.hh>
+#include <crypto/BasicCrypto.hh>
+#include <util/errstream.hh>
+
+#include <string.h>
+
+#ifdef AESNI_AVAILABLE
+
+static const size_t block_bytes = 16;
+
+// BasicCrypto's CMC runs both CBC passes from the IV of salt "0".
+static const uint8_t cmc_iv[block_bytes] = {'0'};
+
+// The blocks of @v once padded: the pad count, 1 to 16, fills the tail.
+static size_t
+padded_blocks(const std::string &v)
+{
+    return v.size() / block_bytes + 1;
+}
+
+static void
+padded_block(const std::string &v, size_t i, uint8_t *out)
+{
+    const size_t offset = i * block_bytes;
+    if (offset + block_bytes <= v.size()) {
+        memcpy(out, v.data() + offset, block_bytes);
+        return;
+    }
+
+    const size_t left = v.size() - offset;
+    memset(out, 0, block_bytes);
+    memcpy(out, v.data() + offset, left);
+    out[block_bytes - 1] = static_cast<uint8_t>(block_bytes - left);
+}
+
+static void
+unpad(std::string *const v)
+{
+    const size_t pad_count = static_cast<uint8_t>((*v)[v->size() - 1]);
+    if (false == (pad_count > 0 && pad_count <= block_bytes)) {
+        throw CryptoError("AES padding is wrong size!");
+    }
+    v->resize(v->size() - pad_count);
+}
+
+static void
+check_ciphertext(const std::string &v)
+{
+    throw_c(v.size() > 0 && 0 == v.size() % block_bytes);
+}
+
+/*
+ * A value being encrypted. Its 2n steps are the n blocks of the first
+ * CBC pass, stored in reverse into @out, then the n of the second pass,
+ * in place over @out.
+ */
+struct EncryptLane {
+    std::string *value;
+    std::string out;
+    size_t blocks;
+    size_t step;
+};
+
+static AESNI void
+aesni_cmc_encrypt(const uint8_t *rk, std::string *const *const values,
+                  size_t count)
+{
+    __m128i k[11];
+    for (int r = 0; r < 11; r++) {
+        k[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rk + 16*r));
+    }
+    const __m128i iv =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(cmc_iv));
+
+    EncryptLane lane[aes_cmc::lanes];
+    __m128i chain[aes_cmc::lanes];
+    size_t next = 0;
+    size_t active = 0;
+    const auto start = [&](size_t j) {
+        lane[j].value = values[next++];
+        lane[j].blocks = padded_blocks(*lane[j].value);
+        lane[j].out.resize(lane[j].blocks * block_bytes);
+        lane[j].step = 0;
+        chain[j] = iv;
+    };
+    while (active < aes_cmc::lanes && next < count) {
+        start(active++);
+    }
+
+    // One block of every active value per iteration; a value that is
+    // done hands its lane to the next one.
+    while (active > 0) {
+        __m128i x[aes_cmc::lanes];
+        for (size_t j = 0; j < active; j++) {
+            const EncryptLane &l = lane[j];
+            __m128i in;
+            if (l.step < l.blocks) {
+                uint8_t b[block_bytes];
+                padded_block(*l.value, l.step, b);
+                in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+            } else {
+                in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                         &l.out[(l.step - l.blocks) * block_bytes]));
+            }
+            x[j] = _mm_xor_si128(_mm_xor_si128(in, chain[j]), k[0]);
+        }
+        for (int r = 1; r < 10; r++) {
+            for (size_t j = 0; j < active; j++) {
+                x[j] = _mm_aesenc_si128(x[j], k[r]);
+            }
+        }
+        for (size_t j = 0; j < active; j++) {
+            x[j] = _mm_aesenclast_si128(x[j], k[10]);
+        }
+
+        for (size_t j = 0; j < active; ) {
+            EncryptLane &l = lane[j];
+            const size_t at = l.step < l.blocks
+                                  ? l.blocks - 1 - l.step
+                                  : l.step - l.blocks;
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(
+                                 &l.out[at * block_bytes]), x[j]);
+            chain[j] = x[j];
+            if (++l.step == l.blocks) {
+                chain[j] = iv;
+            }
+            if (l.step < 2 * l.blocks) {
+                j++;
+                continue;
+            }
+
+            l.value->swap(l.out);
+            if (next < count) {
+                start(j++);
+            } else if (j < --active) {
+                // The last lane takes over this one.
+                lane[j].value = lane[active].value;
+                lane[j].out.swap(lane[active].out);
+                lane[j].blocks = lane[active].blocks;
+                lane[j].step = lane[active].step;
+                chain[j] = chain[active];
+                x[j] = x[active];
+            }
+        }
+    }
+}
+
+// One block of a CBC decryption: D(@src) ^ @prev into @dst.
+struct DecryptJob {
+    const uint8_t *src;
+    const uint8_t *prev;
+    uint8_t *dst;
+};
+
+template<size_t N>
+static AESNI void
+aesni_cbc_decrypt(const uint8_t *drk, const DecryptJob *jobs)
+{
+    __m128i k[11];
+    for (int r = 0; r < 11; r++) {
+        k[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(drk + 16*r));
+    }
+
+    __m128i x[N];
+    for (size_t j = 0; j < N; j++) {
+        x[j] = _mm_xor_si128(_mm_loadu_si128(
+                                 reinterpret_cast<const __m128i *>(
+                                     jobs[j].src)), k[0]);
+    }
+    for (int r = 1; r < 10; r++) {
+        for (size_t j = 0; j < N; j++) {
+            x[j] = _mm_aesdec_si128(x[j], k[r]);
+        }
+    }
+    for (size_t j = 0; j < N; j++) {
+        x[j] = _mm_aesdeclast_si128(x[j], k[10]);
+        x[j] = _mm_xor_si128(x[j], _mm_loadu_si128(
+                                       reinterpret_cast<const __m128i *>(
+                                           jobs[j].prev)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(jobs[j].dst), x[j]);
+    }
+}
+
+static void
+aesni_cbc_decrypt_all(const uint8_t *drk, const std::vector<DecryptJob> &jobs)
+{
+    size_t done = 0;
+    for (; done + aes_cmc::lanes <= jobs.size(); done += aes_cmc::lanes) {
+        aesni_cbc_decrypt<aes_cmc::lanes>(drk, &jobs[done]);
+    }
+    for (; done < jobs.size(); done++) {
+        aesni_cbc_decrypt<1>(drk, &jobs[done]);
+    }
+}
+
+/*
+ * The first pass decrypts each ciphertext into @reversed, blocks in
+ * reverse order; the second decrypts that back into the value.
+ */
+static void
+aesni_cmc_decrypt(const uint8_t *drk, std::string *const *const values,
+                  size_t count)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += values[i]->size() / block_bytes;
+    }
+
+    std::vector<uint8_t> reversed(total * block_bytes);
+    std::vector<DecryptJob> first;
+    std::vector<DecryptJob> second;
+    first.reserve(total);
+    second.reserve(total);
+
+    uint8_t *r = reversed.data();
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *const v = reinterpret_cast<uint8_t *>(&(*values[i])[0]);
+        const size_t n = values[i]->size() / block_bytes;
+        for (size_t b = 0; b < n; b++) {
+            const DecryptJob f = {v + b * block_bytes,
+                                  b ? v + (b - 1) * block_bytes : cmc_iv,
+                                  r + (n - 1 - b) * block_bytes};
+            first.push_back(f);
+            const DecryptJob s = {r + b * block_bytes,
+                                  b ? r + (b - 1) * block_bytes : cmc_iv,
+                                  v + b * block_bytes};
+            second.push_back(s);
+        }
+        r += n * block_bytes;
+    }
+
+    aesni_cbc_decrypt_all(drk, first);
+    aesni_cbc_decrypt_all(drk, second);
+}
+
+#endif
+
+aes_cmc::aes_cmc(const std::string &key)
+{
+    throw_c(key.size() == key_bytes, "aes_cmc takes an AES-128 key");
+
+    const uint8_t *const k = reinterpret_cast<const uint8_t *>(key.data());
+    AES_set_encrypt_key(k, key_bytes * 8, &enckey);
+    AES_set_decrypt_key(k, key_bytes * 8, &deckey);
+
+    memset(round_keys, 0, sizeof(round_keys));
+    memset(dec_round_keys, 0, sizeof(dec_round_keys));
+#ifdef AESNI_AVAILABLE
+    if (aesni_supported()) {
+        aesni_expand_key(k, round_keys);
+        aesni_decrypt_keys(round_keys, dec_round_keys);
+    }
+#endif
+}
+
+std::string
+aes_cmc::encrypt(const std::string &ptext) const
+{
+    std::string v = ptext;
+    std::string *const p = &v;
+    encryptValues(&p, 1);
+    return v;
+}
+
+std::string
+aes_cmc::decrypt(const std::string &ctext) const
+{
+    std::string v = ctext;
+    std::string *const p = &v;
+    decryptValues(&p, 1);
+    return v;
+}
+
+void
+aes_cmc::encrypt(std::vector<std::string> *const values) const
+{
+    std::vector<std::string *> p;
+    p.reserve(values->size());
+    for (auto &v : *values) {
+        p.push_back(&v);
+    }
+    encryptValues(p.data(), p.size());
+}
+
+void
+aes_cmc::decrypt(std::vector<std::string> *const values) const
+{
+    std::vector<std::string *> p;
+    p.reserve(values->size());
+    for (auto &v : *values) {
+        p.push_back(&v);
+    }
+    decryptValues(p.data(), p.size());
+}
+
+void
+aes_cmc::encryptValues(std::string *const *const values,
+                       size_t count) const
+{
+#ifdef AESNI_AVAILABLE
+    if (aesni_supported()) {
+        aesni_cmc_encrypt(round_keys, values, count);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        *values[i] = encrypt_AES_CMC(*values[i], &enckey, true);
+    }
+}
+
+void
+aes_cmc::decryptValues(std::string *const *const values,
+                       size_t count) const
+{
+#ifdef AESNI_AVAILABLE
+    if (aesni_supported()) {
+        for (size_t i = 0; i < count; i++) {
+            check_ciphertext(*values[i]);
+        }
+        aesni_cmc_decrypt(dec_round_keys, values, count);
+        for (size_t i = 0; i < count; i++) {
+            unpad(values[i]);
+        }
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        *values[i] = decrypt_AES_CMC(*values[i], &deckey, true);
+    }
+}
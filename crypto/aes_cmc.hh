@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/aes.h>
+
+/*
+ * encrypt_AES_CMC() and decrypt_AES_CMC() (see BasicCrypto.hh), padding
+ * included, under one AES-128 key; the output is byte for byte the
+ * same.
+ *
+ * Both passes of an encryption are CBC chains, so the blocks of one
+ * value go through AES one after the other; the batch calls keep up to
+ * lanes values in flight and interleave their chains. Both passes of a
+ * decryption are CBC decryptions, whose blocks only depend on the
+ * ciphertext, so every block of every value is independent within a
+ * pass. On CPUs without AES-NI, OpenSSL does one value at a time.
+ */
+class aes_cmc {
+ public:
+    aes_cmc(const std::string &key);
+
+    std::string encrypt(const std::string &ptext) const;
+    std::string decrypt(const std::string &ctext) const;
+    // In place. A value that isn't a ciphertext throws, and leaves the
+    // values in an unspecified state.
+    void encrypt(std::vector<std::string> *const values) const;
+    void decrypt(std::vector<std::string> *const values) const;
+
+    static const size_t key_bytes = 16;
+    static const size_t lanes = 8;
+
+ private:
+    AES_KEY enckey;
+    AES_KEY deckey;
+    uint8_t round_keys[11 * 16];
+    uint8_t dec_round_keys[11 * 16];
+
+    void encryptValues(std::string *const *const values,
+                       size_t count) const;
+    void decryptValues(std::string *const *const values,
+                       size_t count) const;
+};
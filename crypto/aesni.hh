@@ -0,0 +1,74 @@
+#pragma once
+
+/*
+ * AES-128 round keys for the AES-NI kernels of the ciphers that run many
+ * blocks side by side (ffx64_aes, aes_cmc). AESNI_AVAILABLE is defined
+ * where the compiler can emit the instructions; aesni_supported() says
+ * whether this CPU has them.
+ */
+
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#define AESNI_AVAILABLE
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+// The kernels only pay off with their loops unrolled into registers,
+// which the default -O0 build doesn't do.
+#define AESNI __attribute__((target("aes,sse2"), optimize("O3")))
+
+static inline AESNI __m128i
+aesni_expand_step(__m128i k, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, assist);
+}
+
+// The 11 encryption round keys of @key, 16 bytes each.
+static inline AESNI void
+aesni_expand_key(const uint8_t *key, uint8_t *rk)
+{
+    __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(rk), k);
+
+#define EXPAND(i, rcon)                                                 \
+    k = aesni_expand_step(k, _mm_aeskeygenassist_si128(k, rcon));       \
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(rk + 16 * i), k)
+
+    EXPAND(1, 0x01); EXPAND(2, 0x02); EXPAND(3, 0x04); EXPAND(4, 0x08);
+    EXPAND(5, 0x10); EXPAND(6, 0x20); EXPAND(7, 0x40); EXPAND(8, 0x80);
+    EXPAND(9, 0x1b); EXPAND(10, 0x36);
+#undef EXPAND
+}
+
+// The round keys of the equivalent inverse cipher, for aesdec, from the
+// encryption round keys @rk.
+static inline AESNI void
+aesni_decrypt_keys(const uint8_t *rk, uint8_t *drk)
+{
+    for (int r = 0; r <= 10; r++) {
+        __m128i k = _mm_loadu_si128(
+                        reinterpret_cast<const __m128i *>(rk + 16 * (10 - r)));
+        if (r != 0 && r != 10) {
+            k = _mm_aesimc_si128(k);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(drk + 16 * r), k);
+    }
+}
+
+#endif
+
+static inline bool
+aesni_supported()
+{
+#ifdef AESNI_AVAILABLE
+    static const bool aesni = __builtin_cpu_supports("aes");
+    return aesni;
+#else
+    return false;
+#endif
+}
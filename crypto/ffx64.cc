@@ -0,0 +1,247 @@
+#include <crypto/ffx64.hh>
+#include <crypto/ffx.hh>
+#include <crypto/aesni.hh>
+#include <util/errstream.hh>
+
+#include <string.h>
+#include <vector>
+
+/*
+ * A round MACs one block after the header: the round number, then the
+ * right half as a host-order uint64, zero padded. Its output is the top
+ * half of the first eight bytes of the MAC, read in host order.
+ *
+ * Decryption runs the same rounds backwards on swapped halves.
+ */
+
+static const unsigned int half_bits = 32;
+static const uint64_t half_mask = 0xffffffffULL;
+
+static uint64_t
+swap_halves(uint64_t v)
+{
+    return v << half_bits | v >> half_bits;
+}
+
+#ifdef AESNI_AVAILABLE
+
+// All rounds of N values at once; the AES of one value is independent
+// of the others', so they overlap in the pipeline.
+template<size_t N>
+static AESNI void
+aesni_rounds(const uint8_t *rk, const uint8_t *header_mac, uint64_t *v,
+             bool inverse)
+{
+    __m128i k[11];
+    for (int r = 0; r < 11; r++) {
+        k[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rk + 16*r));
+    }
+    // The header MAC goes in with the first round key.
+    const __m128i start =
+        _mm_xor_si128(k[0], _mm_loadu_si128(
+                                reinterpret_cast<const __m128i *>(header_mac)));
+
+    uint64_t a[N], b[N];
+    for (size_t j = 0; j < N; j++) {
+        const uint64_t x = inverse ? swap_halves(v[j]) : v[j];
+        a[j] = x >> half_bits;
+        b[j] = x & half_mask;
+    }
+
+    for (int r = 0; r < ffx64_aes::rounds; r++) {
+        const uint64_t i = inverse ? ffx64_aes::rounds - 1 - r : r;
+
+        __m128i x[N];
+        for (size_t j = 0; j < N; j++) {
+            x[j] = _mm_xor_si128(start, _mm_cvtsi64_si128(i | b[j] << 8));
+        }
+        for (int kr = 1; kr < 10; kr++) {
+            for (size_t j = 0; j < N; j++) {
+                x[j] = _mm_aesenc_si128(x[j], k[kr]);
+            }
+        }
+        for (size_t j = 0; j < N; j++) {
+            x[j] = _mm_aesenclast_si128(x[j], k[10]);
+            const uint64_t c = a[j] ^ (static_cast<uint64_t>(
+                                           _mm_cvtsi128_si64(x[j]))
+                                       >> half_bits);
+            a[j] = b[j];
+            b[j] = c;
+        }
+    }
+
+    for (size_t j = 0; j < N; j++) {
+        const uint64_t x = a[j] << half_bits | b[j];
+        v[j] = inverse ? swap_halves(x) : x;
+    }
+}
+
+#endif
+
+ffx64_aes::ffx64_aes(const std::string &key)
+    : aes(key)
+{
+    throw_c(key.size() == key_bytes, "ffx64_aes takes an AES-128 key");
+
+    const ffx2_mac_header h(64, std::vector<uint8_t>());
+    cbcmac<AES> mac(&aes);
+    mac.update(&h, sizeof(h));
+    mac.final(header_mac);
+
+    memset(round_keys, 0, sizeof(round_keys));
+#ifdef AESNI_AVAILABLE
+    if (hardware()) {
+        aesni_expand_key(reinterpret_cast<const uint8_t *>(key.data()),
+                         round_keys);
+    }
+#endif
+}
+
+bool
+ffx64_aes::hardware()
+{
+    return aesni_supported();
+}
+
+uint64_t
+ffx64_aes::f(uint8_t i, uint64_t b) const
+{
+    uint8_t x[AES::blocksize] = {0};
+    x[0] = i;
+    memcpy(&x[1], &b, sizeof(b));
+    for (size_t j = 0; j < AES::blocksize; j++) {
+        x[j] ^= header_mac[j];
+    }
+
+    uint8_t y[AES::blocksize];
+    aes.block_encrypt(x, y);
+
+    uint64_t out;
+    memcpy(&out, y, sizeof(out));
+    return out >> half_bits;
+}
+
+uint64_t
+ffx64_aes::encrypt(uint64_t pt) const
+{
+#ifdef AESNI_AVAILABLE
+    if (hardware()) {
+        aesni_rounds<1>(round_keys, header_mac, &pt, false);
+        return pt;
+    }
+#endif
+
+    uint64_t a = pt >> half_bits;
+    uint64_t b = pt & half_mask;
+    for (int i = 0; i < rounds; i++) {
+        const uint64_t c = a ^ f(i, b);
+        a = b;
+        b = c;
+    }
+
+    return a << half_bits | b;
+}
+
+uint64_t
+ffx64_aes::decrypt(uint64_t ct) const
+{
+#ifdef AESNI_AVAILABLE
+    if (hardware()) {
+        aesni_rounds<1>(round_keys, header_mac, &ct, true);
+        return ct;
+    }
+#endif
+
+    uint64_t a = ct >> half_bits;
+    uint64_t b = ct & half_mask;
+    for (int i = rounds - 1; i >= 0; i--) {
+        const uint64_t c = b;
+        b = a;
+        a = c ^ f(i, b);
+    }
+
+    return a << half_bits | b;
+}
+
+void
+ffx64_aes::encrypt(uint64_t *v, size_t count) const
+{
+#ifdef AESNI_AVAILABLE
+    if (hardware()) {
+        size_t done = 0;
+        for (; done + batch <= count; done += batch) {
+            aesni_rounds<batch>(round_keys, header_mac, v + done, false);
+        }
+        if (done < count) {
+            // One more pass costs no more than a few single values.
+            uint64_t tail[batch] = {0};
+            memcpy(tail, v + done, (count - done) * sizeof(*v));
+            aesni_rounds<batch>(round_keys, header_mac, tail, false);
+            memcpy(v + done, tail, (count - done) * sizeof(*v));
+        }
+        return;
+    }
+#endif
+
+    for (size_t j = 0; j < count; j++) {
+        v[j] = encrypt(v[j]);
+    }
+}
+
+void
+ffx64_aes::decrypt(uint64_t *v, size_t count) const
+{
+#ifdef AESNI_AVAILABLE
+    if (hardware()) {
+        size_t done = 0;
+        for (; done + batch <= count; done += batch) {
+            aesni_rounds<batch>(round_keys, header_mac, v + done, true);
+        }
+        if (done < count) {
+            // One more pass costs no more than a few single values.
+            uint64_t tail[batch] = {0};
+            memcpy(tail, v + done, (count - done) * sizeof(*v));
+            aesni_rounds<batch>(round_keys, header_mac, tail, true);
+            memcpy(v + done, tail, (count - done) * sizeof(*v));
+        }
+        return;
+    }
+#endif
+
+    for (size_t j = 0; j < count; j++) {
+        v[j] = decrypt(v[j]);
+    }
+}
+
+static uint64_t
+load_be64(const void *p)
+{
+    const uint8_t *const b = static_cast<const uint8_t *>(p);
+    uint64_t v = 0;
+    for (size_t i = 0; i < 8; i++) {
+        v = v << 8 | b[i];
+    }
+    return v;
+}
+
+static void
+store_be64(uint64_t v, void *p)
+{
+    uint8_t *const b = static_cast<uint8_t *>(p);
+    for (int i = 7; i >= 0; i--) {
+        b[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+void
+ffx64_aes::block_encrypt(const void *ptext, void *ctext) const
+{
+    store_be64(encrypt(load_be64(ptext)), ctext);
+}
+
+void
+ffx64_aes::block_decrypt(const void *ctext, void *ptext) const
+{
+    store_be64(decrypt(load_be64(ctext)), ptext);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <crypto/aes.hh>
+
+/*
+ * FFX[2] (see ffx.hh) on 64-bit integers under AES-128 with an empty
+ * tweak: the same permutation as ffx2_block_cipher<AES, 64> applied to
+ * the big-endian bytes of the integer.
+ *
+ * The CBC-MAC of the FFX header is computed once, so each of the ten
+ * rounds is a single AES call. On CPUs with AES-NI the rounds of up to
+ * batch values are interleaved, which hides most of the latency of the
+ * AES instructions; elsewhere OpenSSL's AES does one value at a time.
+ */
+class ffx64_aes {
+ public:
+    ffx64_aes(const std::string &key);
+
+    uint64_t encrypt(uint64_t pt) const;
+    uint64_t decrypt(uint64_t ct) const;
+    // In place.
+    void encrypt(uint64_t *v, size_t count) const;
+    void decrypt(uint64_t *v, size_t count) const;
+
+    void block_encrypt(const void *ptext, void *ctext) const;
+    void block_decrypt(const void *ctext, void *ptext) const;
+
+    // Whether this CPU has AES-NI.
+    static bool hardware();
+
+    static const size_t blocksize = 8;
+    static const size_t key_bytes = 16;
+    static const size_t batch = 8;
+    static const int rounds = 10;
+
+ private:
+    const AES aes;
+    uint8_t round_keys[11 * 16] __attribute__((aligned(16)));
+    // CBC-MAC of the FFX header; every round MACs one more block.
+    uint8_t header_mac[16] __attribute__((aligned(16)));
+
+    uint64_t f(uint8_t i, uint64_t b) const;
+};
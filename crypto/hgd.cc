@@ -1,6 +1,10 @@
 #include <crypto/hgd.hh>
 #include <NTL/RR.h>
 
+#include <cmath>
+#include <limits>
+#include <vector>
+
 using namespace std;
 using namespace NTL;
 
@@ -33,7 +37,7 @@ RAND(PRNG *prng, long precision)
 }
 
 ZZ
-HGD(const ZZ &KK, const ZZ &NN1, const ZZ &NN2, PRNG *prng)
+HGD_bignum(const ZZ &KK, const ZZ &NN1, const ZZ &NN2, PRNG *prng)
 {
     /*
      * XXX
@@ -293,3 +297,531 @@ HGD(const ZZ &KK, const ZZ &NN1, const ZZ &NN2, PRNG *prng)
     JX = IX;
     return to_ZZ(JX);
 }
+
+
+/*
+ * The native tier: HGD_bignum() step for step in doubles, for urns whose
+ * counts are exact in a double.
+ *
+ * Every RR operation rounds to HGD_bignum's precision, which NTL never
+ * lets go below 53 bits, so it is off by no more than the same operation
+ * on doubles; exp() and log() may be off by a few units more on either
+ * side. An hgd_approx carries the double and a bound on how far it and
+ * RR's value can be from the exact one. Every branch and every rounding to an integer that the bound
+ * leaves open throws hgd_undecided, and HGD() then runs HGD_bignum() on
+ * the same PRNG bytes; otherwise both took the same steps and return the
+ * same variate.
+ */
+
+class hgd_undecided {};
+
+typedef double hgd_float;
+
+struct hgd_approx {
+    hgd_float v;
+    hgd_float err;
+};
+
+static const int native_digits = std::numeric_limits<hgd_float>::digits;
+// Unit roundoff of a double, and at least that of RR.
+static const hgd_float unit = 1.0 / (1ULL << native_digits);
+// Error of exp() and log(), in units.
+static const hgd_float fn_units = 16;
+// Slack for the roundings of the error bounds themselves.
+static const hgd_float slack = 1 + 1e-9;
+
+static inline hgd_approx
+exact(hgd_float v)
+{
+    return hgd_approx{v, 0};
+}
+
+// @v is the rounded result of an operation whose exact result is within
+// @err of the exact value. If @exact_op, the operation on doubles was
+// exact and so was RR's.
+static inline hgd_approx
+rounded(hgd_float v, hgd_float err, bool exact_op, hgd_float units = 1)
+{
+    if (!std::isfinite(v) || !std::isfinite(err)) {
+        throw hgd_undecided();
+    }
+    if (0 == err && exact_op) {
+        return exact(v);
+    }
+    return hgd_approx{v, (err + (std::fabs(v) + err) * 2 * units * unit)
+                         * slack};
+}
+
+static inline hgd_approx
+operator+(const hgd_approx &a, const hgd_approx &b)
+{
+    const hgd_float v = a.v + b.v;
+    const hgd_float bb = v - a.v;
+    const bool exact_op = 0 == (a.v - (v - bb)) + (b.v - bb);
+    return rounded(v, a.err + b.err, exact_op);
+}
+
+static inline hgd_approx
+operator-(const hgd_approx &a)
+{
+    return hgd_approx{-a.v, a.err};
+}
+
+static inline hgd_approx
+operator-(const hgd_approx &a, const hgd_approx &b)
+{
+    return a + -b;
+}
+
+static inline hgd_approx
+operator*(const hgd_approx &a, const hgd_approx &b)
+{
+    const hgd_float v = a.v * b.v;
+    return rounded(v,
+                   std::fabs(a.v) * b.err + std::fabs(b.v) * a.err
+                   + 3 * a.err * b.err,
+                   0 == std::fma(a.v, b.v, -v));
+}
+
+static inline hgd_approx
+operator/(const hgd_approx &a, const hgd_approx &b)
+{
+    if (std::fabs(b.v) <= 2 * b.err) {
+        throw hgd_undecided();
+    }
+    const hgd_float v = a.v / b.v;
+    return rounded(v,
+                   (a.err + std::fabs(v) * b.err)
+                   / (std::fabs(b.v) - 2 * b.err),
+                   0 == std::fma(v, b.v, -a.v));
+}
+
+// RR op double: doubles convert exactly.
+static inline hgd_approx
+operator+(const hgd_approx &a, double b) {return a + exact(b);}
+static inline hgd_approx
+operator+(double a, const hgd_approx &b) {return exact(a) + b;}
+static inline hgd_approx
+operator-(const hgd_approx &a, double b) {return a - exact(b);}
+static inline hgd_approx
+operator-(double a, const hgd_approx &b) {return exact(a) - b;}
+static inline hgd_approx
+operator*(const hgd_approx &a, double b) {return a * exact(b);}
+static inline hgd_approx
+operator*(double a, const hgd_approx &b) {return exact(a) * b;}
+static inline hgd_approx
+operator/(const hgd_approx &a, double b) {return a / exact(b);}
+
+static inline hgd_approx
+exp(const hgd_approx &x)
+{
+    const hgd_float v = std::exp(x.v);
+    return rounded(v, v * std::expm1(2 * x.err), false, fn_units);
+}
+
+static inline hgd_approx
+log(const hgd_approx &x)
+{
+    if (x.v <= 2 * x.err) {
+        throw hgd_undecided();
+    }
+    const hgd_float v = std::log(x.v);
+    // Absolute error too, for results near 0.
+    return rounded(v,
+                   x.err / (x.v - 2 * x.err)
+                   + 2 * fn_units * unit,
+                   false, fn_units);
+}
+
+static inline hgd_approx
+sqrt(const hgd_approx &x)
+{
+    if (x.v < 2 * x.err) {
+        throw hgd_undecided();
+    }
+    const hgd_float v = std::sqrt(x.v);
+    return rounded(v, std::sqrt(x.v + 2 * x.err)
+                      - std::sqrt(x.v - 2 * x.err),
+                   0 == std::fma(v, v, -x.v));
+}
+
+static inline hgd_approx
+sqr(const hgd_approx &x)
+{
+    return x * x;
+}
+
+/*
+ * The sign of a - b in both computations. Each of them is within err of
+ * the exact values, so within 2 * err of the native ones.
+ */
+static int
+compare(const hgd_approx &a, const hgd_approx &b)
+{
+    const hgd_float d = a.v - b.v;
+    const hgd_float margin = 2 * (a.err + b.err) * slack;
+    if (0 == margin || std::fabs(d) > margin) {
+        // Rounding never flips the sign of a difference.
+        return (d > 0) - (d < 0);
+    }
+    throw hgd_undecided();
+}
+
+static inline bool
+operator<(const hgd_approx &a, const hgd_approx &b)
+{
+    return compare(a, b) < 0;
+}
+
+static inline bool
+operator<(const hgd_approx &a, double b) {return a < exact(b);}
+static inline bool
+operator<=(const hgd_approx &a, double b) {return compare(a, exact(b)) <= 0;}
+static inline bool
+operator>(const hgd_approx &a, const hgd_approx &b) {return b < a;}
+static inline bool
+operator<=(const hgd_approx &a, const hgd_approx &b)
+{
+    return compare(a, b) <= 0;
+}
+
+static inline hgd_approx
+trunc(const hgd_approx &x)
+{
+    const hgd_float lo = std::trunc(x.v - 2 * x.err);
+    if (lo != std::trunc(x.v + 2 * x.err)) {
+        throw hgd_undecided();
+    }
+    return exact(lo);
+}
+
+// NTL's round() on a tie isn't worth pinning down.
+static inline long
+round_to_long(const hgd_approx &x)
+{
+    const hgd_float lo_end = x.v - 2 * x.err + 0.5;
+    const hgd_float lo = std::floor(lo_end);
+    if (lo != std::floor(x.v + 2 * x.err + 0.5) || lo == lo_end) {
+        throw hgd_undecided();
+    }
+    return static_cast<long>(lo);
+}
+
+static hgd_approx
+AFC(const hgd_approx &I)
+{
+    static const double AL[8] =
+    { 0.0, 0.0, 0.6931471806, 1.791759469, 3.178053830, 4.787491743,
+      6.579251212, 8.525161361 };
+
+    if (I <= 7) {
+        const long i = round_to_long(I);
+        if (i < 0) {
+            throw hgd_undecided();
+        }
+        return exact(AL[i]);
+    } else {
+        const hgd_approx LL = log(I);
+        return (I+0.5) * LL - I + 0.399089934;
+    }
+}
+
+// RAND() of HGD_bignum, from the same bytes: the low @precision bits
+// of a little endian number, over 2^precision.
+static hgd_approx
+RAND_native(PRNG *prng, long precision)
+{
+    const size_t nbytes = (precision + 1) / 8 + 1;
+    uint8_t buf[nbytes];
+    prng->rand_bytes(nbytes, buf);
+
+    // At most 64 bits for the urns HGD_native() takes.
+    uint64_t r = 0;
+    for (size_t i = nbytes; i-- > 0; ) {
+        const long bits = precision - 8 * static_cast<long>(i);
+        if (bits <= 0) {
+            continue;
+        }
+        const unsigned int mask = bits >= 8 ? 0xff : (1U << bits) - 1;
+        r = (r << 8) | (buf[i] & mask);
+    }
+    return rounded(std::ldexp(static_cast<hgd_float>(r), -precision), 0,
+                   precision <= native_digits);
+}
+
+// floor(x), if certain and not negative.
+static uint64_t
+floor_to_uint64(const hgd_approx &x)
+{
+    const hgd_float lo = std::floor(x.v - 2 * x.err);
+    if (lo < 0 || lo != std::floor(x.v + 2 * x.err)) {
+        throw hgd_undecided();
+    }
+    return static_cast<uint64_t>(lo);
+}
+
+static uint64_t
+HGD_native(uint64_t KK, uint64_t NN1, uint64_t NN2, long precision,
+           PRNG *prng)
+{
+    hgd_approx TN, N1, N2, K;
+    hgd_approx P, U, V, A, IX, XL, XR, M;
+    hgd_approx KL, KR, LAMDL, LAMDR, NK, NM, P1, P2, P3;
+
+    bool REJECT;
+    hgd_approx MINJX, MAXJX;
+
+    const double CON = 57.56462733;
+    const double DELTAL = 0.0078;
+    const double DELTAU = 0.0034;
+    const double SCALE = 1.0e25;
+
+    REJECT = true;
+
+    if (NN1 >= NN2) {
+        N1 = exact(NN2);
+        N2 = exact(NN1);
+    } else {
+        N1 = exact(NN1);
+        N2 = exact(NN2);
+    }
+
+    TN = N1 + N2;
+
+    if (exact(KK + KK).v >= TN.v) {
+        K = TN - exact(KK);
+    } else {
+        K = exact(KK);
+    }
+
+    M = (K+1) * (N1+1) / (TN+2);
+
+    if (K-N2 < 0) {
+        MINJX = exact(0);
+    } else {
+        MINJX = K-N2;
+    }
+
+    if (N1 < K) {
+        MAXJX = N1;
+    } else {
+        MAXJX = K;
+    }
+
+    if (0 == compare(MINJX, MAXJX)) {
+        IX = MAXJX;
+    } else if (M-MINJX < 10) {
+        hgd_approx W;
+        if (K < N2) {
+            W = exp(CON + AFC(N2) + AFC(N1+N2-K) - AFC(N2-K) - AFC(N1+N2));
+        } else {
+            W = exp(CON + AFC(N1) + AFC(K) - AFC(K-N2) - AFC(N1+N2));
+        }
+
+        for (;;) {
+            P  = W;
+            IX = MINJX;
+            U  = RAND_native(prng, precision) * SCALE;
+
+            while (U > P) {
+                U  = U - P;
+                P  = P * (N1-IX)*(K-IX);
+                IX = IX + 1;
+                P  = P / IX / (N2-K+IX);
+                if (IX > MAXJX)
+                    break;
+            }
+            if (!(IX > MAXJX))
+                break;
+        }
+    } else {
+        hgd_approx S = sqrt((TN-K) * K * N1 * N2 / (TN-1) / TN /TN);
+
+        const hgd_approx D = trunc(1.5*S) + 0.5;
+        XL = trunc(M - D + 0.5);
+        XR = trunc(M + D + 0.5);
+        A = AFC(M) + AFC(N1-M) + AFC(K-M) + AFC(N2-K+M);
+        const hgd_approx expon =
+            A - AFC(XL) - AFC(N1-XL)- AFC(K-XL) - AFC(N2-K+XL);
+
+        KL = exp(expon);
+        KR = exp(A - AFC(XR-1) - AFC(N1-XR+1) - AFC(K-XR+1) - AFC(N2-K+XR-1));
+        LAMDL = -log(XL * (N2-K+XL) / (N1-XL+1) / (K-XL+1));
+        LAMDR = -log((N1-XR+1) * (K-XR+1) / XR / (N2-K+XR));
+        P1 = 2*D;
+        P2 = P1 + KL / LAMDL;
+        P3 = P2 + KR / LAMDR;
+
+        while (REJECT) {
+            U = RAND_native(prng, precision) * P3;
+            V = RAND_native(prng, precision);
+
+            if (U < P1)  {
+                IX    = XL + U;
+            } else if  (U <= P2)  {
+                IX = XL + log(V)/LAMDL;
+                if (IX < MINJX) {
+                    continue;
+                }
+                V = V * (U-P1) * LAMDL;
+            } else  {
+                IX = XR - log(V)/LAMDR;
+                if (IX > MAXJX)  {
+                    continue;
+                }
+                V = V * (U-P2) * LAMDR;
+            }
+
+            hgd_approx F;
+            if ((M < 100) || (IX <= 50))  {
+                F = exact(1.0);
+                if (M < IX) {
+                    for (hgd_approx I = M+1; I < IX; I = I + 1) {
+                        F = F * (N1-I+1) * (K-I+1) / (N2-K+I) / I;
+                    }
+                } else if (M > IX) {
+                    for (hgd_approx I = IX+1; I < M; I = I + 1) {
+                        F = F * I * (N2-K+I) / (N1-I) / (K-I);
+                    }
+                }
+                if (V <= F)  {
+                    REJECT = false;
+                }
+            } else {
+                hgd_approx Y   = IX;
+                hgd_approx Y1  = Y + 1.;
+                hgd_approx YM  = Y - M;
+                hgd_approx YN  = N1 - Y + 1.;
+                hgd_approx YK  = K - Y + 1.;
+                NK     = N2 - K + Y1;
+                hgd_approx R   = -YM / Y1;
+                S      = YM / YN;
+                hgd_approx T   = YM / YK;
+                hgd_approx E   = -YM / NK;
+                hgd_approx G   = YN * YK / (Y1*NK) - 1.;
+                hgd_approx DG  = exact(1.0);
+                if (G < 0)  { DG = 1.0 + G; }
+                hgd_approx GU  = G * (1.+G*(-0.5+G/3.0));
+                hgd_approx GL  = GU - 0.25 * sqr(sqr(G)) / DG;
+                hgd_approx XM  = M + 0.5;
+                hgd_approx XN  = N1 - M + 0.5;
+                hgd_approx XK  = K - M + 0.5;
+                NM     = N2 - K + XM;
+                hgd_approx UB  = Y * GU - M * GL + DELTAU +
+                         XM * R * (1.+R*(-.5+R/3.)) +
+                         XN * S * (1.+S*(-.5+S/3.)) +
+                         XK * T * (1.+T*(-.5+T/3.)) +
+                         NM * E * (1.+E*(-.5+E/3.));
+
+                hgd_approx ALV = log(V);
+                if (ALV > UB) {
+                    REJECT = true;
+                } else {
+                    hgd_approx DR = XM * sqr(sqr(R));
+                    if (R < 0) {
+                        DR = DR / (1.+R);
+                    }
+                    hgd_approx DS = XN * sqr(sqr(S));
+                    if (S < 0) {
+                        DS = DS / (1.+S);
+                    }
+                    hgd_approx DT = XK * sqr(sqr(T));
+                    if (T < 0) {
+                        DT = DT / (1.+T);
+                    }
+                    hgd_approx DE = NM * sqr(sqr(E));
+                    if (E < 0) {
+                        DE = DE / (1.+E);
+                    }
+                    if (ALV < UB-0.25*(DR+DS+DT+DE) + (Y+M)*(GL-GU) - DELTAL) {
+                        REJECT = false;
+                    } else {
+                        if (ALV <=
+                            (A - AFC(IX) -
+                             AFC(N1-IX)  - AFC(K-IX) - AFC(N2-K+IX)) ) {
+                            REJECT = false;
+                        } else {
+                            REJECT = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (KK + KK >= NN1 + NN2) {
+        if (NN1 > NN2) {
+            IX = exact(KK - NN2) + IX;
+        } else {
+            IX = exact(NN1) - IX;
+        }
+    } else {
+        if (NN1 > NN2) {
+            IX = exact(KK) - IX;
+        }
+    }
+    return floor_to_uint64(IX);
+}
+
+namespace {
+
+// Keeps the bytes drawn from @prng so that they can be drawn again.
+class recording_prng : public PRNG {
+ public:
+    recording_prng(PRNG *p) : prng(p) {}
+
+    virtual void rand_bytes(size_t nbytes, uint8_t *buf) {
+        prng->rand_bytes(nbytes, buf);
+        drawn.insert(drawn.end(), buf, buf + nbytes);
+    }
+
+    PRNG *const prng;
+    std::vector<uint8_t> drawn;
+};
+
+// The bytes of a recording_prng, then the rest of its PRNG's.
+class replay_prng : public PRNG {
+ public:
+    replay_prng(const recording_prng &r) : rec(r), next(0) {}
+
+    virtual void rand_bytes(size_t nbytes, uint8_t *buf) {
+        size_t i = 0;
+        for (; i < nbytes && next < rec.drawn.size(); i++)
+            buf[i] = rec.drawn[next++];
+        if (i < nbytes)
+            rec.prng->rand_bytes(nbytes - i, buf + i);
+    }
+
+ private:
+    const recording_prng &rec;
+    size_t next;
+};
+
+}
+
+// The native tier takes urns of up to 2^38 balls. Past that the sums of
+// AFC() terms lose too many bits to the cancellation in H2PE, for RR
+// just as for doubles, and most draws end up undecided.
+static const long native_bits = 38;
+
+ZZ
+HGD(const ZZ &KK, const ZZ &NN1, const ZZ &NN2, PRNG *prng)
+{
+    if ((NN1 < 0) || (NN2 < 0) || (KK < 0) || (KK > NN1 + NN2))
+        throw_c(false);
+
+    const ZZ TN = NN1 + NN2;
+    if (NumBits(TN) > native_bits)
+        return HGD_bignum(KK, NN1, NN2, prng);
+
+    // HGD_bignum's precision; RR itself never goes below 53 bits.
+    const long precision = NumBits(TN + KK) + 10;
+    recording_prng rec(prng);
+    try {
+        return to_ZZ(HGD_native(to_long(KK), to_long(NN1), to_long(NN2),
+                                precision, &rec));
+    } catch (const hgd_undecided &) {
+        replay_prng replay(rec);
+        return HGD_bignum(KK, NN1, NN2, &replay);
+    }
+}
@@ -8,8 +8,16 @@
  *
  * The implementation is based on an adaptation of the H2PEC alg for large
  * numbers; see hgd.cc for details
+ *
+ * HGD() samples urns of up to 2^38 balls in doubles and only falls back
+ * to NTL's RR when that isn't certain to give HGD_bignum()'s result;
+ * both draw the same PRNG bytes and return the same variate.
  */
 NTL::ZZ HGD(const NTL::ZZ &KK,
             const NTL::ZZ &NN1,
             const NTL::ZZ &NN2,
             PRNG *prng);
+NTL::ZZ HGD_bignum(const NTL::ZZ &KK,
+                   const NTL::ZZ &NN1,
+                   const NTL::ZZ &NN2,
+                   PRNG *prng);
@@ -0,0 +1,707 @@
+#include <crypto/mope.hh>
+#include <crypto/sha.hh>
+#include <util/errstream.hh>
+#include <util/scoped_lock.hh>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Largest share of a window of 2^k labels that may be in use before it
+// is spread out: (1 / density_base)^k.
+static const double density_base = 1.43;
+// Write the log buffer out once it holds this much.
+static const size_t buffer_bytes = 1 << 20;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<string, weak_ptr<MutableOPE> > registry;
+
+static uint64_t pending_total = 0;
+static uint64_t dirty_total = 0;
+static uint64_t relabel_epoch = 0;
+
+static void
+putU64(string *const out, uint64_t v)
+{
+    out->append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+static bool
+getU64(const string &in, size_t *const at, uint64_t *const v)
+{
+    if (in.size() < *at + sizeof(*v)) {
+        return false;
+    }
+    memcpy(v, in.data() + *at, sizeof(*v));
+    *at += sizeof(*v);
+    return true;
+}
+
+// FNV-1a; only guards against torn writes.
+static uint32_t
+checksum(const string &payload)
+{
+    uint32_t h = 2166136261U;
+    for (const char c : payload) {
+        h = (h ^ static_cast<uint8_t>(c)) * 16777619U;
+    }
+    return h;
+}
+
+static void
+writeAll(int fd, const string &bytes)
+{
+    size_t done = 0;
+    while (done < bytes.size()) {
+        const ssize_t n =
+            write(fd, bytes.data() + done, bytes.size() - done);
+        throw_c(n > 0, "can't write mutable OPE log");
+        done += n;
+    }
+}
+
+shared_ptr<MutableOPE>
+MutableOPE::get(const string &key, const string &dir)
+{
+    const string h = sha256::hash(key);
+    string name;
+    for (unsigned int i = 0; i < 16; ++i) {
+        static const char hex[] = "0123456789abcdef";
+        name += hex[static_cast<uint8_t>(h[i]) >> 4];
+        name += hex[static_cast<uint8_t>(h[i]) & 0xf];
+    }
+    const string path = dir + "/mope-" + name;
+
+    scoped_lock l(&registry_lock);
+    shared_ptr<MutableOPE> m = registry[path].lock();
+    if (!m) {
+        m.reset(new MutableOPE(key, path));
+        registry[path] = m;
+    }
+    return m;
+}
+
+MutableOPE::MutableOPE(const string &key, const string &path)
+    : bf(key), path(path), fd(-1), entries(0), next_relabel(0),
+      dirty(false), log_records(0)
+{
+    pthread_rwlock_init(&lock, NULL);
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+    throw_c(fd >= 0, "can't open mutable OPE log " + path);
+    replay();
+}
+
+MutableOPE::~MutableOPE()
+{
+    // Labels only reach the database after a sync(), so losing the
+    // tail here loses nothing stored.
+    try {
+        sync();
+    } catch (...) {
+    }
+    __atomic_sub_fetch(&pending_total, pending.size(), __ATOMIC_RELAXED);
+    if (dirty) {
+        __atomic_sub_fetch(&dirty_total, 1, __ATOMIC_RELAXED);
+    }
+    close(fd);
+    pthread_rwlock_destroy(&lock);
+}
+
+bool
+MutableOPE::findPtext(uint64_t ptext, Position *const pos) const
+{
+    const size_t i =
+        lower_bound(block_ptexts.begin(), block_ptexts.end(), ptext)
+        - block_ptexts.begin();
+    if (blocks.size() == i) {
+        *pos = Position{blocks.size(), 0};
+        return false;
+    }
+
+    const vector<Entry> *const b = &blocks[i];
+    const auto e =
+        lower_bound(b->begin(), b->end(), ptext,
+                    [] (const Entry &entry, uint64_t v)
+                    {return entry.ptext < v;});
+    *pos = Position{i, static_cast<size_t>(e - b->begin())};
+    return e->ptext == ptext;
+}
+
+bool
+MutableOPE::findLabel(uint64_t label, Position *const pos) const
+{
+    const size_t i =
+        lower_bound(block_labels.begin(), block_labels.end(), label)
+        - block_labels.begin();
+    if (blocks.size() == i) {
+        *pos = Position{blocks.size(), 0};
+        return false;
+    }
+
+    const vector<Entry> *const b = &blocks[i];
+    const auto e =
+        lower_bound(b->begin(), b->end(), label,
+                    [] (const Entry &entry, uint64_t v)
+                    {return entry.label < v;});
+    *pos = Position{i, static_cast<size_t>(e - b->begin())};
+    return e->label == label;
+}
+
+MutableOPE::Entry &
+MutableOPE::at(const Position &pos)
+{
+    assert(pos.block < blocks.size()
+           && pos.offset < blocks[pos.block].size());
+    return blocks[pos.block][pos.offset];
+}
+
+bool
+MutableOPE::next(Position *const pos) const
+{
+    if (++pos->offset == blocks[pos->block].size()) {
+        *pos = Position{pos->block + 1, 0};
+    }
+    return pos->block < blocks.size();
+}
+
+bool
+MutableOPE::prev(Position *const pos) const
+{
+    if (pos->offset > 0) {
+        --pos->offset;
+        return true;
+    }
+    if (0 == pos->block) {
+        return false;
+    }
+    --pos->block;
+    pos->offset = blocks[pos->block].size() - 1;
+    return true;
+}
+
+MutableOPE::Position
+MutableOPE::insertAt(const Position &pos, const Entry &e)
+{
+    ++entries;
+    if (blocks.empty()) {
+        blocks.push_back(vector<Entry>(1, e));
+        block_ptexts.push_back(e.ptext);
+        block_labels.push_back(e.label);
+        return Position{0, 0};
+    }
+
+    Position p = pos;
+    if (p.block == blocks.size()) {
+        p = Position{blocks.size() - 1, blocks.back().size()};
+    }
+    vector<Entry> &block = blocks[p.block];
+    block.insert(block.begin() + p.offset, e);
+    block_ptexts[p.block] = block.back().ptext;
+    block_labels[p.block] = block.back().label;
+    if (block.size() <= block_entries) {
+        return p;
+    }
+
+    // Split in halves.
+    const size_t half = block.size() / 2;
+    vector<Entry> upper(block.begin() + half, block.end());
+    block.resize(half);
+    block_ptexts.insert(block_ptexts.begin() + p.block,
+                        block.back().ptext);
+    block_labels.insert(block_labels.begin() + p.block,
+                        block.back().label);
+    blocks.insert(blocks.begin() + p.block + 1, std::move(upper));
+    if (p.offset >= half) {
+        p = Position{p.block + 1, p.offset - half};
+    }
+    return p;
+}
+
+void
+MutableOPE::updateBlockLabel(size_t block)
+{
+    block_labels[block] = blocks[block].back().label;
+}
+
+uint64_t
+MutableOPE::insert(uint64_t ptext)
+{
+    Position pos;
+    if (findPtext(ptext, &pos)) {
+        return at(pos).label;
+    }
+
+    Position before = pos;
+    const bool has_prev = prev(&before);
+    const bool has_next = pos.block < blocks.size();
+    const uint64_t lo = has_prev ? at(before).label : 0;
+    const uint64_t hi = has_next ? at(pos).label : label_limit;
+
+    // 0 if the gap is used up.
+    uint64_t label = 0;
+    if (!has_prev && !has_next) {
+        label = label_limit / 2;
+    } else if (!has_next) {
+        label = lo + min((hi - lo) / 2, end_step);
+        label = label == lo ? 0 : label;
+    } else if (!has_prev) {
+        label = hi - min(hi / 2, end_step);
+        label = label == hi ? 0 : label;
+    } else if (hi - lo >= 2) {
+        label = lo + (hi - lo) / 2;
+    }
+
+    // Until the relabel, the new value shares its neighbour's label.
+    const Position p =
+        insertAt(pos, Entry{ptext, label ? label : (has_prev ? lo : hi)});
+    if (0 == label) {
+        relabelAround(p);
+    }
+    append(insertRecord(at(p)));
+
+    return at(p).label;
+}
+
+// The smallest aligned window of 2^k labels around the value at @pos
+// that is sparse enough takes evenly spaced labels, each one chosen
+// apart from the labels the window had.
+void
+MutableOPE::relabelAround(const Position &pos)
+{
+    const uint64_t anchor = at(pos).label;
+    for (unsigned int k = 1; k <= 63; ++k) {
+        const uint64_t width = 1ULL << k;
+        const uint64_t base = anchor & ~(width - 1);
+        const uint64_t end = base + width;
+
+        Position first;
+        findLabel(base, &first);
+        uint64_t n = 0;
+        for (Position p = first; p.block < blocks.size()
+                                 && at(p).label < end; next(&p)) {
+            ++n;
+        }
+        const uint64_t step = width / (n + 1);
+        if (static_cast<double>(n) > pow(2 / density_base, k)
+            || step <= n) {
+            continue;
+        }
+
+        vector<uint64_t> old_labels;
+        Position p = first;
+        for (uint64_t i = 0; i < n; ++i, next(&p)) {
+            if (p.block != pos.block || p.offset != pos.offset) {
+                old_labels.push_back(at(p).label);
+            }
+        }
+
+        Relabel r;
+        r.id = next_relabel++;
+        r.lo = base;
+        r.hi = end - 1;
+        auto old = old_labels.begin();
+        p = first;
+        for (uint64_t i = 0; i < n; ++i, next(&p)) {
+            uint64_t label = base + (i + 1) * step;
+            for (;;) {
+                old = lower_bound(old, old_labels.end(), label);
+                if (old_labels.end() == old || *old != label) {
+                    break;
+                }
+                ++label;
+            }
+            // Fewer old labels than the step, so the slot has room.
+            assert(label < base + (i + 2) * step);
+
+            Entry &e = at(p);
+            if (p.block != pos.block || p.offset != pos.offset) {
+                r.moves.push_back(make_pair(e.label, label));
+            }
+            e.label = label;
+            updateBlockLabel(p.block);
+        }
+
+        string record(1, 'R');
+        putU64(&record, r.id);
+        putU64(&record, r.lo);
+        putU64(&record, r.hi);
+        putU64(&record, r.moves.size());
+        for (const auto &move : r.moves) {
+            putU64(&record, move.first);
+            putU64(&record, move.second);
+        }
+        append(record);
+
+        pending.push_back(std::move(r));
+        __atomic_add_fetch(&pending_total, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&relabel_epoch, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    throw_c(false, "mutable OPE ran out of labels");
+}
+
+uint64_t
+MutableOPE::encrypt(uint64_t ptext)
+{
+    {
+        scoped_rdlock l(&lock);
+        Position pos;
+        if (findPtext(ptext, &pos)) {
+            return blocks[pos.block][pos.offset].label;
+        }
+    }
+
+    scoped_wrlock l(&lock);
+    return insert(ptext);
+}
+
+bool
+MutableOPE::lookup(uint64_t ptext, uint64_t *const label) const
+{
+    scoped_rdlock l(&lock);
+    Position pos;
+    if (findPtext(ptext, &pos)) {
+        *label = blocks[pos.block][pos.offset].label;
+        return true;
+    }
+
+    Position before = pos;
+    const uint64_t lo =
+        prev(&before) ? blocks[before.block][before.offset].label : 0;
+    const uint64_t hi = pos.block < blocks.size()
+                      ? blocks[pos.block][pos.offset].label
+                      : label_limit;
+    if (hi - lo < 2) {
+        return false;
+    }
+    *label = lo + (hi - lo) / 2;
+    return true;
+}
+
+bool
+MutableOPE::decrypt(uint64_t label, uint64_t *const ptext) const
+{
+    scoped_rdlock l(&lock);
+    Position pos;
+    if (false == findLabel(label, &pos)) {
+        return false;
+    }
+    *ptext = blocks[pos.block][pos.offset].ptext;
+    return true;
+}
+
+void
+MutableOPE::insertBulk(vector<uint64_t> ptexts)
+{
+    sort(ptexts.begin(), ptexts.end());
+    ptexts.erase(unique(ptexts.begin(), ptexts.end()), ptexts.end());
+
+    scoped_wrlock l(&lock);
+    size_t i = 0;
+    while (i < ptexts.size()) {
+        Position pos;
+        if (findPtext(ptexts[i], &pos)) {
+            ++i;
+            continue;
+        }
+
+        // The new values between the same two neighbours.
+        Position before = pos;
+        const bool has_prev = prev(&before);
+        const bool has_next = pos.block < blocks.size();
+        size_t j = i + 1;
+        while (j < ptexts.size()
+               && (!has_next || ptexts[j] < at(pos).ptext)) {
+            ++j;
+        }
+        const uint64_t run = j - i;
+
+        uint64_t lo = has_prev ? at(before).label : 0;
+        uint64_t hi = has_next ? at(pos).label : label_limit;
+        uint64_t step = (hi - lo) / (run + 1);
+        if (!has_next || !has_prev) {
+            step = min(step, end_step);
+        }
+        if (!has_prev && !has_next) {
+            lo = label_limit / 2 - end_step;
+        } else if (!has_prev) {
+            lo = hi - step * (run + 1);
+        }
+        if (0 == step) {
+            // Let insert() relabel.
+            insert(ptexts[i++]);
+            continue;
+        }
+
+        for (uint64_t k = 0; k < run; ++k) {
+            Position p;
+            findPtext(ptexts[i + k], &p);
+            const Position q =
+                insertAt(p, Entry{ptexts[i + k], lo + (k + 1) * step});
+            append(insertRecord(at(q)));
+        }
+        i = j;
+    }
+}
+
+uint64_t
+MutableOPE::size() const
+{
+    scoped_rdlock l(&lock);
+    return entries;
+}
+
+vector<MutableOPE::Relabel>
+MutableOPE::pendingRelabels() const
+{
+    scoped_rdlock l(&lock);
+    return pending;
+}
+
+void
+MutableOPE::relabelApplied(uint64_t id)
+{
+    scoped_wrlock l(&lock);
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+        if (it->id == id) {
+            pending.erase(it);
+            __atomic_sub_fetch(&pending_total, 1, __ATOMIC_RELAXED);
+
+            string record(1, 'A');
+            putU64(&record, id);
+            append(record);
+            return;
+        }
+    }
+}
+
+void
+MutableOPE::sync()
+{
+    scoped_wrlock l(&lock);
+    if (false == dirty) {
+        return;
+    }
+    writeOut();
+    throw_c(0 == fdatasync(fd), "can't sync mutable OPE log");
+
+    if (pending.empty()
+        && log_records > compact_factor * (entries + 1)) {
+        compactLog();
+    }
+    dirty = false;
+    __atomic_sub_fetch(&dirty_total, 1, __ATOMIC_RELAXED);
+}
+
+void
+MutableOPE::syncAll()
+{
+    // Most queries only read labels.
+    if (0 == __atomic_load_n(&dirty_total, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    vector<shared_ptr<MutableOPE> > live;
+    {
+        scoped_lock l(&registry_lock);
+        for (const auto &it : registry) {
+            const shared_ptr<MutableOPE> m = it.second.lock();
+            if (m) {
+                live.push_back(m);
+            }
+        }
+    }
+
+    for (const auto &m : live) {
+        m->sync();
+    }
+}
+
+bool
+MutableOPE::anyPending()
+{
+    return __atomic_load_n(&pending_total, __ATOMIC_RELAXED) > 0;
+}
+
+uint64_t
+MutableOPE::relabelEpoch()
+{
+    return __atomic_load_n(&relabel_epoch, __ATOMIC_ACQUIRE);
+}
+
+string
+MutableOPE::insertRecord(const Entry &e) const
+{
+    string record(1, 'I');
+    putU64(&record, bf.encrypt(e.ptext));
+    putU64(&record, e.label);
+    return record;
+}
+
+void
+MutableOPE::append(const string &record)
+{
+    const uint32_t len = record.size();
+    const uint32_t sum = checksum(record);
+    unsynced.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    unsynced.append(record);
+    unsynced.append(reinterpret_cast<const char *>(&sum), sizeof(sum));
+    ++log_records;
+    if (false == dirty) {
+        dirty = true;
+        __atomic_add_fetch(&dirty_total, 1, __ATOMIC_RELEASE);
+    }
+
+    if (unsynced.size() >= buffer_bytes) {
+        writeOut();
+    }
+}
+
+void
+MutableOPE::writeOut()
+{
+    writeAll(fd, unsynced);
+    unsynced.clear();
+}
+
+// Only without pending relabels: the new log is nothing but inserts.
+void
+MutableOPE::compactLog()
+{
+    assert(pending.empty() && unsynced.empty());
+
+    const string tmp = path + ".tmp";
+    const int tmp_fd =
+        open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    throw_c(tmp_fd >= 0, "can't open " + tmp);
+
+    const int old_fd = fd;
+    fd = tmp_fd;
+    log_records = 0;
+    for (const auto &block : blocks) {
+        for (const auto &e : block) {
+            append(insertRecord(e));
+        }
+    }
+    writeOut();
+    throw_c(0 == fdatasync(fd) && 0 == rename(tmp.c_str(), path.c_str()),
+            "can't replace mutable OPE log " + path);
+    close(old_fd);
+}
+
+bool
+MutableOPE::apply(const string &record)
+{
+    size_t at_byte = 1;
+    switch (record[0]) {
+        case 'I': {
+            uint64_t ctext, label;
+            if (!getU64(record, &at_byte, &ctext)
+                || !getU64(record, &at_byte, &label)) {
+                return false;
+            }
+            const uint64_t ptext = bf.decrypt(ctext);
+            Position pos;
+            if (findPtext(ptext, &pos)) {
+                return false;
+            }
+            insertAt(pos, Entry{ptext, label});
+            return true;
+        }
+        case 'R': {
+            Relabel r;
+            uint64_t count;
+            if (!getU64(record, &at_byte, &r.id)
+                || !getU64(record, &at_byte, &r.lo)
+                || !getU64(record, &at_byte, &r.hi)
+                || !getU64(record, &at_byte, &count)) {
+                return false;
+            }
+            Position p;
+            findLabel(r.lo, &p);
+            for (uint64_t i = 0; i < count; ++i, next(&p)) {
+                pair<uint64_t, uint64_t> move;
+                if (!getU64(record, &at_byte, &move.first)
+                    || !getU64(record, &at_byte, &move.second)
+                    || p.block >= blocks.size()
+                    || at(p).label != move.first) {
+                    return false;
+                }
+                at(p).label = move.second;
+                updateBlockLabel(p.block);
+                r.moves.push_back(move);
+            }
+            next_relabel = max(next_relabel, r.id + 1);
+            pending.push_back(std::move(r));
+            __atomic_add_fetch(&pending_total, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+        case 'A': {
+            uint64_t id;
+            if (!getU64(record, &at_byte, &id)) {
+                return false;
+            }
+            for (auto it = pending.begin(); it != pending.end(); ++it) {
+                if (it->id == id) {
+                    pending.erase(it);
+                    __atomic_sub_fetch(&pending_total, 1,
+                                       __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Reads the log back; a torn or corrupt tail (a crash in the middle of
+// an append) is cut off.
+void
+MutableOPE::replay()
+{
+    string log;
+    char buf[1 << 16];
+    for (;;) {
+        const ssize_t n = pread(fd, buf, sizeof(buf), log.size());
+        throw_c(n >= 0, "can't read mutable OPE log " + path);
+        if (0 == n) {
+            break;
+        }
+        log.append(buf, n);
+    }
+
+    size_t good = 0;
+    for (;;) {
+        uint32_t len, sum;
+        if (log.size() < good + sizeof(len)) {
+            break;
+        }
+        memcpy(&len, log.data() + good, sizeof(len));
+        if (0 == len
+            || log.size() < good + sizeof(len) + len + sizeof(sum)) {
+            break;
+        }
+        const string record = log.substr(good + sizeof(len), len);
+        memcpy(&sum, log.data() + good + sizeof(len) + len, sizeof(sum));
+        if (sum != checksum(record) || false == apply(record)) {
+            break;
+        }
+        good += sizeof(len) + len + sizeof(sum);
+        ++log_records;
+    }
+
+    if (good < log.size()) {
+        throw_c(0 == ftruncate(fd, good),
+                "can't truncate mutable OPE log " + path);
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <crypto/blowfish.hh>
+
+/*
+ * Mutable order-preserving encoding (the ope_server of online_ope.hh,
+ * kept by the proxy): every plaintext seen so far has a label in
+ * [1, 2^63), and labels are in the order of their plaintexts. Encrypting
+ * a known value is a binary search; a new value takes a label between
+ * its neighbours', and when there is no room left a small window of
+ * labels around it is spread out again (an order-maintenance list, so
+ * inserts cost O(log^2 n) moved labels amortized).
+ *
+ * Values live in sorted blocks of at most block_entries pairs, searched
+ * by plaintext or by label. Each relabel is kept as a Relabel until the
+ * caller reports that the stored ciphertexts were rewritten with it
+ * (relabelApplied()); its new labels are disjoint from the old ones so
+ * applying it twice, or in pieces, does no harm.
+ *
+ * The state is an append-only log in @dir, named after a hash of the
+ * key, with the plaintexts under blowfish. Appends are buffered until
+ * sync(); labels must not reach the database before the log that
+ * assigned them is synced.
+ */
+class MutableOPE {
+public:
+    struct Relabel {
+        uint64_t id;
+        // Every moved label is in [lo, hi].
+        uint64_t lo;
+        uint64_t hi;
+        // (old label, new label), in label order.
+        std::vector<std::pair<uint64_t, uint64_t> > moves;
+    };
+
+    // One dictionary per key for the whole process.
+    static std::shared_ptr<MutableOPE>
+        get(const std::string &key, const std::string &dir);
+    ~MutableOPE();
+
+    uint64_t encrypt(uint64_t ptext);
+    // The label @ptext compares as, without adding it: its own if it is
+    // known, else one strictly between its neighbours'. False if those
+    // are adjacent and only encrypt() can place it.
+    // > A value added later may take that label; a lookup is good for
+    //   the query it was made for.
+    bool lookup(uint64_t ptext, uint64_t *const label) const;
+    // False if no plaintext has @label.
+    bool decrypt(uint64_t label, uint64_t *const ptext) const;
+    // Adds @ptexts at once; runs of new values that share a gap get
+    // evenly spaced labels instead of halving it each time.
+    void insertBulk(std::vector<uint64_t> ptexts);
+    uint64_t size() const;
+
+    std::vector<Relabel> pendingRelabels() const;
+    void relabelApplied(uint64_t id);
+
+    // Writes the buffered log and waits for it to reach the disk.
+    void sync();
+    // sync() of every dictionary appended to since it last synced.
+    static void syncAll();
+    // Whether any dictionary has relabels to apply.
+    static bool anyPending();
+    // Counts relabels of every dictionary; a rewrite that saw it change
+    // may hold labels that have moved since.
+    static uint64_t relabelEpoch();
+
+private:
+    MutableOPE(const std::string &key, const std::string &path);
+
+    struct Entry {
+        uint64_t ptext;
+        uint64_t label;
+    };
+    struct Position {
+        size_t block;
+        size_t offset;
+    };
+
+    static const size_t block_entries = 256;
+    static const uint64_t label_limit = 1ULL << 63;
+    // The label step when appending past either end.
+    static const uint64_t end_step = 1ULL << 24;
+    // Rewrite the log once it is this many times the live state.
+    static const uint64_t compact_factor = 4;
+
+    const blowfish bf;
+    const std::string path;
+    int fd;
+    std::vector<std::vector<Entry> > blocks;
+    // The last plaintext and label of every block, searched before the
+    // block itself.
+    std::vector<uint64_t> block_ptexts;
+    std::vector<uint64_t> block_labels;
+    uint64_t entries;
+    std::vector<Relabel> pending;
+    uint64_t next_relabel;
+    std::string unsynced;
+    // Appended to since the last sync(); the log may have been written
+    // out already.
+    bool dirty;
+    uint64_t log_records;
+    mutable pthread_rwlock_t lock;
+
+    bool findPtext(uint64_t ptext, Position *const pos) const;
+    bool findLabel(uint64_t label, Position *const pos) const;
+    Entry &at(const Position &pos);
+    bool next(Position *const pos) const;
+    bool prev(Position *const pos) const;
+    Position insertAt(const Position &pos, const Entry &e);
+    void updateBlockLabel(size_t block);
+    // Requires the write lock.
+    uint64_t insert(uint64_t ptext);
+    void relabelAround(const Position &pos);
+
+    void replay();
+    bool apply(const std::string &record);
+    void append(const std::string &record);
+    void writeOut();
+    void compactLog();
+    std::string insertRecord(const Entry &e) const;
+};
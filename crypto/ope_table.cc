@@ -0,0 +1,234 @@
+#include <crypto/ope_table.hh>
+#include <crypto/sha.hh>
+#include <util/util.hh>
+#include <util/scoped_lock.hh>
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace NTL;
+
+static const uint64_t table_magic = 0x3162617465706f63ULL;  // "copetab1"
+static const size_t header_words = 4;
+
+shared_ptr<OPETable>
+OPETable::get(const string &key, size_t pbits, size_t cbits,
+              uint64_t domain)
+{
+    static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+    static std::map<string, weak_ptr<OPETable> > tables;
+
+    const string id = key + "/" + to_string(pbits) + "/" +
+                      to_string(cbits) + "/" + to_string(domain);
+
+    scoped_lock l(&tables_lock);
+    shared_ptr<OPETable> t = tables[id].lock();
+    if (!t) {
+        t.reset(new OPETable(key, pbits, cbits, domain));
+        tables[id] = t;
+    }
+    return t;
+}
+
+OPETable::OPETable(const string &key, size_t pbits, size_t cbits,
+                   uint64_t domain)
+    : ope(key, pbits, cbits), entries(domain),
+      pages((domain + page_entries - 1) / page_entries),
+      map_bytes(0), map(MAP_FAILED), filled(NULL), table(NULL),
+      complete(false), firsts(pages), first_known(pages, false)
+{
+    throw_c(domain > 0 && domain <= (1ULL << pbits),
+            "OPE table domain too large");
+    pthread_mutex_init(&lock, NULL);
+
+    const size_t flag_bytes = (pages + 7) / 8 * 8;
+    map_bytes = header_words * sizeof(uint64_t) + flag_bytes +
+                entries * sizeof(uint64_t);
+
+    const char *const dir = getenv("CRYPTDB_OPE_TABLE_DIR");
+    bool mapped = false;
+    if (dir) {
+        const string h =
+            sha256::hash(key + "/" + to_string(pbits) + "/" +
+                         to_string(cbits) + "/" + to_string(domain));
+        string name;
+        for (unsigned int i = 0; i < 16; ++i) {
+            static const char hex[] = "0123456789abcdef";
+            name += hex[static_cast<uint8_t>(h[i]) >> 4];
+            name += hex[static_cast<uint8_t>(h[i]) & 0xf];
+        }
+        mapped = mapFile(string(dir) + "/ope-" + name);
+    }
+    if (false == mapped) {
+        map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        throw_c(MAP_FAILED != map, "can't allocate OPE table");
+    }
+
+    uint64_t *const header = static_cast<uint64_t *>(map);
+    if (table_magic != header[0] || entries != header[1]
+        || pbits != header[2] || cbits != header[3]) {
+        // New (or foreign) file; start over.
+        memset(map, 0, header_words * sizeof(uint64_t) + flag_bytes);
+        header[1] = entries;
+        header[2] = pbits;
+        header[3] = cbits;
+        __atomic_store_n(&header[0], table_magic, __ATOMIC_RELEASE);
+    }
+    filled = reinterpret_cast<uint8_t *>(header + header_words);
+    table = reinterpret_cast<uint64_t *>(filled + flag_bytes);
+}
+
+OPETable::~OPETable()
+{
+    munmap(map, map_bytes);
+    pthread_mutex_destroy(&lock);
+}
+
+bool
+OPETable::mapFile(const string &path)
+{
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    const bool sized =
+        0 == fstat(fd, &st)
+        && (static_cast<size_t>(st.st_size) == map_bytes
+            || 0 == ftruncate(fd, map_bytes));
+    if (sized) {
+        map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    }
+    close(fd);
+
+    return MAP_FAILED != map;
+}
+
+// Pages are filled under @lock; a set flag is only ever seen after the
+// ciphertexts it covers.
+void
+OPETable::fillPage(uint64_t page)
+{
+    scoped_lock l(&lock);
+    if (__atomic_load_n(&filled[page], __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    const uint64_t end = min(entries, (page + 1) * page_entries);
+    for (uint64_t p = page * page_entries; p < end; ++p) {
+        table[p] = uint64FromZZ(ope.encrypt(ZZFromUint64(p)));
+    }
+    __atomic_store_n(&filled[page], 1, __ATOMIC_RELEASE);
+}
+
+// Requires @lock.
+uint64_t
+OPETable::pageFirst(uint64_t page)
+{
+    const uint64_t p = page * page_entries;
+    if (__atomic_load_n(&filled[page], __ATOMIC_ACQUIRE)) {
+        return table[p];
+    }
+    if (!first_known[page]) {
+        firsts[page] = uint64FromZZ(ope.encrypt(ZZFromUint64(p)));
+        first_known[page] = true;
+    }
+    return firsts[page];
+}
+
+// The last page whose first ciphertext is at most @ctext; one OPE
+// encryption per step the first time a page boundary is looked at.
+bool
+OPETable::findPage(uint64_t ctext, uint64_t *const page)
+{
+    scoped_lock l(&lock);
+
+    if (ctext < pageFirst(0)) {
+        return false;
+    }
+    uint64_t lo = 0;
+    uint64_t hi = pages - 1;
+    while (lo < hi) {
+        const uint64_t mid = lo + (hi - lo + 1) / 2;
+        if (pageFirst(mid) <= ctext) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    *page = lo;
+    return true;
+}
+
+bool
+OPETable::isComplete()
+{
+    if (__atomic_load_n(&complete, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+
+    for (uint64_t page = 0; page < pages; ++page) {
+        if (!__atomic_load_n(&filled[page], __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+    }
+    __atomic_store_n(&complete, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint64_t
+OPETable::encrypt(uint64_t ptext)
+{
+    throw_c(ptext < entries, "plaintext outside of the OPE table");
+
+    const uint64_t page = ptext / page_entries;
+    if (!__atomic_load_n(&filled[page], __ATOMIC_ACQUIRE)) {
+        fillPage(page);
+    }
+    return table[ptext];
+}
+
+bool
+OPETable::decrypt(uint64_t ctext, uint64_t *const ptext)
+{
+    const uint64_t *begin = table;
+    const uint64_t *end = table + entries;
+    if (false == isComplete()) {
+        if (pages > eager_pages) {
+            uint64_t page;
+            if (false == findPage(ctext, &page)) {
+                return false;
+            }
+            if (!__atomic_load_n(&filled[page], __ATOMIC_ACQUIRE)) {
+                fillPage(page);
+            }
+            begin = table + page * page_entries;
+            end = table + min(entries, (page + 1) * page_entries);
+        } else {
+            // Small tables are cheap enough to finish on the spot.
+            for (uint64_t page = 0; page < pages; ++page) {
+                fillPage(page);
+            }
+            assert(isComplete());
+        }
+    }
+
+    const uint64_t *const it = lower_bound(begin, end, ctext);
+    if (end == it || *it != ctext) {
+        return false;
+    }
+    *ptext = it - table;
+    return true;
+}
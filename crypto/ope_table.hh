@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <crypto/ope.hh>
+
+/*
+ * Every ciphertext OPE(key, pbits, cbits) gives to the plaintexts
+ * [0, domain), for domains small enough to enumerate (TINYINT, SMALLINT,
+ * MEDIUMINT). Encryption is an array lookup and decryption a binary
+ * search; the ciphertexts are exactly the ones OPE::encrypt produces.
+ *
+ * The table is filled lazily, one page of plaintexts at a time, so a
+ * MEDIUMINT column only pays for the ranges it encrypts or decrypts:
+ * decryption finds the page a ciphertext falls in by binary search over
+ * the first ciphertext of each page and fills just that page. If
+ * CRYPTDB_OPE_TABLE_DIR is set the table lives in a file there, named
+ * after a hash of the key, and filled pages survive restarts and are
+ * shared with other processes; otherwise it is anonymous memory.
+ */
+class OPETable {
+public:
+    // One table per key and domain for the whole process.
+    static std::shared_ptr<OPETable>
+        get(const std::string &key, size_t pbits, size_t cbits,
+            uint64_t domain);
+    ~OPETable();
+
+    uint64_t domain() const {return entries;}
+    uint64_t encrypt(uint64_t ptext);
+    // False if @ctext is not the ciphertext of a plaintext in the domain.
+    bool decrypt(uint64_t ctext, uint64_t *const ptext);
+
+private:
+    OPETable(const std::string &key, size_t pbits, size_t cbits,
+             uint64_t domain);
+
+    static const uint64_t page_entries = 4096;
+    // decrypt() fills in tables of up to this many pages (SMALLINT).
+    static const uint64_t eager_pages = 16;
+
+    OPE ope;
+    const uint64_t entries;
+    const uint64_t pages;
+    size_t map_bytes;
+    void *map;
+    // One flag per page, then the ciphertexts.
+    uint8_t *filled;
+    uint64_t *table;
+    bool complete;
+    // Ciphertext of each page's first plaintext, known or not; only
+    // used under @lock.
+    std::vector<uint64_t> firsts;
+    std::vector<bool> first_known;
+    pthread_mutex_t lock;
+
+    bool mapFile(const std::string &path);
+    void fillPage(uint64_t page);
+    uint64_t pageFirst(uint64_t page);
+    bool findPage(uint64_t ctext, uint64_t *const page);
+    bool isComplete();
+};
@@ -99,6 +99,19 @@ Paillier_priv::Paillier_priv(const vector<ZZ> &sk)
     throw_c(sk.size() == 4);
 }
 
+Paillier_priv::Paillier_priv(const vector<ZZ> &sk, const vector<ZZ> &crt)
+    : Paillier({sk[0]*sk[1], sk[2]}), p(sk[0]), q(sk[1]), a(sk[3]),
+      fast(a != 0),
+      p2(p * p), q2(q * q),
+      two_p(power(to_ZZ(2), NumBits(p))),
+      two_q(power(to_ZZ(2), NumBits(q))),
+      pinv(InvMod(p, two_p)),
+      qinv(InvMod(q, two_q)),
+      hp(crt[0]), hq(crt[1])
+{
+    throw_c(sk.size() == 4 && crt.size() == 2);
+}
+
 std::vector<NTL::ZZ>
 Paillier_priv::keygen(PRNG *rng, uint nbits, uint abits)
 {
@@ -109,7 +109,12 @@ class Paillier_priv : public Paillier {
  public:
     Paillier_priv() : fast(false) {} //HACK: should not need this
     Paillier_priv(const std::vector<NTL::ZZ> &sk);
+    // With the CRT values from crt() of the same key, which are the
+    // costly part of the constructor above.
+    Paillier_priv(const std::vector<NTL::ZZ> &sk,
+                  const std::vector<NTL::ZZ> &crt);
     std::vector<NTL::ZZ> privkey() const { return { p, q, g, a }; }
+    std::vector<NTL::ZZ> crt() const { return { hp, hq }; }
 
     NTL::ZZ decrypt(const NTL::ZZ &ciphertext) const;
 
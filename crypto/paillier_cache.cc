@@ -0,0 +1,301 @@
+#include <crypto/paillier_cache.hh>
+#include <crypto/BasicCrypto.hh>
+#include <crypto/arc4.hh>
+#include <crypto/prng.hh>
+#include <crypto/sha.hh>
+#include <crypto/hmac.hh>
+#include <util/errstream.hh>
+#include <util/scoped_lock.hh>
+#include <util/util.hh>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace NTL;
+
+/*
+ * A file holds, under AES-CBC, nbits and p, q, g, a, hp and hq, each a
+ * 32 bit length and the bytes of StringFromZZ(), and then the HMAC of
+ * all that. The payload for a seed never changes, so the IV is fixed.
+ */
+static const string file_iv = "paillier cache";
+
+struct KeyEntry {
+    KeyEntry() : ready(false) {pthread_mutex_init(&lock, NULL);}
+
+    // Held while the key is read or generated.
+    pthread_mutex_t lock;
+    bool ready;
+    vector<ZZ> sk;
+    vector<ZZ> crt;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+// By hash of the seed and nbits; one per HOM onion, never freed.
+static map<string, KeyEntry *> cache;
+
+struct WarmupJob {
+    string seed;
+    uint nbits;
+    string dir;
+};
+
+static pthread_mutex_t warmup_lock = PTHREAD_MUTEX_INITIALIZER;
+static deque<WarmupJob> warmup_jobs;
+static bool warmup_running = false;
+
+static string
+hexName(const string &bytes)
+{
+    static const char hex[] = "0123456789abcdef";
+    string name;
+    for (const char c : bytes) {
+        name += hex[static_cast<uint8_t>(c) >> 4];
+        name += hex[static_cast<uint8_t>(c) & 0xf];
+    }
+    return name;
+}
+
+static string
+filePath(const string &dir, const string &seed, uint nbits)
+{
+    return dir + "/paillier-" + to_string(nbits) + "-"
+           + hexName(sha256::hash(seed).substr(0, 16));
+}
+
+// Keys of their own for the file, so neither is the seed itself.
+static string
+fileKey(const string &seed, const string &use)
+{
+    return hmac<sha256>::mac(use, seed);
+}
+
+static void
+putZZ(string *const out, const ZZ &v)
+{
+    const string bytes = StringFromZZ(v);
+    const uint32_t len = bytes.size();
+    out->append(reinterpret_cast<const char *>(&len), sizeof(len));
+    out->append(bytes);
+}
+
+static bool
+getZZ(const string &in, size_t *const at, ZZ *const v)
+{
+    uint32_t len;
+    if (in.size() < *at + sizeof(len)) {
+        return false;
+    }
+    memcpy(&len, in.data() + *at, sizeof(len));
+    *at += sizeof(len);
+    if (in.size() < *at + len) {
+        return false;
+    }
+    *v = ZZFromString(in.substr(*at, len));
+    *at += len;
+    return true;
+}
+
+static bool
+readFile(const string &path, string *const out)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out->append(buf, n);
+    }
+    close(fd);
+    return 0 == n;
+}
+
+// Whether @path holds the key of @seed; fills @e if it does.
+static bool
+loadKey(const string &path, const string &seed, uint nbits,
+        KeyEntry *const e)
+{
+    string ctext;
+    if (false == readFile(path, &ctext)) {
+        return false;
+    }
+
+    string payload;
+    try {
+        const unique_ptr<AES_KEY>
+            deckey(get_AES_dec_key(fileKey(seed, "enc").substr(0, 16)));
+        payload = decrypt_AES_CBC(ctext, deckey.get(), file_iv);
+    } catch (const CryptoError &) {
+        return false;
+    }
+    if (payload.size() < sha256::hashsize) {
+        return false;
+    }
+    const size_t body = payload.size() - sha256::hashsize;
+    if (hmac<sha256>::mac(payload.substr(0, body), fileKey(seed, "mac"))
+        != payload.substr(body)) {
+        return false;
+    }
+
+    size_t at = 0;
+    ZZ v[7];
+    for (ZZ &it : v) {
+        if (false == getZZ(payload, &at, &it)) {
+            return false;
+        }
+    }
+    if (at != body || v[0] != static_cast<long>(nbits)) {
+        return false;
+    }
+
+    e->sk = {v[1], v[2], v[3], v[4]};
+    e->crt = {v[5], v[6]};
+    return true;
+}
+
+// Best effort; a key that isn't saved is generated again next time.
+static void
+saveKey(const string &path, const string &seed, uint nbits,
+        const KeyEntry &e)
+{
+    string payload;
+    putZZ(&payload, to_ZZ(static_cast<long>(nbits)));
+    for (const ZZ &it : e.sk) {
+        putZZ(&payload, it);
+    }
+    for (const ZZ &it : e.crt) {
+        putZZ(&payload, it);
+    }
+    payload += hmac<sha256>::mac(payload, fileKey(seed, "mac"));
+
+    const unique_ptr<AES_KEY>
+        enckey(get_AES_enc_key(fileKey(seed, "enc").substr(0, 16)));
+    const string ctext = encrypt_AES_CBC(payload, enckey.get(), file_iv);
+
+    // Written aside and renamed, so a reader never sees half a file.
+    const string tmp = path + ".tmp" + to_string(getpid());
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    size_t done = 0;
+    while (done < ctext.size()) {
+        const ssize_t n =
+            write(fd, ctext.data() + done, ctext.size() - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    const bool ok = done == ctext.size() && 0 == fsync(fd);
+    close(fd);
+    if (false == ok || 0 != rename(tmp.c_str(), path.c_str())) {
+        unlink(tmp.c_str());
+    }
+}
+
+static KeyEntry *
+entry(const string &seed, uint nbits)
+{
+    const string name = sha256::hash(seed) + to_string(nbits);
+
+    scoped_lock l(&cache_lock);
+    KeyEntry *&e = cache[name];
+    if (NULL == e) {
+        e = new KeyEntry();
+    }
+    return e;
+}
+
+// Requires @e->lock.
+static void
+makeReady(KeyEntry *const e, const string &seed, uint nbits,
+          const char *dir)
+{
+    if (e->ready) {
+        return;
+    }
+
+    const string path = dir ? filePath(dir, seed, nbits) : "";
+    if (dir && loadKey(path, seed, nbits, e)) {
+        __atomic_store_n(&e->ready, true, __ATOMIC_RELEASE);
+        return;
+    }
+
+    const unique_ptr<streamrng<arc4> > prng(new streamrng<arc4>(seed));
+    e->sk = Paillier_priv::keygen(prng.get(), nbits);
+    e->crt = Paillier_priv(e->sk).crt();
+    __atomic_store_n(&e->ready, true, __ATOMIC_RELEASE);
+    if (dir) {
+        saveKey(path, seed, nbits, *e);
+    }
+}
+
+Paillier_priv *
+PaillierKeyCache::get(const string &seed, uint nbits, const char *dir)
+{
+    KeyEntry *const e = entry(seed, nbits);
+    scoped_lock l(&e->lock);
+    makeReady(e, seed, nbits, dir);
+    return new Paillier_priv(e->sk, e->crt);
+}
+
+static void *
+warmupMain(void *)
+{
+    for (;;) {
+        WarmupJob job;
+        {
+            scoped_lock l(&warmup_lock);
+            if (warmup_jobs.empty()) {
+                warmup_running = false;
+                return NULL;
+            }
+            job = warmup_jobs.front();
+            warmup_jobs.pop_front();
+        }
+
+        KeyEntry *const e = entry(job.seed, job.nbits);
+        scoped_lock l(&e->lock);
+        try {
+            makeReady(e, job.seed, job.nbits,
+                      job.dir.empty() ? NULL : job.dir.c_str());
+        } catch (const CryptoError &) {
+            // get() runs into it again, on a thread that can report it.
+        }
+    }
+}
+
+void
+PaillierKeyCache::warmup(const string &seed, uint nbits, const char *dir)
+{
+    KeyEntry *const e = entry(seed, nbits);
+    if (__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+#ifndef NTL_THREADS
+    // NTL keeps global state; get() generates the key, or reads it from
+    // @dir, on the thread that needs it.
+    return;
+#endif
+
+    scoped_lock l(&warmup_lock);
+    warmup_jobs.push_back(WarmupJob{seed, nbits, dir ? dir : ""});
+    if (false == warmup_running) {
+        pthread_t t;
+        throw_c(0 == pthread_create(&t, NULL, warmupMain, NULL),
+                "can't start the Paillier key warmup");
+        pthread_detach(t);
+        warmup_running = true;
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <crypto/paillier.hh>
+
+/*
+ * Paillier_priv keys generated from a seed, as HOM does it: keygen()
+ * over streamrng<arc4>(seed), a prime search that takes seconds. The
+ * result of keygen() and the CRT values are kept per seed, in memory
+ * for the process and, given a @dir, in a file there named after a hash
+ * of the seed. Files are mode 0600, under AES-CBC with a key derived
+ * from the seed and checked with an HMAC-SHA256; one that is missing or
+ * doesn't check out is generated and written again.
+ *
+ * warmup() hands seeds to a background thread, so their keys are
+ * ready, or on their way, by the time get() asks for them. Unless NTL
+ * was built with NTL_THREADS the prime search must not run beside other
+ * NTL work, and warmup() does nothing: the first get() of a seed
+ * generates its key, and later runs of the process read it from @dir.
+ */
+class PaillierKeyCache {
+public:
+    // A new Paillier_priv for the caller; each keeps its own
+    // precomputed randomness. @dir may be NULL.
+    static Paillier_priv *get(const std::string &seed, uint nbits,
+                              const char *dir);
+    static void warmup(const std::string &seed, uint nbits,
+                       const char *dir);
+};
@@ -0,0 +1,233 @@
+#include <crypto/swp_batch.hh>
+#include <crypto/SWPSearch.hh>
+#include <crypto/aesni.hh>
+#include <util/errstream.hh>
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * SWP::SWPencrypt() of word W_i, the i-th from 1, with SWPCiphSize 16;
+ * every AES input is one block, padded 10..0 (see pad() in
+ * SWPSearch.cc):
+ *
+ *   C   = E_k(pad(W_i) ^ SWPfixedIV)         E[W_i]
+ *   k_i = E_k(pad(C[0..12)) ^ k)             PRP_k(L_i)
+ *   S   = E_k(pad(decimal i) ^ k)[4..16)     S_i = PRP_k(i)
+ *   F   = E_k_i(pad(S) ^ k_i)[12..16)        F_{k_i}(S_i)
+ *
+ * and the ciphertext is C ^ (S || F). Where the IV of a PRP is its key,
+ * it cancels against the first round key.
+ */
+static_assert(SWPCiphSize == 16 && SWPr == 12 && SWPm == 4,
+              "swp_batch implements SWP with 16 byte ciphertexts");
+
+static const size_t block_bytes = 16;
+
+// @len bytes of @in, padded to a block.
+static void
+pad_block(const uint8_t *in, size_t len, uint8_t *out)
+{
+    memset(out, 0, block_bytes);
+    memcpy(out, in, len);
+    out[len] = 1;
+}
+
+static void
+pad_index(uint32_t index, uint8_t *out)
+{
+    // strFromVal(uint32_t).
+    char digits[16];
+    const int len = snprintf(digits, sizeof(digits), "%d",
+                             static_cast<int32_t>(index));
+    pad_block(reinterpret_cast<const uint8_t *>(digits), len, out);
+}
+
+#ifdef AESNI_AVAILABLE
+
+template<size_t N>
+static AESNI void
+aesni_swp(const uint8_t *rk, const uint8_t (*words)[16],
+          const uint8_t (*indexes)[16], uint8_t *out)
+{
+    __m128i k[11];
+    for (int r = 0; r < 11; r++) {
+        k[r] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rk + 16*r));
+    }
+    const __m128i iv =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(SWPfixedIV));
+    // The pad byte of a 12 byte input, and the bytes it keeps.
+    const __m128i one12 = _mm_set_epi32(1, 0, 0, 0);
+    const __m128i low12 = _mm_set_epi32(0, -1, -1, -1);
+
+    // C and S of every word, side by side.
+    __m128i c[N], s[N];
+    for (size_t j = 0; j < N; j++) {
+        c[j] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(words[j]));
+        c[j] = _mm_xor_si128(_mm_xor_si128(c[j], iv), k[0]);
+        s[j] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                                   indexes[j]));
+    }
+    for (int r = 1; r < 10; r++) {
+        for (size_t j = 0; j < N; j++) {
+            c[j] = _mm_aesenc_si128(c[j], k[r]);
+            s[j] = _mm_aesenc_si128(s[j], k[r]);
+        }
+    }
+    for (size_t j = 0; j < N; j++) {
+        c[j] = _mm_aesenclast_si128(c[j], k[10]);
+        // S_i moves to the front, which is where it is used.
+        s[j] = _mm_srli_si128(_mm_aesenclast_si128(s[j], k[10]), 4);
+    }
+
+    // The word keys.
+    __m128i wk[N][11];
+    for (size_t j = 0; j < N; j++) {
+        wk[j][0] = _mm_or_si128(_mm_and_si128(c[j], low12), one12);
+    }
+    for (int r = 1; r < 10; r++) {
+        for (size_t j = 0; j < N; j++) {
+            wk[j][0] = _mm_aesenc_si128(wk[j][0], k[r]);
+        }
+    }
+    for (size_t j = 0; j < N; j++) {
+        wk[j][0] = _mm_aesenclast_si128(wk[j][0], k[10]);
+    }
+
+#define EXPAND(i, rcon)                                                 \
+    for (size_t j = 0; j < N; j++) {                                    \
+        wk[j][i] = aesni_expand_step(                                   \
+                       wk[j][i - 1],                                    \
+                       _mm_aeskeygenassist_si128(wk[j][i - 1], rcon));  \
+    }
+
+    EXPAND(1, 0x01); EXPAND(2, 0x02); EXPAND(3, 0x04); EXPAND(4, 0x08);
+    EXPAND(5, 0x10); EXPAND(6, 0x20); EXPAND(7, 0x40); EXPAND(8, 0x80);
+    EXPAND(9, 0x1b); EXPAND(10, 0x36);
+#undef EXPAND
+
+    // F under each word key.
+    __m128i f[N];
+    for (size_t j = 0; j < N; j++) {
+        f[j] = _mm_or_si128(s[j], one12);
+    }
+    for (int r = 1; r < 10; r++) {
+        for (size_t j = 0; j < N; j++) {
+            f[j] = _mm_aesenc_si128(f[j], wk[j][r]);
+        }
+    }
+    for (size_t j = 0; j < N; j++) {
+        f[j] = _mm_aesenclast_si128(f[j], wk[j][10]);
+        const __m128i mask =
+            _mm_or_si128(s[j], _mm_andnot_si128(low12, f[j]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * j),
+                         _mm_xor_si128(c[j], mask));
+    }
+}
+
+#endif
+
+// E_@key(@in ^ @iv), one block.
+static void
+prp_block(const AES_KEY *key, const uint8_t *in, const uint8_t *iv,
+          uint8_t *out)
+{
+    uint8_t x[block_bytes];
+    for (size_t b = 0; b < block_bytes; b++) {
+        x[b] = in[b] ^ iv[b];
+    }
+    AES_encrypt(x, out, key);
+}
+
+static void
+swp_word(const AES_KEY *enckey, const uint8_t *key, const uint8_t *word,
+         const uint8_t *index, uint8_t *out)
+{
+    uint8_t c[block_bytes];
+    prp_block(enckey, word, SWPfixedIV, c);
+
+    uint8_t s[block_bytes];
+    prp_block(enckey, index, key, s);
+
+    uint8_t l[block_bytes];
+    pad_block(c, SWPr, l);
+    uint8_t wk[block_bytes];
+    prp_block(enckey, l, key, wk);
+
+    AES_KEY word_key;
+    AES_set_encrypt_key(wk, 8 * block_bytes, &word_key);
+    uint8_t p[block_bytes];
+    pad_block(s + SWPm, SWPr, p);
+    uint8_t f[block_bytes];
+    prp_block(&word_key, p, wk, f);
+
+    for (size_t b = 0; b < SWPr; b++) {
+        out[b] = c[b] ^ s[SWPm + b];
+    }
+    for (size_t b = SWPr; b < block_bytes; b++) {
+        out[b] = c[b] ^ f[b];
+    }
+}
+
+swp_batch::swp_batch(const std::string &k)
+{
+    throw_c(k.size() == key_bytes, "key has incorrect length");
+
+    memcpy(key, k.data(), key_bytes);
+    AES_set_encrypt_key(key, 8 * key_bytes, &enckey);
+
+    memset(round_keys, 0, sizeof(round_keys));
+#ifdef AESNI_AVAILABLE
+    if (aesni_supported()) {
+        aesni_expand_key(key, round_keys);
+    }
+#endif
+}
+
+std::string
+swp_batch::encrypt(const std::string &words,
+                   const std::vector<size_t> &ends) const
+{
+    std::string out(ends.size() * SWPCiphSize, 0);
+    uint8_t *const o = reinterpret_cast<uint8_t *>(&out[0]);
+
+    // One group of padded words and indexes at a time.
+    uint8_t w[lanes][block_bytes];
+    uint8_t x[lanes][block_bytes];
+    size_t start = 0;
+    for (size_t i = 0; i < ends.size(); i += lanes) {
+        const size_t n =
+            ends.size() - i < lanes ? ends.size() - i : lanes;
+        for (size_t j = 0; j < n; j++) {
+            const size_t len = ends[i + j] - start;
+            if (len >= SWPCiphSize) {
+                throw CryptoError(" given word " + words.substr(start, len)
+                                  + " is longer than SWPCiphSize");
+            }
+            pad_block(reinterpret_cast<const uint8_t *>(words.data())
+                          + start, len, w[j]);
+            pad_index(i + j + 1, x[j]);
+            start = ends[i + j];
+        }
+
+        uint8_t *const dst = o + i * SWPCiphSize;
+#ifdef AESNI_AVAILABLE
+        if (aesni_supported()) {
+            if (lanes == n) {
+                aesni_swp<lanes>(round_keys, w, x, dst);
+            } else {
+                for (size_t j = 0; j < n; j++) {
+                    aesni_swp<1>(round_keys, &w[j], &x[j],
+                                 dst + j * SWPCiphSize);
+                }
+            }
+            continue;
+        }
+#endif
+        for (size_t j = 0; j < n; j++) {
+            swp_word(&enckey, key, w[j], x[j], dst + j * SWPCiphSize);
+        }
+    }
+
+    return out;
+}
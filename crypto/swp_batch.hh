@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/aes.h>
+
+/*
+ * SWP::encrypt() under one key, for all the words of a document at once;
+ * the ciphertexts are byte for byte the same.
+ *
+ * SWP expands its key again for every AES call, four times per word.
+ * This expands the key once, and with AES-NI encrypts lanes words side
+ * by side, including the schedule of each word key. On CPUs without
+ * AES-NI it uses OpenSSL, which still has to expand each word key.
+ */
+class swp_batch {
+ public:
+    swp_batch(const std::string &key);
+
+    // The words lie back to back in @words; word i ends at @ends[i].
+    // Returns the SWPCiphSize bytes of each, in order. Throws if a word
+    // is SWPCiphSize bytes or longer.
+    std::string encrypt(const std::string &words,
+                        const std::vector<size_t> &ends) const;
+
+    static const size_t key_bytes = 16;
+    static const size_t lanes = 8;
+
+ private:
+    uint8_t key[key_bytes];
+    AES_KEY enckey;
+    uint8_t round_keys[11 * 16];
+};
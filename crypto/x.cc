@@ -1,27 +1,41 @@
 #include <vector>
+#include <map>
 #include <iomanip>
+#include <memory>
+#include <unistd.h>
 #include <crypto/cbc.hh>
 #include <crypto/cmc.hh>
 #include <crypto/prng.hh>
 #include <crypto/aes.hh>
 #include <crypto/blowfish.hh>
 #include <crypto/ope.hh>
+#include <crypto/ope_table.hh>
 #include <crypto/arc4.hh>
 #include <crypto/hgd.hh>
 #include <crypto/sha.hh>
 #include <crypto/hmac.hh>
 #include <crypto/paillier.hh>
+#include <crypto/paillier_cache.hh>
 #include <crypto/bn.hh>
 #include <crypto/ecjoin.hh>
 #include <crypto/search.hh>
 #include <crypto/skip32.hh>
 #include <crypto/cbcmac.hh>
 #include <crypto/ffx.hh>
+#include <crypto/ffx64.hh>
+#include <crypto/aes_cmc.hh>
+#include <crypto/BasicCrypto.hh>
+#include <crypto/SWPSearch.hh>
+#include <crypto/swp_batch.hh>
 #include <crypto/online_ope.hh>
+#include <crypto/mope.hh>
 #include <crypto/padding.hh>
 #include <crypto/mont.hh>
 #include <crypto/gfe.hh>
 #include <util/timer.hh>
+#include <util/cryptdb_log.hh>
+#include <util/zz.hh>
+#include <util/util.hh>
 #include <NTL/ZZ.h>
 #include <NTL/RR.h>
 
@@ -120,6 +134,92 @@ test_ope(int pbits, int cbits)
                                                        : NumBits(to_ZZ(1/maxerr))) << endl;
 }
 
+/*
+ * OPE_tinyint, OPE_smallint and OPE_mediumint encrypt through an
+ * OPETable; their ciphertexts must be OPE_int's (32-bit plaintexts,
+ * 64-bit ciphertexts), and a MEDIUMINT table decrypts before it is full.
+ */
+static void
+test_ope_table()
+{
+    urandom u;
+    const string key = u.rand_string(16);
+    OPE o(key, 32, 64);
+
+    for (uint64_t domain : {0x100ULL, 0x10000ULL, 0x1000000ULL}) {
+        vector<uint64_t> pts = {0, 4095, 4096, domain - 1};
+        for (uint i = 0; i < 16; i++) {
+            pts.push_back(u.rand<uint32_t>() % domain);
+        }
+
+        timer t;
+        auto table = OPETable::get(key, 32, 64, domain);
+        for (auto pt : pts) {
+            if (pt >= domain) {
+                continue;
+            }
+            const uint64_t ct = uint64FromZZ(o.encrypt(ZZFromUint64(pt)));
+            uint64_t pt2;
+            throw_c(table->decrypt(ct, &pt2) && pt2 == pt);
+            throw_c(table->encrypt(pt) == ct);
+            // 64-bit ciphertexts of 32-bit plaintexts leave gaps.
+            throw_c(!table->decrypt(ct + 1, &pt2));
+        }
+        const uint64_t first = uint64FromZZ(o.encrypt(ZZFromUint64(0)));
+        uint64_t pt2;
+        throw_c(0 == first || !table->decrypt(first - 1, &pt2));
+
+        cout << "--- ope table over " << domain << " plaintexts: "
+             << t.lap() / pts.size() << " usec per value" << endl;
+    }
+}
+
+/*
+ * What a LOG() of the values in a hot encryption path costs when its
+ * group is disabled, next to formatting them unconditionally (what
+ * every LOG() used to do).
+ */
+static void
+test_log_overhead()
+{
+    urandom u;
+    AES aes(u.rand_string(16));
+    string pt = u.rand_string(AES::blocksize);
+    string ct(pt.size(), 0);
+    enum { niter = 1000000 };
+
+    cryptdb_logger::disable(log_group::log_crypto_data);
+
+    timer t;
+    for (uint i = 0; i < niter; i++) {
+        aes.block_encrypt(&pt[0], &ct[0]);
+        pt[0] = ct[0];
+    }
+    const double bare = t.lap();
+
+    for (uint i = 0; i < niter; i++) {
+        aes.block_encrypt(&pt[0], &ct[0]);
+        LOG(crypto_data) << "encrypt " << ZZFromString(pt) << " ---> "
+                         << ZZFromString(ct);
+        pt[0] = ct[0];
+    }
+    const double disabled = t.lap();
+
+    for (uint i = 0; i < niter; i++) {
+        aes.block_encrypt(&pt[0], &ct[0]);
+        stringstream ss;
+        ss << "encrypt " << ZZFromString(pt) << " ---> "
+           << ZZFromString(ct);
+        pt[0] = ct[0];
+    }
+    const double formatted = t.lap();
+
+    cout << "--- log overhead per aes-128 encryption: "
+         << "disabled LOG() " << (disabled - bare) * 1000 / niter
+         << " nsec; formatting anyway " << (formatted - bare) * 1000 / niter
+         << " nsec (bare " << bare * 1000 / niter << " nsec)" << endl;
+}
+
 static void
 test_hgd()
 {
@@ -136,6 +236,42 @@ test_hgd()
     throw_c(s == 100);
 }
 
+/*
+ * HGD() must give HGD_bignum()'s variate and leave the PRNG where
+ * HGD_bignum() does, whichever tier answers; OPE ciphertexts depend on
+ * both.
+ */
+static void
+test_hgd_tiers()
+{
+    streamrng<arc4> pick("hgd tiers");
+    double native_usec = 0, bignum_usec = 0;
+
+    enum { niter = 2000 };
+    for (uint i = 0; i < niter; i++) {
+        const long bits = 1 + i % 60;
+        const ZZ tn = pick.rand_zz_mod(to_ZZ(1) << bits) + 1;
+        const ZZ n1 = pick.rand_zz_mod(tn + 1);
+        // Half of them shaped like OPE's: K is half the range.
+        const ZZ k = (i % 2) ? tn / 2 : pick.rand_zz_mod(tn + 1);
+
+        const std::string seed = "seed " + std::to_string(i);
+        streamrng<arc4> r1(seed), r2(seed);
+
+        timer t;
+        const ZZ s1 = HGD(k, n1, tn - n1, &r1);
+        native_usec += t.lap();
+        const ZZ s2 = HGD_bignum(k, n1, tn - n1, &r2);
+        bignum_usec += t.lap();
+
+        throw_c(s1 == s2, "HGD tiers disagree");
+        throw_c(r1.rand<uint64_t>() == r2.rand<uint64_t>(),
+                "HGD tiers drew different bytes");
+    }
+    cout << "--- hgd: " << native_usec / niter << " usec per sample, "
+         << bignum_usec / niter << " usec with RR only" << endl;
+}
+
 static void
 test_paillier()
 {
@@ -182,6 +318,56 @@ test_paillier()
     }
 }
 
+static void
+test_paillier_cache()
+{
+    urandom u;
+    const string seed = u.rand_string(16);
+    char dir[] = "/tmp/paillier-test-XXXXXX";
+    throw_c(mkdtemp(dir) != NULL);
+
+    const string key_file = string("ls ") + dir
+                            + "/paillier-1024-* >/dev/null 2>&1";
+    timer t;
+    PaillierKeyCache::warmup(seed, 1024, dir);
+#ifdef NTL_THREADS
+    // The background thread generates and writes the key unasked.
+    for (uint i = 0; i < 600 && 0 != system(key_file.c_str()); i++) {
+        usleep(100000);
+    }
+    throw_c(0 == system(key_file.c_str()));
+#else
+    // Nothing runs beside the caller's NTL work.
+    usleep(100000);
+    throw_c(0 != system(key_file.c_str()));
+#endif
+    const std::unique_ptr<Paillier_priv>
+        cold(PaillierKeyCache::get(seed, 1024, dir));
+    const double generate = t.lap();
+    const std::unique_ptr<Paillier_priv>
+        warm(PaillierKeyCache::get(seed, 1024, dir));
+    const double cached = t.lap();
+
+    streamrng<arc4> prng(seed);
+    const Paillier_priv ref(Paillier_priv::keygen(&prng, 1024));
+    throw_c(cold->privkey() == ref.privkey());
+    throw_c(warm->privkey() == ref.privkey());
+    throw_c(warm->crt() == ref.crt());
+
+    ZZ pt = u.rand_zz_mod(to_ZZ(1) << 256);
+    throw_c(warm->decrypt(cold->encrypt(pt)) == pt);
+
+    // One file, readable by nobody else.
+    const string ls = string("test \"$(stat -c %a ") + dir
+                      + "/paillier-1024-*)\" = 600";
+    throw_c(0 == system(ls.c_str()));
+
+    cout << "paillier cache: " << generate / 1000 << " msec to generate, "
+         << cached << " usec cached" << endl;
+
+    throw_c(0 == system((string("rm -rf ") + dir).c_str()));
+}
+
 static void
 test_paillier_packing()
 {
@@ -436,6 +622,162 @@ test_ffx()
     }
 }
 
+static void
+test_ffx64()
+{
+    streamrng<arc4> rnd("ffx64 seed");
+    const std::string k = rnd.rand_string(ffx64_aes::key_bytes);
+
+    AES key(k);
+    const ffx2_block_cipher<AES, 64> ref(&key, std::vector<uint8_t>());
+    const ffx64_aes f(k);
+    cout << "ffx64: aes-ni " << ffx64_aes::hardware() << endl;
+
+    // Odd lengths leave a partial batch.
+    for (size_t count: {1, 7, 8, 9, 100, 1003}) {
+        const auto pt = rnd.rand_vec<uint64_t>(count);
+        auto ct = pt;
+        f.encrypt(&ct[0], ct.size());
+
+        for (size_t i = 0; i < count; i++) {
+            uint8_t p[8], c[8];
+            for (int j = 0; j < 8; j++) {
+                p[j] = pt[i] >> (56 - 8 * j);
+            }
+            ref.block_encrypt(p, c);
+            uint64_t refct = 0;
+            for (int j = 0; j < 8; j++) {
+                refct = refct << 8 | c[j];
+            }
+
+            throw_c(ct[i] == refct);
+            throw_c(f.encrypt(pt[i]) == refct);
+            throw_c(f.decrypt(refct) == pt[i]);
+        }
+
+        f.decrypt(&ct[0], ct.size());
+        throw_c(ct == pt);
+    }
+
+    urandom u;
+    test_block_cipher(&f, &u, "ffx64-aes128-fast");
+
+    enum { nperf = 1 << 20 };
+    auto v = rnd.rand_vec<uint64_t>(nperf);
+    blowfish bf(k);
+    timer t;
+    f.encrypt(&v[0], v.size());
+    const double batch = t.lap();
+    for (auto &x: v) {
+        x = f.encrypt(x);
+    }
+    const double single = t.lap();
+    for (auto &x: v) {
+        x = bf.encrypt(x);
+    }
+    const double bfsingle = t.lap();
+    cout << "ffx64: " << batch * 1000 / nperf << " nsec/value in batches, "
+         << single * 1000 / nperf << " one at a time; blowfish "
+         << bfsingle * 1000 / nperf << endl;
+}
+
+static void
+test_aes_cmc()
+{
+    streamrng<arc4> rnd("aes_cmc seed");
+    const std::string k = rnd.rand_string(aes_cmc::key_bytes);
+    const aes_cmc c(k);
+    const std::unique_ptr<AES_KEY> enckey(get_AES_enc_key(k));
+    const std::unique_ptr<AES_KEY> deckey(get_AES_dec_key(k));
+
+    // Values of every length around the block size, in batches that
+    // leave lanes idle.
+    for (size_t count: {1, 7, 8, 9, 100}) {
+        std::vector<std::string> pt;
+        std::vector<std::string> ref;
+        for (size_t i = 0; i < count; i++) {
+            pt.push_back(rnd.rand_string(i % 50));
+            ref.push_back(encrypt_AES_CMC(pt.back(), enckey.get(), true));
+        }
+
+        auto ct = pt;
+        c.encrypt(&ct);
+        throw_c(ct == ref);
+        for (size_t i = 0; i < count; i++) {
+            throw_c(c.encrypt(pt[i]) == ref[i]);
+            throw_c(c.decrypt(ref[i]) == pt[i]);
+        }
+
+        c.decrypt(&ct);
+        throw_c(ct == pt);
+    }
+
+    enum { nperf = 1 << 18 };
+    std::vector<std::string> v(nperf, rnd.rand_string(20));
+    timer t;
+    c.encrypt(&v);
+    const double batch = t.lap();
+    for (auto &x: v) {
+        x = decrypt_AES_CMC(x, deckey.get(), true);
+    }
+    for (auto &x: v) {
+        x = encrypt_AES_CMC(x, enckey.get(), true);
+    }
+    const double single = t.lap();
+    c.decrypt(&v);
+    const double batchdec = t.lap();
+    cout << "aes_cmc: " << batch * 1000 / nperf
+         << " nsec/value encrypting in batches, " << batchdec * 1000 / nperf
+         << " decrypting; openssl " << single * 1000 / nperf
+         << " for both" << endl;
+}
+
+static void
+test_swp_batch()
+{
+    streamrng<arc4> rnd("swp seed");
+    const std::string k = rnd.rand_string(swp_batch::key_bytes);
+    const swp_batch b(k);
+
+    for (size_t count: {0, 1, 7, 8, 9, 100}) {
+        std::list<std::string> words;
+        std::string flat;
+        std::vector<size_t> ends;
+        for (size_t i = 0; i < count; i++) {
+            words.push_back(rnd.rand_string(i % SWPCiphSize));
+            flat += words.back();
+            ends.push_back(flat.size());
+        }
+
+        const std::unique_ptr<std::list<std::string>>
+            ref(SWP::encrypt(k, words));
+        std::string refct;
+        for (const auto &c: *ref) {
+            refct += c;
+        }
+        throw_c(b.encrypt(flat, ends) == refct);
+    }
+
+    enum { nperf = 1 << 16 };
+    std::list<std::string> words;
+    std::string flat;
+    std::vector<size_t> ends;
+    for (size_t i = 0; i < nperf; i++) {
+        words.push_back("word" + std::to_string(i));
+        flat += words.back();
+        ends.push_back(flat.size());
+    }
+    timer t;
+    const std::string ct = b.encrypt(flat, ends);
+    const double batch = t.lap();
+    const std::unique_ptr<std::list<std::string>> ref(SWP::encrypt(k, words));
+    const double single = t.lap();
+    throw_c(ct.size() == ref->size() * SWPCiphSize);
+    // Plaintext bytes per usec are MB/s.
+    cout << "swp: " << flat.size() / batch << " MB/s in batches, "
+         << flat.size() / single << " MB/s one word at a time" << endl;
+}
+
 static void
 test_online_ope()
 {
@@ -509,6 +851,98 @@ test_online_ope_rebalance()
     cerr << "test online ope rebalance OK \n";
 }
 
+/*
+ * MutableOPE against a plaintext -> label map kept up to date with its
+ * relabels the way the proxy updates the database; then the same
+ * dictionary again from its log.
+ */
+static void
+test_mutable_ope()
+{
+    urandom u;
+    const string key = u.rand_string(16);
+    char dir[] = "/tmp/mope-test-XXXXXX";
+    throw_c(mkdtemp(dir) != NULL);
+
+    map<uint64_t, uint64_t> labels;
+    // label -> plaintext, as the database would have them.
+    map<uint64_t, uint64_t> stored;
+    enum { niter = 100000 };
+    timer t;
+    {
+        auto m = MutableOPE::get(key, dir);
+        for (uint i = 0; i < niter; i++) {
+            // Half appends in the middle of the range, half random.
+            const uint64_t pt = (i % 2) ? (1 << 20) + i
+                                        : u.rand<uint64_t>() % (1 << 22);
+            const uint64_t label = m->encrypt(pt);
+
+            for (const auto &r : m->pendingRelabels()) {
+                vector<pair<uint64_t, uint64_t> > moved;
+                for (const auto &move : r.moves) {
+                    auto it = stored.find(move.first);
+                    if (it != stored.end()) {
+                        moved.push_back(make_pair(move.second, it->second));
+                        stored.erase(it);
+                    }
+                }
+                for (const auto &it : moved) {
+                    stored[it.first] = it.second;
+                    labels[it.second] = it.first;
+                }
+                m->relabelApplied(r.id);
+            }
+
+            if (!labels.count(pt)) {
+                labels[pt] = m->encrypt(pt);
+                stored[labels[pt]] = pt;
+            } else {
+                throw_c(labels[pt] == label);
+            }
+        }
+
+        vector<uint64_t> bulk;
+        for (uint i = 0; i < 10000; i++) {
+            bulk.push_back((1 << 23) + u.rand<uint16_t>());
+        }
+        m->insertBulk(bulk);
+        throw_c(m->pendingRelabels().empty());
+        for (auto pt : bulk) {
+            labels[pt] = m->encrypt(pt);
+        }
+        m->sync();
+    }
+    const double build = t.lap();
+
+    auto m = MutableOPE::get(key, dir);
+    throw_c(m->size() == labels.size());
+    uint64_t last = 0;
+    for (const auto &it : labels) {
+        uint64_t pt;
+        throw_c(it.second > last);
+        throw_c(m->decrypt(it.second, &pt) && pt == it.first);
+        throw_c(m->encrypt(it.first) == it.second);
+        last = it.second;
+    }
+    const double lookups = t.lap();
+
+    // A value it doesn't know compares between its neighbours and is
+    // not added.
+    const uint64_t absent = (1 << 22) + 1;
+    const auto above = labels.upper_bound(absent);
+    uint64_t label;
+    throw_c(m->lookup(absent, &label));
+    throw_c(label > std::prev(above)->second && label < above->second);
+    throw_c(m->size() == labels.size());
+
+    cout << "--- mutable ope: " << build * 1000 / niter
+         << " nsec per insert, "
+         << lookups * 1000 / (2 * labels.size())
+         << " nsec per lookup after reload" << endl;
+
+    throw_c(0 == system((string("rm -rf ") + dir).c_str()));
+}
+
 static void
 test_padding()
 {
@@ -616,11 +1050,16 @@ main(int ac, char **av)
     test_ecjoin();
     test_search();
     test_paillier();
+    test_paillier_cache();
     test_paillier_packing();
     test_montgomery();
     test_skip32();
     test_online_ope();
+    test_mutable_ope();
     test_ffx();
+    test_ffx64();
+    test_aes_cmc();
+    test_swp_batch();
 
     AES aes128(u.rand_string(16));
     test_block_cipher(&aes128, &u, "aes-128");
@@ -651,6 +1090,9 @@ main(int ac, char **av)
     cout << dec << endl;
 
     test_hgd();
+    test_hgd_tiers();
+    test_log_overhead();
+    test_ope_table();
 
     for (int pbits = 32; pbits <= 128; pbits += 32)
         for (int cbits = pbits; cbits <= pbits + 128; cbits += 32)
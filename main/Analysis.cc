@@ -2,8 +2,10 @@
 #include <main/rewrite_util.hh>
 #include <main/rewrite_main.hh>
 #include <main/metadata_tables.hh>
+#include <main/metadata_store.hh>
 #include <main/macro_util.hh>
 #include <main/stored_procedures.hh>
+#include <main/index_planner.hh>
 
 // FIXME: Memory leaks when we allocate MetaKey<...>, use smart pointer.
 
@@ -17,6 +19,11 @@ EncSet::EncSet(Analysis &a, FieldMeta * const fm) {
          pair++) {
         OnionMeta *const om = (*pair).second.get();
         OnionMetaKey const &key = (*pair).first;
+        // Stale onions can't answer anything until they are refreshed.
+        if (fm->getOnionsStale() && oAGG != key.getValue()) {
+            a.stale_fields_asked.insert(fm);
+            continue;
+        }
         osl[key.getValue()] = LevelFieldPair(a.getOnionLevel(*om), fm);
     }
 }
@@ -378,7 +385,10 @@ ProxyState::ProxyState(ConnectionInfo ci, const std::string &embed_dir,
                                                    // list.
       conn(new Connect(ci.server, ci.user, ci.passwd, ci.port)),
       e_conn(Connect::getEmbedded(embed_dir)), 
-      default_sec_rating(default_sec_rating)
+      default_sec_rating(default_sec_rating),
+      compact_tables(getenv("CRYPTDB_COMPACT_TABLES")
+                     && std::string("0") != getenv("CRYPTDB_COMPACT_TABLES")),
+      index_planner(new IndexPlanner(ci))
 {
     assert(conn && e_conn);
 
@@ -407,14 +417,14 @@ int ProxyState::db_init(const std::string &embed_dir)
     return 1;
 }
 
-std::string Delta::tableNameFromType(TableType table_type) const
+MetaStore::Table Delta::storeTableFromType(TableType table_type) const
 {
     switch (table_type) {
         case REGULAR_TABLE: {
-            return MetaData::Table::metaObject();
+            return MetaStore::Table::REGULAR;
         }
         case BLEEDING_TABLE: {
-            return MetaData::Table::bleedingMetaObject();
+            return MetaStore::Table::BLEEDING;
         }
         default: {
             FAIL_TextMessageError("Unrecognized table type!");
@@ -426,13 +436,13 @@ std::string Delta::tableNameFromType(TableType table_type) const
 bool CreateDelta::apply(const std::unique_ptr<Connect> &e_conn,
                         TableType table_type)
 {
-    const std::string table_name = tableNameFromType(table_type);
+    const MetaStore::Table table = storeTableFromType(table_type);
     std::function<bool(const DBMeta &, const DBMeta &,
                        const AbstractMetaKey * const,
                        const unsigned int * const)> helper =
-        [&e_conn, &helper, table_name] (const DBMeta &object,
-                                        const DBMeta &parent,
-                                        const AbstractMetaKey * const k,
+        [&e_conn, &helper, table] (const DBMeta &object,
+                                   const DBMeta &parent,
+                                   const AbstractMetaKey * const k,
                                const unsigned int * const ptr_parent_id)
     {
         const std::string child_serial = object.serialize(parent);
@@ -458,26 +468,14 @@ bool CreateDelta::apply(const std::unique_ptr<Connect> &e_conn,
             };
 
         const std::string serial_key = getSerialKey(parent, object, k);
-        const std::string esc_serial_key =
-            escapeString(e_conn, serial_key);
-
-        // ------------------------
-        //    Build the queries.
-        // ------------------------
-
-        // On CREATE, the database generates a unique ID for us.
-        const std::string esc_child_serial =
-            escapeString(e_conn, child_serial);
-
-        const std::string query =
-            " INSERT INTO " + table_name + 
-            "    (serial_object, serial_key, parent_id) VALUES (" 
-            " '" + esc_child_serial + "',"
-            " '" + esc_serial_key + "',"
-            " " + std::to_string(parent_id) + ");";
-        RETURN_FALSE_IF_FALSE(e_conn->execute(query));
 
-        const unsigned int object_id = e_conn->last_insert_id();
+        // On CREATE, the store generates a unique ID for us.
+        unsigned long new_id;
+        RETURN_FALSE_IF_FALSE(
+            MetaData::store().insertObject(e_conn, table, child_serial,
+                                           serial_key, parent_id,
+                                           &new_id));
+        const unsigned int object_id = new_id;
 
         std::function<bool(const DBMeta &)> localCreateHandler =
             [&object, object_id, &helper]
@@ -494,22 +492,16 @@ bool CreateDelta::apply(const std::unique_ptr<Connect> &e_conn,
 bool ReplaceDelta::apply(const std::unique_ptr<Connect> &e_conn,
                          TableType table_type)
 {
-    const std::string table_name = tableNameFromType(table_type);
+    const MetaStore::Table table = storeTableFromType(table_type);
 
     const unsigned int child_id = meta.getDatabaseID();
-
-    const std::string child_serial = meta.serialize(parent_meta);
-    const std::string esc_child_serial =
-        escapeString(e_conn, child_serial);
+    const std::string child_serial =
+        serial ? *serial : meta.serialize(parent_meta);
     const std::string serial_key = key.getSerial();
-    const std::string esc_serial_key = escapeString(e_conn, serial_key);
 
-    const std::string query = 
-        " UPDATE " + table_name +
-        "    SET serial_object = '" + esc_child_serial + "', "
-        "        serial_key = '" + esc_serial_key + "'"
-        "  WHERE id = " + std::to_string(child_id) + ";";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(query));
+    RETURN_FALSE_IF_FALSE(
+        MetaData::store().replaceObject(e_conn, table, child_id,
+                                        child_serial, serial_key));
 
     return true;
 }
@@ -517,23 +509,17 @@ bool ReplaceDelta::apply(const std::unique_ptr<Connect> &e_conn,
 bool DeleteDelta::apply(const std::unique_ptr<Connect> &e_conn,
                         TableType table_type)
 {
-    const std::string table_name = tableNameFromType(table_type);
-    Connect * const e_c = e_conn.get();
+    const MetaStore::Table table = storeTableFromType(table_type);
     std::function<bool(const DBMeta &, const DBMeta &)> helper =
-        [&e_c, &helper, table_name](const DBMeta &object,
-                                    const DBMeta &parent)
+        [&e_conn, &helper, table](const DBMeta &object,
+                                  const DBMeta &parent)
     {
         const unsigned int object_id = object.getDatabaseID();
         const unsigned int parent_id = parent.getDatabaseID();
 
-        const std::string query =
-            " DELETE " + table_name + " "
-            "   FROM " + table_name + 
-            "  WHERE " + table_name + ".id" +
-            "      = "     + std::to_string(object_id) + 
-            "    AND " + table_name + ".parent_id" +
-            "      = "     + std::to_string(parent_id) + ";";
-        RETURN_FALSE_IF_FALSE(e_c->execute(query));
+        RETURN_FALSE_IF_FALSE(
+            MetaData::store().deleteObject(e_conn, table, object_id,
+                                           parent_id));
 
         std::function<bool(const DBMeta &)> localDestroyHandler =
             [&object, &helper] (const DBMeta &child) {
@@ -786,30 +772,31 @@ void
 DeltaOutput::beforeQuery(const std::unique_ptr<Connect> &conn,
                          const std::unique_ptr<Connect> &e_conn)
 {
-    TEST_Sync(e_conn->execute("START TRANSACTION;"),
-              "failed to start transaction");
-
     // We must save the current default database because recovery
     // may be happening after a restart in which case such state
     // was lost.
+    std::string default_db;
+    TEST_Sync(lowLevelGetCurrentDatabase(e_conn, &default_db),
+              "failed to get current database");
+
+    MetaStore &store = MetaData::store();
+    TEST_Sync(store.begin(e_conn), "failed to start transaction");
+
     const CompletionType &completion_type = this->getCompletionType();
-    const std::string &q_completion =
-        " INSERT INTO " + MetaData::Table::embeddedQueryCompletion() +
-        "   (begin, complete, original_query, default_db, aborted, type)"
-        "   VALUES (TRUE,  FALSE,"
-        "    '" + escapeString(conn, this->original_query) + "',"
-        "    (SELECT DATABASE()),  FALSE,"
-        "    '" + TypeText<CompletionType>::toText(completion_type)
-            + "');";
-    SYNC_IF_FALSE(e_conn->execute(q_completion), e_conn);
-    this->embedded_completion_id = e_conn->last_insert_id();
+    unsigned long completion_id;
+    STORE_SYNC_IF_FALSE(
+        store.beginCompletion(e_conn, this->original_query, default_db,
+                      TypeText<CompletionType>::toText(completion_type),
+                      &completion_id),
+        e_conn);
+    this->embedded_completion_id = completion_id;
 
     for (auto it = deltas.begin(); it != deltas.end(); it++) {
         const bool b = (*it)->apply(e_conn, Delta::BLEEDING_TABLE);
-        SYNC_IF_FALSE(b, e_conn);
+        STORE_SYNC_IF_FALSE(b, e_conn);
     }
 
-    SYNC_IF_FALSE(e_conn->execute("COMMIT;"), e_conn);
+    STORE_SYNC_IF_FALSE(store.commit(e_conn), e_conn);
 
     return;
 }
@@ -817,22 +804,22 @@ DeltaOutput::beforeQuery(const std::unique_ptr<Connect> &conn,
 void
 DeltaOutput::afterQuery(const std::unique_ptr<Connect> &e_conn) const
 {
-    TEST_Sync(e_conn->execute("START TRANSACTION;"),
-              "failed to start transaction");
+    MetaStore &store = MetaData::store();
+    TEST_Sync(store.begin(e_conn), "failed to start transaction");
 
-    const std::string q_update =
-        " UPDATE " + MetaData::Table::embeddedQueryCompletion() +
-        "    SET complete = TRUE"
-        "  WHERE id=" +
-                 std::to_string(this->embedded_completion_id.get()) + ";";
-    SYNC_IF_FALSE(e_conn->execute(q_update), e_conn);
+    STORE_SYNC_IF_FALSE(
+        store.finishCompletion(e_conn,
+                               this->embedded_completion_id.get()),
+        e_conn);
 
     for (auto it = deltas.begin(); it != deltas.end(); it++) {
         const bool b = (*it)->apply(e_conn, Delta::REGULAR_TABLE);
-        SYNC_IF_FALSE(b, e_conn);
+        STORE_SYNC_IF_FALSE(b, e_conn);
     }
 
-    SYNC_IF_FALSE(e_conn->execute("COMMIT;"), e_conn);
+    STORE_SYNC_IF_FALSE(store.commit(e_conn), e_conn);
+    // Every SchemaCache, ours included, reloads for its next query.
+    SchemaCache::invalidateAll();
 
     return;
 }
@@ -849,36 +836,18 @@ DeltaOutput::getEmbeddedCompletionID() const
     return this->embedded_completion_id.get();
 }
 
-static bool
-tableCopy(const std::unique_ptr<Connect> &c, const std::string &src,
-          const std::string &dest)
-{
-    const std::string delete_query =
-        " DELETE FROM " + dest + ";";
-    RETURN_FALSE_IF_FALSE(c->execute(delete_query));
-
-    const std::string insert_query =
-        " INSERT " + dest +
-        "   SELECT * FROM " + src + ";";
-    RETURN_FALSE_IF_FALSE(c->execute(insert_query));
-
-    return true;
-}
-
 bool
 setRegularTableToBleedingTable(const std::unique_ptr<Connect> &e_conn)
 {
-    const std::string src = MetaData::Table::bleedingMetaObject();
-    const std::string dest = MetaData::Table::metaObject();
-    return tableCopy(e_conn, src, dest);
+    return MetaData::store().copyTable(e_conn, MetaStore::Table::BLEEDING,
+                                       MetaStore::Table::REGULAR);
 }
 
 bool
 setBleedingTableToRegularTable(const std::unique_ptr<Connect> &e_conn)
 {
-    const std::string src = MetaData::Table::metaObject();
-    const std::string dest = MetaData::Table::bleedingMetaObject();
-    return tableCopy(e_conn, src, dest);
+    return MetaData::store().copyTable(e_conn, MetaStore::Table::REGULAR,
+                                       MetaStore::Table::BLEEDING);
 }
 
 void
@@ -1022,6 +991,77 @@ CompletionType AdjustOnionOutput::getCompletionType() const
     return CompletionType::AdjustOnionCompletion;
 }
 
+void
+StaleOnionOutput::beforeQuery(const std::unique_ptr<Connect> &conn,
+                              const std::unique_ptr<Connect> &e_conn)
+{
+    assert(deltas.size() > 0);
+
+    // The refresh is idempotent; if we fail before the metadata
+    // change lands the field simply stays stale.
+    if (refresh_queries.size() > 0) {
+        TEST_TextMessageError(conn->execute("START TRANSACTION;"),
+                              "failed to start refresh transaction");
+        for (const auto &it : refresh_queries) {
+            if (false == conn->execute(it)) {
+                assert(conn->execute("ROLLBACK;"));
+                FAIL_TextMessageError("failed to rewrite onions: "
+                                      + conn->getError());
+            }
+        }
+        TEST_TextMessageError(conn->execute("COMMIT;"),
+                              "failed to commit onion refresh");
+    }
+
+    return DeltaOutput::beforeQuery(conn, e_conn);
+}
+
+void
+StaleOnionOutput::getQuery(std::list<std::string> * const queryz,
+                           SchemaInfo const &) const
+{
+    queryz->clear();
+    queryz->push_back(mysql_noop());
+}
+
+QueryAction
+StaleOnionOutput::queryAction(const std::unique_ptr<Connect> &) const
+{
+    return QueryAction::AGAIN;
+}
+
+bool StaleOnionOutput::doDecryption() const
+{
+    return false;
+}
+
+CompletionType StaleOnionOutput::getCompletionType() const
+{
+    return CompletionType::StaleOnionCompletion;
+}
+
+CompletionType CompactTableOutput::getCompletionType() const
+{
+    return CompletionType::CompactCompletion;
+}
+
+std::shared_ptr<Arena> Analysis::newArena()
+{
+    static const bool pooled = [] () {
+        const char *const ev = getenv("CRYPTDB_REWRITE_ARENA");
+        return NULL == ev || std::string("0") != ev;
+    }();
+
+    return std::make_shared<Arena>(8192, pooled);
+}
+
+void Analysis::noteFilterOnions(size_t first_rewrite)
+{
+    assert(first_rewrite <= field_rewrites.size());
+    filter_onions.insert(field_rewrites.begin() + first_rewrite,
+                         field_rewrites.end());
+}
+
 bool Analysis::addAlias(const std::string &alias,
                         const std::string &db,
                         const std::string &table)
@@ -1188,13 +1228,25 @@ std::string Analysis::unAliasTable(const std::string &db,
     return alias_pair->second;
 }
 
-EncLayer &Analysis::getBackEncLayer(const OnionMeta &om)
+EncLayer &Analysis::getBackEncLayer(const OnionMeta &om) const
 {
+    auto it = assumed_levels.find(&om);
+    if (assumed_levels.end() != it) {
+        EncLayer *const el = om.getLayer(it->second);
+        assert(el);
+        return *el;
+    }
+
     return *om.layers.back().get();
 }
 
-SECLEVEL Analysis::getOnionLevel(const OnionMeta &om)
+SECLEVEL Analysis::getOnionLevel(const OnionMeta &om) const
 {
+    auto it = assumed_levels.find(&om);
+    if (assumed_levels.end() != it) {
+        return it->second;
+    }
+
     return om.getSecLevel();
 }
 
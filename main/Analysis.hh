@@ -1,10 +1,13 @@
 #pragma once
 
 #include <algorithm>
+#include <tuple>
 #include <util/onions.hh>
 #include <util/cryptdb_log.hh>
 #include <main/schema.hh>
 #include <main/rewrite_ds.hh>
+#include <main/metadata_store.hh>
+#include <main/result_cache.hh>
 #include <parser/embedmysql.hh>
 #include <parser/stringify.hh>
 
@@ -67,6 +70,8 @@ public:
 
 } ConnectionInfo;
 
+class IndexPlanner;
+
 // state maintained at the proxy
 typedef struct ProxyState {
     ProxyState(ConnectionInfo ci, const std::string &embed_dir,
@@ -85,6 +90,10 @@ typedef struct ProxyState {
     }
     const std::unique_ptr<Connect> &getConn() const {return conn;}
     const std::unique_ptr<Connect> &getEConn() const {return e_conn;}
+    IndexPlanner &getIndexPlanner() const {return *index_planner;}
+    // CRYPTDB_COMPACT_TABLES=1 creates new tables in the compact
+    // storage format.
+    bool compactTables() const {return compact_tables;}
 
     static int db_init(const std::string &embed_dir);
 
@@ -95,6 +104,8 @@ private:
     const std::unique_ptr<Connect> conn;
     const std::unique_ptr<Connect> e_conn;
     const SECURITY_RATING default_sec_rating;
+    const bool compact_tables;
+    const std::unique_ptr<IndexPlanner> index_planner;
 } ProxyState;
 
 
@@ -115,7 +126,7 @@ public:
 protected:
     const DBMeta &parent_meta;
 
-    std::string tableNameFromType(TableType table_type) const;
+    MetaStore::Table storeTableFromType(TableType table_type) const;
 };
 
 // CreateDelta calls must provide the key.  meta and
@@ -166,12 +177,21 @@ class ReplaceDelta : public DerivedKeyDelta {
 public:
     ReplaceDelta(const DBMeta &meta, const DBMeta &parent_meta)
         : DerivedKeyDelta(meta, parent_meta) {}
+    // Stores @serial instead of what @meta serializes to, so a change
+    // reaches the metadata without touching the cached @meta.
+    ReplaceDelta(const DBMeta &meta, const DBMeta &parent_meta,
+                 const std::string &serial)
+        : DerivedKeyDelta(meta, parent_meta),
+          serial(new std::string(serial)) {}
 
     bool save(const std::unique_ptr<Connect> &e_conn,
               unsigned long * const delta_output_id);
     bool apply(const std::unique_ptr<Connect> &e_conn,
                TableType table_type);
     bool destroyRecord(const std::unique_ptr<Connect> &e_conn);
+
+private:
+    const std::unique_ptr<const std::string> serial;
 };
 
 class DeleteDelta : public DerivedKeyDelta {
@@ -279,7 +299,8 @@ private:
     AssignOnce<bool> do_nothing;
 };
 
-enum class CompletionType {DDLCompletion, AdjustOnionCompletion};
+enum class CompletionType {DDLCompletion, AdjustOnionCompletion,
+                           StaleOnionCompletion, CompactCompletion};
 
 class DeltaOutput : public RewriteOutput {
 public:
@@ -363,9 +384,64 @@ private:
     const std::function<std::string(const std::string &)> hackEscape;
 };
 
+// Flips the stale flag of fields whose onions an in-place HOM increment
+// leaves behind (or that were just rebuilt from oAGG by
+// @refresh_queries) and then has the query reissued.
+class StaleOnionOutput : public DeltaOutput {
+public:
+    StaleOnionOutput(const std::string &original_query,
+                     std::vector<std::unique_ptr<Delta> > &&deltas,
+                     const std::list<std::string> &refresh_queries)
+        : DeltaOutput(original_query, std::move(deltas)),
+          refresh_queries(refresh_queries) {}
+    ~StaleOnionOutput() {;}
+    void beforeQuery(const std::unique_ptr<Connect> &conn,
+                     const std::unique_ptr<Connect> &e_conn);
+    void getQuery(std::list<std::string> * const queryz,
+                  SchemaInfo const &schema) const;
+    QueryAction queryAction(const std::unique_ptr<Connect> &conn) const;
+    bool doDecryption() const;
+
+protected:
+    CompletionType getCompletionType() const;
+
+private:
+    const std::list<std::string> refresh_queries;
+};
+
+// Moves a table to the compact storage format. The queries re-salt each
+// field with the row salt along with its own salt column, so the rows
+// read the same under the old and the new metadata.
+class CompactTableOutput : public StaleOnionOutput {
+public:
+    CompactTableOutput(const std::string &original_query,
+                       std::vector<std::unique_ptr<Delta> > &&deltas,
+                       const std::list<std::string> &resalt_queries)
+        : StaleOnionOutput(original_query, std::move(deltas),
+                           resalt_queries) {}
+    ~CompactTableOutput() {;}
+
+protected:
+    CompletionType getCompletionType() const;
+};
+
 bool setRegularTableToBleedingTable(const std::unique_ptr<Connect> &e_conn);
 bool setBleedingTableToRegularTable(const std::unique_ptr<Connect> &e_conn);
 
+typedef std::tuple<const TableMeta *, const FieldMeta *, onion> FieldOnion;
+
+// A field reference of the query resolved against the schema.
+struct FieldHandle {
+    FieldHandle(TableMeta *const tm, FieldMeta *const fm,
+                const std::string &anon_table)
+        : tm(tm), fm(fm), anon_table(anon_table) {}
+
+    TableMeta *const tm;
+    FieldMeta *const fm;
+    // The alias, if the query names the table through one.
+    const std::string anon_table;
+};
+
 class RewritePlan;
 class Analysis {
     Analysis() = delete;
@@ -374,23 +450,79 @@ class Analysis {
     Analysis &operator=(const Analysis &a) = delete;
     Analysis &operator=(Analysis &&a) = delete;
 
+    // Declared ahead of everything allocated from it. The analyses of
+    // subqueries share their parent's, as plans move between the two.
+    const std::shared_ptr<Arena> arena_owner;
+    // Pooled unless CRYPTDB_REWRITE_ARENA=0.
+    static std::shared_ptr<Arena> newArena();
+
 public:
-    Analysis(const std::string &default_db, const SchemaInfo &schema)
-        : pos(0), special_update(false), db_name(default_db),
+    // @parent_arena: that of the enclosing query, for a subquery.
+    Analysis(const std::string &default_db, const SchemaInfo &schema,
+             const std::shared_ptr<Arena> &parent_arena =
+                std::shared_ptr<Arena>())
+        : arena_owner(parent_arena ? parent_arena : newArena()),
+          arena(*arena_owner), pos(0),
+          salts(std::less<const FieldMeta *>(), arena), row_salt(0),
+          rewritePlans(std::less<const Item *>(), arena),
+          item_cache(std::less<const Item_field *>(), arena),
+          field_handles(std::less<const Item_field *>(), arena),
+          special_update(false), changes_default_db(false),
+          lookup_constants(false),
+          cache_footprint(default_db), db_name(default_db),
           schema(schema) {}
 
+    // The rewrite state of the query is allocated here and released
+    // with the last Analysis that shares it.
+    Arena &arena;
+    const std::shared_ptr<Arena> &sharedArena() const {return arena_owner;}
+
     unsigned int pos; // > a counter indicating how many projection
                       // fields have been analyzed so far
-    std::map<const FieldMeta *, const salt_type> salts;
-    std::map<const Item *, std::unique_ptr<RewritePlan> > rewritePlans;
+    ArenaMap<const FieldMeta *, const salt_type>::type salts;
+    // Salt of the row being INSERTed into a compact table.
+    salt_type row_salt;
+    ArenaMap<const Item *, std::unique_ptr<RewritePlan> >::type
+        rewritePlans;
     std::map<std::string, std::map<const std::string, const std::string>>
         table_aliases;
-    std::map<const Item_field *, std::pair<Item_field *, OLK>> item_cache;
+    ArenaMap<const Item_field *, std::pair<Item_field *, OLK> >::type
+        item_cache;
+    // Each field reference is looked up once and its handle shared by
+    // the gather and rewrite passes.
+    ArenaMap<const Item_field *, FieldHandle>::type field_handles;
 
     // information for decrypting results
     ReturnMeta rmeta;
 
     bool special_update;
+    // Set by statements that change the session's default database
+    // once they succeed: USE, and DROP DATABASE of the current one,
+    // which leaves none.
+    bool changes_default_db;
+    std::string new_default_db;
+    // Set while WHERE, ON and HAVING are rewritten: their constants
+    // are only compared against, so layers that would have to remember
+    // a new value (OPE_mutable) look it up instead.
+    bool lookup_constants;
+    // The tables the statement reads or writes, for the result cache.
+    CacheFootprint cache_footprint;
+    // (database, anonymous table) of each table the statement drops;
+    // an empty table stands for every table of the database.
+    std::vector<std::pair<std::string, std::string> > dropped_tables;
+    // Fields an in-place HOM increment is about to leave stale.
+    std::map<FieldMeta *, const TableMeta *> newly_stale_fields;
+    // Stale fields the statement wanted another onion of than oAGG;
+    // a NoAvailableEncSet refreshes them.
+    std::set<const FieldMeta *> stale_fields_asked;
+    // Every onion a field was rewritten to, in order.
+    std::vector<FieldOnion> field_rewrites;
+    // The onions fields in WHERE, ON, GROUP BY and ORDER BY were
+    // rewritten to; an index on one of these could serve the query.
+    std::set<FieldOnion> filter_onions;
+
+    // Moves the rewrites since @first_rewrite into filter_onions.
+    void noteFilterOnions(size_t first_rewrite);
 
     // These functions are prefered to their lower level counterparts.
     bool addAlias(const std::string &alias, const std::string &db,
@@ -425,14 +557,19 @@ public:
     std::string getAnonIndexName(const TableMeta &tm,
                                  const std::string &index_name,
                                  onion o) const;
-    static EncLayer &getBackEncLayer(const OnionMeta &om);
-    static SECLEVEL getOnionLevel(const OnionMeta &om);
+    EncLayer &getBackEncLayer(const OnionMeta &om) const;
+    SECLEVEL getOnionLevel(const OnionMeta &om) const;
     static std::vector<std::unique_ptr<EncLayer>> const &
         getEncLayers(const OnionMeta &om);
     const SchemaInfo &getSchema() {return schema;}
 
     std::vector<std::unique_ptr<Delta> > deltas;
 
+    // Levels that onions are taken to already be adjusted down to; lets
+    // a planner find every adjustment a query needs without modifying
+    // the schema.
+    std::map<const OnionMeta *, SECLEVEL> assumed_levels;
+
     std::string getDatabaseName() const {return db_name;}
 
 private:
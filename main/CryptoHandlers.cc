@@ -3,9 +3,14 @@
 #include <main/schema.hh>
 #include <parser/lex_util.hh>
 #include <crypto/ope.hh>
+#include <crypto/ope_table.hh>
+#include <crypto/mope.hh>
 #include <crypto/BasicCrypto.hh>
 #include <crypto/SWPSearch.hh>
 #include <crypto/arc4.hh>
+#include <crypto/ffx64.hh>
+#include <crypto/aes_cmc.hh>
+#include <crypto/paillier_cache.hh>
 #include <util/util.hh>
 #include <util/cryptdb_log.hh>
 #include <util/zz.hh>
@@ -30,22 +35,27 @@ using namespace NTL;
 
    - We have a set of implementation EncLayer-s: each implementation layer
    is tied to some specific encryption scheme and key/block size:
-   RND_int, RND_str, DET_int, DET_str, OPE_int, OPE_str
+   RND_int, RND_str, DET_int, DET_str, OPE_int, OPE_str, RND_int_ffx,
+   DET_int_ffx
 
    - LayerFactory: creates an implementation EncLayer for a certain security
    level and field type:
 
    - RNDFactory: outputs a RND layer
-         - RND layers: RND_int for blowfish, RND_str for AES
+         - RND layers: RND_int for blowfish, RND_int_ffx for FFX over
+           AES, RND_str for AES
 
     -DETFactory: outputs a DET layer
-         - DET layers: DET_int, DET_str
+         - DET layers: DET_int, DET_int_ffx, DET_str
 
     -OPEFactory: outputs a OPE layer
-         - OPE layers: OPE_int, OPE_str, OPE_dec
+         - OPE layers: OPE_int, OPE_str, OPE_dec, OPE_mutable
 
     -HOMFactory: outputs a HOM layer
          - HOM layers: HOM (for integers), HOM_dec (for decimals)
+
+   - OnionPipeline implementations: FusedPipeline for the layer classes
+   of the fixed onion layouts, LayeredPipeline for other stacks.
   
  */
 
@@ -109,6 +119,21 @@ public:
 };
 
 
+// New RND and DET integer layers are FFX over AES (RND_int_ffx,
+// DET_int_ffx) when CRYPTDB_INT_CIPHER is "ffx", and blowfish
+// otherwise. A layer keeps the cipher it was created with.
+static bool
+ffxIntegers()
+{
+    static const bool ffx = [] () {
+        const char *const ev = getenv("CRYPTDB_INT_CIPHER");
+        return ev && std::string("ffx") == ev;
+    }();
+
+    return ffx;
+}
+
+
 /*=====================  SERIALIZE Helpers =============================*/
 
 struct SerialLayer {
@@ -326,6 +351,16 @@ public:
     Item * decrypt(Item * const ctext, uint64_t IV) const;
     Item * decryptUDF(Item * const col, Item * const ivcol) const;
 
+    ValueKind plainKind() const {return ValueKind::INT;}
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setUnsigned(bf.encrypt(v->uintValue() ^ IV));
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setUnsigned(bf.decrypt(v->uintValue()) ^ IV);
+    }
+
 private:
     std::string const key;
     blowfish const bf;
@@ -334,6 +369,50 @@ private:
 
 };
 
+// > Like RND_int, with ffx64_aes in place of blowfish.
+// > Decrypts result columns in batches; see EncLayer::decryptBatch.
+class RND_int_ffx : public EncLayer {
+public:
+    RND_int_ffx(Create_field * const cf, const std::string &seed_key);
+
+    // serialize and deserialize
+    std::string doSerialize() const {return key;}
+    RND_int_ffx(unsigned int id, const std::string &serial);
+
+    SECLEVEL level() const {return SECLEVEL::RND;}
+    std::string name() const {return "RND_int_ffx";}
+
+    Create_field * newCreateField(const Create_field * const cf,
+                                  const std::string &anonname = "")
+        const;
+
+    Item *encrypt(const Item &ptext, uint64_t IV) const;
+    Item * decrypt(Item * const ctext, uint64_t IV) const;
+    bool decryptBatch(std::vector<Item *> *const ctexts,
+                      const std::vector<uint64_t> &IVs) const
+    {
+        return decryptBatchAsValues(ctexts, IVs);
+    }
+    Item * decryptUDF(Item * const col, Item * const ivcol) const;
+
+    ValueKind plainKind() const {return ValueKind::INT;}
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setUnsigned(ffx.encrypt(v->uintValue() ^ IV));
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setUnsigned(ffx.decrypt(v->uintValue()) ^ IV);
+    }
+    bool decryptValues(std::vector<LayerValue> *const vs,
+                       const std::vector<uint64_t> &IVs) const;
+
+private:
+    std::string const key;
+    ffx64_aes const ffx;
+    static int const ciph_size = 8;
+};
+
 class RND_str : public EncLayer {
 public:
     RND_str(Create_field * const cf, const std::string &seed_key);
@@ -352,6 +431,20 @@ public:
     Item * decrypt(Item * const ctext, uint64_t IV) const;
     Item * decryptUDF(Item * const col, Item * const ivcol) const;
 
+    ValueKind plainKind() const {return ValueKind::BYTES;}
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setBytes(encrypt_AES_CBC(v->bytes, enckey,
+                                    BytesFromInt(IV, SALT_LEN_BYTES),
+                                    false));
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setBytes(decrypt_AES_CBC(v->bytes, deckey,
+                                    BytesFromInt(IV, SALT_LEN_BYTES),
+                                    false));
+    }
+
 private:
     std::string const rawkey;
     static int const key_bytes = 16;
@@ -364,6 +457,9 @@ EncLayer *
 RNDFactory::create(Create_field * const cf, const std::string &key)
 {
     if (IsMySQLTypeNumeric(cf->sql_type)) { // the ope case as well 
+        if (ffxIntegers()) {
+            return new RND_int_ffx(cf, key);
+        }
         return new RND_int(cf, key);
     } else {
         return new RND_str(cf, key);
@@ -375,6 +471,8 @@ RNDFactory::deserialize(unsigned int id, const SerialLayer &sl)
 {
     if (sl.name == "RND_int") {
         return new RND_int(id, sl.layer_info);
+    } else if (sl.name == "RND_int_ffx") {
+        return new RND_int_ffx(id, sl.layer_info);
     } else {
         return new RND_str(id, sl.layer_info);
     }
@@ -463,6 +561,98 @@ RND_int::decryptUDF(Item * const col, Item * const ivcol) const
 
 ///////////////////////////////////////////////
 
+RND_int_ffx::RND_int_ffx(Create_field * const f, const std::string &seed_key)
+    : key(prng_expand(seed_key, ffx64_aes::key_bytes)), ffx(key)
+{}
+
+RND_int_ffx::RND_int_ffx(unsigned int id, const std::string &serial)
+    : EncLayer(id), key(serial), ffx(key)
+{}
+
+Create_field *
+RND_int_ffx::newCreateField(const Create_field * const cf,
+                            const std::string &anonname) const
+{
+    return createFieldHelper(cf, ciph_size, MYSQL_TYPE_LONGLONG,
+                             anonname);
+}
+
+Item *
+RND_int_ffx::encrypt(const Item &ptext, uint64_t IV) const
+{
+    const uint64_t p = RiboldMYSQL::val_uint(ptext);
+    const uint64_t c = ffx.encrypt(p ^ IV);
+    LOG(encl) << "RND_int_ffx encrypt " << p << " IV " << IV << "-->" << c;
+
+    return new (current_thd->mem_root)
+               Item_int(static_cast<ulonglong>(c));
+}
+
+Item *
+RND_int_ffx::decrypt(Item * const ctext, uint64_t IV) const
+{
+    const uint64_t c = static_cast<Item_int*>(ctext)->value;
+    const uint64_t p = ffx.decrypt(c) ^ IV;
+    LOG(encl) << "RND_int_ffx decrypt " << c << " IV " << IV << " --> "
+              << p;
+
+    return new (current_thd->mem_root)
+               Item_int(static_cast<ulonglong>(p));
+}
+
+bool
+RND_int_ffx::decryptValues(std::vector<LayerValue> *const vs,
+                           const std::vector<uint64_t> &IVs) const
+{
+    assert(vs->size() == IVs.size());
+
+    std::vector<uint64_t> v(vs->size());
+    for (size_t i = 0; i < v.size(); ++i) {
+        v[i] = (*vs)[i].uintValue();
+    }
+    ffx.decrypt(v.data(), v.size());
+    for (size_t i = 0; i < v.size(); ++i) {
+        (*vs)[i].setUnsigned(v[i] ^ IVs[i]);
+    }
+
+    return true;
+}
+
+static udf_func u_decRNDIntFFX = {
+    LEXSTRING("cryptdb_decrypt_int_sem_ffx"),
+    INT_RESULT,
+    UDFTYPE_FUNCTION,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    0L,
+};
+
+Item *
+RND_int_ffx::decryptUDF(Item * const col, Item * const ivcol) const
+{
+    List<Item> l;
+    l.push_back(col);
+    l.push_back(get_key_item(key));
+    l.push_back(ivcol);
+
+    Item *const udfdec =
+        new (current_thd->mem_root) Item_func_udf_int(&u_decRNDIntFFX, l);
+    udfdec->name = NULL;
+
+    Item *const udf =
+        new (current_thd->mem_root) Item_func_unsigned(udfdec);
+    udf->name = NULL;
+
+    return udf;
+}
+
+///////////////////////////////////////////////
+
 RND_str::RND_str(Create_field * const f, const std::string &seed_key)
     : rawkey(prng_expand(seed_key, key_bytes)),
       enckey(get_AES_enc_key(rawkey)), deckey(get_AES_dec_key(rawkey))
@@ -566,13 +756,33 @@ public:
     Item *decrypt(Item *const ctext, uint64_t IV) const;
     Item *decryptUDF(Item *const col, Item *const ivcol = NULL) const;
 
+    ValueKind plainKind() const {return ValueKind::INT;}
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setUnsigned(bf.encrypt(v->uintValue() + shift));
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        // Columns with a shift are signed.
+        if (shift) {
+            v->setSigned(static_cast<longlong>(bf.decrypt(v->uintValue()))
+                         - shift);
+        } else {
+            v->setUnsigned(bf.decrypt(v->uintValue()));
+        }
+    }
+
 protected:
     const std::string key;
     const blowfish bf;
     const int64_t shift;
     static const int bf_key_size = 16;
 
+    LayerCache *getCache() const {return &cache;}
+
 private:
+    mutable LayerCache cache;
+
     std::string getKeyFromSerial(const std::string &serial);
     static int64_t getShift(const std::string &serial);
 };
@@ -583,7 +793,7 @@ public:
                          const std::string &seed_key);
     DET_abstract_integer(unsigned int id, const std::string &serial);
 
-private:
+    // Moves signed values of the column's type to unsigned ones.
     static int64_t getShift(const Create_field *const f);
 };
 
@@ -597,6 +807,8 @@ public:
     std::string doSerialize() const;
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item *decrypt(Item *const ctext, uint64_t IV) const;
+    // Plaintexts are Item_decimals.
+    ValueKind plainKind() const {return ValueKind::NONE;}
 
 protected:
     const uint decimals;      // number of decimals
@@ -627,6 +839,79 @@ static udf_func u_decDETInt = {
     0L,
 };
 
+// > Like DET_int, with ffx64_aes in place of blowfish; serialized the
+//   same way.
+// > Decrypts result columns in batches; see EncLayer::decryptBatch.
+class DET_int_ffx : public EncLayer {
+public:
+    DET_int_ffx(Create_field *const cf, const std::string &seed_key);
+    // create object from serialized contents
+    DET_int_ffx(unsigned int id, const std::string &serial);
+
+    SECLEVEL level() const {return SECLEVEL::DET;}
+    std::string name() const {return "DET_int_ffx";}
+
+    std::string doSerialize() const;
+    Create_field *newCreateField(const Create_field *const cf,
+                                 const std::string &anonname = "")
+        const;
+
+    Item *encrypt(const Item &ptext, uint64_t IV) const;
+    Item *decrypt(Item *const ctext, uint64_t IV) const;
+    bool decryptBatch(std::vector<Item *> *const ctexts,
+                      const std::vector<uint64_t> &IVs) const
+    {
+        return decryptBatchAsValues(ctexts, IVs);
+    }
+    Item *decryptUDF(Item *const col, Item *const ivcol = NULL) const;
+
+    ValueKind plainKind() const {return ValueKind::INT;}
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setUnsigned(ffx.encrypt(v->uintValue() + shift));
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        setPlaintext(v, ffx.decrypt(v->uintValue()) - shift);
+    }
+    bool decryptValues(std::vector<LayerValue> *const vs,
+                       const std::vector<uint64_t> &IVs) const;
+
+protected:
+    LayerCache *getCache() const {return &cache;}
+
+private:
+    const std::string key;
+    const ffx64_aes ffx;
+    const int64_t shift;
+    mutable LayerCache cache;
+
+    Item *plaintextItem(uint64_t p) const;
+    void setPlaintext(LayerValue *const v, uint64_t p) const
+    {
+        // Columns with a shift are signed.
+        if (shift) {
+            v->setSigned(static_cast<longlong>(p));
+        } else {
+            v->setUnsigned(p);
+        }
+    }
+};
+
+static udf_func u_decDETIntFFX = {
+    LEXSTRING("cryptdb_decrypt_int_det_ffx"),
+    INT_RESULT,
+    UDFTYPE_FUNCTION,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    0L,
+};
+
 class DET_dec : public DET_abstract_decimal {
 public:
     DET_dec(Create_field *const cf, const std::string &seed_key);
@@ -639,6 +924,8 @@ public:
     std::string name() const {return "DET_dec";}
 };
 
+// > Encrypts the values of an INSERT and decrypts result columns in
+//   batches; see aes_cmc.
 class DET_str : public EncLayer {
 public:
     DET_str(Create_field * const cf, const std::string &seed_key);
@@ -656,14 +943,35 @@ public:
 
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item * decrypt(Item * const ctext, uint64_t IV) const;
+    bool decryptBatch(std::vector<Item *> *const ctexts,
+                      const std::vector<uint64_t> &IVs) const
+    {
+        return decryptBatchAsValues(ctexts, IVs);
+    }
+    void prepareEncrypt(const std::vector<const Item *> &ptexts) const;
     Item * decryptUDF(Item * const col, Item * const ivcol = NULL) const;
 
+    ValueKind plainKind() const {return ValueKind::BYTES;}
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setBytes(cmc.encrypt(v->bytes));
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setBytes(cmc.decrypt(v->bytes));
+    }
+    bool decryptValues(std::vector<LayerValue> *const vs,
+                       const std::vector<uint64_t> &IVs) const;
+
 protected:
     std::string const rawkey;
     static const int key_bytes = 16;
-    AES_KEY const * const enckey;
-    AES_KEY const * const deckey;
+    const aes_cmc cmc;
 
+    LayerCache *getCache() const {return &cache;}
+
+private:
+    mutable LayerCache cache;
 };
 
 
@@ -674,6 +982,8 @@ DETFactory::create(Create_field * const cf, const std::string &key)
         if (cf->sql_type == MYSQL_TYPE_DECIMAL
             || cf->sql_type == MYSQL_TYPE_NEWDECIMAL) {
             return new DET_dec(cf, key);
+        } else if (ffxIntegers()) {
+            return new DET_int_ffx(cf, key);
         } else {
             return new DET_int(cf, key);
         }
@@ -687,6 +997,8 @@ DETFactory::deserialize(unsigned int id, const SerialLayer &sl)
 {
     if ("DET_int" == sl.name) {
         return new DET_int(id, sl.layer_info);
+    } else if ("DET_int_ffx" == sl.name) {
+        return new DET_int_ffx(id, sl.layer_info);
     } else if ("DET_dec" == sl.name) {
         return new DET_dec(id, sl.layer_info);
     } else if ("DET_str" == sl.name) {
@@ -823,6 +1135,104 @@ DET_abstract_integer::getShift(const Create_field * const cf)
     }
 }
 
+DET_int_ffx::DET_int_ffx(Create_field *const cf,
+                         const std::string &seed_key)
+    : key(prng_expand(seed_key, ffx64_aes::key_bytes)), ffx(key),
+      shift(DET_abstract_integer::getShift(cf))
+{}
+
+DET_int_ffx::DET_int_ffx(unsigned int id, const std::string &serial)
+    : EncLayer(id), key(serial.substr(serial.find(' ')+1)), ffx(key),
+      shift(atol(serial.substr(0, serial.find(' ')).c_str()))
+{}
+
+std::string
+DET_int_ffx::doSerialize() const
+{
+    return std::to_string(shift) + " " + key;
+}
+
+Create_field *
+DET_int_ffx::newCreateField(const Create_field * const cf,
+                            const std::string &anonname) const
+{
+    const int64_t ciph_size = 8;
+    return createFieldHelper(cf, ciph_size, MYSQL_TYPE_LONGLONG,
+                             anonname);
+}
+
+Item *
+DET_int_ffx::encrypt(const Item &ptext, uint64_t IV) const
+{
+    const ulonglong value = RiboldMYSQL::val_uint(ptext);
+
+    const ulonglong res = static_cast<ulonglong>(ffx.encrypt(value+shift));
+    LOG(encl) << "DET_int_ffx enc " << value << "--->" << res;
+    return new (current_thd->mem_root) Item_int(res);
+}
+
+Item *
+DET_int_ffx::plaintextItem(uint64_t p) const
+{
+    // Columns with a shift are signed.
+    if (shift) {
+        return new (current_thd->mem_root)
+                   Item_int(static_cast<longlong>(p));
+    }
+
+    return new (current_thd->mem_root) Item_int(static_cast<ulonglong>(p));
+}
+
+Item *
+DET_int_ffx::decrypt(Item *const ctext, uint64_t IV) const
+{
+    const ulonglong value = static_cast<Item_int *>(ctext)->value;
+
+    const uint64_t p = ffx.decrypt(value) - shift;
+    LOG(encl) << "DET_int_ffx dec " << value << "--->" << p;
+    return plaintextItem(p);
+}
+
+bool
+DET_int_ffx::decryptValues(std::vector<LayerValue> *const vs,
+                           const std::vector<uint64_t> &IVs) const
+{
+    std::vector<uint64_t> v(vs->size());
+    for (size_t i = 0; i < v.size(); ++i) {
+        v[i] = (*vs)[i].uintValue();
+    }
+    ffx.decrypt(v.data(), v.size());
+    for (size_t i = 0; i < v.size(); ++i) {
+        setPlaintext(&(*vs)[i], v[i] - shift);
+    }
+
+    return true;
+}
+
+Item *
+DET_int_ffx::decryptUDF(Item *const col, Item *const ivcol) const
+{
+    List<Item> l;
+    l.push_back(col);
+
+    l.push_back(get_key_item(key));
+    // Only used for signed columns, otherwise zero.
+    l.push_back(new (current_thd->mem_root)
+                    Item_int(static_cast<ulonglong>(shift)));
+
+    Item *const udfdec = new (current_thd->mem_root)
+                             Item_func_udf_int(&u_decDETIntFFX, l);
+    udfdec->name = NULL;
+
+    Item *const udf = 0 == shift ? new (current_thd->mem_root)
+                                       Item_func_unsigned(udfdec)
+                                 : new (current_thd->mem_root)
+                                       Item_func_signed(udfdec);
+    udf->name = NULL;
+
+    return udf;
+}
+
 DET_abstract_decimal::DET_abstract_decimal(Create_field *const cf,
                                            const std::string &seed_key)
     : DET_abstract_number(seed_key, pow(10, cf->decimals)),
@@ -901,13 +1311,11 @@ DET_dec::DET_dec(unsigned int id, const std::string &serial)
 {}
 
 DET_str::DET_str(Create_field * const f, const std::string &seed_key)
-    : rawkey(prng_expand(seed_key, key_bytes)),
-      enckey(get_AES_enc_key(rawkey)), deckey(get_AES_dec_key(rawkey))
+    : rawkey(prng_expand(seed_key, key_bytes)), cmc(rawkey)
 {}
 
 DET_str::DET_str(unsigned int id, const std::string &serial)
-    : EncLayer(id), rawkey(serial), enckey(get_AES_enc_key(rawkey)),
-    deckey(get_AES_dec_key(rawkey))
+    : EncLayer(id), rawkey(serial), cmc(rawkey)
 {}
 
 
@@ -925,7 +1333,7 @@ Item *
 DET_str::encrypt(const Item &ptext, uint64_t IV) const
 {
     const std::string plain = ItemToString(ptext);
-    const std::string enc = encrypt_AES_CMC(plain, enckey, true);
+    const std::string enc = cmc.encrypt(plain);
     LOG(encl) << " DET_str encrypt " << plain  << " IV " << IV << " ---> "
               << " enc len " << enc.length() << " enc " << enc;
 
@@ -938,7 +1346,7 @@ Item *
 DET_str::decrypt(Item * const ctext, uint64_t IV) const
 {
     const std::string enc = ItemToString(*ctext);
-    const std::string dec = decrypt_AES_CMC(enc, deckey, true);
+    const std::string dec = cmc.decrypt(enc);
     LOG(encl) << " DET_str decrypt enc len " << enc.length()
               << " enc " << enc << " IV " << IV << " ---> "
               << " dec len " << dec.length() << " dec " << dec;
@@ -948,6 +1356,50 @@ DET_str::decrypt(Item * const ctext, uint64_t IV) const
                                                    &my_charset_bin);
 }
 
+bool
+DET_str::decryptValues(std::vector<LayerValue> *const vs,
+                       const std::vector<uint64_t> &IVs) const
+{
+    std::vector<std::string> v;
+    v.reserve(vs->size());
+    for (LayerValue &it : *vs) {
+        v.push_back(std::move(it.bytes));
+    }
+    cmc.decrypt(&v);
+    for (size_t i = 0; i < v.size(); ++i) {
+        (*vs)[i].setBytes(std::move(v[i]));
+    }
+
+    return true;
+}
+
+// Encrypts the constants of the column together and leaves the results
+// in the layer cache, where encrypt() of each finds them.
+void
+DET_str::prepareEncrypt(const std::vector<const Item *> &ptexts) const
+{
+    if (false == LayerCache::enabled()) {
+        return;
+    }
+
+    std::vector<const Item *> items;
+    std::vector<std::string> v;
+    for (const Item *const i : ptexts) {
+        if (i->basic_const_item() && false == RiboldMYSQL::is_null(*i)) {
+            items.push_back(i);
+            v.push_back(ItemToString(*i));
+        }
+    }
+    cmc.encrypt(&v);
+    for (size_t i = 0; i < v.size(); ++i) {
+        const Item *const enc =
+            new (current_thd->mem_root) Item_string(make_thd_string(v[i]),
+                                                    v[i].length(),
+                                                    &my_charset_bin);
+        cache.store(LayerCache::Direction::ENCRYPT, *items[i], *enc);
+    }
+}
+
 static udf_func u_decDETStr = {
     LEXSTRING("cryptdb_decrypt_text_det"),
     STRING_RESULT,
@@ -1072,14 +1524,41 @@ public:
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item * decrypt(Item * const c, uint64_t IV) const;
 
+    ValueKind plainKind() const {return ValueKind::INT;}
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        // AWARE: Truncation.
+        const uint32_t pval = v->uintValue();
+        v->setUnsigned(uint64FromZZ(ope.encrypt(to_ZZ(pval))));
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setUnsigned(uint64FromZZ(ope.decrypt(ZZFromUint64(
+                                                     v->uintValue()))));
+    }
+
+protected:
+    // Same ciphertexts as encrypt()/decrypt(), through an OPETable over
+    // [0, domain).
+    Item *encryptSmall(ulonglong val, uint64_t domain, uint64_t IV) const;
+    Item *decryptSmall(Item * const ctext, uint64_t domain,
+                       uint64_t IV) const;
+    // And as encryptValue()/decryptValue().
+    void encryptSmallValue(LayerValue *const v, uint64_t domain) const;
+    void decryptSmallValue(LayerValue *const v, uint64_t domain) const;
 
 private:
     std::string const key;
     // HACK.
     mutable OPE ope;
+    mutable std::shared_ptr<OPETable> small_table;
+    mutable LayerCache cache;
     static const size_t key_bytes = 16;
     static const size_t plain_size = 4;
     static const size_t ciph_size = 8;
+
+    OPETable &smallTable(uint64_t domain) const;
+    LayerCache *getCache() const {return &cache;}
 };
 
 class OPE_tinyint : public OPE_int {
@@ -1093,6 +1572,14 @@ public:
 
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item * decrypt(Item * const c, uint64_t IV) const;
+    void encryptValue(LayerValue *const v, uint64_t IV) const;
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        decryptSmallValue(v, domain);
+    }
+
+private:
+    static const uint64_t domain = 0x100;
 };
 
 OPE_tinyint::OPE_tinyint(Create_field * const cf,
@@ -1115,26 +1602,106 @@ OPE_tinyint::encrypt(const Item &ptext, uint64_t IV) const
                           " won't floor. ");
 
     LOG(encl) << "OPE_tinyint encrypt " << val << " IV " << IV << "--->";
-    return OPE_int::encrypt(ptext, static_cast<const ulong>(val));
+    return encryptSmall(val, domain, IV);
 }
 
 Item *
 OPE_tinyint::decrypt(Item * const ctext, uint64_t IV) const
 {
-    return OPE_int::decrypt(ctext, IV);
+    return decryptSmall(ctext, domain, IV);
 }
 
-class OPE_mediumint : public OPE_int {
-public:
-    OPE_mediumint(Create_field * const cf, const std::string &seed_key);
-
-    // create object from serialized contents
-    OPE_mediumint(unsigned int id, const std::string &serial);
-
+void
+OPE_tinyint::encryptValue(LayerValue *const v, uint64_t IV) const
+{
+    static const ulonglong tiny_max = 0xff;
+    TEST_TextMessageError(tiny_max > v->uintValue(),
+                          "Backend storage unit it not TINYINT,"
+                          " won't floor. ");
+
+    encryptSmallValue(v, domain);
+}
+
+class OPE_smallint : public OPE_int {
+public:
+    OPE_smallint(Create_field * const cf, const std::string &seed_key);
+
+    // create object from serialized contents
+    OPE_smallint(unsigned int id, const std::string &serial);
+
+    std::string name() const {return "OPE_smallint";}
+
+    Item *encrypt(const Item &p, uint64_t IV) const;
+    Item * decrypt(Item * const c, uint64_t IV) const;
+    void encryptValue(LayerValue *const v, uint64_t IV) const;
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        decryptSmallValue(v, domain);
+    }
+
+private:
+    static const uint64_t domain = 0x10000;
+};
+
+OPE_smallint::OPE_smallint(Create_field * const cf,
+                           const std::string &seed_key)
+    : OPE_int(cf, seed_key)
+{}
+
+OPE_smallint::OPE_smallint(unsigned int id, const std::string &serial)
+    : OPE_int(id, serial)
+{}
+
+Item *
+OPE_smallint::encrypt(const Item &ptext, uint64_t IV) const
+{
+    const ulonglong val = RiboldMYSQL::val_uint(ptext);
+
+    static const ulonglong small_max = 0xffff;
+    TEST_TextMessageError(small_max > val,
+                          "Backend storage unit it not SMALLINT,"
+                          " won't floor. ");
+
+    LOG(encl) << "OPE_smallint encrypt " << val << " IV " << IV << "--->";
+    return encryptSmall(val, domain, IV);
+}
+
+Item *
+OPE_smallint::decrypt(Item * const ctext, uint64_t IV) const
+{
+    return decryptSmall(ctext, domain, IV);
+}
+
+void
+OPE_smallint::encryptValue(LayerValue *const v, uint64_t IV) const
+{
+    static const ulonglong small_max = 0xffff;
+    TEST_TextMessageError(small_max > v->uintValue(),
+                          "Backend storage unit it not SMALLINT,"
+                          " won't floor. ");
+
+    encryptSmallValue(v, domain);
+}
+
+class OPE_mediumint : public OPE_int {
+public:
+    OPE_mediumint(Create_field * const cf, const std::string &seed_key);
+
+    // create object from serialized contents
+    OPE_mediumint(unsigned int id, const std::string &serial);
+
     std::string name() const {return "OPE_mediumint";}
 
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item * decrypt(Item * const c, uint64_t IV) const;
+    void encryptValue(LayerValue *const v, uint64_t IV) const;
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        decryptSmallValue(v, domain);
+    }
+
+private:
+    static const uint64_t domain = 0x1000000;
 };
 
 OPE_mediumint::OPE_mediumint(Create_field * const cf,
@@ -1157,13 +1724,24 @@ OPE_mediumint::encrypt(const Item &ptext, uint64_t IV) const
                           " won't floor. ");
 
     LOG(encl) << "OPE_mediumint encrypt " << val << " IV " << IV << "--->";
-    return OPE_int::encrypt(ptext, static_cast<const ulong>(val));
+    return encryptSmall(val, domain, IV);
 }
 
 Item *
 OPE_mediumint::decrypt(Item * const ctext, uint64_t IV) const
 {
-    return OPE_int::decrypt(ctext, IV);
+    return decryptSmall(ctext, domain, IV);
+}
+
+void
+OPE_mediumint::encryptValue(LayerValue *const v, uint64_t IV) const
+{
+    static const ulonglong medium_max = 0xffffff;
+    TEST_TextMessageError(medium_max > v->uintValue(),
+                          "Backend storage unit it not MEDIUMINT,"
+                          " won't floor. ");
+
+    encryptSmallValue(v, domain);
 }
 
 class OPE_str : public EncLayer {
@@ -1184,13 +1762,26 @@ public:
     Item * decrypt(Item * const c, uint64_t IV) const
         __attribute__((noreturn));
 
+    ValueKind plainKind() const {return ValueKind::BYTES;}
+    ValueKind cipherKind() const {return ValueKind::INT;}
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        v->setUnsigned(encryptString(v->bytes));
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+        __attribute__((noreturn));
+
 private:
     std::string const key;
     // HACK.
     mutable OPE ope;
+    mutable LayerCache cache;
     static const size_t key_bytes = 16;
     static const size_t plain_size = 4;
     static const size_t ciph_size = 8;
+
+    LayerCache *getCache() const {return &cache;}
+    ulonglong encryptString(const std::string &ptext) const;
 };
 
 
@@ -1206,6 +1797,8 @@ public:
 
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item * decrypt(Item * const c, uint64_t IV) const;
+    // Plaintexts are Item_decimals.
+    ValueKind plainKind() const {return ValueKind::NONE;}
 
 private:
     uint const decimals;
@@ -1214,6 +1807,150 @@ private:
 
 
 
+// Labels from a MutableOPE shared by every proxy thread (see
+// crypto/mope.hh) instead of stateless OPE ciphertexts: encrypting a
+// value already seen is one lookup, and all 64 bits of the plaintext
+// count. Signed values are ordered by flipping their sign bit.
+// > Used for integer columns when CRYPTDB_MOPE_DIR names the directory
+//   for the dictionaries.
+// > No LayerCache; relabeling moves the ciphertexts.
+class OPE_mutable : public EncLayer {
+public:
+    OPE_mutable(Create_field * const cf, const std::string &seed_key);
+
+    // serialize and deserialize
+    std::string doSerialize() const;
+    OPE_mutable(unsigned int id, const std::string &serial);
+
+    SECLEVEL level() const {return SECLEVEL::OPE;}
+    std::string name() const {return "OPE_mutable";}
+    Create_field * newCreateField(const Create_field * const cf,
+                                  const std::string &anonname = "")
+        const;
+
+    Item *encrypt(const Item &p, uint64_t IV) const;
+    Item * decrypt(Item * const c, uint64_t IV) const;
+    Item *encryptForLookup(const Item &p, uint64_t IV) const;
+    void prepareEncrypt(const std::vector<const Item *> &ptexts) const;
+    MutableOPE *mutableOPE() const {return dictionary.get();}
+
+    static const char *directory() {return getenv("CRYPTDB_MOPE_DIR");}
+
+private:
+    std::string const key;
+    bool const is_unsigned;
+    std::shared_ptr<MutableOPE> const dictionary;
+    static const size_t key_bytes = 16;
+    static const uint64_t sign_bit = 1ULL << 63;
+
+    uint64_t ordered(const Item &ptext) const;
+    static std::shared_ptr<MutableOPE>
+        openDictionary(const std::string &key);
+};
+
+OPE_mutable::OPE_mutable(Create_field * const cf,
+                         const std::string &seed_key)
+    : key(prng_expand(seed_key, key_bytes)),
+      is_unsigned(cf->flags & UNSIGNED_FLAG),
+      dictionary(openDictionary(key))
+{}
+
+std::string
+OPE_mutable::doSerialize() const
+{
+    return std::string(is_unsigned ? "1" : "0") + key;
+}
+
+OPE_mutable::OPE_mutable(unsigned int id, const std::string &serial)
+    : EncLayer(id), key(serial.substr(1)), is_unsigned('1' == serial[0]),
+      dictionary(openDictionary(key))
+{}
+
+std::shared_ptr<MutableOPE>
+OPE_mutable::openDictionary(const std::string &key)
+{
+    TEST_TextMessageError(directory(),
+                          "OPE_mutable needs CRYPTDB_MOPE_DIR!");
+    return MutableOPE::get(key, directory());
+}
+
+Create_field *
+OPE_mutable::newCreateField(const Create_field * const cf,
+                            const std::string &anonname) const
+{
+    return createFieldHelper(cf, cf->length, MYSQL_TYPE_LONGLONG,
+                             anonname);
+}
+
+uint64_t
+OPE_mutable::ordered(const Item &ptext) const
+{
+    const uint64_t val = RiboldMYSQL::val_uint(ptext);
+    return is_unsigned ? val : val ^ sign_bit;
+}
+
+Item *
+OPE_mutable::encrypt(const Item &ptext, uint64_t IV) const
+{
+    const uint64_t val = ordered(ptext);
+    const ulonglong enc = dictionary->encrypt(val);
+    LOG(encl) << "OPE_mutable encrypt " << val << " IV " << IV
+              << "--->" << enc;
+
+    return new (current_thd->mem_root) Item_int(enc);
+}
+
+// A value the dictionary doesn't know compares right against the
+// stored labels without being added; it only has to be added when the
+// labels of its neighbours are adjacent.
+Item *
+OPE_mutable::encryptForLookup(const Item &ptext, uint64_t IV) const
+{
+    const uint64_t val = ordered(ptext);
+    uint64_t enc;
+    if (false == dictionary->lookup(val, &enc)) {
+        enc = dictionary->encrypt(val);
+    }
+    LOG(encl) << "OPE_mutable lookup " << val << " IV " << IV
+              << "--->" << enc;
+
+    return new (current_thd->mem_root)
+        Item_int(static_cast<ulonglong>(enc));
+}
+
+Item *
+OPE_mutable::decrypt(Item * const ctext, uint64_t IV) const
+{
+    const ulonglong cval =
+        static_cast<ulonglong>(static_cast<Item_int *>(ctext)->value);
+    uint64_t dec;
+    TEST_TextMessageError(dictionary->decrypt(cval, &dec),
+                          "unknown mutable OPE label "
+                          + std::to_string(cval) + "!");
+    LOG(encl) << "OPE_mutable decrypt " << cval << " IV " << IV
+              << "--->" << dec;
+
+    if (is_unsigned) {
+        return new (current_thd->mem_root)
+            Item_int(static_cast<ulonglong>(dec));
+    }
+    return new (current_thd->mem_root)
+        Item_int(static_cast<longlong>(dec ^ sign_bit));
+}
+
+void
+OPE_mutable::prepareEncrypt(const std::vector<const Item *> &ptexts) const
+{
+    std::vector<uint64_t> vals;
+    for (const Item *const i : ptexts) {
+        if (i->basic_const_item() && false == RiboldMYSQL::is_null(*i)) {
+            vals.push_back(ordered(*i));
+        }
+    }
+    dictionary->insertBulk(vals);
+}
+
+
 EncLayer *
 OPEFactory::create(Create_field * const cf, const std::string &key)
 {
@@ -1221,8 +1958,12 @@ OPEFactory::create(Create_field * const cf, const std::string &key)
         if (cf->sql_type == MYSQL_TYPE_DECIMAL
             || cf->sql_type ==  MYSQL_TYPE_NEWDECIMAL) {
             return new OPE_dec(cf, key);
+        } else if (OPE_mutable::directory()) {
+            return new OPE_mutable(cf, key);
         } else if (cf->sql_type == MYSQL_TYPE_TINY) { 
             return new OPE_tinyint(cf, key);
+        } else if (cf->sql_type == MYSQL_TYPE_SHORT) {
+            return new OPE_smallint(cf, key);
         } else if (cf->sql_type == MYSQL_TYPE_INT24) { 
             return new OPE_mediumint(cf, key);
         }
@@ -1238,8 +1979,12 @@ OPEFactory::deserialize(unsigned int id, const SerialLayer &sl)
         return new OPE_int(id, sl.layer_info);
     } else if (sl.name == "OPE_tinyint") {
         return new OPE_tinyint(id, sl.layer_info);
+    } else if (sl.name == "OPE_smallint") {
+        return new OPE_smallint(id, sl.layer_info);
     } else if (sl.name == "OPE_mediumint") {
         return new OPE_mediumint(id, sl.layer_info);
+    } else if (sl.name == "OPE_mutable") {
+        return new OPE_mutable(id, sl.layer_info);
     } else if (sl.name == "OPE_str") {
         return new OPE_str(id, sl.layer_info);
     } else  {
@@ -1335,6 +2080,63 @@ OPE_int::decrypt(Item * const ctext, uint64_t IV) const
     return new (current_thd->mem_root) Item_int(dec);
 }
 
+OPETable &
+OPE_int::smallTable(uint64_t domain) const
+{
+    if (!small_table) {
+        small_table =
+            OPETable::get(key, plain_size * 8, ciph_size * 8, domain);
+    }
+    assert(small_table->domain() == domain);
+
+    return *small_table.get();
+}
+
+Item *
+OPE_int::encryptSmall(ulonglong val, uint64_t domain, uint64_t IV) const
+{
+    const ulonglong enc = smallTable(domain).encrypt(val);
+    LOG(encl) << "OPE_int table encrypt " << val << " IV " << IV
+              << "--->" << enc;
+
+    return new (current_thd->mem_root) Item_int(enc);
+}
+
+Item *
+OPE_int::decryptSmall(Item * const ctext, uint64_t domain,
+                      uint64_t IV) const
+{
+    const ulonglong cval =
+        static_cast<ulonglong>(static_cast<Item_int *>(ctext)->value);
+    uint64_t dec;
+    if (false == smallTable(domain).decrypt(cval, &dec)) {
+        return OPE_int::decrypt(ctext, IV);
+    }
+    LOG(encl) << "OPE_int table decrypt " << cval << " IV " << IV
+              << "--->" << dec << std::endl;
+
+    return new (current_thd->mem_root)
+        Item_int(static_cast<ulonglong>(dec));
+}
+
+void
+OPE_int::encryptSmallValue(LayerValue *const v, uint64_t domain) const
+{
+    v->setUnsigned(smallTable(domain).encrypt(v->uintValue()));
+}
+
+void
+OPE_int::decryptSmallValue(LayerValue *const v, uint64_t domain) const
+{
+    uint64_t dec;
+    if (false == smallTable(domain).decrypt(v->uintValue(), &dec)) {
+        OPE_int::decryptValue(v, 0);
+        return;
+    }
+
+    v->setUnsigned(dec);
+}
+
 
 OPE_str::OPE_str(Create_field * const f, const std::string &seed_key)
     : key(prng_expand(seed_key, key_bytes)),
@@ -1365,10 +2167,10 @@ OPE_str::newCreateField(const Create_field * const cf,
  * |         1 |         1 |         1 |         1 |
  * +-----------+-----------+-----------+-----------+
  */
-Item *
-OPE_str::encrypt(const Item &ptext, uint64_t IV) const
+ulonglong
+OPE_str::encryptString(const std::string &ptext) const
 {
-    std::string ps = toUpperCase(ItemToString(ptext));
+    std::string ps = toUpperCase(ptext);
     if (ps.size() < plain_size)
         ps = ps + std::string(plain_size - ps.size(), 0);
 
@@ -1380,8 +2182,14 @@ OPE_str::encrypt(const Item &ptext, uint64_t IV) const
 
     const ZZ enc = ope.encrypt(to_ZZ(pv));
 
+    return static_cast<ulonglong>(uint64FromZZ(enc));
+}
+
+Item *
+OPE_str::encrypt(const Item &ptext, uint64_t IV) const
+{
     return new (current_thd->mem_root)
-               Item_int(static_cast<ulonglong>(uint64FromZZ(enc)));
+               Item_int(encryptString(ItemToString(ptext)));
 }
 
 Item *
@@ -1390,6 +2198,12 @@ OPE_str::decrypt(Item * const ctext, uint64_t IV) const
     thrower() << "cannot decrypt string from OPE";
 }
 
+void
+OPE_str::decryptValue(LayerValue *const v, uint64_t IV) const
+{
+    thrower() << "cannot decrypt string from OPE";
+}
+
 
 /**************** HOM ***************************/
 
@@ -1538,6 +2352,10 @@ ZZToItemDec(const ZZ &val, const ZZ &shift)
 Item *
 HOM_dec::encrypt(const Item &ptext, uint64_t IV) const
 {
+    if (true == waiting) {
+        this->unwait();
+    }
+
     const ZZ enc = sk->encrypt(ItemDecToZZ(ptext, shift, decimals));
 
     return ZZToItemStr(enc);
@@ -1546,6 +2364,10 @@ HOM_dec::encrypt(const Item &ptext, uint64_t IV) const
 Item *
 HOM_dec::decrypt(Item * const ctext, uint64_t IV) const
 {
+    if (true == waiting) {
+        this->unwait();
+    }
+
     const ZZ enc = ItemStrToZZ(ctext);
     const ZZ dec = sk->decrypt(enc);
 
@@ -1554,13 +2376,26 @@ HOM_dec::decrypt(Item * const ctext, uint64_t IV) const
 
 
 
+// Where PaillierKeyCache keeps the keys; unset keeps them in memory.
+static const char *
+homKeyDirectory()
+{
+    return getenv("CRYPTDB_HOM_KEY_DIR");
+}
+
+// Generating the key takes seconds, so it starts in the background as
+// soon as the layer exists.
 HOM::HOM(Create_field * const f, const std::string &seed_key)
     : seed_key(seed_key), sk(NULL), waiting(true)
-{}
+{
+    PaillierKeyCache::warmup(seed_key, nbits, homKeyDirectory());
+}
 
 HOM::HOM(unsigned int id, const std::string &serial)
     : EncLayer(id), seed_key(serial), sk(NULL), waiting(true)
-{}
+{
+    PaillierKeyCache::warmup(seed_key, nbits, homKeyDirectory());
+}
 
 Create_field *
 HOM::newCreateField(const Create_field * const cf,
@@ -1570,12 +2405,20 @@ HOM::newCreateField(const Create_field * const cf,
                              anonname, &my_charset_bin);
 }
 
+// StringFromZZ drops leading zero bytes but they are the high end of a
+// little endian string; the zeros BINARY pads with leave the value alone.
+Create_field *
+HOM::newCompactCreateField(const Create_field * const cf,
+                           const std::string &anonname) const
+{
+    return createFieldHelper(cf, ciphertextBytes(), MYSQL_TYPE_STRING,
+                             anonname, &my_charset_bin);
+}
+
 void
 HOM::unwait() const
 {
-    const std::unique_ptr<streamrng<arc4>>
-        prng(new streamrng<arc4>(seed_key));
-    sk = new Paillier_priv(Paillier_priv::keygen(prng.get(), nbits));
+    sk = PaillierKeyCache::get(seed_key, nbits, homKeyDirectory());
     waiting = false;
 }
 
@@ -1666,11 +2509,11 @@ HOM::~HOM() {
 /******* SEARCH **************************/
 
 Search::Search(Create_field * const f, const std::string &seed_key)
-    : key(prng_expand(seed_key, key_bytes))
+    : key(prng_expand(seed_key, key_bytes)), swp(key)
 {}
 
 Search::Search(unsigned int id, const std::string &serial) 
-    : EncLayer(id), key(prng_expand(serial, key_bytes))
+    : EncLayer(id), key(prng_expand(serial, key_bytes)), swp(key)
 {}
 
 Create_field *
@@ -1682,85 +2525,109 @@ Search::newCreateField(const Create_field * const cf,
 }
 
 
-//returns the concatenation of all words in the given list
-static std::string
-assembleWords(std::list<std::string> * const words)
-{
-    std::string res = "";
-
-    for (std::list<std::string>::iterator it = words->begin();
-         it != words->end();
-         it++) {
-        res = res + *it;
-    }
-
-    return res;
-}
-
-static std::string
-encryptSWP(const std::string &key, const std::list<std::string> &words)
-{
-    const std::unique_ptr<std::list<std::string>>
-        l(SWP::encrypt(key, words));
-    const std::string r = assembleWords(l.get());
-    return r;
-}
-
 static Token
 token(const std::string &key, const std::string &word)
 {
     return SWP::token(key, word);
 }
 
+static uint64_t
+hashWord(const char *const word, size_t len)
+{
+    // FNV-1a.
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ static_cast<unsigned char>(word[i])) * 1099511628211ULL;
+    }
+    return h;
+}
+
 //this function should in fact be provided by the programmer
 //currently, we split by whitespaces
 // only consider words at least 3 chars in len
 // discard not unique objects
-static std::list<std::string> *
-tokenize(const std::string &text)
-{
-    std::list<std::string> tokens = split(text, " ,;:.");
-
-    std::set<std::string> search_tokens;
-
-    std::list<std::string> * const res = new std::list<std::string>();
+//
+// The words go lowercased into @words, back to back; word i ends at
+// (*ends)[i]. A word is discarded if it is the same as a lowercased word
+// kept before it.
+static void
+tokenize(const std::string &text, std::string *const words,
+         std::vector<size_t> *const ends)
+{
+    static const char separators[] = " ,;:.";
+    // Like strtok(), stop at a NUL.
+    const size_t nul = text.find('\0');
+    const size_t len = std::string::npos == nul ? text.size() : nul;
+    const auto separator = [&text] (size_t i) {
+        return NULL != memchr(separators, text[i], sizeof(separators) - 1);
+    };
 
-    for (std::list<std::string>::iterator it = tokens.begin();
-            it != tokens.end();
-            it++) {
-        if ((it->length() >= 3) &&
-                (search_tokens.find(*it) == search_tokens.end())) {
-            const std::string token = toLowerCase(*it);
-            search_tokens.insert(token);
-            res->push_back(token);
-        }
+    // The kept words by hash, open addressed; 0 is a free slot, and
+    // word i is i + 1. A word takes at least four bytes with its
+    // separator, so the table stays at most half full.
+    size_t slots = 16;
+    while (slots < 2 * (len / 4 + 1)) {
+        slots *= 2;
     }
+    std::vector<size_t> table(slots, 0);
+    const auto probe = [&] (const char *const word, size_t n) {
+        size_t slot = hashWord(word, n) & (slots - 1);
+        for (; 0 != table[slot]; slot = (slot + 1) & (slots - 1)) {
+            const size_t k = table[slot] - 1;
+            const size_t begin = 0 == k ? 0 : (*ends)[k - 1];
+            if ((*ends)[k] - begin == n
+                && 0 == memcmp(words->data() + begin, word, n)) {
+                break;
+            }
+        }
+        return slot;
+    };
 
-    search_tokens.clear();
-    return res;
+    words->reserve(len);
+    ends->reserve(len / 4 + 1);
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && separator(i)) {
+            ++i;
+        }
+        const size_t start = i;
+        while (i < len && false == separator(i)) {
+            ++i;
+        }
 
-}
+        const size_t n = i - start;
+        if (n < 3 || 0 != table[probe(text.data() + start, n)]) {
+            continue;
+        }
 
-static char *
-newmem(const std::string &a)
-{
-    const unsigned int len = a.length();
-    char * const res = new char[len];
-    memcpy(res, a.c_str(), len);
-    return res;
+        const size_t begin = words->size();
+        for (size_t j = start; j < i; ++j) {
+            words->push_back(static_cast<char>(
+                                 tolower(static_cast<unsigned char>(
+                                             text[j]))));
+        }
+        ends->push_back(words->size());
+        size_t &slot = table[probe(words->data() + begin, n)];
+        if (0 == slot) {
+            slot = ends->size();
+        }
+    }
 }
 
 Item *
 Search::encrypt(const Item &ptext, uint64_t IV) const
 {
     const std::string plainstr = ItemToString(ptext);
-    //TODO: remove string, string serves this purpose now..
-    const std::list<std::string> * const tokens = tokenize(plainstr);
-    const std::string ciph = encryptSWP(key, *tokens);
+    std::string words;
+    std::vector<size_t> ends;
+    tokenize(plainstr, &words, &ends);
+    const std::string ciph = swp.encrypt(words, ends);
 
     LOG(encl) << "SEARCH encrypt " << plainstr << " --> " << ciph;
 
-    return new Item_string(newmem(ciph), ciph.length(), &my_charset_bin);
+    return new (current_thd->mem_root) Item_string(make_thd_string(ciph),
+                                                   ciph.length(),
+                                                   &my_charset_bin);
 }
 
 Item *
@@ -1809,13 +2676,13 @@ Search::searchUDF(Item * const field, Item * const expr) const
     const Token t =
         token(key, std::string(searchstrip(ItemToString(*expr))));
     Item_string * const t1 =
-        new Item_string(newmem(t.ciph), t.ciph.length(),
+        new Item_string(make_thd_string(t.ciph), t.ciph.length(),
                         &my_charset_bin);
     t1->name = NULL; //no alias
     l.push_back(t1);
 
     Item_string * const t2 =
-        new Item_string(newmem(t.wordKey), t.wordKey.length(),
+        new Item_string(make_thd_string(t.wordKey), t.wordKey.length(),
                         &my_charset_bin);
     t2->name = NULL;
     l.push_back(t2);
@@ -1836,6 +2703,388 @@ PlainText::newCreateField(const Create_field * const cf,
     return f0;
 }
 
+Item *
+EncLayer::cachedEncrypt(const Item &ptext, uint64_t IV) const
+{
+    LayerCache *const cache = getCache();
+    if (NULL == cache) {
+        return encrypt(ptext, IV);
+    }
+
+    Item *const hit = cache->lookup(LayerCache::Direction::ENCRYPT, ptext);
+    if (hit) {
+        return hit;
+    }
+
+    Item *const enc = encrypt(ptext, IV);
+    cache->store(LayerCache::Direction::ENCRYPT, ptext, *enc);
+    return enc;
+}
+
+Item *
+EncLayer::cachedDecrypt(Item * const ctext, uint64_t IV) const
+{
+    LayerCache *const cache = getCache();
+    if (NULL == cache) {
+        return decrypt(ctext, IV);
+    }
+
+    Item *const hit = cache->lookup(LayerCache::Direction::DECRYPT, *ctext);
+    if (hit) {
+        return hit;
+    }
+
+    Item *const dec = decrypt(ctext, IV);
+    cache->store(LayerCache::Direction::DECRYPT, *ctext, *dec);
+    return dec;
+}
+
+bool
+EncLayer::decryptBatchAsValues(std::vector<Item *> *const ctexts,
+                               const std::vector<uint64_t> &IVs) const
+{
+    std::vector<LayerValue> vs(ctexts->size());
+    for (size_t i = 0; i < vs.size(); ++i) {
+        if (false == LayerValue::fromItem(*(*ctexts)[i], &vs[i])) {
+            return false;
+        }
+    }
+    if (false == decryptValues(&vs, IVs)) {
+        return false;
+    }
+    for (size_t i = 0; i < vs.size(); ++i) {
+        (*ctexts)[i] = vs[i].toItem();
+    }
+
+    return true;
+}
+
+/******************** PIPELINES ***************************/
+
+static bool
+fusedLayers()
+{
+    static const bool fused = [] () {
+        const char *const ev = getenv("CRYPTDB_FUSED_LAYERS");
+        return NULL == ev || std::string("0") != ev;
+    }();
+
+    return fused;
+}
+
+// One layer of a pipeline, through the layer's cache if it has one.
+template <typename Apply>
+static inline void
+cachedStep(LayerCache *const cache, LayerCache::Direction dir,
+           LayerValue *const v, const Apply &apply)
+{
+    if (NULL == cache) {
+        apply(v);
+        return;
+    }
+
+    LayerValue out;
+    if (cache->lookup(dir, *v, &out)) {
+        *v = std::move(out);
+        return;
+    }
+
+    const LayerValue in(*v);
+    apply(v);
+    cache->store(dir, in, *v);
+}
+
+// The layers L... of an onion, bottom first. The calls are qualified
+// with the layer classes, so none of them is virtual.
+template <typename... L>
+struct FusedSteps;
+
+template <>
+struct FusedSteps<> {
+    static void encrypt(const EncLayer *const *, LayerCache *const *,
+                        LayerValue *const, uint64_t)
+    {}
+    static void decrypt(const EncLayer *const *, LayerCache *const *,
+                        LayerValue *const, uint64_t)
+    {}
+    static void decryptColumn(const EncLayer *const *,
+                              LayerCache *const *,
+                              std::vector<LayerValue> *const,
+                              const std::vector<uint64_t> &)
+    {}
+};
+
+template <typename L, typename... Rest>
+struct FusedSteps<L, Rest...> {
+    static void
+    encrypt(const EncLayer *const *layers, LayerCache *const *caches,
+            LayerValue *const v, uint64_t IV)
+    {
+        const L &layer = static_cast<const L &>(*layers[0]);
+        cachedStep(caches[0], LayerCache::Direction::ENCRYPT, v,
+                   [&layer, IV] (LayerValue *const x)
+                   {
+                       layer.L::encryptValue(x, IV);
+                   });
+        FusedSteps<Rest...>::encrypt(layers + 1, caches + 1, v, IV);
+    }
+
+    static void
+    decrypt(const EncLayer *const *layers, LayerCache *const *caches,
+            LayerValue *const v, uint64_t IV)
+    {
+        FusedSteps<Rest...>::decrypt(layers + 1, caches + 1, v, IV);
+        const L &layer = static_cast<const L &>(*layers[0]);
+        cachedStep(caches[0], LayerCache::Direction::DECRYPT, v,
+                   [&layer, IV] (LayerValue *const x)
+                   {
+                       layer.L::decryptValue(x, IV);
+                   });
+    }
+
+    static void
+    decryptColumn(const EncLayer *const *layers, LayerCache *const *caches,
+                  std::vector<LayerValue> *const vs,
+                  const std::vector<uint64_t> &IVs)
+    {
+        FusedSteps<Rest...>::decryptColumn(layers + 1, caches + 1, vs,
+                                           IVs);
+        const L &layer = static_cast<const L &>(*layers[0]);
+        if (layer.L::decryptValues(vs, IVs)) {
+            return;
+        }
+        for (size_t i = 0; i < vs->size(); ++i) {
+            const uint64_t IV = IVs[i];
+            cachedStep(caches[0], LayerCache::Direction::DECRYPT,
+                       &(*vs)[i],
+                       [&layer, IV] (LayerValue *const x)
+                       {
+                           layer.L::decryptValue(x, IV);
+                       });
+        }
+    }
+};
+
+template <typename... L>
+class FusedPipeline : public OnionPipeline {
+public:
+    FusedPipeline(const std::vector<const EncLayer *> &layers,
+                  const std::vector<LayerCache *> &caches)
+        : OnionPipeline(layers, caches)
+    {
+        assert(sizeof...(L) == layers.size());
+    }
+
+protected:
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        FusedSteps<L...>::encrypt(layers.data(), caches.data(), v, IV);
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        FusedSteps<L...>::decrypt(layers.data(), caches.data(), v, IV);
+    }
+    void decryptValues(std::vector<LayerValue> *const vs,
+                       const std::vector<uint64_t> &IVs) const
+    {
+        FusedSteps<L...>::decryptColumn(layers.data(), caches.data(), vs,
+                                        IVs);
+    }
+};
+
+// Any other stack of layers with value paths.
+class LayeredPipeline : public OnionPipeline {
+public:
+    LayeredPipeline(const std::vector<const EncLayer *> &layers,
+                    const std::vector<LayerCache *> &caches)
+        : OnionPipeline(layers, caches) {}
+
+protected:
+    void encryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        for (size_t i = 0; i < layers.size(); ++i) {
+            const EncLayer *const layer = layers[i];
+            cachedStep(caches[i], LayerCache::Direction::ENCRYPT, v,
+                       [layer, IV] (LayerValue *const x)
+                       {
+                           layer->encryptValue(x, IV);
+                       });
+        }
+    }
+    void decryptValue(LayerValue *const v, uint64_t IV) const
+    {
+        for (size_t i = layers.size(); i-- > 0; ) {
+            const EncLayer *const layer = layers[i];
+            cachedStep(caches[i], LayerCache::Direction::DECRYPT, v,
+                       [layer, IV] (LayerValue *const x)
+                       {
+                           layer->decryptValue(x, IV);
+                       });
+        }
+    }
+    void decryptValues(std::vector<LayerValue> *const vs,
+                       const std::vector<uint64_t> &IVs) const
+    {
+        for (size_t i = layers.size(); i-- > 0; ) {
+            const EncLayer *const layer = layers[i];
+            if (layer->decryptValues(vs, IVs)) {
+                continue;
+            }
+            for (size_t j = 0; j < vs->size(); ++j) {
+                const uint64_t IV = IVs[j];
+                cachedStep(caches[i], LayerCache::Direction::DECRYPT,
+                           &(*vs)[j],
+                           [layer, IV] (LayerValue *const x)
+                           {
+                               layer->decryptValue(x, IV);
+                           });
+            }
+        }
+    }
+};
+
+typedef OnionPipeline *(*PipelineMaker)(const std::vector<const EncLayer *> &,
+                                        const std::vector<LayerCache *> &);
+
+template <typename... L>
+static OnionPipeline *
+makeFused(const std::vector<const EncLayer *> &layers,
+          const std::vector<LayerCache *> &caches)
+{
+    return new FusedPipeline<L...>(layers, caches);
+}
+
+// The layer classes that the layouts of util/onions.hh end up with,
+// for either integer cipher, and what is left of them as onions are
+// peeled. The RND layer of a string OPE onion is an integer one, as
+// OPE_str ciphertexts are integers.
+static const struct {
+    std::vector<std::string> names;
+    PipelineMaker make;
+} fused_layouts[] = {
+    // oDET, integers.
+    {{"DETJOIN_int", "DET_int", "RND_int"},
+     &makeFused<DETJOIN_int, DET_int, RND_int>},
+    {{"DETJOIN_int", "DET_int_ffx", "RND_int_ffx"},
+     &makeFused<DETJOIN_int, DET_int_ffx, RND_int_ffx>},
+    {{"DETJOIN_int", "DET_int"}, &makeFused<DETJOIN_int, DET_int>},
+    {{"DETJOIN_int", "DET_int_ffx"},
+     &makeFused<DETJOIN_int, DET_int_ffx>},
+    {{"DETJOIN_int"}, &makeFused<DETJOIN_int>},
+    // oDET, strings.
+    {{"DETJOIN_str", "DET_str", "RND_str"},
+     &makeFused<DETJOIN_str, DET_str, RND_str>},
+    {{"DETJOIN_str", "DET_str"}, &makeFused<DETJOIN_str, DET_str>},
+    {{"DETJOIN_str"}, &makeFused<DETJOIN_str>},
+    // oOPE, integers.
+    {{"OPE_int", "RND_int"}, &makeFused<OPE_int, RND_int>},
+    {{"OPE_int", "RND_int_ffx"}, &makeFused<OPE_int, RND_int_ffx>},
+    {{"OPE_int"}, &makeFused<OPE_int>},
+    // oOPE, strings.
+    {{"OPE_str", "RND_int"}, &makeFused<OPE_str, RND_int>},
+    {{"OPE_str", "RND_int_ffx"}, &makeFused<OPE_str, RND_int_ffx>},
+    {{"OPE_str"}, &makeFused<OPE_str>},
+};
+
+OnionPipeline::OnionPipeline(const std::vector<const EncLayer *> &layers,
+                             const std::vector<LayerCache *> &caches)
+    : layers(layers), caches(caches), input(layers.front()->plainKind())
+{
+    assert(layers.size() == caches.size());
+}
+
+OnionPipeline *
+OnionPipeline::build(const std::vector<std::unique_ptr<EncLayer> > &layers)
+{
+    return fusedLayers() ? make(layers, true) : NULL;
+}
+
+OnionPipeline *
+OnionPipeline::make(const std::vector<std::unique_ptr<EncLayer> > &layers,
+                    bool fused)
+{
+    if (layers.empty()) {
+        return NULL;
+    }
+
+    std::vector<const EncLayer *> ls;
+    std::vector<LayerCache *> caches;
+    std::vector<std::string> names;
+    for (const auto &it : layers) {
+        if (NULL == it.get()
+            || EncLayer::ValueKind::NONE == it->plainKind()) {
+            return NULL;
+        }
+        // Each layer has to take what the one below gives it.
+        if (false == ls.empty()
+            && ls.back()->cipherKind() != it->plainKind()) {
+            return NULL;
+        }
+        ls.push_back(it.get());
+        caches.push_back(LayerCache::enabled() ? it->getCache() : NULL);
+        names.push_back(it->name());
+    }
+
+    for (const auto &layout : fused_layouts) {
+        if (fused && layout.names == names) {
+            return layout.make(ls, caches);
+        }
+    }
+
+    return new LayeredPipeline(ls, caches);
+}
+
+Item *
+OnionPipeline::encrypt(const Item &ptext, uint64_t IV) const
+{
+    // Read as the bottom layer's encrypt() reads it; the flag and the
+    // charset keep the layer cache keys of Items.
+    LayerValue v;
+    if (EncLayer::ValueKind::INT == input) {
+        v.setUnsigned(RiboldMYSQL::val_uint(ptext));
+        v.unsigned_flag = ptext.unsigned_flag;
+    } else {
+        v.setBytes(ItemToString(ptext));
+        v.charset = ptext.collation.collation;
+    }
+
+    encryptValue(&v, IV);
+    return v.toItem();
+}
+
+Item *
+OnionPipeline::decrypt(Item *const ctext, uint64_t IV) const
+{
+    LayerValue v;
+    if (false == LayerValue::fromItem(*ctext, &v)) {
+        return NULL;
+    }
+
+    decryptValue(&v, IV);
+    return v.toItem();
+}
+
+bool
+OnionPipeline::decryptColumn(std::vector<Item *> *const items,
+                             const std::vector<uint64_t> &IVs) const
+{
+    assert(items->size() == IVs.size());
+
+    std::vector<LayerValue> vs(items->size());
+    for (size_t i = 0; i < vs.size(); ++i) {
+        if (false == LayerValue::fromItem(*(*items)[i], &vs[i])) {
+            return false;
+        }
+    }
+
+    decryptValues(&vs, IVs);
+    for (size_t i = 0; i < vs.size(); ++i) {
+        (*items)[i] = vs[i].toItem();
+    }
+
+    return true;
+}
+
 Item *
 PlainText::encrypt(const Item &ptext, uint64_t IV) const
 {
@@ -1876,8 +3125,10 @@ static udf_func u_cryptdb_version = {
 
 const std::vector<udf_func*> udf_list = {
     &u_decRNDInt,
+    &u_decRNDIntFFX,
     &u_decRNDString,
     &u_decDETInt,
+    &u_decDETIntFFX,
     &u_decDETStr,
     &u_sum_f,
     &u_sum_a,
@@ -7,11 +7,14 @@
 #include <crypto/BasicCrypto.hh>
 #include <crypto/paillier.hh>
 #include <crypto/ope.hh>
+#include <crypto/mope.hh>
 #include <crypto/blowfish.hh>
 #include <parser/sql_utils.hh>
 #include <crypto/SWPSearch.hh>
+#include <crypto/swp_batch.hh>
 
 #include <main/dbobject.hh>
+#include <main/layer_cache.hh>
 
 #include <sql_select.h>
 #include <sql_delete.h>
@@ -61,9 +64,64 @@ public:
     virtual Create_field *
         newCreateField(const Create_field * const cf,
                        const std::string &anonname = "") const = 0;
+    // The column of a compact table (see TableMeta::isCompact); layers
+    // with fixed width ciphertexts declare exactly that width.
+    virtual Create_field *
+        newCompactCreateField(const Create_field * const cf,
+                              const std::string &anonname = "") const
+    {
+        return newCreateField(cf, anonname);
+    }
 
     virtual Item *encrypt(const Item &ptext, uint64_t IV) const = 0;
     virtual Item *decrypt(Item * const ctext, uint64_t IV) const = 0;
+    // encrypt()/decrypt() through the layer's cache, if it has one.
+    Item *cachedEncrypt(const Item &ptext, uint64_t IV) const;
+    Item *cachedDecrypt(Item * const ctext, uint64_t IV) const;
+    // encrypt() of a constant that is only compared against and never
+    // stored; the same as cachedEncrypt() but for layers with state.
+    virtual Item *encryptForLookup(const Item &ptext, uint64_t IV) const
+    {
+        return cachedEncrypt(ptext, IV);
+    }
+    // Decrypts the values of one result column in place, @IVs
+    // alongside; false if the layer has no batch path, and decrypt()
+    // is called one value at a time instead.
+    virtual bool decryptBatch(std::vector<Item *> *const,
+                              const std::vector<uint64_t> &) const
+    {
+        return false;
+    }
+    // Called with the values of a column before they go through
+    // encrypt() one at a time, for layers that do better with all of
+    // them at once.
+    virtual void prepareEncrypt(const std::vector<const Item *> &) const
+    {}
+
+    // encrypt()/decrypt() on a LayerValue in place, for OnionPipeline.
+    // plainKind() is what encryptValue() takes and decryptValue() gives
+    // back, cipherKind() the other way around; NONE for layers that
+    // only work on Items.
+    enum class ValueKind {NONE, INT, BYTES};
+    virtual ValueKind plainKind() const {return ValueKind::NONE;}
+    virtual ValueKind cipherKind() const {return plainKind();}
+    virtual void encryptValue(LayerValue *const, uint64_t) const
+    {
+        thrower() << name() << " has no value path";
+    }
+    virtual void decryptValue(LayerValue *const, uint64_t) const
+    {
+        thrower() << name() << " has no value path";
+    }
+    // decryptBatch() for LayerValues.
+    virtual bool decryptValues(std::vector<LayerValue> *const,
+                               const std::vector<uint64_t> &) const
+    {
+        return false;
+    }
+    // The label dictionary of a mutable OPE layer (see OPE_mutable);
+    // its relabels have to reach the stored ciphertexts.
+    virtual MutableOPE *mutableOPE() const {return NULL;}
 
     // returns the decryptUDF to remove the onion layer
     virtual Item *decryptUDF(Item * const col, Item * const ivcol = NULL)
@@ -81,11 +139,72 @@ public:
 
 protected:
      friend class EncLayerFactory;
+     friend class OnionPipeline;
+
+     // decryptBatch() through decryptValues().
+     bool decryptBatchAsValues(std::vector<Item *> *const ctexts,
+                               const std::vector<uint64_t> &IVs) const;
+
+     // Only layers whose results depend on nothing but their input
+     // (and so not on the IV) may keep a cache.
+     virtual LayerCache *getCache() const {return NULL;}
 
 private:
      constexpr static const char * type_name = "encLayer";
 };
 
+/*
+ * The layers of an onion applied as one unit: the Item is read once,
+ * each layer works on a LayerValue in place, and only the result is an
+ * Item again. The layouts of util/onions.hh, whole or peeled, get a
+ * pipeline specialized to their layer classes, so that the calls from
+ * one layer to the next are resolved at compile time; other stacks of
+ * layers with value paths get one that makes the virtual calls. Layer
+ * caches are used as cachedEncrypt()/cachedDecrypt() use them.
+ *
+ * CRYPTDB_FUSED_LAYERS=0 turns pipelines off.
+ */
+class OnionPipeline {
+public:
+    virtual ~OnionPipeline() {}
+
+    // @layers bottom first, as in OnionMeta; NULL if some layer has no
+    // value path, and the layers are then applied one Item at a time.
+    static OnionPipeline *
+        build(const std::vector<std::unique_ptr<EncLayer> > &layers);
+    // build() regardless of CRYPTDB_FUSED_LAYERS; with @fused false the
+    // pipeline makes virtual calls even for a fixed layout. For tests
+    // and benchmarks.
+    static OnionPipeline *
+        make(const std::vector<std::unique_ptr<EncLayer> > &layers,
+             bool fused);
+
+    Item *encrypt(const Item &ptext, uint64_t IV) const;
+    // NULL if @ctext is neither an integer nor a string.
+    Item *decrypt(Item *const ctext, uint64_t IV) const;
+    // Decrypts the values of one result column in place, through the
+    // batch paths of the layers; false, with @items untouched, under
+    // the same condition as decrypt().
+    bool decryptColumn(std::vector<Item *> *const items,
+                       const std::vector<uint64_t> &IVs) const;
+
+protected:
+    OnionPipeline(const std::vector<const EncLayer *> &layers,
+                  const std::vector<LayerCache *> &caches);
+
+    virtual void encryptValue(LayerValue *const v, uint64_t IV) const = 0;
+    virtual void decryptValue(LayerValue *const v, uint64_t IV) const = 0;
+    virtual void decryptValues(std::vector<LayerValue> *const vs,
+                               const std::vector<uint64_t> &IVs) const = 0;
+
+    const std::vector<const EncLayer *> layers;
+    // NULL for layers without one.
+    const std::vector<LayerCache *> caches;
+
+private:
+    const EncLayer::ValueKind input;
+};
+
 class HOM : public EncLayer {
 public:
     HOM(Create_field * const cf, const std::string &seed_key);
@@ -99,6 +218,11 @@ public:
     Create_field * newCreateField(const Create_field * const cf,
                                   const std::string &anonname = "")
         const;
+    Create_field * newCompactCreateField(const Create_field * const cf,
+                                         const std::string &anonname = "")
+        const;
+    // Ciphertexts are integers mod n^2.
+    static unsigned int ciphertextBytes() {return 2 * nbits / 8;}
 
     //TODO needs multi encrypt and decrypt
     Item *encrypt(const Item &p, uint64_t IV) const;
@@ -115,7 +239,6 @@ protected:
 
     ~HOM();
 
-private:
     void unwait() const;
 
     mutable bool waiting;
@@ -145,6 +268,7 @@ public:
 private:
     static const uint key_bytes = 16;
     std::string const key;
+    const swp_batch swp;
 };
 
 extern const std::vector<udf_func*> udf_list;
@@ -1,6 +1,7 @@
 #include <main/alter_sub_handler.hh>
 #include <main/rewrite_util.hh>
 #include <main/dispatcher.hh>
+#include <main/index_planner.hh>
 #include <parser/lex_util.hh>
 #include <util/enum_text.hh>
 
@@ -52,12 +53,17 @@ class DropColumnSubHandler : public AlterSubHandler {
             FieldMeta const &fm =
                 a.getFieldMeta(preamble.dbname, preamble.table,
                                adrop->name);
-            TableMeta const &tm =
+            TableMeta &tm =
                 a.getTableMeta(preamble.dbname, preamble.table);
             List<Alter_drop> lst = this->rewrite(fm, adrop);
             out_list.concat(&lst);
             a.deltas.push_back(std::unique_ptr<Delta>(
                                             new DeleteDelta(fm, tm)));
+            if (tm.dropLazyIndexColumn(fm.fname)) {
+                a.deltas.push_back(std::unique_ptr<Delta>(
+                    new ReplaceDelta(tm,
+                                     a.getDatabaseMeta(preamble.dbname))));
+            }
             return out_list; /* lambda */
         });
 
@@ -79,8 +85,8 @@ class DropColumnSubHandler : public AlterSubHandler {
             out_list.push_back(new_adrop);
         }
 
-        // Rewrite the salt column.
-        if (fm.getHasSalt()) {
+        // Rewrite the salt column; the row salt stays with the table.
+        if (fm.getHasSalt() && false == fm.getSharesSalt()) {
             Alter_drop * const new_adrop = adrop->clone(thd->mem_root);
             new_adrop->name =
                 thd->strdup(fm.getSaltName().c_str());
@@ -114,7 +120,7 @@ class AddIndexSubHandler : public AlterSubHandler {
                                   const ProxyState &ps,
                                   const Preamble &preamble) const
     {
-        TableMeta const &tm =
+        TableMeta &tm =
             a.getTableMeta(preamble.dbname, preamble.table);
 
         // Add each new index.
@@ -132,6 +138,10 @@ class AddIndexSubHandler : public AlterSubHandler {
                     return out_list;    /* lambda */
             });
 
+        // Plain indexes are recorded in the TableMeta.
+        a.deltas.push_back(std::unique_ptr<Delta>(
+            new ReplaceDelta(tm, a.getDatabaseMeta(preamble.dbname))));
+
         return lex;
     }
 };
@@ -141,7 +151,7 @@ class DropIndexSubHandler : public AlterSubHandler {
                                   const ProxyState &ps,
                                   const Preamble &preamble) const
     {
-        TableMeta const &tm =
+        TableMeta &tm =
             a.getTableMeta(preamble.dbname, preamble.table);
 
         // Get the key drops.
@@ -159,11 +169,16 @@ class DropIndexSubHandler : public AlterSubHandler {
             List_iterator<Alter_drop>(key_drop_list);
         lex->alter_info.drop_list =
             accumList<Alter_drop>(drop_it,
-                [preamble, &tm, &a, this]
+                [preamble, &tm, &a, &ps, this]
                     (List<Alter_drop> out_list, Alter_drop *adrop)
                 {
+                        std::string declared_name;
                         List<Alter_drop> lst =
-                            this->rewrite(a, adrop, preamble.table);
+                            tm.dropLazyIndex(adrop->name, &declared_name)
+                                ? this->rewriteLazy(a, ps, tm, adrop,
+                                                    declared_name,
+                                                    preamble)
+                                : this->rewrite(a, adrop, preamble.table);
                         out_list.concat(&lst); 
                         return out_list;
                 });
@@ -171,6 +186,39 @@ class DropIndexSubHandler : public AlterSubHandler {
         return lex;
     }
 
+    // Only drop the onions the IndexPlanner has built.
+    List<Alter_drop> rewriteLazy(Analysis &a, const ProxyState &ps,
+                                 const TableMeta &tm, Alter_drop *adrop,
+                                 const std::string &declared_name,
+                                 const Preamble &preamble) const
+    {
+        a.deltas.push_back(std::unique_ptr<Delta>(
+            new ReplaceDelta(tm, a.getDatabaseMeta(preamble.dbname))));
+
+        std::set<std::string> existing;
+        TEST_TextMessageError(remoteIndexNames(ps.getConn(),
+                                               preamble.dbname,
+                                               tm.getAnonTableName(),
+                                               &existing),
+                              "failed to read remote indexes");
+
+        List<Alter_drop> out_list;
+        for (auto o : getOnionIndexTypes()) {
+            const std::string name =
+                a.getAnonIndexName(tm, declared_name, o);
+            if (existing.end() == existing.find(name)) {
+                continue;
+            }
+
+            Alter_drop *const new_adrop =
+                adrop->clone(current_thd->mem_root);
+            new_adrop->name = make_thd_string(name);
+            out_list.push_back(new_adrop);
+        }
+
+        return out_list;
+    }
+
     List<Alter_drop> rewrite(const Analysis &a, Alter_drop *adrop,
                              const std::string &table) const
     {
@@ -2,9 +2,12 @@
 
 #include <functional>
 #include <memory>
+#include <type_traits>
+#include <unordered_map>
 
 #include <util/enum_text.hh>
 #include <main/serializers.hh>
+#include <main/metadata_store.hh>
 
 // FIXME: Maybe should inherit from DBObject.
 class AbstractMetaKey {
@@ -39,6 +42,13 @@ public:
 
     KeyType getValue() const {return key_data;}
     std::string getSerial() const {return serial;}
+    std::size_t hash() const;
+};
+
+// For the hashed indexes of MappedDBMeta.
+template <typename KeyType>
+struct MetaKeyHash {
+    std::size_t operator()(const KeyType &key) const {return key.hash();}
 };
 
 template <typename KeyType>
@@ -123,6 +133,17 @@ public:
 };
 
 class Connect;
+class EncLayer;
+
+/*
+ * The serialized tree that DBMeta::fetchChildren() rebuilds the
+ * in-memory one from, read with a single MetaStore call. Layers that
+ * loadSchemaInfo() has already deserialized wait in 'layers', by id.
+ */
+struct SchemaRows {
+    MetaStore::ChildMap children;
+    std::map<unsigned long, std::unique_ptr<EncLayer> > layers;
+};
 
 /*
  * DBMeta is also a design choice about how we use Deltas.
@@ -145,7 +166,7 @@ public:
     // FIXME: Use rtti.
     virtual std::string typeName() const = 0;
     virtual std::vector<DBMeta *>
-        fetchChildren(const std::unique_ptr<Connect> &e_conn) = 0;
+        fetchChildren(SchemaRows *const rows) = 0;
     // Stops processing on error.
     virtual bool
         applyToChildren(std::function<bool(const DBMeta &)>)
@@ -155,7 +176,7 @@ public:
 
 protected:
     std::vector<DBMeta*>
-        doFetchChildren(const std::unique_ptr<Connect> &e_conn,
+        doFetchChildren(const SchemaRows &rows,
                         std::function<DBMeta*
                             (const std::string &, const std::string &,
                              const std::string &)>
@@ -168,7 +189,7 @@ public:
     LeafDBMeta(unsigned int id) : DBMeta(id) {}
 
     std::vector<DBMeta *>
-        fetchChildren(const std::unique_ptr<Connect> &e_conn)
+        fetchChildren(SchemaRows *const rows)
     {
         return std::vector<DBMeta *>();
     }
@@ -189,8 +210,8 @@ public:
 // > TODO: Use static deserialization functions for the derived types so we
 //   can get rid of the <Constructor>(std::string serial) functions and put
 //   'const' back on the members.
-// > FIXME: The key in children is a pointer so this means our lookup is
-//   slow. Use std::reference_wrapper.
+// > children is ordered for the iterations that walk the schema; lookups
+//   by key and by child go through hashed indexes kept by addChild.
 template <typename ChildType, typename KeyType>
 class MappedDBMeta : public DBMeta {
 public:
@@ -204,12 +225,19 @@ public:
         getChild(const KeyType &key) const;
     KeyType const &getKey(const DBMeta &child) const;
     virtual std::vector<DBMeta *>
-        fetchChildren(const std::unique_ptr<Connect> &e_conn);
+        fetchChildren(SchemaRows *const rows);
     bool applyToChildren(std::function<bool(const DBMeta &)>
         fn) const;
 
     // FIXME: Make protected.
+    // Only addChild may change it.
     std::map<KeyType, std::unique_ptr<ChildType>> children;
+
+private:
+    std::unordered_map<KeyType, ChildType *, MetaKeyHash<KeyType>>
+        child_index;
+    // Points at the keys in children.
+    std::unordered_map<const DBMeta *, const KeyType *> key_index;
 };
 
 #include <main/dbobject.tt>
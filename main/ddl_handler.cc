@@ -27,7 +27,8 @@ class CreateTableHandler : public DDLHandler {
         // doesn't exist.
         if (false == a.tableMetaExists(db_name, table)) {
             // TODO: Use appropriate values for has_sensitive and has_salt.
-            std::unique_ptr<TableMeta> tm(new TableMeta(true, true));
+            std::unique_ptr<TableMeta>
+                tm(new TableMeta(true, true, ps.compactTables()));
 
             // -----------------------------
             //         Rewrite TABLE       
@@ -57,6 +58,11 @@ class CreateTableHandler : public DDLHandler {
                         return createAndRewriteField(a, ps, cf, tm.get(),
                                                      true, out_list);
                 });
+            if (tm->isCompact() && lex->alter_info.create_list.head()) {
+                new_lex->alter_info.create_list.push_back(
+                    salt_create_field(lex->alter_info.create_list.head(),
+                                      tm->getSaltName()));
+            }
 
             // -----------------------------
             //         Rewrite INDEX
@@ -185,6 +191,9 @@ class DropTableHandler : public DDLHandler {
             a.deltas.push_back(std::unique_ptr<Delta>(
                             new DeleteDelta(tm,
                                             a.getDatabaseMeta(tbl->db))));
+            a.dropped_tables.push_back(
+                std::make_pair(std::string(tbl->db),
+                               tm.getAnonTableName()));
         }
     }
 };
@@ -215,6 +224,9 @@ class ChangeDBHandler : public DDLHandler {
     virtual LEX *rewriteAndUpdate(Analysis &a, LEX *const lex,
                                   const ProxyState &ps) const
     {
+        a.changes_default_db = true;
+        a.new_default_db = lex->select_lex.db;
+
         return copyWithTHD(lex);
     }
 };
@@ -228,6 +240,11 @@ class DropDBHandler : public DDLHandler {
         DatabaseMeta &dm = a.getDatabaseMeta(dbname);
         a.deltas.push_back(std::unique_ptr<Delta>(
                                     new DeleteDelta(dm, a.getSchema())));
+        a.dropped_tables.push_back(std::make_pair(dbname, std::string()));
+        if (a.getDatabaseName() == dbname) {
+            a.changes_default_db = true;
+            a.new_default_db.clear();
+        }
 
         return copyWithTHD(lex);
     }
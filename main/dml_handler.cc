@@ -37,6 +37,25 @@ SIMPLE_UPDATE_TYPE
 determineUpdateType(const Item &value_item, const FieldMeta &fm,
                     const EncSet &es);
 
+static bool
+usesOtherOnion(const Analysis &a, const FieldMeta &fm);
+
+static bool
+isHOMIncrement(const Item &value_item, const FieldMeta &fm,
+               const EncSet &es, const Analysis &a);
+
+static void
+doPairRewrite(FieldMeta &fm, const EncSet &es,
+              const Item_field &field_item, const Item &value_item,
+              List<Item> *const res_fields, List<Item> *const res_values,
+              Analysis &a);
+
+static void
+addSalt(FieldMeta &fm, const Item_field &field_item,
+        List<Item> *const res_fields, List<Item> *const res_values,
+        Analysis &a,
+        std::function<Item *(const Item_field &rew_fd)> getSaltValue);
+
 void
 handleUpdateType(SIMPLE_UPDATE_TYPE update_type, const EncSet &es,
                  const Item_field &field_item, const Item &value_item,
@@ -54,6 +73,39 @@ void rewriteInsertHelper(const Item &i, const FieldMeta &fm, Analysis &a,
     }
 }
 
+// Shows the innermost layer of every onion the whole column of a
+// multi-row INSERT before the rows are encrypted one by one.
+static void
+prepareInsertColumns(const List<List_item> &many_values,
+                     const std::vector<FieldMeta *> &fmVec,
+                     const Analysis &a)
+{
+    std::vector<std::vector<const Item *> > columns(fmVec.size());
+    auto row_it = RiboldMYSQL::constList_iterator<List_item>(many_values);
+    for (;;) {
+        const List_item *const li = row_it++;
+        if (!li) {
+            break;
+        }
+        if (li->elements != fmVec.size()) {
+            continue;
+        }
+        auto it = RiboldMYSQL::constList_iterator<Item>(*li);
+        for (auto &column : columns) {
+            column.push_back(it++);
+        }
+    }
+
+    for (unsigned int i = 0; i < fmVec.size(); ++i) {
+        for (const auto &it : fmVec[i]->orderedOnionMetas()) {
+            const auto &layers = a.getEncLayers(*it.second);
+            if (false == layers.empty()) {
+                layers.front()->prepareEncrypt(columns[i]);
+            }
+        }
+    }
+}
+
 class InsertHandler : public DMLHandler {
     virtual void gather(Analysis &a, LEX *const lex,
                         const ProxyState &ps) const
@@ -95,6 +147,7 @@ class InsertHandler : public DMLHandler {
         // > INSERT INTO t () VALUES ();
         // FIXME: Make vector of references.
         std::vector<FieldMeta *> fmVec;
+        std::vector<FieldMeta *> field_implicit_defaults;
         std::vector<Item *> implicit_defaults;
         if (lex->field_list.head()) {
             auto it = List_iterator<Item>(lex->field_list);
@@ -118,7 +171,7 @@ class InsertHandler : public DMLHandler {
             // Collect the implicit defaults.
             // > Such must be done because fields that can not have NULL
             // will be implicitly converted by mysql sans encryption.
-            std::vector<FieldMeta *> field_implicit_defaults =
+            field_implicit_defaults =
                 vectorDifference(tm.defaultedFieldMetas(), fmVec);
             const Item_field *const seed_item_field =
                 static_cast<Item_field *>(new_lex->field_list.head());
@@ -131,9 +184,14 @@ class InsertHandler : public DMLHandler {
                                     &newList);
 
                 // Get default values.
-                const std::string def_value = implicit_it->defaultValue();
-                rewriteInsertHelper(*make_item_string(def_value),
-                                    *implicit_it, a, &implicit_defaults);
+                // > In a compact table they take the salt of each row.
+                if (false == tm.isCompact()) {
+                    const std::string def_value =
+                        implicit_it->defaultValue();
+                    rewriteInsertHelper(*make_item_string(def_value),
+                                        *implicit_it, a,
+                                        &implicit_defaults);
+                }
             }
 
             new_lex->field_list = newList;
@@ -145,12 +203,42 @@ class InsertHandler : public DMLHandler {
             assert(fmVec.empty());
             std::vector<FieldMeta *> fmetas = tm.orderedFieldMetas();
             fmVec.assign(fmetas.begin(), fmetas.end());
+
+            // The row salt of a compact table has no fixed position so
+            // the columns must be named.
+            // > INSERT INTO t () VALUES () stays as it is.
+            if (tm.isCompact() && lex->many_values.head()
+                && lex->many_values.head()->elements > 0) {
+                List<Item> newList;
+                for (auto it : fmVec) {
+                    const Item_field *const item_field =
+                        new (current_thd->mem_root)
+                            Item_field(&new_lex->select_lex.context,
+                                       make_thd_string(db_name),
+                                       make_thd_string(table),
+                                       make_thd_string(it->fname));
+                    rewriteInsertHelper(*item_field, *it, a, &newList);
+                }
+                new_lex->field_list = newList;
+            }
+        }
+
+        // The row salt is the first column.
+        if (tm.isCompact() && new_lex->field_list.head()) {
+            const Item_field *const seed_item_field =
+                static_cast<Item_field *>(new_lex->field_list.head());
+            new_lex->field_list.push_front(
+                make_item_field(*seed_item_field, tm.getAnonTableName(),
+                                tm.getSaltName()));
         }
 
         // -----------------
         //      Values
         // -----------------
         if (lex->many_values.head()) {
+            if (lex->many_values.elements > 1) {
+                prepareInsertColumns(lex->many_values, fmVec, a);
+            }
             auto it = List_iterator<List_item>(lex->many_values);
             List<List_item> newList;
             for (;;) {
@@ -168,6 +256,12 @@ class InsertHandler : public DMLHandler {
                     // > INSERT INTO <table> () VALUES ();
                     // > INSERT INTO <table> VALUES ();
                 } else {
+                    if (tm.isCompact()) {
+                        a.row_salt = randomValue();
+                        newList0->push_back(new Item_int(
+                            static_cast<ulonglong>(a.row_salt)));
+                    }
+
                     auto it0 = List_iterator<Item>(*li);
                     auto fmVecIt = fmVec.begin();
                     for (;;) {
@@ -183,6 +277,13 @@ class InsertHandler : public DMLHandler {
                     for (auto def_it : implicit_defaults) {
                         newList0->push_back(def_it);
                     }
+                    if (tm.isCompact()) {
+                        for (auto def_it : field_implicit_defaults) {
+                            rewriteInsertHelper(
+                                *make_item_string(def_it->defaultValue()),
+                                *def_it, a, newList0);
+                        }
+                    }
                 }
                 newList.push_back(newList0);
             }
@@ -196,8 +297,10 @@ class InsertHandler : public DMLHandler {
             auto fd_it = List_iterator<Item>(lex->update_list);
             auto val_it = List_iterator<Item>(lex->value_list);
             List<Item> res_fields, res_values;
-            assert(rewrite_field_value_pairs(fd_it, val_it, a, &res_fields,
-                                             &res_values));
+            TEST_TextMessageError(
+                rewrite_field_value_pairs(fd_it, val_it, a, &res_fields,
+                                          &res_values),
+                "can't rewrite ON DUPLICATE KEY UPDATE!");
             new_lex->update_list = res_fields;
             new_lex->value_list = res_values;
         }
@@ -431,6 +534,7 @@ static st_select_lex *
 rewrite_filters_lex(const st_select_lex &select_lex, Analysis & a)
 {
     st_select_lex *const new_select_lex = copyWithTHD(&select_lex);
+    const size_t first_rewrite = a.field_rewrites.size();
 
     // FIXME: Use const reference for list.
     new_select_lex->group_list =
@@ -438,6 +542,8 @@ rewrite_filters_lex(const st_select_lex &select_lex, Analysis & a)
     new_select_lex->order_list =
         *rewrite_order(a, select_lex.order_list, ORD_EncSet, "order by");
 
+    const bool lookup_constants = a.lookup_constants;
+    a.lookup_constants = true;
     if (select_lex.where) {
         set_where(new_select_lex, rewrite(*select_lex.where,
                                           PLAIN_EncSet, a));
@@ -448,6 +554,7 @@ rewrite_filters_lex(const st_select_lex &select_lex, Analysis & a)
     //cerr << "select_lex join conds " << select_lex->join->conds << "\n";
     //rewrite(&select_lex->join->conds, a);
     //}
+    a.noteFilterOnions(first_rewrite);
 
     // HACK: We only care about Analysis::item_cache from HAVING.
     a.item_cache.clear();
@@ -455,6 +562,7 @@ rewrite_filters_lex(const st_select_lex &select_lex, Analysis & a)
         set_having(new_select_lex, rewrite(*select_lex.having,
                                            PLAIN_EncSet, a));
     }
+    a.lookup_constants = lookup_constants;
 
     return new_select_lex;
 }
@@ -465,6 +573,8 @@ rewrite_field_value_pairs(List_iterator<Item> fd_it,
                           List<Item> *const res_fields,
                           List<Item> *const res_values)
 {
+    std::vector<FieldMeta *> incremented;
+    std::vector<std::pair<FieldMeta *, const TableMeta *> > stale;
     for (;;) {
         const Item *const field_item = fd_it++;
         const Item *const value_item = val_it++;
@@ -494,13 +604,59 @@ rewrite_field_value_pairs(List_iterator<Item> fd_it,
         const SIMPLE_UPDATE_TYPE update_type =
             determineUpdateType(*value_item, fm, r_es);
         if (SIMPLE_UPDATE_TYPE::UNSUPPORTED == update_type) {
-            return false;
+            if (false == isHOMIncrement(*value_item, fm, r_es, a)) {
+                return false;
+            }
+
+            // The rows whose other onions fall behind are marked by
+            // their salt, so a field without a salt of its own can't
+            // leave them behind.
+            const bool leaves_stale = fm.children.size() > 1;
+            if (leaves_stale
+                && (false == fm.getHasSalt() || fm.getSharesSalt())) {
+                return false;
+            }
+
+            // Only oAGG follows the increment; the server adds the
+            // ciphertexts and the other onions fall behind.
+            const auto agg = r_es.osl.find(oAGG);
+            EncSet agg_es(OLK(oAGG, agg->second.first, &fm));
+            doPairRewrite(fm, agg_es, *ifd, *value_item, res_fields,
+                          res_values, a);
+            if (leaves_stale) {
+                addSalt(fm, *ifd, res_fields, res_values, a,
+                        [] (const Item_field &)
+                {
+                    return new (current_thd->mem_root)
+                               Item_int(static_cast<ulonglong>(
+                                            STALE_ROW_SALT));
+                });
+            }
+            incremented.push_back(&fm);
+            if (false == fm.getOnionsStale() && leaves_stale) {
+                const TableMeta &tm =
+                    a.getTableMeta(a.getDatabaseName(), ifd->table_name);
+                stale.push_back(std::make_pair(&fm, &tm));
+            }
+            continue;
         }
 
         handleUpdateType(update_type, r_es, *ifd, *value_item,
                          res_fields, res_values, a);
     }
 
+    // A later SET value may have read another onion of an incremented
+    // field.
+    for (auto it : incremented) {
+        if (usesOtherOnion(a, *it)) {
+            return false;
+        }
+    }
+
+    for (auto it : stale) {
+        a.newly_stale_fields.insert(it);
+    }
+
     return true;
 }
 
@@ -686,6 +842,68 @@ invalidates(const FieldMeta &fm, const EncSet & es)
     return false;
 }
 
+// Has the statement rewritten @fm to an onion other than oAGG?
+static bool
+usesOtherOnion(const Analysis &a, const FieldMeta &fm)
+{
+    for (const auto &it : a.field_rewrites) {
+        if (&fm == std::get<1>(it) && oAGG != std::get<2>(it)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Is this SET x = x + c with a non-negative constant that oAGG can add
+// in place?
+// > The increment leaves the other onions stale; if the statement also
+//   reads one of them (ie, WHERE x = 5) the refresh would go stale again
+//   on every reissue.
+static bool
+isHOMIncrement(const Item &value_item, const FieldMeta &fm,
+               const EncSet &es, const Analysis &a)
+{
+    if (usesOtherOnion(a, fm)) {
+        return false;
+    }
+
+    const auto agg = es.osl.find(oAGG);
+    if (es.osl.end() == agg || SECLEVEL::HOM != agg->second.first) {
+        return false;
+    }
+
+    if (Item::Type::FUNC_ITEM != value_item.type()) {
+        return false;
+    }
+    const Item_func &func = static_cast<const Item_func &>(value_item);
+    if (2 != func.argument_count()
+        || std::string("+") != func.func_name()) {
+        return false;
+    }
+
+    Item *const *const args = func.arguments();
+    for (unsigned int i = 0; i < 2; ++i) {
+        const Item &field = *args[i];
+        const Item &constant = *args[1 - i];
+        if (Item::Type::FIELD_ITEM != field.type()
+            || false == equalsIgnoreCase(fm.fname,
+                            static_cast<const Item_field &>(field)
+                                .field_name)) {
+            continue;
+        }
+
+        // HOM works modulo n; a negative addend would wrap.
+        if ((Item::Type::INT_ITEM == constant.type()
+             || Item::Type::DECIMAL_ITEM == constant.type())
+            && RiboldMYSQL::val_real(constant) >= 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 SIMPLE_UPDATE_TYPE
 determineUpdateType(const Item &value_item, const FieldMeta &fm,
                     const EncSet &es)
@@ -694,8 +912,15 @@ determineUpdateType(const Item &value_item, const FieldMeta &fm,
         return SIMPLE_UPDATE_TYPE::UNSUPPORTED;
     }
 
+    // A new value needs a new salt; but a shared salt belongs to every
+    // field of the row.
+    const bool needs_own_salt = fm.getSharesSalt() && needsSalt(es);
+
     if (value_item.type() == Item::Type::FIELD_ITEM) {
         if (true == isItem_insert_value(value_item)) {
+            if (needs_own_salt) {
+                return SIMPLE_UPDATE_TYPE::UNSUPPORTED;
+            }
             return SIMPLE_UPDATE_TYPE::ON_DUPLICATE_VALUE;
         } else {
             const std::string &item_field_name =
@@ -705,6 +930,10 @@ determineUpdateType(const Item &value_item, const FieldMeta &fm,
         }
     }
 
+    if (needs_own_salt) {
+        return SIMPLE_UPDATE_TYPE::UNSUPPORTED;
+    }
+
     return SIMPLE_UPDATE_TYPE::NEW_VALUE;
 }
 
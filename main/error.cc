@@ -52,15 +52,31 @@ std::string NoAvailableEncSet::to_string() const
         << "OPERATION: " << why << std::endl
         << "REQUIRED ENCSET: " << req_enc_set << std::endl
         << "***** CHILDREN REASONS *****" << std::endl;
-    for (auto it = childr_rp.begin(); it != childr_rp.end(); it++) {
-        s << "[" << std::to_string(std::distance(childr_rp.begin(), it))
+    for (auto it = child_reasons.begin(); it != child_reasons.end();
+         it++) {
+        s << "[" << std::to_string(std::distance(child_reasons.begin(),
+                                                 it))
                  << "] "
-          << (*it)->getReason() << std::endl;
+          << *it << std::endl;
     }
 
     return s.str();
 }
 
+std::vector<std::string>
+NoAvailableEncSet::reasons(const std::vector<std::shared_ptr<RewritePlan> >
+                            &childr_rp)
+{
+    std::vector<std::string> out;
+    for (auto it = childr_rp.begin(); it != childr_rp.end(); it++) {
+        std::stringstream s;
+        s << (*it)->getReason();
+        out.push_back(s.str());
+    }
+
+    return out;
+}
+
 std::string TextMessageError::to_string() const
 {
     return "Error: " + message + "\n"
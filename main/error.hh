@@ -71,7 +71,8 @@ public:
                       const std::vector<std::shared_ptr<RewritePlan> >
                         &childr_rp)
         : AbstractException(file_name, line_number), type(type),
-          req_enc_set(req_enc_set), why(why), childr_rp(childr_rp) {}
+          req_enc_set(req_enc_set), why(why),
+          child_reasons(reasons(childr_rp)) {}
     ~NoAvailableEncSet() {}
 
     // std::string to_string() const final;
@@ -82,7 +83,12 @@ private:
     const unsigned int type;
     const EncSet req_enc_set;
     const std::string why;
-    const std::vector<std::shared_ptr<RewritePlan> > childr_rp;
+    // Printed when thrown; the plans are gone with their Analysis by the
+    // time the exception is caught.
+    const std::vector<std::string> child_reasons;
+
+    static std::vector<std::string>
+    reasons(const std::vector<std::shared_ptr<RewritePlan> > &childr_rp);
 };
 
 class TextMessageError : public AbstractException {
@@ -0,0 +1,433 @@
+#include <cstdlib>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include <memory>
+
+#include <main/index_planner.hh>
+#include <main/Analysis.hh>
+#include <main/rewrite_util.hh>
+#include <main/macro_util.hh>
+#include <util/cryptdb_log.hh>
+#include <util/scoped_lock.hh>
+
+// How often observe() looks for indexes to drop, in queries.
+static const unsigned long SWEEP_INTERVAL = 1024;
+
+std::vector<IndexCandidate>
+indexCandidates(const Analysis &a)
+{
+    std::set<const TableMeta *> tables;
+    for (const auto &it : a.filter_onions) {
+        tables.insert(std::get<0>(it));
+    }
+
+    std::vector<IndexCandidate> out;
+    for (const TableMeta *const tm : tables) {
+        for (const auto &index : tm->getLazyIndexes()) {
+            const IndexColumns &columns = index.second;
+            assert(columns.size() > 0);
+
+            for (const onion o : getOnionIndexTypes()) {
+                // Every column must have the onion.
+                std::string spec;
+                bool complete = true;
+                for (const auto &column : columns) {
+                    if (false ==
+                        tm->childExists(IdentityMetaKey(column.first))) {
+                        complete = false;
+                        break;
+                    }
+                    const FieldMeta &fm = a.getFieldMeta(*tm, column.first);
+                    const OnionMeta *const om = fm.getOnionMeta(o);
+                    if (NULL == om) {
+                        complete = false;
+                        break;
+                    }
+
+                    spec += (spec.empty() ? "" : ", ") +
+                            om->getAnonOnionName();
+                    if (column.second > 0) {
+                        spec += "(" + std::to_string(column.second) + ")";
+                    }
+                }
+                if (false == complete) {
+                    continue;
+                }
+
+                // MySQL only uses an index through its leading column;
+                // and an index on RND ciphertexts serves nothing.
+                const FieldMeta &lead =
+                    a.getFieldMeta(*tm, columns.front().first);
+                const bool used =
+                    a.filter_onions.end() !=
+                        a.filter_onions.find(FieldOnion(tm, &lead, o))
+                    && SECLEVEL::RND !=
+                        a.getOnionLevel(*lead.getOnionMeta(o));
+
+                IndexCandidate candidate;
+                candidate.db = a.getDatabaseName();
+                candidate.table = tm->getAnonTableName();
+                candidate.index_name =
+                    a.getAnonIndexName(*tm, index.first, o);
+                candidate.columns = "(" + spec + ")";
+                candidate.used = used;
+                out.push_back(candidate);
+            }
+        }
+    }
+
+    return out;
+}
+
+bool
+remoteIndexNames(const std::unique_ptr<Connect> &conn,
+                 const std::string &db, const std::string &table,
+                 std::set<std::string> *const out)
+{
+    out->clear();
+
+    std::unique_ptr<DBResult> dbres;
+    const std::string q =
+        " SELECT DISTINCT INDEX_NAME "
+        "   FROM INFORMATION_SCHEMA.STATISTICS "
+        "  WHERE TABLE_SCHEMA = '" + escapeString(conn, db) + "'"
+        "    AND TABLE_NAME = '" + escapeString(conn, table) + "';";
+    RETURN_FALSE_IF_FALSE(conn->execute(q, &dbres));
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(dbres->n))) {
+        const unsigned long *const l = mysql_fetch_lengths(dbres->n);
+        out->insert(std::string(row[0], l[0]));
+    }
+
+    return true;
+}
+
+static unsigned long
+thresholdFromEnv(const char *const name, unsigned long fallback)
+{
+    const char *const ev = getenv(name);
+    if (NULL == ev) {
+        return fallback;
+    }
+
+    const unsigned long value = strtoul(ev, NULL, 10);
+    TEST_TextMessageError(value > 0,
+                          std::string("bad value for ") + name);
+    return value;
+}
+
+// CRYPTDB_INDEX_WINDOW=<from>-<to>, in hours.
+static void
+windowFromEnv(int *const from, int *const to)
+{
+    *from = -1;
+    *to = -1;
+
+    const char *const ev = getenv("CRYPTDB_INDEX_WINDOW");
+    if (NULL == ev) {
+        return;
+    }
+
+    char *end;
+    const long f = strtol(ev, &end, 10);
+    const bool dash = end != ev && '-' == *end;
+    const char *const rest = end + 1;
+    const long t = dash ? strtol(rest, &end, 10) : -1;
+    TEST_TextMessageError(dash && end != rest && '\0' == *end
+                          && f >= 0 && f < 24 && t >= 0 && t <= 24
+                          && f != t,
+                          "bad value for CRYPTDB_INDEX_WINDOW");
+    *from = f;
+    *to = t;
+}
+
+IndexPlanner::IndexPlanner(const ConnectionInfo &ci)
+    : server(ci.server), user(ci.user), passwd(ci.passwd), port(ci.port),
+      build_after(thresholdFromEnv("CRYPTDB_INDEX_BUILD_AFTER", 4)),
+      drop_after(thresholdFromEnv("CRYPTDB_INDEX_DROP_AFTER", 100000)),
+      worker_running(false), stopping(false), clock(0)
+{
+    windowFromEnv(&window_from, &window_to);
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&has_jobs, NULL);
+}
+
+IndexPlanner::~IndexPlanner()
+{
+    {
+        scoped_lock l(&lock);
+        stopping = true;
+        pthread_cond_signal(&has_jobs);
+    }
+
+    if (worker_running) {
+        pthread_join(worker, NULL);
+    }
+
+    pthread_cond_destroy(&has_jobs);
+    pthread_mutex_destroy(&lock);
+}
+
+void
+IndexPlanner::observe(const std::vector<IndexCandidate> &candidates)
+{
+    scoped_lock l(&lock);
+    ++clock;
+
+    std::map<std::string, std::vector<IndexCandidate> > unprobed;
+    for (const auto &it : candidates) {
+        const auto entry_it = entries.find(it.key());
+        Entry &entry = entries[it.key()];
+        if (entries.end() == entry_it) {
+            // The unused window starts when we first see the index.
+            entry.last_use = clock;
+        }
+        entry.candidate = it;
+        if (it.used) {
+            ++entry.uses;
+            entry.last_use = clock;
+        }
+
+        const std::string table = it.db + "." + it.table;
+        if (probed_tables.end() == probed_tables.find(table)) {
+            unprobed[table].push_back(it);
+        }
+    }
+
+    // Learn what already exists before building anything.
+    for (const auto &it : unprobed) {
+        probed_tables.insert(it.first);
+        for (const auto &candidate : it.second) {
+            entries[candidate.key()].busy = true;
+        }
+        enqueue(JobType::PROBE, it.second);
+    }
+
+    // Outside the window the counts go on; a later query builds it.
+    if (false == inWindow()) {
+        return;
+    }
+
+    for (const auto &it : candidates) {
+        Entry &entry = entries[it.key()];
+        if (false == entry.built && false == entry.busy
+            && entry.uses >= build_after) {
+            entry.busy = true;
+            enqueue(JobType::BUILD, std::vector<IndexCandidate>({it}));
+        }
+    }
+
+    if (0 == clock % SWEEP_INTERVAL) {
+        sweep();
+    }
+}
+
+void
+IndexPlanner::forget(const std::string &db, const std::string &table)
+{
+    scoped_lock l(&lock);
+
+    const auto gone = [&db, &table] (const IndexCandidate &c)
+    {
+        return db == c.db && (table.empty() || table == c.table);
+    };
+
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        if (gone(it->second.candidate)) {
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // Each job is about one table.
+    for (auto it = jobs.begin(); it != jobs.end(); ) {
+        if (gone(it->candidates.front())) {
+            it = jobs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    const std::string prefix = db + ".";
+    for (auto it = probed_tables.begin(); it != probed_tables.end(); ) {
+        if (table.empty() ? 0 == it->compare(0, prefix.size(), prefix)
+                          : prefix + table == *it) {
+            it = probed_tables.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool
+IndexPlanner::inWindow() const
+{
+    if (window_from < 0) {
+        return true;
+    }
+
+    const time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    const int hour = local.tm_hour;
+
+    return window_from < window_to
+        ? hour >= window_from && hour < window_to
+        : hour >= window_from || hour < window_to;
+}
+
+// Requires @lock.
+void
+IndexPlanner::enqueue(JobType type,
+                      const std::vector<IndexCandidate> &candidates)
+{
+    Job job;
+    job.type = type;
+    job.candidates = candidates;
+    jobs.push_back(job);
+
+    if (false == worker_running) {
+        TEST_TextMessageError(0 == pthread_create(&worker, NULL,
+                                                  workerMain, this),
+                              "failed to start index planner");
+        worker_running = true;
+    }
+    pthread_cond_signal(&has_jobs);
+}
+
+// Requires @lock.
+void
+IndexPlanner::sweep()
+{
+    for (auto &it : entries) {
+        Entry &entry = it.second;
+        if (entry.built && false == entry.busy
+            && clock - entry.last_use > drop_after) {
+            entry.busy = true;
+            enqueue(JobType::DROP,
+                    std::vector<IndexCandidate>({entry.candidate}));
+        }
+    }
+}
+
+void *
+IndexPlanner::workerMain(void *const arg)
+{
+    embedded_thread_init();
+    static_cast<IndexPlanner *>(arg)->work();
+    embedded_thread_end();
+
+    return NULL;
+}
+
+void
+IndexPlanner::work()
+{
+    scoped_lock l(&lock);
+    for (;;) {
+        while (jobs.empty() && false == stopping) {
+            pthread_cond_wait(&has_jobs, &lock);
+        }
+        // Queued work is only an optimization; don't hold up shutdown.
+        if (stopping) {
+            break;
+        }
+
+        const Job job = jobs.front();
+        jobs.pop_front();
+
+        pthread_mutex_unlock(&lock);
+        std::set<std::string> existing;
+        const bool success = runJob(job, &existing);
+        pthread_mutex_lock(&lock);
+
+        finishJob(job, success, existing);
+    }
+
+    conn.reset();
+}
+
+bool
+IndexPlanner::runJob(const Job &job, std::set<std::string> *const existing)
+{
+    assert(job.candidates.size() > 0);
+    const IndexCandidate &first = job.candidates.front();
+
+    if (!conn) {
+        try {
+            conn.reset(new Connect(server, user, passwd, port));
+        } catch (std::runtime_error &e) {
+            LOG(warn) << "index planner can't connect: " << e.what();
+            return false;
+        }
+    }
+
+    std::string q;
+    switch (job.type) {
+        case JobType::PROBE:
+            return remoteIndexNames(conn, first.db, first.table, existing);
+        case JobType::BUILD:
+            assert(1 == job.candidates.size());
+            q = " ALTER TABLE " + first.db + "." + first.table +
+                "   ADD INDEX " + first.index_name + " " + first.columns +
+                ";";
+            break;
+        case JobType::DROP:
+            assert(1 == job.candidates.size());
+            q = " ALTER TABLE " + first.db + "." + first.table +
+                "  DROP INDEX " + first.index_name + ";";
+            break;
+        default:
+            FAIL_TextMessageError("unknown index planner job");
+    }
+
+    if (false == conn->execute(q)) {
+        LOG(warn) << "index planner failed: " << q << ": "
+                  << conn->getError();
+        return false;
+    }
+
+    LOG(cdb_v) << "index planner: " << q;
+    return true;
+}
+
+// Requires @lock.
+void
+IndexPlanner::finishJob(const Job &job, bool success,
+                        const std::set<std::string> &existing)
+{
+    for (const auto &it : job.candidates) {
+        // The table was dropped meanwhile.
+        const auto entry_it = entries.find(it.key());
+        if (entries.end() == entry_it) {
+            continue;
+        }
+        Entry &entry = entry_it->second;
+        entry.busy = false;
+
+        switch (job.type) {
+            case JobType::PROBE:
+                if (false == success) {
+                    probed_tables.erase(it.db + "." + it.table);
+                    break;
+                }
+                entry.built =
+                    existing.end() != existing.find(it.index_name);
+                break;
+            case JobType::BUILD:
+                entry.built = success;
+                if (false == success) {
+                    entry.uses = 0;
+                }
+                break;
+            case JobType::DROP:
+                // Either way the index is gone; usage starts over.
+                entry.built = false;
+                entry.uses = 0;
+                break;
+        }
+    }
+}
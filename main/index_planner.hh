@@ -0,0 +1,120 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <list>
+#include <string>
+#include <memory>
+#include <vector>
+#include <pthread.h>
+
+#include <main/Connect.hh>
+
+class Analysis;
+class ConnectionInfo;
+
+/*
+ * A lazy user index (see TableMeta::addLazyIndex) as it would be built
+ * on one onion.
+ */
+struct IndexCandidate {
+    std::string db;
+    std::string table;          // anonymous
+    std::string index_name;     // anonymous
+    std::string columns;        // "(onion_a, onion_b(16))"
+    // Did a filter of the query use this onion of the leading column?
+    bool used;
+
+    std::string key() const {return db + "." + table + "." + index_name;}
+};
+
+// The lazy indexes of every table whose filters the query used.
+std::vector<IndexCandidate>
+indexCandidates(const Analysis &a);
+
+bool
+remoteIndexNames(const std::unique_ptr<Connect> &conn,
+                 const std::string &db, const std::string &table,
+                 std::set<std::string> *const out);
+
+/*
+ * Builds the onion of a lazy index once enough queries filtered on it
+ * and drops it again once it has gone unused for long enough.
+ *
+ * The DDL runs on a background thread with its own connection so that
+ * neither the query that crossed a threshold nor an open user
+ * transaction waits on (or is committed by) ALTER TABLE. It still
+ * locks the table: on MySQL 5.5 InnoDB builds a secondary index in
+ * place but blocks writes to the table until it is done, and other
+ * engines copy the whole table under that lock. The remote server is
+ * the only record of which indexes exist; the first time a table is
+ * seen its current indexes are read back from it.
+ *
+ * CRYPTDB_INDEX_BUILD_AFTER and CRYPTDB_INDEX_DROP_AFTER override the
+ * thresholds, both counted in queries. CRYPTDB_INDEX_WINDOW=<from>-<to>
+ * (hours, local time; 22-6 wraps midnight) only builds and drops
+ * indexes in that maintenance window; queries outside it still count.
+ */
+class IndexPlanner {
+public:
+    IndexPlanner(const ConnectionInfo &ci);
+    ~IndexPlanner();
+
+    void observe(const std::vector<IndexCandidate> &candidates);
+    // The table (anonymous name), or with an empty one every table of
+    // the database, was dropped.
+    void forget(const std::string &db, const std::string &table);
+
+private:
+    enum class JobType {PROBE, BUILD, DROP};
+
+    struct Job {
+        JobType type;
+        std::vector<IndexCandidate> candidates;
+    };
+
+    struct Entry {
+        Entry() : uses(0), last_use(0), built(false), busy(false) {}
+
+        IndexCandidate candidate;
+        unsigned long uses;
+        unsigned long last_use;
+        bool built;
+        // A job for this index is queued or running.
+        bool busy;
+    };
+
+    const std::string server;
+    const std::string user;
+    const std::string passwd;
+    const unsigned int port;
+    const unsigned long build_after;
+    const unsigned long drop_after;
+    // Hours; -1 when builds and drops may run at any time.
+    int window_from;
+    int window_to;
+
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs;
+    pthread_t worker;
+    bool worker_running;
+    bool stopping;
+
+    unsigned long clock;
+    std::map<std::string, Entry> entries;
+    std::set<std::string> probed_tables;
+    std::list<Job> jobs;
+
+    // Only used by the worker.
+    std::unique_ptr<Connect> conn;
+
+    void enqueue(JobType type,
+                 const std::vector<IndexCandidate> &candidates);
+    void sweep();
+    bool inWindow() const;
+    void work();
+    bool runJob(const Job &job, std::set<std::string> *const existing);
+    void finishJob(const Job &job, bool success,
+                   const std::set<std::string> &existing);
+    static void *workerMain(void *const arg);
+};
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+
+#include <main/layer_cache.hh>
+#include <parser/sql_utils.hh>
+#include <util/cryptdb_log.hh>
+#include <util/scoped_lock.hh>
+
+// Bookkeeping per entry beyond its key and value: the slot and the
+// index node.
+static const size_t ENTRY_OVERHEAD = 128;
+// Log the totals every this many lookups.
+static const unsigned long long REPORT_INTERVAL = 1 << 20;
+
+static unsigned long long total_bytes = 0;
+static unsigned long long total_hits = 0;
+static unsigned long long total_misses = 0;
+static unsigned long long total_evictions = 0;
+
+// Every live cache, for the global eviction hand; taken before any shard
+// lock.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<LayerCache *> &
+registry()
+{
+    // Never freed; caches may go away during exit.
+    static std::vector<LayerCache *> *const caches =
+        new std::vector<LayerCache *>();
+    return *caches;
+}
+// The shard the global hand points at; requires the registry lock.
+static size_t hand_cache = 0;
+static unsigned int hand_shard = 0;
+
+static unsigned long long
+budget()
+{
+    static const unsigned long long bytes = [] () {
+        const char *const ev = getenv("CRYPTDB_LAYER_CACHE_BYTES");
+        return ev ? strtoull(ev, NULL, 10) : 64ULL << 20;
+    }();
+
+    return bytes;
+}
+
+static size_t
+entrySize(const std::string &key, const std::string &value)
+{
+    return key.size() + value.size() + ENTRY_OVERHEAD;
+}
+
+LayerCache::Shard::Shard()
+    : hand(0)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+LayerCache::Shard::~Shard()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+LayerCache::LayerCache()
+{
+    scoped_lock l(&registry_lock);
+    registry().push_back(this);
+}
+
+LayerCache::~LayerCache()
+{
+    {
+        scoped_lock l(&registry_lock);
+        std::vector<LayerCache *> &caches = registry();
+        caches.erase(std::find(caches.begin(), caches.end(), this));
+    }
+    __atomic_sub_fetch(&total_bytes, stats().bytes, __ATOMIC_RELAXED);
+}
+
+bool
+LayerValue::fromItem(const Item &i, LayerValue *const out)
+{
+    switch (i.type()) {
+        case Item::Type::INT_ITEM:
+            out->is_int = true;
+            out->unsigned_flag = i.unsigned_flag;
+            out->int_value = static_cast<const Item_int &>(i).value;
+            out->bytes.clear();
+            return true;
+        case Item::Type::STRING_ITEM:
+            out->is_int = false;
+            out->bytes = ItemToString(i);
+            out->charset = i.collation.collation;
+            return true;
+        default:
+            return false;
+    }
+}
+
+Item *
+LayerValue::toItem() const
+{
+    if (is_int) {
+        return unsigned_flag
+            ? new (current_thd->mem_root) Item_int(uintValue())
+            : new (current_thd->mem_root) Item_int(int_value);
+    }
+
+    return new (current_thd->mem_root)
+        Item_string(make_thd_string(bytes), bytes.length(), charset);
+}
+
+void
+LayerCache::makeKey(Direction dir, const LayerValue &in,
+                    std::string *const key)
+{
+    key->clear();
+    key->push_back(Direction::ENCRYPT == dir ? 'e' : 'd');
+
+    if (in.is_int) {
+        key->push_back(in.unsigned_flag ? 'u' : 'i');
+        key->append(reinterpret_cast<const char *>(&in.int_value),
+                    sizeof(in.int_value));
+    } else {
+        const uint charset = in.charset->number;
+        key->push_back('s');
+        key->append(reinterpret_cast<const char *>(&charset),
+                    sizeof(charset));
+        key->append(in.bytes);
+    }
+}
+
+LayerCache::Shard &
+LayerCache::shardFor(const std::string &key)
+{
+    return shards[std::hash<std::string>()(key) % shard_count];
+}
+
+Item *
+LayerCache::lookup(Direction dir, const Item &in)
+{
+    LayerValue v, out;
+    if (false == LayerValue::fromItem(in, &v)
+        || false == lookup(dir, v, &out)) {
+        return NULL;
+    }
+
+    return out.toItem();
+}
+
+bool
+LayerCache::lookup(Direction dir, const LayerValue &in,
+                   LayerValue *const out)
+{
+    if (0 == budget()) {
+        return false;
+    }
+
+    std::string key;
+    makeKey(dir, in, &key);
+    Shard &shard = shardFor(key);
+    bool hit = false;
+    {
+        scoped_lock l(&shard.lock);
+        const auto it = shard.index.find(key);
+        if (shard.index.end() == it) {
+            ++shard.stats.misses;
+        } else {
+            ++shard.stats.hits;
+            Slot &slot = shard.slots[it->second];
+            slot.referenced = true;
+            *out = slot.value;
+            hit = true;
+        }
+    }
+
+    __atomic_add_fetch(hit ? &total_hits : &total_misses, 1,
+                       __ATOMIC_RELAXED);
+    const unsigned long long lookups =
+        __atomic_load_n(&total_hits, __ATOMIC_RELAXED)
+        + __atomic_load_n(&total_misses, __ATOMIC_RELAXED);
+    if (0 == lookups % REPORT_INTERVAL) {
+        const LayerCacheStats t = totals();
+        LOG(edb_perf) << "layer caches: " << t.hits << " hits, "
+                      << t.misses << " misses, " << t.evictions
+                      << " evictions, " << t.bytes << " bytes";
+    }
+
+    return hit;
+}
+
+void
+LayerCache::store(Direction dir, const Item &in, const Item &out)
+{
+    LayerValue v_in, v_out;
+    // DECIMAL results and the like are rebuilt every time.
+    if (LayerValue::fromItem(in, &v_in)
+        && LayerValue::fromItem(out, &v_out)) {
+        store(dir, v_in, v_out);
+    }
+}
+
+void
+LayerCache::store(Direction dir, const LayerValue &in,
+                  const LayerValue &out)
+{
+    if (0 == budget()) {
+        return;
+    }
+
+    std::string key;
+    makeKey(dir, in, &key);
+
+    const size_t size = entrySize(key, out.bytes);
+    // One huge literal shouldn't flush everything else.
+    if (size > budget() / 64) {
+        return;
+    }
+
+    // Concurrent stores may overshoot the budget by an entry each.
+    if (false == makeRoom(size)) {
+        return;
+    }
+
+    Shard &shard = shardFor(key);
+    scoped_lock l(&shard.lock);
+    if (shard.index.end() != shard.index.find(key)) {
+        return;
+    }
+
+    size_t i;
+    if (shard.free_slots.empty()) {
+        i = shard.slots.size();
+        shard.slots.push_back(Slot());
+    } else {
+        i = shard.free_slots.back();
+        shard.free_slots.pop_back();
+    }
+
+    Slot &slot = shard.slots[i];
+    slot.key = key;
+    slot.value = out;
+    slot.referenced = false;
+    slot.live = true;
+    shard.index[key] = i;
+
+    shard.stats.bytes += size;
+    __atomic_add_fetch(&total_bytes, size, __ATOMIC_RELAXED);
+}
+
+bool
+LayerCache::evictOne(Shard *const shard)
+{
+    if (shard->index.empty()) {
+        return false;
+    }
+
+    // Two sweeps at most; the first clears every reference bit.
+    for (;;) {
+        if (shard->hand >= shard->slots.size()) {
+            shard->hand = 0;
+        }
+        Slot &slot = shard->slots[shard->hand++];
+        if (false == slot.live) {
+            continue;
+        }
+        if (slot.referenced) {
+            slot.referenced = false;
+            continue;
+        }
+
+        const size_t size = entrySize(slot.key, slot.value.bytes);
+        shard->index.erase(slot.key);
+        slot.live = false;
+        slot.key.clear();
+        slot.value.bytes.clear();
+        shard->free_slots.push_back(shard->hand - 1);
+
+        ++shard->stats.evictions;
+        shard->stats.bytes -= size;
+        __atomic_sub_fetch(&total_bytes, size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&total_evictions, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+}
+
+bool
+LayerCache::makeRoom(size_t size)
+{
+    if (__atomic_load_n(&total_bytes, __ATOMIC_RELAXED) + size
+        <= budget()) {
+        return true;
+    }
+
+    scoped_lock r(&registry_lock);
+    const std::vector<LayerCache *> &caches = registry();
+    // Shards passed in a row without evicting anything.
+    size_t idle = 0;
+    while (__atomic_load_n(&total_bytes, __ATOMIC_RELAXED) + size
+           > budget()) {
+        if (caches.empty() || idle > caches.size() * shard_count) {
+            return false;
+        }
+        if (hand_cache >= caches.size()) {
+            hand_cache = 0;
+        }
+
+        LayerCache *const cache = caches[hand_cache];
+        Shard &shard = cache->shards[hand_shard];
+        if (shard_count == ++hand_shard) {
+            hand_shard = 0;
+            ++hand_cache;
+        }
+
+        scoped_lock l(&shard.lock);
+        idle = cache->evictOne(&shard) ? 0 : idle + 1;
+    }
+
+    return true;
+}
+
+LayerCacheStats
+LayerCache::stats() const
+{
+    LayerCacheStats out;
+    for (unsigned int i = 0; i < shard_count; ++i) {
+        Shard &shard = const_cast<Shard &>(shards[i]);
+        scoped_lock l(&shard.lock);
+        out.hits += shard.stats.hits;
+        out.misses += shard.stats.misses;
+        out.evictions += shard.stats.evictions;
+        out.bytes += shard.stats.bytes;
+    }
+
+    return out;
+}
+
+LayerCacheStats
+LayerCache::totals()
+{
+    LayerCacheStats out;
+    out.hits = __atomic_load_n(&total_hits, __ATOMIC_RELAXED);
+    out.misses = __atomic_load_n(&total_misses, __ATOMIC_RELAXED);
+    out.evictions = __atomic_load_n(&total_evictions, __ATOMIC_RELAXED);
+    out.bytes = __atomic_load_n(&total_bytes, __ATOMIC_RELAXED);
+
+    return out;
+}
+
+bool
+LayerCache::enabled()
+{
+    return 0 != budget();
+}
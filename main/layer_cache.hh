@@ -0,0 +1,130 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <pthread.h>
+
+#include <sql_class.h>
+#include <item.h>
+
+struct LayerCacheStats {
+    LayerCacheStats() : hits(0), misses(0), evictions(0), bytes(0) {}
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long bytes;
+};
+
+/*
+ * A value as one layer of an onion hands it to the next, without an
+ * Item around it: an integer, as Item_int holds it, or bytes and their
+ * charset, as Item_string does. See OnionPipeline.
+ */
+struct LayerValue {
+    LayerValue() : is_int(true), unsigned_flag(true), int_value(0),
+                   charset(&my_charset_bin) {}
+
+    ulonglong uintValue() const {return static_cast<ulonglong>(int_value);}
+    void setUnsigned(ulonglong v)
+    {
+        is_int = true;
+        unsigned_flag = true;
+        int_value = static_cast<longlong>(v);
+        bytes.clear();
+    }
+    void setSigned(longlong v)
+    {
+        is_int = true;
+        unsigned_flag = false;
+        int_value = v;
+        bytes.clear();
+    }
+    // Layers produce binary strings.
+    void setBytes(std::string &&b)
+    {
+        is_int = false;
+        bytes = std::move(b);
+        charset = &my_charset_bin;
+    }
+
+    // Of an INT_ITEM or a STRING_ITEM; false for any other item.
+    static bool fromItem(const Item &i, LayerValue *const out);
+    // Allocated on the THD.
+    Item *toItem() const;
+
+    bool is_int;
+    bool unsigned_flag;
+    longlong int_value;
+    std::string bytes;
+    CHARSET_INFO *charset;
+};
+
+/*
+ * Plaintext -> ciphertext and ciphertext -> plaintext results of one
+ * deterministic layer (DET, DETJOIN, OPE); see EncLayer::getCache().
+ * Layers whose output depends on the IV or on randomness (RND, HOM)
+ * must not have one.
+ *
+ * Only integer and string items are cached. The cache is split into
+ * shards, each with its own lock and CLOCK hand. Every cache of the
+ * process shares one memory budget, CRYPTDB_LAYER_CACHE_BYTES (64MB by
+ * default, 0 turns caching off); once it is spent a second hand goes
+ * round the shards of every cache and evicts from each in turn, so the
+ * layers with hot literals end up with most of it.
+ */
+class LayerCache {
+public:
+    enum class Direction {ENCRYPT, DECRYPT};
+
+    LayerCache();
+    ~LayerCache();
+
+    // Result of an earlier store() for the same input, allocated on the
+    // THD; NULL otherwise.
+    Item *lookup(Direction dir, const Item &in);
+    void store(Direction dir, const Item &in, const Item &out);
+    // The same entries, for callers that work on LayerValues; an Item
+    // and the LayerValue of it share an entry.
+    bool lookup(Direction dir, const LayerValue &in, LayerValue *const out);
+    void store(Direction dir, const LayerValue &in, const LayerValue &out);
+
+    LayerCacheStats stats() const;
+    // Summed over every cache of the process.
+    static LayerCacheStats totals();
+    // False if CRYPTDB_LAYER_CACHE_BYTES turned caching off.
+    static bool enabled();
+
+private:
+    struct Slot {
+        std::string key;
+        LayerValue value;
+        bool referenced;
+        bool live;
+    };
+
+    struct Shard {
+        Shard();
+        ~Shard();
+
+        pthread_mutex_t lock;
+        std::unordered_map<std::string, size_t> index;
+        std::vector<Slot> slots;
+        std::vector<size_t> free_slots;
+        size_t hand;
+        LayerCacheStats stats;
+    };
+
+    static const unsigned int shard_count = 16;
+    Shard shards[shard_count];
+
+    static void makeKey(Direction dir, const LayerValue &in,
+                        std::string *const key);
+    Shard &shardFor(const std::string &key);
+    // Requires the shard's lock.
+    bool evictOne(Shard *const shard);
+    // Evicts from any cache until @size more bytes fit in the budget;
+    // false if nothing is left to evict. Takes the shard locks itself.
+    static bool makeRoom(size_t size);
+};
@@ -30,7 +30,7 @@
 }
 
 inline void
-testBadItemArgumentCount(const std::string &file_name,
+testBadItemArgumentCount(const char *file_name,
                          unsigned int line_number, int type, int expected,
                          int actual)
 {
@@ -47,7 +47,7 @@ testBadItemArgumentCount(const std::string &file_name,
 }
 
 inline void
-testUnexpectedSecurityLevel(const std::string &file_name,
+testUnexpectedSecurityLevel(const char *file_name,
                             unsigned int line_number, onion o,
                             SECLEVEL expected, SECLEVEL actual)
 {
@@ -65,7 +65,7 @@ testUnexpectedSecurityLevel(const std::string &file_name,
 
 // FIXME: Nicer to take reason instead of 'why'.
 inline void
-testNoAvailableEncSet(const std::string &file_name,
+testNoAvailableEncSet(const char *file_name,
                       unsigned int line_number, const EncSet &enc_set,
                       unsigned int type, const EncSet &req_enc_set,
                       const std::string &why,
@@ -86,7 +86,7 @@ testNoAvailableEncSet(const std::string &file_name,
 }
 
 inline void
-testTextMessageError(const std::string &file_name,
+testTextMessageError(const char *file_name,
                      unsigned int line_number, bool test,
                      const std::string &message)
 {
@@ -95,9 +95,13 @@ testTextMessageError(const std::string &file_name,
     }
 }
 
+// The message is only built once the test has failed; these run on
+// every lookup of every query.
 #define TEST_TextMessageError(test, message)                        \
 {                                                                   \
-    testTextMessageError(__FILE__, __LINE__, (test), (message));    \
+    if (false == static_cast<bool>(test)) {                         \
+        testTextMessageError(__FILE__, __LINE__, false, (message)); \
+    }                                                               \
 }                                                                   \
 
 #define FAIL_TextMessageError(message)                              \
@@ -112,7 +116,7 @@ testTextMessageError(const std::string &file_name,
 }
 
 inline void
-testIdentifierNotFound(const std::string &file_name,
+testIdentifierNotFound(const char *file_name,
                        unsigned int line_number, bool test,
                        const std::string &identifier_name)
 {
@@ -124,31 +128,35 @@ testIdentifierNotFound(const std::string &file_name,
 
 #define TEST_IdentifierNotFound(test, identifier_name)              \
 {                                                                   \
-    testIdentifierNotFound(__FILE__, __LINE__, (test),              \
-                          (identifier_name));                       \
+    if (false == static_cast<bool>(test)) {                         \
+        testIdentifierNotFound(__FILE__, __LINE__, false,           \
+                               (identifier_name));                  \
+    }                                                               \
 }
 
 inline void
-testDatabaseNotFound(const std::string &file_name,
+testDatabaseNotFound(const char *file_name,
                        unsigned int line_number, bool test,
                        const std::string &identifier_name)
 {
-    const std::string msg =
-        identifier_name.size() == 0 ? "must select a database"
-                                    : "database '" + identifier_name +
-                                      "' not found";
     if (false == test) {
+        const std::string msg =
+            identifier_name.size() == 0 ? "must select a database"
+                                        : "database '" + identifier_name +
+                                          "' not found";
         throw TextMessageError(file_name, line_number,
                                msg);
     }
 }
 #define TEST_DatabaseNotFound(test, identifier_name)                \
 {                                                                   \
-    testDatabaseNotFound(__FILE__, __LINE__, (test),                \
-                          (identifier_name));                       \
+    if (false == static_cast<bool>(test)) {                         \
+        testDatabaseNotFound(__FILE__, __LINE__, false,             \
+                             (identifier_name));                    \
+    }                                                               \
 }
 inline void
-testSync(const std::string &file_name, unsigned int line_number,
+testSync(const char *file_name, unsigned int line_number,
          bool test, const std::string &identifier_name)
 {
     if (false == test) {
@@ -160,7 +168,9 @@ testSync(const std::string &file_name, unsigned int line_number,
 
 #define TEST_Sync(test, identifier_name)                            \
 {                                                                   \
-    testSync(__FILE__, __LINE__, (test), (identifier_name));        \
+    if (false == static_cast<bool>(test)) {                         \
+        testSync(__FILE__, __LINE__, false, (identifier_name));     \
+    }                                                               \
 }
 
 #define FAIL_Sync(identifier_name)                                  \
@@ -0,0 +1,1011 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <memory>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <main/metadata_store.hh>
+#include <main/metadata_tables.hh>
+#include <main/rewrite_util.hh>
+#include <main/macro_util.hh>
+#include <util/cryptdb_log.hh>
+#include <util/scoped_lock.hh>
+
+// ----------------------------------------
+//              SQLMetaStore
+// ----------------------------------------
+
+std::string
+SQLMetaStore::tableName(Table table)
+{
+    switch (table) {
+        case Table::REGULAR: {
+            return MetaData::Table::metaObject();
+        }
+        case Table::BLEEDING: {
+            return MetaData::Table::bleedingMetaObject();
+        }
+        default: {
+            FAIL_TextMessageError("Unrecognized table type!");
+        }
+    }
+}
+
+// Stores created before lazy indexes held serial objects in a
+// VARBINARY(500), which a table with a few indexes outgrows.
+static bool
+widenSerialObject(const std::unique_ptr<Connect> &e_conn,
+                  const std::string &table_name)
+{
+    std::unique_ptr<DBResult> dbres;
+    RETURN_FALSE_IF_FALSE(e_conn->execute(
+        " SHOW COLUMNS FROM " + table_name + " LIKE 'serial_object';",
+        &dbres));
+    RETURN_FALSE_IF_FALSE(mysql_num_rows(dbres->n) == 1);
+
+    const MYSQL_ROW row = mysql_fetch_row(dbres->n);
+    const unsigned long *const l = mysql_fetch_lengths(dbres->n);
+    if ("blob" == toLowerCase(std::string(row[1], l[1]))) {
+        return true;
+    }
+
+    LOG(warn) << "widening serial_object of " << table_name;
+    return e_conn->execute(
+        " ALTER TABLE " + table_name +
+        "   MODIFY serial_object BLOB NOT NULL;");
+}
+
+bool
+SQLMetaStore::createTables(const std::unique_ptr<Connect> &e_conn)
+{
+    const std::string create_db =
+        " CREATE DATABASE IF NOT EXISTS " +
+        MetaData::DB::embeddedDB() + ";";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(create_db));
+
+    const std::string create_meta_table =
+        " CREATE TABLE IF NOT EXISTS " + MetaData::Table::metaObject() +
+        "   (serial_object BLOB NOT NULL,"
+        "    serial_key VARBINARY(500) NOT NULL,"
+        "    parent_id BIGINT NOT NULL,"
+        "    id SERIAL PRIMARY KEY)"
+        " ENGINE=InnoDB;";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(create_meta_table));
+
+    const std::string create_bleeding_table =
+        " CREATE TABLE IF NOT EXISTS " +
+                    MetaData::Table::bleedingMetaObject() +
+        "   (serial_object BLOB NOT NULL,"
+        "    serial_key VARBINARY(500) NOT NULL,"
+        "    parent_id BIGINT NOT NULL,"
+        "    id SERIAL PRIMARY KEY)"
+        " ENGINE=InnoDB;";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(create_bleeding_table));
+
+    RETURN_FALSE_IF_FALSE(widenSerialObject(e_conn,
+                                            MetaData::Table::metaObject()));
+    RETURN_FALSE_IF_FALSE(
+        widenSerialObject(e_conn, MetaData::Table::bleedingMetaObject()));
+
+    const std::string create_embedded_completion =
+        " CREATE TABLE IF NOT EXISTS " +
+                    MetaData::Table::embeddedQueryCompletion() +
+        "   (begin BOOLEAN NOT NULL,"
+        "    complete BOOLEAN NOT NULL,"
+        "    original_query VARCHAR(500) NOT NULL,"
+        "    default_db VARCHAR(500),"      // default database is NULLable
+        "    aborted BOOLEAN NOT NULL,"
+        "    type VARCHAR(100) NOT NULL,"
+        "    id SERIAL PRIMARY KEY)"
+        " ENGINE=InnoDB;";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(create_embedded_completion));
+
+    const std::string create_staleness =
+        " CREATE TABLE IF NOT EXISTS " + MetaData::Table::staleness() +
+        "   (cache_id BIGINT UNIQUE NOT NULL,"
+        "    stale BOOLEAN NOT NULL,"
+        "    id SERIAL PRIMARY KEY)"
+        " ENGINE=InnoDB;";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(create_staleness));
+
+    return true;
+}
+
+bool
+SQLMetaStore::begin(const std::unique_ptr<Connect> &e_conn)
+{
+    return e_conn->execute("START TRANSACTION;");
+}
+
+bool
+SQLMetaStore::commit(const std::unique_ptr<Connect> &e_conn)
+{
+    return e_conn->execute("COMMIT;");
+}
+
+bool
+SQLMetaStore::rollback(const std::unique_ptr<Connect> &e_conn)
+{
+    return e_conn->execute("ROLLBACK;");
+}
+
+bool
+SQLMetaStore::insertObject(const std::unique_ptr<Connect> &e_conn,
+                           Table table, const std::string &serial_object,
+                           const std::string &serial_key,
+                           unsigned long parent_id,
+                           unsigned long *const id)
+{
+    const std::string table_name = tableName(table);
+    // On CREATE, the database generates a unique ID for us.
+    const std::string query =
+        " INSERT INTO " + table_name +
+        "    (serial_object, serial_key, parent_id) VALUES ("
+        " '" + escapeString(e_conn, serial_object) + "',"
+        " '" + escapeString(e_conn, serial_key) + "',"
+        " " + std::to_string(parent_id) + ");";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(query));
+
+    *id = e_conn->last_insert_id();
+    return true;
+}
+
+bool
+SQLMetaStore::replaceObject(const std::unique_ptr<Connect> &e_conn,
+                            Table table, unsigned long id,
+                            const std::string &serial_object,
+                            const std::string &serial_key)
+{
+    const std::string table_name = tableName(table);
+    const std::string query =
+        " UPDATE " + table_name +
+        "    SET serial_object = '" +
+                    escapeString(e_conn, serial_object) + "', "
+        "        serial_key = '" + escapeString(e_conn, serial_key) + "'"
+        "  WHERE id = " + std::to_string(id) + ";";
+
+    return e_conn->execute(query);
+}
+
+bool
+SQLMetaStore::deleteObject(const std::unique_ptr<Connect> &e_conn,
+                           Table table, unsigned long id,
+                           unsigned long parent_id)
+{
+    const std::string table_name = tableName(table);
+    const std::string query =
+        " DELETE " + table_name + " "
+        "   FROM " + table_name +
+        "  WHERE " + table_name + ".id" +
+        "      = "     + std::to_string(id) +
+        "    AND " + table_name + ".parent_id" +
+        "      = "     + std::to_string(parent_id) + ";";
+
+    return e_conn->execute(query);
+}
+
+bool
+SQLMetaStore::copyTable(const std::unique_ptr<Connect> &e_conn,
+                        Table src, Table dest)
+{
+    const std::string src_name = tableName(src);
+    const std::string dest_name = tableName(dest);
+
+    const std::string delete_query =
+        " DELETE FROM " + dest_name + ";";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(delete_query));
+
+    const std::string insert_query =
+        " INSERT " + dest_name +
+        "   SELECT * FROM " + src_name + ";";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(insert_query));
+
+    return true;
+}
+
+bool
+SQLMetaStore::fetchAllChildren(const std::unique_ptr<Connect> &e_conn,
+                               ChildMap *const out)
+{
+    const std::string table_name = MetaData::Table::metaObject();
+
+    std::unique_ptr<DBResult> db_res;
+    const std::string serials_query =
+        " SELECT " + table_name + ".serial_object,"
+        "        " + table_name + ".serial_key,"
+        "        " + table_name + ".id,"
+        "        " + table_name + ".parent_id"
+        " FROM " + table_name +
+        " ORDER BY " + table_name + ".id;";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(serials_query, &db_res));
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(db_res->n))) {
+        unsigned long * const l = mysql_fetch_lengths(db_res->n);
+        assert(l != NULL);
+
+        const std::string child_serial_object(row[0], l[0]);
+        const std::string child_key(row[1], l[1]);
+        const std::string child_id(row[2], l[2]);
+        const std::string parent_id(row[3], l[3]);
+
+        (*out)[strtoul(parent_id.c_str(), NULL, 10)].push_back(
+            Child(child_key, child_serial_object,
+                  strtoul(child_id.c_str(), NULL, 10)));
+    }
+
+    return true;
+}
+
+bool
+SQLMetaStore::beginCompletion(const std::unique_ptr<Connect> &e_conn,
+                              const std::string &original_query,
+                              const std::string &default_db,
+                              const std::string &type,
+                              unsigned long *const id)
+{
+    const std::string esc_default_db =
+        default_db.size() == 0
+            ? "NULL"
+            : "'" + escapeString(e_conn, default_db) + "'";
+    const std::string query =
+        " INSERT INTO " + MetaData::Table::embeddedQueryCompletion() +
+        "   (begin, complete, original_query, default_db, aborted, type)"
+        "   VALUES (TRUE,  FALSE,"
+        "    '" + escapeString(e_conn, original_query) + "',"
+        "    " + esc_default_db + ",  FALSE,"
+        "    '" + escapeString(e_conn, type) + "');";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(query));
+
+    *id = e_conn->last_insert_id();
+    return true;
+}
+
+bool
+SQLMetaStore::finishCompletion(const std::unique_ptr<Connect> &e_conn,
+                               unsigned long id)
+{
+    const std::string query =
+        " UPDATE " + MetaData::Table::embeddedQueryCompletion() +
+        "    SET complete = TRUE"
+        "  WHERE id = " + std::to_string(id) + ";";
+
+    return e_conn->execute(query);
+}
+
+bool
+SQLMetaStore::abortCompletion(const std::unique_ptr<Connect> &e_conn,
+                              unsigned long id)
+{
+    const std::string query =
+        " UPDATE " + MetaData::Table::embeddedQueryCompletion() +
+        "    SET aborted = TRUE"
+        "  WHERE id = " + std::to_string(id) + ";";
+
+    return e_conn->execute(query);
+}
+
+static MetaStore::Completion
+completionFromRow(const MYSQL_ROW row, const unsigned long *const l)
+{
+    MetaStore::Completion c;
+    c.id = strtoul(std::string(row[0], l[0]).c_str(), NULL, 10);
+    c.begin = string_to_bool(std::string(row[1], l[1]));
+    c.complete = string_to_bool(std::string(row[2], l[2]));
+    c.original_query = std::string(row[3], l[3]);
+    // default database is NULLable
+    c.default_db = row[4] ? std::string(row[4], l[4]) : "";
+    c.aborted = string_to_bool(std::string(row[5], l[5]));
+    c.type = std::string(row[6], l[6]);
+
+    return c;
+}
+
+bool
+SQLMetaStore::getCompletion(const std::unique_ptr<Connect> &e_conn,
+                            unsigned long id, Completion *const out)
+{
+    std::unique_ptr<DBResult> dbres;
+    const std::string query =
+        " SELECT id, begin, complete, original_query, default_db,"
+        "        aborted, type"
+        "   FROM " + MetaData::Table::embeddedQueryCompletion() +
+        "  WHERE id = " + std::to_string(id) + ";";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(query, &dbres));
+    RETURN_FALSE_IF_FALSE(mysql_num_rows(dbres->n) == 1);
+
+    const MYSQL_ROW row = mysql_fetch_row(dbres->n);
+    const unsigned long *const l = mysql_fetch_lengths(dbres->n);
+    *out = completionFromRow(row, l);
+
+    return true;
+}
+
+bool
+SQLMetaStore::unfinishedCompletions(const std::unique_ptr<Connect> &e_conn,
+                                    std::vector<Completion> *const out)
+{
+    std::unique_ptr<DBResult> dbres;
+    const std::string query =
+        " SELECT id, begin, complete, original_query, default_db,"
+        "        aborted, type"
+        "   FROM " + MetaData::Table::embeddedQueryCompletion() +
+        "  WHERE (begin = FALSE OR complete = FALSE)"
+        "    AND aborted != TRUE;";
+    RETURN_FALSE_IF_FALSE(e_conn->execute(query, &dbres));
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(dbres->n))) {
+        const unsigned long *const l = mysql_fetch_lengths(dbres->n);
+        out->push_back(completionFromRow(row, l));
+    }
+
+    return true;
+}
+
+bool
+SQLMetaStore::seedStaleness(const std::unique_ptr<Connect> &e_conn,
+                            unsigned int cache_id)
+{
+    const std::string query =
+        " INSERT INTO " + MetaData::Table::staleness() +
+        "   (cache_id, stale) VALUES " +
+        "   (" + std::to_string(cache_id) + ", TRUE);";
+
+    return e_conn->execute(query);
+}
+
+bool
+SQLMetaStore::removeStaleness(const std::unique_ptr<Connect> &e_conn,
+                              unsigned int cache_id)
+{
+    const std::string query =
+        " DELETE FROM " + MetaData::Table::staleness() +
+        "       WHERE cache_id = " + std::to_string(cache_id) + ";";
+
+    return e_conn->execute(query);
+}
+
+bool
+SQLMetaStore::getStaleness(const std::unique_ptr<Connect> &e_conn,
+                           unsigned int cache_id, bool *const stale)
+{
+    const std::string query =
+        " SELECT stale FROM " + MetaData::Table::staleness() +
+        "  WHERE cache_id = " + std::to_string(cache_id) + ";";
+    std::unique_ptr<DBResult> db_res;
+    RETURN_FALSE_IF_FALSE(e_conn->execute(query, &db_res));
+    RETURN_FALSE_IF_FALSE(1 == mysql_num_rows(db_res->n));
+
+    const MYSQL_ROW row = mysql_fetch_row(db_res->n);
+    const unsigned long *const l = mysql_fetch_lengths(db_res->n);
+    assert(l != NULL);
+
+    *stale = string_to_bool(std::string(row[0], l[0]));
+    return true;
+}
+
+bool
+SQLMetaStore::setStaleness(const std::unique_ptr<Connect> &e_conn,
+                           unsigned int cache_id, bool stale)
+{
+    const std::string query =
+        " UPDATE " + MetaData::Table::staleness() +
+        "    SET stale = " + bool_to_string(stale) +
+        "  WHERE cache_id = " + std::to_string(cache_id) + ";";
+
+    return e_conn->execute(query);
+}
+
+bool
+SQLMetaStore::setAllStale(const std::unique_ptr<Connect> &e_conn)
+{
+    const std::string query =
+        " UPDATE " + MetaData::Table::staleness() +
+        "    SET stale = TRUE;";
+
+    return e_conn->execute(query);
+}
+
+// ----------------------------------------
+//              LogMetaStore
+// ----------------------------------------
+
+// Rewrite the log once it has grown this much past the last snapshot.
+static const unsigned long long SNAPSHOT_BYTES = 4 << 20;
+
+// Frame: payload length, FNV-1a of the payload, payload.
+static const size_t FRAME_HEADER_BYTES = 2 * sizeof(uint32_t);
+
+static uint32_t
+fnv1a(const char *const p, size_t length)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= static_cast<unsigned char>(p[i]);
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static std::string
+encodeRecord(const std::vector<std::string> &fields)
+{
+    std::string out;
+    for (auto it : fields) {
+        out += serialize_string(it);
+    }
+
+    return serialize_string(out);
+}
+
+static std::string
+tableText(MetaStore::Table table)
+{
+    return MetaStore::Table::REGULAR == table ? "R" : "B";
+}
+
+static MetaStore::Table
+textTable(const std::string &s)
+{
+    return "R" == s ? MetaStore::Table::REGULAR
+                    : MetaStore::Table::BLEEDING;
+}
+
+static unsigned long
+toULong(const std::string &s)
+{
+    return strtoul(s.c_str(), NULL, 10);
+}
+
+static bool
+writeAll(int fd, const std::string &data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        const ssize_t n =
+            ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return false;
+        }
+        done += n;
+    }
+
+    return true;
+}
+
+static std::string
+frame(const std::string &payload)
+{
+    const uint32_t length = payload.size();
+    const uint32_t sum = fnv1a(payload.data(), payload.size());
+
+    std::string out(FRAME_HEADER_BYTES, '\0');
+    memcpy(&out[0], &length, sizeof(length));
+    memcpy(&out[sizeof(length)], &sum, sizeof(sum));
+
+    return out + payload;
+}
+
+LogMetaStore::LogMetaStore(const std::string &path)
+    : path(path), fd(-1), log_bytes(0), snapshot_bytes(0),
+      next_completion_id(1)
+{
+    pthread_mutex_init(&lock, NULL);
+
+    TEST_TextMessageError(replay(),
+                          "failed to replay metadata log: " + path);
+}
+
+LogMetaStore::~LogMetaStore()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+LogMetaStore::Image &
+LogMetaStore::image(Table table)
+{
+    return Table::REGULAR == table ? regular : bleeding;
+}
+
+bool
+LogMetaStore::appendFrame(const std::string &payload)
+{
+    const std::string data = frame(payload);
+    if (false == writeAll(fd, data) || 0 != fdatasync(fd)) {
+        // Don't leave a partial frame in front of the next one.
+        RETURN_FALSE_IF_FALSE(0 == ftruncate(fd, log_bytes));
+        return false;
+    }
+    log_bytes += data.size();
+
+    return true;
+}
+
+// Caller holds the lock.
+bool
+LogMetaStore::write(const std::unique_ptr<Connect> &e_conn,
+                    const std::vector<std::string> &record)
+{
+    const auto it = pending.find(e_conn.get());
+    if (pending.end() != it) {
+        it->second.push_back(encodeRecord(record));
+        return true;
+    }
+
+    RETURN_FALSE_IF_FALSE(appendFrame(encodeRecord(record)));
+    applyRecord(record);
+
+    return true;
+}
+
+// Caller holds the lock; the whole transaction is one frame.
+bool
+LogMetaStore::flushPending(std::vector<std::string> *const records)
+{
+    if (0 == records->size()) {
+        return true;
+    }
+
+    std::string payload;
+    for (auto it : *records) {
+        payload += it;
+    }
+    RETURN_FALSE_IF_FALSE(appendFrame(payload));
+    for (auto it : *records) {
+        applyRecord(unserialize_string(unserialize_one_string(it)));
+    }
+    records->clear();
+
+    return true;
+}
+
+// Caller holds the lock.
+void
+LogMetaStore::applyRecord(const std::vector<std::string> &record)
+{
+    assert(record.size() > 0);
+    const std::string &op = record[0];
+
+    if ("I" == op) {
+        assert(6 == record.size());
+        Image &img = image(textTable(record[1]));
+        const unsigned long id = toULong(record[2]);
+        const unsigned long parent_id = toULong(record[3]);
+
+        img.objects[id] = Object{record[5], record[4], parent_id};
+        img.children[parent_id].insert(id);
+        img.next_id = std::max(img.next_id, id + 1);
+    } else if ("U" == op) {
+        assert(5 == record.size());
+        Image &img = image(textTable(record[1]));
+        const auto it = img.objects.find(toULong(record[2]));
+        if (img.objects.end() != it) {
+            it->second.serial_key = record[3];
+            it->second.serial_object = record[4];
+        }
+    } else if ("D" == op) {
+        assert(4 == record.size());
+        Image &img = image(textTable(record[1]));
+        const unsigned long id = toULong(record[2]);
+        const unsigned long parent_id = toULong(record[3]);
+        const auto it = img.objects.find(id);
+        if (img.objects.end() != it && parent_id == it->second.parent_id) {
+            img.objects.erase(it);
+            img.children[parent_id].erase(id);
+            if (img.children[parent_id].empty()) {
+                img.children.erase(parent_id);
+            }
+        }
+    } else if ("C" == op) {
+        assert(3 == record.size());
+        image(textTable(record[2])) = image(textTable(record[1]));
+    } else if ("N" == op) {
+        assert(3 == record.size());
+        const unsigned long next = toULong(record[2]);
+        if ("Q" == record[1]) {
+            next_completion_id = next;
+        } else {
+            image(textTable(record[1])).next_id = next;
+        }
+    } else if ("B" == op) {
+        assert(5 == record.size());
+        Completion c;
+        c.id = toULong(record[1]);
+        c.begin = true;
+        c.original_query = record[2];
+        c.default_db = record[3];
+        c.type = record[4];
+
+        completions[c.id] = c;
+        next_completion_id = std::max(next_completion_id, c.id + 1);
+    } else if ("F" == op || "A" == op) {
+        assert(2 == record.size());
+        const auto it = completions.find(toULong(record[1]));
+        if (completions.end() != it) {
+            if ("F" == op) {
+                it->second.complete = true;
+            } else {
+                it->second.aborted = true;
+            }
+        }
+    } else {
+        FAIL_TextMessageError("unknown metadata log record: " + op);
+    }
+}
+
+bool
+LogMetaStore::replay()
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+    RETURN_FALSE_IF_FALSE(fd >= 0);
+
+    struct stat st;
+    RETURN_FALSE_IF_FALSE(0 == fstat(fd, &st));
+    const size_t size = st.st_size;
+
+    size_t offset = 0;
+    if (size > 0) {
+        void *const map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        RETURN_FALSE_IF_FALSE(MAP_FAILED != map);
+        const char *const base = static_cast<const char *>(map);
+
+        while (offset + FRAME_HEADER_BYTES <= size) {
+            uint32_t length, sum;
+            memcpy(&length, base + offset, sizeof(length));
+            memcpy(&sum, base + offset + sizeof(length), sizeof(sum));
+            const char *const payload = base + offset + FRAME_HEADER_BYTES;
+            if (offset + FRAME_HEADER_BYTES + length > size
+                || fnv1a(payload, length) != sum) {
+                break;
+            }
+
+            const std::string p(payload, length);
+            for (auto it : unserialize_string(p)) {
+                applyRecord(unserialize_string(it));
+            }
+            offset += FRAME_HEADER_BYTES + length;
+        }
+
+        munmap(map, size);
+    }
+
+    // A crash in the middle of a commit leaves a torn frame; that
+    // transaction never committed.
+    if (offset != size) {
+        LOG(warn) << "discarding " << size - offset
+                  << " bytes of torn metadata log";
+        RETURN_FALSE_IF_FALSE(0 == ftruncate(fd, offset));
+    }
+    log_bytes = offset;
+    snapshot_bytes = offset;
+
+    return true;
+}
+
+// Caller holds the lock. Open transactions only hold their records, so
+// they commit on top of the snapshot.
+bool
+LogMetaStore::snapshot()
+{
+    std::string payload;
+    payload += encodeRecord({"N", "R", std::to_string(regular.next_id)});
+    payload += encodeRecord({"N", "B", std::to_string(bleeding.next_id)});
+    payload +=
+        encodeRecord({"N", "Q", std::to_string(next_completion_id)});
+    for (auto table : {Table::REGULAR, Table::BLEEDING}) {
+        for (const auto &it : image(table).objects) {
+            payload +=
+                encodeRecord({"I", tableText(table),
+                              std::to_string(it.first),
+                              std::to_string(it.second.parent_id),
+                              it.second.serial_key,
+                              it.second.serial_object});
+        }
+    }
+    // Recovery only ever looks at the unfinished completions.
+    for (const auto &it : completions) {
+        const Completion &c = it.second;
+        if (c.complete || c.aborted) {
+            continue;
+        }
+        payload += encodeRecord({"B", std::to_string(c.id),
+                                 c.original_query, c.default_db, c.type});
+    }
+
+    const std::string tmp_path = path + ".snapshot";
+    const int tmp_fd =
+        open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    RETURN_FALSE_IF_FALSE(tmp_fd >= 0);
+    const std::string data = frame(payload);
+    const bool written = writeAll(tmp_fd, data) && 0 == fsync(tmp_fd);
+    close(tmp_fd);
+    RETURN_FALSE_IF_FALSE(written);
+    RETURN_FALSE_IF_FALSE(0 == rename(tmp_path.c_str(), path.c_str()));
+
+    // Make the rename durable.
+    const std::string::size_type slash = path.find_last_of('/');
+    const std::string dir =
+        std::string::npos == slash ? "." : path.substr(0, slash + 1);
+    const int dir_fd = open(dir.c_str(), O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    close(fd);
+    fd = open(path.c_str(), O_RDWR | O_APPEND);
+    RETURN_FALSE_IF_FALSE(fd >= 0);
+    log_bytes = data.size();
+    snapshot_bytes = data.size();
+
+    return true;
+}
+
+bool
+LogMetaStore::begin(const std::unique_ptr<Connect> &e_conn)
+{
+    scoped_lock l(&lock);
+
+    // Like START TRANSACTION, implicitly commit an open transaction.
+    const auto it = pending.find(e_conn.get());
+    if (pending.end() != it) {
+        RETURN_FALSE_IF_FALSE(flushPending(&it->second));
+    } else {
+        pending[e_conn.get()];
+    }
+
+    return true;
+}
+
+bool
+LogMetaStore::commit(const std::unique_ptr<Connect> &e_conn)
+{
+    scoped_lock l(&lock);
+
+    const auto it = pending.find(e_conn.get());
+    RETURN_FALSE_IF_FALSE(pending.end() != it);
+    RETURN_FALSE_IF_FALSE(flushPending(&it->second));
+    pending.erase(it);
+
+    if (log_bytes > SNAPSHOT_BYTES && log_bytes > 2 * snapshot_bytes) {
+        // The log is still complete if this fails.
+        if (false == snapshot()) {
+            LOG(warn) << "failed to snapshot metadata log " << path;
+        }
+    }
+
+    return true;
+}
+
+bool
+LogMetaStore::rollback(const std::unique_ptr<Connect> &e_conn)
+{
+    scoped_lock l(&lock);
+
+    pending.erase(e_conn.get());
+    return true;
+}
+
+bool
+LogMetaStore::insertObject(const std::unique_ptr<Connect> &e_conn,
+                           Table table, const std::string &serial_object,
+                           const std::string &serial_key,
+                           unsigned long parent_id,
+                           unsigned long *const id)
+{
+    scoped_lock l(&lock);
+
+    *id = image(table).next_id++;
+    return write(e_conn, {"I", tableText(table), std::to_string(*id),
+                          std::to_string(parent_id), serial_key,
+                          serial_object});
+}
+
+bool
+LogMetaStore::replaceObject(const std::unique_ptr<Connect> &e_conn,
+                            Table table, unsigned long id,
+                            const std::string &serial_object,
+                            const std::string &serial_key)
+{
+    scoped_lock l(&lock);
+
+    return write(e_conn, {"U", tableText(table), std::to_string(id),
+                          serial_key, serial_object});
+}
+
+bool
+LogMetaStore::deleteObject(const std::unique_ptr<Connect> &e_conn,
+                           Table table, unsigned long id,
+                           unsigned long parent_id)
+{
+    scoped_lock l(&lock);
+
+    return write(e_conn, {"D", tableText(table), std::to_string(id),
+                          std::to_string(parent_id)});
+}
+
+bool
+LogMetaStore::copyTable(const std::unique_ptr<Connect> &e_conn, Table src,
+                        Table dest)
+{
+    scoped_lock l(&lock);
+
+    return write(e_conn, {"C", tableText(src), tableText(dest)});
+}
+
+bool
+LogMetaStore::fetchAllChildren(const std::unique_ptr<Connect> &,
+                               ChildMap *const out)
+{
+    scoped_lock l(&lock);
+
+    for (const auto &it : regular.children) {
+        std::vector<Child> &children = (*out)[it.first];
+        for (auto id : it.second) {
+            const Object &object = regular.objects.at(id);
+            children.push_back(Child(object.serial_key,
+                                     object.serial_object, id));
+        }
+    }
+
+    return true;
+}
+
+bool
+LogMetaStore::beginCompletion(const std::unique_ptr<Connect> &e_conn,
+                              const std::string &original_query,
+                              const std::string &default_db,
+                              const std::string &type,
+                              unsigned long *const id)
+{
+    scoped_lock l(&lock);
+
+    *id = next_completion_id++;
+    return write(e_conn, {"B", std::to_string(*id), original_query,
+                          default_db, type});
+}
+
+bool
+LogMetaStore::finishCompletion(const std::unique_ptr<Connect> &e_conn,
+                               unsigned long id)
+{
+    scoped_lock l(&lock);
+
+    return write(e_conn, {"F", std::to_string(id)});
+}
+
+bool
+LogMetaStore::abortCompletion(const std::unique_ptr<Connect> &e_conn,
+                              unsigned long id)
+{
+    scoped_lock l(&lock);
+
+    return write(e_conn, {"A", std::to_string(id)});
+}
+
+bool
+LogMetaStore::getCompletion(const std::unique_ptr<Connect> &,
+                            unsigned long id, Completion *const out)
+{
+    scoped_lock l(&lock);
+
+    const auto it = completions.find(id);
+    RETURN_FALSE_IF_FALSE(completions.end() != it);
+
+    *out = it->second;
+    return true;
+}
+
+bool
+LogMetaStore::unfinishedCompletions(const std::unique_ptr<Connect> &,
+                                    std::vector<Completion> *const out)
+{
+    scoped_lock l(&lock);
+
+    for (const auto &it : completions) {
+        const Completion &c = it.second;
+        if ((false == c.begin || false == c.complete)
+            && false == c.aborted) {
+            out->push_back(c);
+        }
+    }
+
+    return true;
+}
+
+bool
+LogMetaStore::seedStaleness(const std::unique_ptr<Connect> &,
+                            unsigned int cache_id)
+{
+    scoped_lock l(&lock);
+
+    // cache_id is UNIQUE.
+    return staleness.insert(std::make_pair(cache_id, true)).second;
+}
+
+bool
+LogMetaStore::removeStaleness(const std::unique_ptr<Connect> &,
+                              unsigned int cache_id)
+{
+    scoped_lock l(&lock);
+
+    staleness.erase(cache_id);
+    return true;
+}
+
+bool
+LogMetaStore::getStaleness(const std::unique_ptr<Connect> &,
+                           unsigned int cache_id, bool *const stale)
+{
+    scoped_lock l(&lock);
+
+    const auto it = staleness.find(cache_id);
+    RETURN_FALSE_IF_FALSE(staleness.end() != it);
+
+    *stale = it->second;
+    return true;
+}
+
+bool
+LogMetaStore::setStaleness(const std::unique_ptr<Connect> &,
+                           unsigned int cache_id, bool stale)
+{
+    scoped_lock l(&lock);
+
+    const auto it = staleness.find(cache_id);
+    if (staleness.end() != it) {
+        it->second = stale;
+    }
+
+    return true;
+}
+
+bool
+LogMetaStore::setAllStale(const std::unique_ptr<Connect> &)
+{
+    scoped_lock l(&lock);
+
+    for (auto &it : staleness) {
+        it.second = true;
+    }
+
+    return true;
+}
+
+// ----------------------------------------
+//              MetaData
+// ----------------------------------------
+
+static std::unique_ptr<MetaStore> &
+lowLevelStore()
+{
+    static std::unique_ptr<MetaStore> store;
+    return store;
+}
+
+MetaStore &
+MetaData::store()
+{
+    assert(lowLevelStore());
+    return *lowLevelStore().get();
+}
+
+void
+MetaData::Internal::installStore(std::unique_ptr<MetaStore> &&store)
+{
+    lowLevelStore() = std::move(store);
+}
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <memory>
+#include <vector>
+#include <pthread.h>
+
+#include <main/Connect.hh>
+
+/*
+ * Storage for the proxy's own bookkeeping: the serialized DBMeta tree
+ * (a regular and a bleeding copy), the embedded half of the query
+ * completion protocol and the staleness flag of each SchemaCache.
+ *
+ * Every call takes the embedded connection because SQLMetaStore keeps
+ * using it; other backends are free to ignore it.
+ */
+class MetaStore {
+public:
+    enum class Table {REGULAR, BLEEDING};
+
+    struct Child {
+        Child(const std::string &serial_key,
+              const std::string &serial_object, unsigned long id)
+            : serial_key(serial_key), serial_object(serial_object),
+              id(id) {}
+
+        std::string serial_key;
+        std::string serial_object;
+        unsigned long id;
+    };
+
+    struct Completion {
+        Completion() : id(0), begin(false), complete(false),
+                       aborted(false) {}
+
+        unsigned long id;
+        bool begin;
+        bool complete;
+        bool aborted;
+        std::string original_query;
+        // Empty if there was no default database.
+        std::string default_db;
+        std::string type;
+    };
+
+    virtual ~MetaStore() {}
+
+    // Writes made between begin() and commit() become visible together;
+    // outside of a transaction every write commits on its own.
+    virtual bool begin(const std::unique_ptr<Connect> &e_conn) = 0;
+    virtual bool commit(const std::unique_ptr<Connect> &e_conn) = 0;
+    virtual bool rollback(const std::unique_ptr<Connect> &e_conn) = 0;
+
+    virtual bool insertObject(const std::unique_ptr<Connect> &e_conn,
+                              Table table,
+                              const std::string &serial_object,
+                              const std::string &serial_key,
+                              unsigned long parent_id,
+                              unsigned long *const id) = 0;
+    virtual bool replaceObject(const std::unique_ptr<Connect> &e_conn,
+                               Table table, unsigned long id,
+                               const std::string &serial_object,
+                               const std::string &serial_key) = 0;
+    virtual bool deleteObject(const std::unique_ptr<Connect> &e_conn,
+                              Table table, unsigned long id,
+                              unsigned long parent_id) = 0;
+    // Make 'dest' an exact copy of 'src'.
+    virtual bool copyTable(const std::unique_ptr<Connect> &e_conn,
+                           Table src, Table dest) = 0;
+    // Every object of the regular table, under the id of its parent;
+    // the children of a parent are in id order.
+    typedef std::map<unsigned long, std::vector<Child> > ChildMap;
+    virtual bool fetchAllChildren(const std::unique_ptr<Connect> &e_conn,
+                                  ChildMap *const out) = 0;
+
+    virtual bool beginCompletion(const std::unique_ptr<Connect> &e_conn,
+                                 const std::string &original_query,
+                                 const std::string &default_db,
+                                 const std::string &type,
+                                 unsigned long *const id) = 0;
+    virtual bool finishCompletion(const std::unique_ptr<Connect> &e_conn,
+                                  unsigned long id) = 0;
+    virtual bool abortCompletion(const std::unique_ptr<Connect> &e_conn,
+                                 unsigned long id) = 0;
+    virtual bool getCompletion(const std::unique_ptr<Connect> &e_conn,
+                               unsigned long id,
+                               Completion *const out) = 0;
+    // Completions that neither finished nor aborted.
+    virtual bool
+        unfinishedCompletions(const std::unique_ptr<Connect> &e_conn,
+                              std::vector<Completion> *const out) = 0;
+
+    virtual bool seedStaleness(const std::unique_ptr<Connect> &e_conn,
+                               unsigned int cache_id) = 0;
+    virtual bool removeStaleness(const std::unique_ptr<Connect> &e_conn,
+                                 unsigned int cache_id) = 0;
+    virtual bool getStaleness(const std::unique_ptr<Connect> &e_conn,
+                              unsigned int cache_id,
+                              bool *const stale) = 0;
+    virtual bool setStaleness(const std::unique_ptr<Connect> &e_conn,
+                              unsigned int cache_id, bool stale) = 0;
+    virtual bool setAllStale(const std::unique_ptr<Connect> &e_conn) = 0;
+};
+
+/*
+ * The original backend; tables in the embedded database.
+ */
+class SQLMetaStore : public MetaStore {
+public:
+    SQLMetaStore() {}
+
+    static bool createTables(const std::unique_ptr<Connect> &e_conn);
+
+    bool begin(const std::unique_ptr<Connect> &e_conn);
+    bool commit(const std::unique_ptr<Connect> &e_conn);
+    bool rollback(const std::unique_ptr<Connect> &e_conn);
+
+    bool insertObject(const std::unique_ptr<Connect> &e_conn,
+                      Table table, const std::string &serial_object,
+                      const std::string &serial_key,
+                      unsigned long parent_id, unsigned long *const id);
+    bool replaceObject(const std::unique_ptr<Connect> &e_conn,
+                       Table table, unsigned long id,
+                       const std::string &serial_object,
+                       const std::string &serial_key);
+    bool deleteObject(const std::unique_ptr<Connect> &e_conn,
+                      Table table, unsigned long id,
+                      unsigned long parent_id);
+    bool copyTable(const std::unique_ptr<Connect> &e_conn, Table src,
+                   Table dest);
+    bool fetchAllChildren(const std::unique_ptr<Connect> &e_conn,
+                          ChildMap *const out);
+
+    bool beginCompletion(const std::unique_ptr<Connect> &e_conn,
+                         const std::string &original_query,
+                         const std::string &default_db,
+                         const std::string &type,
+                         unsigned long *const id);
+    bool finishCompletion(const std::unique_ptr<Connect> &e_conn,
+                          unsigned long id);
+    bool abortCompletion(const std::unique_ptr<Connect> &e_conn,
+                         unsigned long id);
+    bool getCompletion(const std::unique_ptr<Connect> &e_conn,
+                       unsigned long id, Completion *const out);
+    bool unfinishedCompletions(const std::unique_ptr<Connect> &e_conn,
+                               std::vector<Completion> *const out);
+
+    bool seedStaleness(const std::unique_ptr<Connect> &e_conn,
+                       unsigned int cache_id);
+    bool removeStaleness(const std::unique_ptr<Connect> &e_conn,
+                         unsigned int cache_id);
+    bool getStaleness(const std::unique_ptr<Connect> &e_conn,
+                      unsigned int cache_id, bool *const stale);
+    bool setStaleness(const std::unique_ptr<Connect> &e_conn,
+                      unsigned int cache_id, bool stale);
+    bool setAllStale(const std::unique_ptr<Connect> &e_conn);
+
+private:
+    static std::string tableName(Table table);
+};
+
+/*
+ * In-process backend: every committed transaction is appended to a log
+ * file as one checksummed frame and fsync'd before commit() returns; the
+ * current state lives in memory. Opening the store replays the log
+ * (a torn trailing frame is discarded) and once the log grows past a
+ * threshold it is rewritten as a snapshot of the live state.
+ * Transactions belong to the connection that began them.
+ *
+ * Staleness flags are kept in memory only; they describe SchemaCaches
+ * of the running process.
+ */
+class LogMetaStore : public MetaStore {
+public:
+    LogMetaStore(const std::string &path);
+    ~LogMetaStore();
+
+    bool begin(const std::unique_ptr<Connect> &e_conn);
+    bool commit(const std::unique_ptr<Connect> &e_conn);
+    bool rollback(const std::unique_ptr<Connect> &e_conn);
+
+    bool insertObject(const std::unique_ptr<Connect> &e_conn,
+                      Table table, const std::string &serial_object,
+                      const std::string &serial_key,
+                      unsigned long parent_id, unsigned long *const id);
+    bool replaceObject(const std::unique_ptr<Connect> &e_conn,
+                       Table table, unsigned long id,
+                       const std::string &serial_object,
+                       const std::string &serial_key);
+    bool deleteObject(const std::unique_ptr<Connect> &e_conn,
+                      Table table, unsigned long id,
+                      unsigned long parent_id);
+    bool copyTable(const std::unique_ptr<Connect> &e_conn, Table src,
+                   Table dest);
+    bool fetchAllChildren(const std::unique_ptr<Connect> &e_conn,
+                          ChildMap *const out);
+
+    bool beginCompletion(const std::unique_ptr<Connect> &e_conn,
+                         const std::string &original_query,
+                         const std::string &default_db,
+                         const std::string &type,
+                         unsigned long *const id);
+    bool finishCompletion(const std::unique_ptr<Connect> &e_conn,
+                          unsigned long id);
+    bool abortCompletion(const std::unique_ptr<Connect> &e_conn,
+                         unsigned long id);
+    bool getCompletion(const std::unique_ptr<Connect> &e_conn,
+                       unsigned long id, Completion *const out);
+    bool unfinishedCompletions(const std::unique_ptr<Connect> &e_conn,
+                               std::vector<Completion> *const out);
+
+    bool seedStaleness(const std::unique_ptr<Connect> &e_conn,
+                       unsigned int cache_id);
+    bool removeStaleness(const std::unique_ptr<Connect> &e_conn,
+                         unsigned int cache_id);
+    bool getStaleness(const std::unique_ptr<Connect> &e_conn,
+                      unsigned int cache_id, bool *const stale);
+    bool setStaleness(const std::unique_ptr<Connect> &e_conn,
+                      unsigned int cache_id, bool stale);
+    bool setAllStale(const std::unique_ptr<Connect> &e_conn);
+
+private:
+    struct Object {
+        std::string serial_object;
+        std::string serial_key;
+        unsigned long parent_id;
+    };
+
+    struct Image {
+        Image() : next_id(1) {}
+
+        std::map<unsigned long, Object> objects;
+        std::map<unsigned long, std::set<unsigned long> > children;
+        // Mirrors AUTO_INCREMENT; copied along with the objects so
+        // both tables hand out the same ids for the same deltas.
+        unsigned long next_id;
+    };
+
+    const std::string path;
+    int fd;
+    unsigned long long log_bytes;
+    unsigned long long snapshot_bytes;
+
+    pthread_mutex_t lock;
+    Image regular;
+    Image bleeding;
+    std::map<unsigned long, Completion> completions;
+    unsigned long next_completion_id;
+    std::map<unsigned int, bool> staleness;
+
+    // Open transactions by connection, like MySQL's; each one's records
+    // wait here until its commit(). Ids are handed out eagerly and, as
+    // with AUTO_INCREMENT, not given back on rollback: another
+    // connection may already hold the next one.
+    std::map<const Connect *, std::vector<std::string> > pending;
+
+    Image &image(Table table);
+    bool write(const std::unique_ptr<Connect> &e_conn,
+               const std::vector<std::string> &record);
+    bool flushPending(std::vector<std::string> *const records);
+    bool appendFrame(const std::string &payload);
+    void applyRecord(const std::vector<std::string> &record);
+    bool replay();
+    bool snapshot();
+};
+
+namespace MetaData {
+    // Backend chosen by MetaData::initialize(...).
+    MetaStore &store();
+
+    namespace Internal {
+        void installStore(std::unique_ptr<MetaStore> &&store);
+    };
+};
+
+// Counterparts of macro_util.hh's ROLLBACK_AND_RFIF and SYNC_IF_FALSE
+// for writes that go through the MetaStore.
+#define STORE_ROLLBACK_AND_RFIF(status, e_conn)                     \
+{                                                                   \
+    if (!(status)) {                                                \
+        assert(MetaData::store().rollback(e_conn));                 \
+        return false;                                               \
+    }                                                               \
+}
+
+#define STORE_SYNC_IF_FALSE(status, e_conn)                         \
+{                                                                   \
+    if (!(status)) {                                                \
+        assert(MetaData::store().rollback(e_conn));                 \
+        TEST_Sync(status, "metadata update failed");                \
+    }                                                               \
+}
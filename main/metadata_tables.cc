@@ -2,6 +2,7 @@
 #include <memory>
 
 #include <main/metadata_tables.hh>
+#include <main/metadata_store.hh>
 #include <main/Connect.hh>
 #include <main/macro_util.hh>
 
@@ -102,48 +103,16 @@ MetaData::initialize(const std::unique_ptr<Connect> &conn,
     }
     MetaData::Internal::initPrefix(prefix);
 
-    // Embedded database.
-    const std::string create_db =
-        " CREATE DATABASE IF NOT EXISTS " + DB::embeddedDB() + ";";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(create_db));
-
-    const std::string create_meta_table =
-        " CREATE TABLE IF NOT EXISTS " + Table::metaObject() +
-        "   (serial_object VARBINARY(500) NOT NULL,"
-        "    serial_key VARBINARY(500) NOT NULL,"
-        "    parent_id BIGINT NOT NULL,"
-        "    id SERIAL PRIMARY KEY)"
-        " ENGINE=InnoDB;";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(create_meta_table));
-
-    const std::string create_bleeding_table =
-        " CREATE TABLE IF NOT EXISTS " + Table::bleedingMetaObject() +
-        "   (serial_object VARBINARY(500) NOT NULL,"
-        "    serial_key VARBINARY(500) NOT NULL,"
-        "    parent_id BIGINT NOT NULL,"
-        "    id SERIAL PRIMARY KEY)"
-        " ENGINE=InnoDB;";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(create_bleeding_table));
-
-    const std::string create_embedded_completion =
-        " CREATE TABLE IF NOT EXISTS " + Table::embeddedQueryCompletion() +
-        "   (begin BOOLEAN NOT NULL,"
-        "    complete BOOLEAN NOT NULL,"
-        "    original_query VARCHAR(500) NOT NULL,"
-        "    default_db VARCHAR(500),"      // default database is NULLable
-        "    aborted BOOLEAN NOT NULL,"
-        "    type VARCHAR(100) NOT NULL,"
-        "    id SERIAL PRIMARY KEY)"
-        " ENGINE=InnoDB;";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(create_embedded_completion));
-
-    const std::string create_staleness =
-        " CREATE TABLE IF NOT EXISTS " + Table::staleness() +
-        "   (cache_id BIGINT UNIQUE NOT NULL,"
-        "    stale BOOLEAN NOT NULL,"
-        "    id SERIAL PRIMARY KEY)"
-        " ENGINE=InnoDB;";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(create_staleness));
+    // Embedded bookkeeping.
+    const char *const log_path = getenv("CRYPTDB_META_LOG");
+    if (log_path) {
+        Internal::installStore(
+            std::unique_ptr<MetaStore>(new LogMetaStore(log_path)));
+    } else {
+        RETURN_FALSE_IF_FALSE(SQLMetaStore::createTables(e_conn));
+        Internal::installStore(
+            std::unique_ptr<MetaStore>(new SQLMetaStore()));
+    }
 
     // Remote database.
     const std::string create_remote_db =
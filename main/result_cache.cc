@@ -0,0 +1,286 @@
+#include <cstdlib>
+
+#include <main/result_cache.hh>
+#include <util/cryptdb_log.hh>
+#include <util/scoped_lock.hh>
+
+// Bookkeeping per entry beyond its key and values: the map, index and
+// LRU nodes.
+static const size_t ENTRY_OVERHEAD = 512;
+// Log the counters every this many lookups.
+static const unsigned long long REPORT_INTERVAL = 1 << 12;
+
+CachedResult::CachedResult(const ResType &res)
+    : names(res.names), row_count(res.rows.size()), byte_count(0)
+{
+    values.reserve(row_count * names.size());
+    missing.reserve(row_count * names.size());
+    for (const auto &row : res.rows) {
+        assert(row.size() == names.size());
+        for (const auto &item : row) {
+            missing.push_back(NULL == item);
+            values.push_back(item ? ItemToString(*item) : std::string());
+            byte_count += sizeof(std::string) + values.back().size();
+        }
+    }
+    for (const auto &name : names) {
+        byte_count += sizeof(std::string) + name.size();
+    }
+}
+
+static size_t
+env_size(const char *const name, size_t dflt)
+{
+    const char *const ev = getenv(name);
+    return ev ? strtoull(ev, NULL, 10) : dflt;
+}
+
+ResultCache::ResultCache(size_t budget, unsigned int ttl_seconds,
+                         size_t max_entries)
+    : budget(budget), ttl_seconds(ttl_seconds), max_entries(max_entries),
+      current_generation(0)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+ResultCache::~ResultCache()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+ResultCache *
+ResultCache::fromEnvironment()
+{
+    const size_t budget = env_size("CRYPTDB_RESULT_CACHE_BYTES", 0);
+    if (0 == budget) {
+        return NULL;
+    }
+
+    const unsigned int ttl =
+        static_cast<unsigned int>(env_size("CRYPTDB_RESULT_CACHE_TTL", 30));
+    const size_t max_entries =
+        env_size("CRYPTDB_RESULT_CACHE_ENTRIES", 4096);
+    LOG(wrapper) << "result cache: " << budget << " bytes, "
+                 << max_entries << " entries, " << ttl << "s TTL";
+    return new ResultCache(budget, ttl, max_entries);
+}
+
+std::string
+ResultCache::makeKey(const std::string &db, const std::string &query)
+{
+    // Database names can't hold a NUL.
+    return db + '\0' + query;
+}
+
+time_t
+ResultCache::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+std::shared_ptr<const CachedResult>
+ResultCache::lookup(const std::string &db, const std::string &query)
+{
+    const std::string key = makeKey(db, query);
+
+    scoped_lock l(&lock);
+    std::shared_ptr<const CachedResult> out;
+    const auto it = entries.find(key);
+    if (entries.end() != it) {
+        if (ttl_seconds && now() >= it->second.expires) {
+            erase(key);
+            ++counters.expirations;
+        } else {
+            lru.splice(lru.begin(), lru, it->second.lru_position);
+            out = it->second.result;
+        }
+    }
+
+    ++(out ? counters.hits : counters.misses);
+    if (0 == (counters.hits + counters.misses) % REPORT_INTERVAL) {
+        report();
+    }
+
+    return out;
+}
+
+uint64_t
+ResultCache::beginRead()
+{
+    scoped_lock l(&lock);
+    live_reads.insert(current_generation);
+    return current_generation;
+}
+
+void
+ResultCache::endRead(uint64_t read_generation)
+{
+    scoped_lock l(&lock);
+    const auto it = live_reads.find(read_generation);
+    assert(live_reads.end() != it);
+    live_reads.erase(it);
+    prune();
+}
+
+void
+ResultCache::store(const CacheFootprint &read, const std::string &query,
+                   const std::shared_ptr<const CachedResult> &result,
+                   uint64_t read_generation)
+{
+    assert(CacheFootprint::Kind::READ == read.kind);
+
+    const std::string key = makeKey(read.db, query);
+    const size_t size = key.size() + result->bytes() + ENTRY_OVERHEAD;
+    // One huge result shouldn't flush everything else.
+    if (size > budget / 4) {
+        return;
+    }
+
+    scoped_lock l(&lock);
+    // A write may have landed between the read and now.
+    if (changedSince(read, read_generation)
+        || entries.end() != entries.find(key)) {
+        return;
+    }
+
+    while (false == lru.empty()
+           && (counters.bytes + size > budget
+               || counters.entries + 1 > max_entries)) {
+        const std::string victim = lru.back();
+        erase(victim);
+        ++counters.evictions;
+    }
+
+    lru.push_front(key);
+    Entry &entry = entries[key];
+    entry.db = read.db;
+    entry.tables = read.tables;
+    entry.result = result;
+    entry.size = size;
+    entry.expires = now() + ttl_seconds;
+    entry.lru_position = lru.begin();
+
+    for (const auto &table : read.tables) {
+        db_readers[table.first].insert(key);
+        table_readers[table].insert(key);
+    }
+
+    ++counters.stores;
+    ++counters.entries;
+    counters.bytes += size;
+}
+
+void
+ResultCache::invalidate(const CacheFootprint &write)
+{
+    scoped_lock l(&lock);
+    ++current_generation;
+
+    std::set<std::string> keys;
+    if (write.tables.empty()) {
+        db_changed[write.db] = current_generation;
+        const auto it = db_readers.find(write.db);
+        if (db_readers.end() != it) {
+            keys = it->second;
+        }
+    } else {
+        for (const auto &table : write.tables) {
+            table_changed[table] = current_generation;
+            const auto it = table_readers.find(table);
+            if (table_readers.end() != it) {
+                keys.insert(it->second.begin(), it->second.end());
+            }
+        }
+    }
+
+    for (const auto &key : keys) {
+        erase(key);
+        ++counters.invalidations;
+    }
+    prune();
+}
+
+void
+ResultCache::erase(const std::string &key)
+{
+    const auto it = entries.find(key);
+    assert(entries.end() != it);
+    const Entry &entry = it->second;
+
+    for (const auto &table : entry.tables) {
+        const auto db_reader = db_readers.find(table.first);
+        if (db_readers.end() != db_reader) {
+            db_reader->second.erase(key);
+            if (db_reader->second.empty()) {
+                db_readers.erase(db_reader);
+            }
+        }
+
+        const auto reader = table_readers.find(table);
+        reader->second.erase(key);
+        if (reader->second.empty()) {
+            table_readers.erase(reader);
+        }
+    }
+
+    --counters.entries;
+    counters.bytes -= entry.size;
+    lru.erase(entry.lru_position);
+    entries.erase(it);
+}
+
+bool
+ResultCache::changedSince(const CacheFootprint &read,
+                          uint64_t read_generation) const
+{
+    for (const auto &table : read.tables) {
+        const auto db = db_changed.find(table.first);
+        if (db_changed.end() != db && db->second > read_generation) {
+            return true;
+        }
+        const auto it = table_changed.find(table);
+        if (table_changed.end() != it && it->second > read_generation) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// changedSince() only asks about invalidations after the generation of
+// a live read; those up to the oldest one can go.
+void
+ResultCache::prune()
+{
+    const uint64_t oldest =
+        live_reads.empty() ? current_generation : *live_reads.begin();
+    for (auto it = table_changed.begin(); it != table_changed.end();) {
+        it = it->second <= oldest ? table_changed.erase(it) : ++it;
+    }
+    for (auto it = db_changed.begin(); it != db_changed.end();) {
+        it = it->second <= oldest ? db_changed.erase(it) : ++it;
+    }
+}
+
+void
+ResultCache::report() const
+{
+    const unsigned long long lookups = counters.hits + counters.misses;
+    LOG(edb_perf) << "result cache: " << counters.hits << " hits in "
+                  << lookups << " lookups ("
+                  << (100 * counters.hits / lookups) << "%), "
+                  << counters.invalidations << " invalidated, "
+                  << counters.evictions << " evicted, "
+                  << counters.expirations << " expired, "
+                  << counters.entries << " entries, "
+                  << counters.bytes << " bytes";
+}
+
+ResultCacheStats
+ResultCache::stats() const
+{
+    scoped_lock l(&lock);
+    return counters;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <parser/sql_utils.hh>
+
+// How a statement bears on cached results; see cacheFootprint() in
+// rewrite_main.cc.
+struct CacheFootprint {
+    enum class Kind {
+        // Reads and writes no table data (SHOW, SET, SELECT NOW()).
+        NONE,
+        // A SELECT whose result depends on nothing but the rows of
+        // @tables.
+        READ,
+        // Changes @tables, or anything in @db if there are none
+        // (DROP DATABASE).
+        WRITE,
+        TRANSACTION_BEGIN,
+        TRANSACTION_END,
+        // SET autocommit = 0: every statement of the session is in a
+        // transaction until it is set back to 1, which commits.
+        AUTOCOMMIT_OFF,
+        AUTOCOMMIT_ON
+    };
+
+    // Anything the rewriter doesn't classify invalidates @db.
+    CacheFootprint() : kind(Kind::WRITE) {}
+    explicit CacheFootprint(const std::string &db)
+        : kind(Kind::WRITE), db(db) {}
+
+    // (database, table)
+    typedef std::pair<std::string, std::string> Table;
+
+    Kind kind;
+    // The session's database; a READ is cached under it.
+    std::string db;
+    // Each with its own database, which need not be @db.
+    std::set<Table> tables;
+};
+
+// A decrypted result as the client receives it: the text of each value,
+// row by row. The Items of a ResType live on the THD of the query, so
+// they can't be kept.
+class CachedResult {
+public:
+    explicit CachedResult(const ResType &res);
+
+    std::vector<std::string> names;
+    size_t rowCount() const {return row_count;}
+    // NULL for a missing value.
+    const std::string *value(size_t row, size_t col) const
+    {
+        const size_t i = row * names.size() + col;
+        return missing[i] ? NULL : &values[i];
+    }
+    size_t bytes() const {return byte_count;}
+
+private:
+    size_t row_count;
+    std::vector<std::string> values;
+    std::vector<bool> missing;
+    size_t byte_count;
+};
+
+struct ResultCacheStats {
+    ResultCacheStats()
+        : hits(0), misses(0), stores(0), invalidations(0), evictions(0),
+          expirations(0), entries(0), bytes(0) {}
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long stores;
+    // Entries dropped because a table they read changed.
+    unsigned long long invalidations;
+    // Entries dropped for room, and for age.
+    unsigned long long evictions;
+    unsigned long long expirations;
+    unsigned long long entries;
+    unsigned long long bytes;
+};
+
+/*
+ * Decrypted results of the proxy's SELECTs, keyed by the session's
+ * database and the rewritten query, so a repeated read skips the server
+ * and the decryption. An entry goes away when a statement changes one
+ * of the tables it read, when it is older than the TTL, or when the
+ * least recently used entries make room for new ones.
+ *
+ * The proxy turns it on with CRYPTDB_RESULT_CACHE_BYTES (off by
+ * default); CRYPTDB_RESULT_CACHE_TTL (seconds, 30 by default) and
+ * CRYPTDB_RESULT_CACHE_ENTRIES (4096 by default) bound it further.
+ * Only statements that go through the proxy invalidate entries; writes
+ * from elsewhere show up once the TTL runs out.
+ */
+class ResultCache {
+    ResultCache(const ResultCache &);
+    ResultCache &operator=(const ResultCache &);
+
+public:
+    // @ttl_seconds: 0 keeps entries until they are invalidated.
+    ResultCache(size_t budget, unsigned int ttl_seconds,
+                size_t max_entries);
+    ~ResultCache();
+
+    // NULL if the environment leaves the cache off.
+    static ResultCache *fromEnvironment();
+
+    // NULL on a miss.
+    std::shared_ptr<const CachedResult>
+        lookup(const std::string &db, const std::string &query);
+    // The generation, advanced by every invalidation, that a read is
+    // sent at; its result is only stored if none of its tables changed
+    // since. Each beginRead() needs its endRead(), after any store().
+    uint64_t beginRead();
+    void endRead(uint64_t read_generation);
+    // @read: the footprint of the query, of kind READ.
+    void store(const CacheFootprint &read, const std::string &query,
+               const std::shared_ptr<const CachedResult> &result,
+               uint64_t read_generation);
+    // @write: of kind WRITE, or any statement that changed the schema of
+    // its tables.
+    void invalidate(const CacheFootprint &write);
+
+    ResultCacheStats stats() const;
+
+private:
+    typedef CacheFootprint::Table TableKey;
+
+    struct Entry {
+        std::string db;
+        std::set<TableKey> tables;
+        std::shared_ptr<const CachedResult> result;
+        size_t size;
+        time_t expires;
+        std::list<std::string>::iterator lru_position;
+    };
+
+    const size_t budget;
+    const unsigned int ttl_seconds;
+    const size_t max_entries;
+
+    mutable pthread_mutex_t lock;
+    std::unordered_map<std::string, Entry> entries;
+    // Most recently used first.
+    std::list<std::string> lru;
+    // The entries that read each table, and a table of each database.
+    std::map<TableKey, std::set<std::string> > table_readers;
+    std::map<std::string, std::set<std::string> > db_readers;
+    // The generation at which each was last invalidated, if a read
+    // still in flight began before.
+    std::map<TableKey, uint64_t> table_changed;
+    std::map<std::string, uint64_t> db_changed;
+    uint64_t current_generation;
+    std::multiset<uint64_t> live_reads;
+    ResultCacheStats counters;
+
+    static std::string makeKey(const std::string &db,
+                               const std::string &query);
+    static time_t now();
+    // All of these require the lock.
+    void erase(const std::string &key);
+    bool changedSince(const CacheFootprint &read,
+                      uint64_t read_generation) const;
+    void prune();
+    void report() const;
+};
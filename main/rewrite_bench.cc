@@ -0,0 +1,124 @@
+/*
+ * Heap allocations and time per rewrite: each query read from stdin is
+ * rewritten [iterations] times against the schema, without being run.
+ *
+ *   rewrite_bench <embedded-db-path> <db-name> [iterations] < queries
+ *
+ * Lines starting with '!' are executed once instead, to set up the
+ * schema the others use: !CREATE TABLE t (x integer, y text).
+ *
+ * Run it again with CRYPTDB_REWRITE_ARENA=0 for the same rewrites with
+ * one heap allocation per arena allocation; the arena's own blocks are
+ * counted either way.
+ */
+
+#include <string>
+#include <iostream>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <main/rewrite_main.hh>
+#include <main/rewrite_util.hh>
+#include <util/errstream.hh>
+#include <util/timer.hh>
+
+// Every operator new of the process goes through here.
+static unsigned long allocations = 0;
+
+void *
+operator new(size_t size)
+{
+    ++allocations;
+    void *const p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *
+operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void
+operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+static void
+bench_rewrite(const ProxyState &ps, SchemaCache *const schema_cache,
+              const std::string &db, const std::string &q,
+              unsigned int niter)
+{
+    const SchemaInfo &schema =
+        schema_cache->getSchema(ps.getConn(), ps.getEConn());
+
+    // Once untimed: the first rewrite warms the layer caches.
+    Rewriter::rewrite(ps, q, schema, db);
+
+    const unsigned long before = allocations;
+    timer t;
+    for (unsigned int i = 0; i < niter; i++) {
+        Rewriter::rewrite(ps, q, schema, db);
+    }
+    const double usec = static_cast<double>(t.lap()) / niter;
+    const double allocs =
+        static_cast<double>(allocations - before) / niter;
+
+    std::cout << "--- " << allocs << " allocations, " << usec
+              << " usec per rewrite: " << q << std::endl;
+}
+
+int
+main(int ac, char **av)
+{
+    if (ac != 3 && ac != 4) {
+        std::cerr << "Usage: " << av[0]
+                  << " <embedded-db-path> <db-name> [iterations]"
+                  << std::endl;
+        exit(1);
+    }
+    const std::string db = av[2];
+    const unsigned int niter = 4 == ac ? atoi(av[3]) : 1000;
+
+    ConnectionInfo ci("localhost", "root", "letmein");
+    ProxyState ps(ci, av[1], "2392834");
+    SchemaCache schema_cache;
+    executeQuery(ps, "CREATE DATABASE IF NOT EXISTS " + db, db,
+                 &schema_cache, false);
+    executeQuery(ps, "USE " + db, db, &schema_cache, false);
+
+    for (;;) {
+        std::string s;
+        getline(std::cin, s);
+        if (std::cin.eof()) {
+            break;
+        }
+        if (s.empty()) {
+            continue;
+        }
+
+        try {
+            if ('!' == s[0]) {
+                executeQuery(ps, s.substr(1), db, &schema_cache, false);
+            } else {
+                bench_rewrite(ps, &schema_cache, db, s, niter);
+            }
+        } catch (const AbstractException &e) {
+            std::cout << "ERROR: " << e << " in query " << s << std::endl;
+        } catch (const std::runtime_error &e) {
+            std::cout << "ERROR: " << e.what() << " in query " << s
+                      << std::endl;
+        }
+    }
+}
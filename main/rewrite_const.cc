@@ -57,7 +57,7 @@ static class ANON : public CItemSubtypeIT<Item_string,
         LOG(cdb_v) << " String item do_gather " << i << std::endl;
         const std::string why = "is a string constant";
         reason rsn(FULL_EncSet_Str, why, i);
-        return new RewritePlan(FULL_EncSet_Str, rsn);
+        return new (a.arena) RewritePlan(FULL_EncSet_Str, rsn);
     }
 
     virtual Item * do_optimize_type(Item_string *i, Analysis & a) const {
@@ -88,7 +88,7 @@ static class ANON : public CItemSubtypeIT<Item_int, Item::Type::INT_ITEM> {
                    << std::endl;
         const std::string why = "is an int constant";
         reason rsn(FULL_EncSet_Int, why, i);
-        return new RewritePlan(FULL_EncSet_Int, rsn);
+        return new (a.arena) RewritePlan(FULL_EncSet_Int, rsn);
     }
 
     virtual Item * do_optimize_type(Item_int *i, Analysis & a) const
@@ -123,7 +123,7 @@ static class ANON : public CItemSubtypeIT<Item_decimal,
 
         const std::string why = "is a decimal constant";
         reason rsn(FULL_EncSet, why, i);
-        return new RewritePlan(FULL_EncSet_Int, rsn);
+        return new (a.arena) RewritePlan(FULL_EncSet_Int, rsn);
     }
 
     virtual Item * do_optimize_type(Item_decimal *i, Analysis & a) const
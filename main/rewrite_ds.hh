@@ -1,10 +1,14 @@
 #pragma once
 
+#include <initializer_list>
 #include <list>
+#include <map>
 #include <vector>
 #include <memory>
+#include <assert.h>
 
 #include <util/onions.hh>
+#include <util/arena.hh>
 
 class FieldMeta;
 /**
@@ -16,7 +20,103 @@ typedef std::pair<SECLEVEL, FieldMeta *> LevelFieldPair;
 
 typedef std::map<SECLEVEL, FieldMeta *> LevelFieldMap;
 typedef std::pair<onion, LevelFieldPair> OnionLevelFieldPair;
-typedef std::map<onion, LevelFieldPair> OnionLevelFieldMap;
+
+/*
+ * The map of an EncSet, from the few onions there are: a slot for each
+ * onion and a bitset of the slots in use, so that the EncSets built and
+ * copied for every node of every query don't allocate. Iterates in
+ * onion order, as the std::map it stands in for did.
+ */
+class OnionLevelFieldMap {
+    static const unsigned int onion_count = oINVALID + 1;
+
+    template <typename Map, typename Value>
+    class Iterator {
+    public:
+        Iterator(Map *const m, unsigned int i) : m(m), i(m->skip(i)) {}
+        // iterator -> const_iterator
+        template <typename M, typename V>
+        Iterator(const Iterator<M, V> &other)
+            : m(other.m), i(other.i) {}
+
+        Value &operator*() const {return m->slots[i];}
+        Value *operator->() const {return &m->slots[i];}
+        Iterator &operator++() {i = m->skip(i + 1); return *this;}
+        Iterator operator++(int)
+        {
+            const Iterator old = *this;
+            ++*this;
+            return old;
+        }
+        bool operator==(const Iterator &rhs) const {return i == rhs.i;}
+        bool operator!=(const Iterator &rhs) const {return i != rhs.i;}
+
+        Map *m;
+        unsigned int i;
+    };
+
+public:
+    typedef onion key_type;
+    typedef OnionLevelFieldPair value_type;
+    typedef Iterator<OnionLevelFieldMap, value_type> iterator;
+    typedef Iterator<const OnionLevelFieldMap, const value_type>
+        const_iterator;
+
+    OnionLevelFieldMap() : present(0) {}
+    OnionLevelFieldMap(std::initializer_list<value_type> l) : present(0)
+    {
+        for (auto it : l) {
+            (*this)[it.first] = it.second;
+        }
+    }
+
+    LevelFieldPair &operator[](onion o)
+    {
+        assert(static_cast<unsigned int>(o) < onion_count);
+        if (false == has(o)) {
+            slots[o] = value_type(o, LevelFieldPair(SECLEVEL::INVALID,
+                                                    NULL));
+            present |= 1u << o;
+        }
+        return slots[o].second;
+    }
+
+    iterator find(onion o)
+    {
+        return has(o) ? iterator(this, o) : end();
+    }
+    const_iterator find(onion o) const
+    {
+        return has(o) ? const_iterator(this, o) : end();
+    }
+
+    iterator begin() {return iterator(this, 0);}
+    iterator end() {return iterator(this, onion_count);}
+    const_iterator begin() const {return const_iterator(this, 0);}
+    const_iterator end() const {return const_iterator(this, onion_count);}
+
+    size_t size() const {return __builtin_popcount(present);}
+    bool empty() const {return 0 == present;}
+    size_t count(onion o) const {return has(o) ? 1 : 0;}
+    void clear() {present = 0;}
+
+private:
+    bool has(onion o) const
+    {
+        return static_cast<unsigned int>(o) < onion_count
+               && (present & 1u << o);
+    }
+    unsigned int skip(unsigned int i) const
+    {
+        while (i < onion_count && !(present & 1u << i)) {
+            ++i;
+        }
+        return i;
+    }
+
+    value_type slots[onion_count];
+    unsigned int present;
+};
 
 class Analysis;
 // onion-level-key: all the information needed to know how to encrypt a
@@ -181,6 +281,9 @@ operator<<(std::ostream &out, const reason &r);
 // The rewrite plan of a lex node: the information a
 // node remembers after gather, to be used during rewrite
 // Other more specific RewritePlan-s inherit from this class
+//
+// Plans live in the arena of their Analysis: new (a.arena) RewritePlan(...).
+// Deleting one runs its destructor and leaves the memory to the arena.
 class RewritePlan {
 public:
     const reason r;
@@ -188,8 +291,17 @@ public:
     EncSet es_out; // encset that this item can output
 
     RewritePlan(const EncSet &es, reason r) : r(r), es_out(es) {};
+    virtual ~RewritePlan() {}
     reason getReason() const {return r;}
 
+    static void *operator new(size_t size, Arena &arena)
+    {
+        return arena.allocate(size);
+    }
+    static void operator delete(void *, Arena &) {}
+    static void operator delete(void *) {}
+    static void *operator new(size_t) = delete;
+
     //only keep plans that have parent_olk in es
 //    void restrict(const EncSet & es);
 
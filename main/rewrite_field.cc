@@ -61,26 +61,42 @@ deductPlainTableName(const std::string &field_name,
     return deductPlainTableName(field_name, context->outer_context, a);
 }
 
+static const FieldHandle &
+resolveField(const Item_field &i, Analysis &a)
+{
+    const auto it = a.field_handles.find(&i);
+    if (a.field_handles.end() != it) {
+        return it->second;
+    }
+
+    const std::string &db_name = a.getDatabaseName();
+    const std::string table =
+        i.table_name ? i.table_name :
+                        deductPlainTableName(i.field_name, i.context, a);
+    TableMeta &tm = a.getTableMeta(db_name, table);
+    FieldMeta &fm = a.getFieldMeta(tm, i.field_name);
+
+    return a.field_handles.insert(
+               std::make_pair(&i,
+                              FieldHandle(&tm, &fm,
+                                          a.getAnonTableName(db_name,
+                                                             table))))
+           .first->second;
+}
+
 class ANON : public CItemSubtypeIT<Item_field, Item::Type::FIELD_ITEM> {
     virtual RewritePlan *
     do_gather_type(const Item_field &i, Analysis &a) const
     {
         LOG(cdb_v) << "FIELD_ITEM do_gather " << i << std::endl;
 
-        const std::string fieldname = i.field_name;
-        const std::string table =
-            i.table_name ? i.table_name :
-                            deductPlainTableName(i.field_name,
-                                                 i.context, a);
- 
-        FieldMeta &fm =
-            a.getFieldMeta(a.getDatabaseName(), table, fieldname);
+        FieldMeta &fm = *resolveField(i, a).fm;
         const EncSet es = EncSet(a, &fm);
 
         const std::string why = "is a field";
         reason rsn(es, why, i);
 
-        return new RewritePlan(es, rsn);
+        return new (a.arena) RewritePlan(es, rsn);
     }
 
     virtual Item *
@@ -90,31 +106,22 @@ class ANON : public CItemSubtypeIT<Item_field, Item::Type::FIELD_ITEM> {
     {
         LOG(cdb_v) << "do_rewrite_type FIELD_ITEM " << i << std::endl;
 
-        const std::string &db_name = a.getDatabaseName();
-        const std::string plain_table_name =
-            i.table_name ? i.table_name :
-                            deductPlainTableName(i.field_name,
-                                                 i.context, a);
-        const FieldMeta &fm =
-            a.getFieldMeta(db_name, plain_table_name, i.field_name);
+        const FieldHandle &h = resolveField(i, a);
+        const FieldMeta &fm = *h.fm;
         //assert(constr.key == fm);
 
         //check if we need onion adjustment
-        const OnionMeta &om =
-            a.getOnionMeta(db_name, plain_table_name, i.field_name,
-                           constr.o);
+        const OnionMeta &om = a.getOnionMeta(fm, constr.o);
         const SECLEVEL onion_level = a.getOnionLevel(om);
         assert(onion_level != SECLEVEL::INVALID);
         if (constr.l < onion_level) {
             //need adjustment, throw exception
-            const TableMeta &tm =
-                a.getTableMeta(db_name, plain_table_name);
-            throw OnionAdjustExcept(tm, fm, constr.o, constr.l);
+            throw OnionAdjustExcept(*h.tm, fm, constr.o, constr.l);
         }
 
-        const std::string anon_table_name =
-            a.getAnonTableName(db_name, plain_table_name);
+        const std::string &anon_table_name = h.anon_table;
         const std::string anon_field_name = om.getAnonOnionName();
+        a.field_rewrites.push_back(FieldOnion(h.tm, &fm, constr.o));
 
         Item_field * const res =
             make_item_field(i, anon_table_name, anon_field_name);
@@ -167,7 +174,8 @@ class ANON : public CItemSubtypeIT<Item_field, Item::Type::FIELD_ITEM> {
                 make_item_field(i, anon_table_name, anon_field_name);
             l->push_back(new_field);
         }
-        if (fm.getHasSalt()) {
+        // A shared salt is named once for the whole row.
+        if (fm.getHasSalt() && false == fm.getSharesSalt()) {
             assert(new_field); // need an anonymized field as template to
                                // create salt item
             l->push_back(make_item_field(*new_field, anon_table_name,
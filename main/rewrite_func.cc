@@ -109,7 +109,7 @@ typical_gather(Analysis &a, const Item_func &i, const EncSet &my_es,
     const EncSet out_es = getEncSet();
     const reason rsn(out_es, why, i);
 
-    return new RewritePlanOneOLK(out_es,
+    return new (a.arena) RewritePlanOneOLK(out_es,
                                  solution.chooseOne(), childr_rp,
                                  rsn);
 }
@@ -129,7 +129,7 @@ iterateGather(const Item_func &i, const EncSet &out_es, EncSet child_es,
         child_es = child_es.intersect(childr_rp[index]->es_out);
     }
 
-    return new RewritePlanOneOLK(out_es, child_es.chooseOne(),
+    return new (a.arena) RewritePlanOneOLK(out_es, child_es.chooseOne(),
                                  childr_rp, rsn);
 }
 
@@ -338,7 +338,7 @@ class CItemCond : public CItemSubtypeFT<Item_cond, FT> {
         const reason rsn(out_es, why, i);
 
         // Must be an OLK for each argument.
-        return new RewritePlanPerChildOLK(out_es, out_child_olks, rsn);
+        return new (a.arena) RewritePlanPerChildOLK(out_es, out_child_olks, rsn);
     }
 
     virtual Item * do_optimize_type(Item_cond *i, Analysis & a) const {
@@ -400,7 +400,7 @@ class CItemNullcheck : public CItemSubtypeFT<Item_bool_func, FT> {
         const std::string why = "nullcheck";
         const reason rsn(out_es, why, i);
 
-        return new RewritePlanOneOLK(out_es, solution.chooseOne(),
+        return new (a.arena) RewritePlanOneOLK(out_es, solution.chooseOne(),
                                      child_rp, rsn);
     }
 
@@ -430,7 +430,7 @@ static class ANON : public CItemSubtypeFT<Item_func_get_system_var, Item_func::F
     {
         const std::string why = "system var";
         const reason r = reason(PLAIN_EncSet, why, i);
-        return new RewritePlan(PLAIN_EncSet, r);
+        return new (a.arena) RewritePlan(PLAIN_EncSet, r);
     }
 
     virtual Item *
@@ -749,7 +749,7 @@ static class ANON : public CItemSubtypeFT<Item_func_like, Item_func::Functype::L
 		tr = reason(PLAIN_EncSet, ss.str(), i);
 		tr.add_child(r1);
 
-		return new RewritePlan(PLAIN_OLK, solution.chooseOne(), tr);
+		return new (a.arena) RewritePlan(PLAIN_OLK, solution.chooseOne(), tr);
             }
         } else {
             // we cannot support non-constant search patterns
@@ -931,7 +931,7 @@ class CItemMinMax : public CItemSubtypeFN<Item_func_min_max, FN> {
         const reason rsn(out_es, why, i);
 
         //prepare rewrite plans
-        return new RewritePlanOneOLK(out_es, supported_es.chooseOne(),
+        return new (a.arena) RewritePlanOneOLK(out_es, supported_es.chooseOne(),
                                      childr_rp, rsn);
     }
 
@@ -1059,7 +1059,7 @@ static class ANON : public CItemSubtypeFN<Item_func_nullif, str_nullif> {
         const std::string why = "nullif";
         const reason rsn(out_es, why, i);
 
-        return new RewritePlanOneOLK(out_es, child_es.chooseOne(),
+        return new (a.arena) RewritePlanOneOLK(out_es, child_es.chooseOne(),
                                      childr_rp, rsn);
     }
 
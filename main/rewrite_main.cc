@@ -9,19 +9,25 @@
 #include <set>
 #include <list>
 #include <algorithm>
+#include <iterator>
 #include <stdio.h>
 #include <typeinfo>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <main/rewrite_main.hh>
 #include <main/rewrite_util.hh>
 #include <util/cryptdb_log.hh>
 #include <util/enum_text.hh>
+#include <util/timer.hh>
 #include <main/CryptoHandlers.hh>
 #include <parser/lex_util.hh>
 #include <main/sql_handler.hh>
 #include <main/dml_handler.hh>
 #include <main/ddl_handler.hh>
 #include <main/metadata_tables.hh>
+#include <main/metadata_store.hh>
+#include <main/stored_procedures.hh>
 #include <main/macro_util.hh>
 
 #include "field.h"
@@ -169,27 +175,16 @@ collectRecoveryDetails(const std::unique_ptr<Connect> &conn,
                        unsigned long unfinished_id,
                        std::unique_ptr<RecoveryDetails> *details)
 {
-    const std::string embedded_completion_table =
-        MetaData::Table::embeddedQueryCompletion();
     const std::string remote_completion_table =
         MetaData::Table::remoteQueryCompletion();
 
     // collect completion data
-    std::unique_ptr<DBResult> dbres;
-    const std::string embedded_completion_q =
-        " SELECT begin, complete, original_query, default_db FROM " +
-            embedded_completion_table +
-        "  WHERE id = " + std::to_string(unfinished_id) + ";";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(embedded_completion_q, &dbres));
-    assert(mysql_num_rows(dbres->n) == 1);
-
-    const MYSQL_ROW embedded_row = mysql_fetch_row(dbres->n);
-    const unsigned long *const l = mysql_fetch_lengths(dbres->n);
-    const std::string string_embedded_begin(embedded_row[0], l[0]);
-    const std::string string_embedded_complete(embedded_row[1], l[1]);
-    const std::string string_embedded_query(embedded_row[2], l[2]);
-    const std::string string_embedded_default_db(embedded_row[3], l[3]);
+    MetaStore::Completion embedded;
+    RETURN_FALSE_IF_FALSE(MetaData::store().getCompletion(e_conn,
+                                                          unfinished_id,
+                                                          &embedded));
 
+    std::unique_ptr<DBResult> dbres;
     const std::string remote_completion_q =
         " SELECT begin, complete FROM " + remote_completion_table +
         "  WHERE embedded_completion_id = " +
@@ -209,9 +204,8 @@ collectRecoveryDetails(const std::unique_ptr<Connect> &conn,
         assert(string_to_bool(string_remote_begin) == true);
     }
 
-    const bool embedded_begin = string_to_bool(string_embedded_begin);
-    const bool embedded_complete =
-        string_to_bool(string_embedded_complete);
+    const bool embedded_begin = embedded.begin;
+    const bool embedded_complete = embedded.complete;
     const bool remote_begin =
         false_if_false(existed_remote, string_remote_begin);
     const bool remote_complete =
@@ -223,8 +217,8 @@ collectRecoveryDetails(const std::unique_ptr<Connect> &conn,
         std::unique_ptr<RecoveryDetails>(
             new RecoveryDetails(embedded_begin, embedded_complete,
                                 existed_remote, remote_begin,
-                                remote_complete, string_embedded_query,
-                                string_embedded_default_db));
+                                remote_complete, embedded.original_query,
+                                embedded.default_db));
 
     return true;
 }
@@ -233,18 +227,13 @@ static bool
 abortQuery(const std::unique_ptr<Connect> &e_conn,
            unsigned long unfinished_id)
 {
-    const std::string embedded_completion_table =
-        MetaData::Table::embeddedQueryCompletion();
+    MetaStore &store = MetaData::store();
 
-    const std::string update_aborted =
-        " UPDATE " + embedded_completion_table +
-        "    SET aborted = TRUE"
-        "  WHERE id = " + std::to_string(unfinished_id) + ";";
-
-    RETURN_FALSE_IF_FALSE(e_conn->execute("START TRANSACTION"));
-    ROLLBACK_AND_RFIF(setBleedingTableToRegularTable(e_conn), e_conn);
-    ROLLBACK_AND_RFIF(e_conn->execute(update_aborted), e_conn);
-    ROLLBACK_AND_RFIF(e_conn->execute("COMMIT"), e_conn);
+    RETURN_FALSE_IF_FALSE(store.begin(e_conn));
+    STORE_ROLLBACK_AND_RFIF(setBleedingTableToRegularTable(e_conn), e_conn);
+    STORE_ROLLBACK_AND_RFIF(store.abortCompletion(e_conn, unfinished_id),
+                            e_conn);
+    STORE_ROLLBACK_AND_RFIF(store.commit(e_conn), e_conn);
 
     return true;
 }
@@ -253,18 +242,13 @@ static bool
 finishQuery(const std::unique_ptr<Connect> &e_conn,
             unsigned long unfinished_id)
 {
-    const std::string embedded_completion_table =
-        MetaData::Table::embeddedQueryCompletion();
-
-    const std::string update_completed =
-        " UPDATE " + embedded_completion_table +
-        "    SET complete = TRUE"
-        "  WHERE id = " + std::to_string(unfinished_id) + ";";
+    MetaStore &store = MetaData::store();
 
-    RETURN_FALSE_IF_FALSE(e_conn->execute("START TRANSACTION"));
-    ROLLBACK_AND_RFIF(setRegularTableToBleedingTable(e_conn), e_conn);
-    ROLLBACK_AND_RFIF(e_conn->execute(update_completed), e_conn);
-    ROLLBACK_AND_RFIF(e_conn->execute("COMMIT"), e_conn);
+    RETURN_FALSE_IF_FALSE(store.begin(e_conn));
+    STORE_ROLLBACK_AND_RFIF(setRegularTableToBleedingTable(e_conn), e_conn);
+    STORE_ROLLBACK_AND_RFIF(store.finishCompletion(e_conn, unfinished_id),
+                            e_conn);
+    STORE_ROLLBACK_AND_RFIF(store.commit(e_conn), e_conn);
 
     return true;
 }
@@ -456,15 +440,10 @@ static bool
 deltaSanityCheck(const std::unique_ptr<Connect> &conn,
                  const std::unique_ptr<Connect> &e_conn)
 {
-    const std::string embedded_completion =
-        MetaData::Table::embeddedQueryCompletion();
-    std::unique_ptr<DBResult> dbres;
-    const std::string unfinished_deltas =
-        " SELECT id, type FROM " + embedded_completion +
-        "  WHERE (begin = FALSE OR complete = FALSE)"
-        "    AND aborted != TRUE;";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(unfinished_deltas, &dbres));
-    const unsigned long long unfinished_count = mysql_num_rows(dbres->n);
+    std::vector<MetaStore::Completion> unfinished;
+    RETURN_FALSE_IF_FALSE(MetaData::store().unfinishedCompletions(e_conn,
+                                                          &unfinished));
+    const unsigned long long unfinished_count = unfinished.size();
     std::cerr << GREEN_BEGIN << "there are " << unfinished_count
               << " unfinished deltas" << COLOR_END << std::endl;
 
@@ -474,27 +453,136 @@ deltaSanityCheck(const std::unique_ptr<Connect> &conn,
         return false;
     }
 
-    const MYSQL_ROW row = mysql_fetch_row(dbres->n);
-    const unsigned long *const l = mysql_fetch_lengths(dbres->n);
-    const std::string string_unfinished_id(row[0], l[0]);
-    const std::string string_unfinished_type(row[1], l[1]);
-
-    const unsigned long unfinished_id =
-        atoi(string_unfinished_id.c_str());
+    const unsigned long unfinished_id = unfinished.front().id;
     const CompletionType type =
-        TypeText<CompletionType>::toType(string_unfinished_type);
+        TypeText<CompletionType>::toType(unfinished.front().type);
 
     switch (type) {
         case CompletionType::AdjustOnionCompletion:
             return fixAdjustOnion(conn, e_conn, unfinished_id);
         case CompletionType::DDLCompletion:
             return fixDDL(conn, e_conn, unfinished_id);
+        case CompletionType::StaleOnionCompletion:
+            // Only the stale flag changes; a field that is left stale
+            // gets refreshed again when it is next needed.
+            return abortQuery(e_conn, unfinished_id);
+        case CompletionType::CompactCompletion:
+            // The re-salted rows read the same under the old metadata;
+            // the directive can simply be issued again.
+            return abortQuery(e_conn, unfinished_id);
         default:
             std::cerr << "unknown completion type" << std::endl;
             return false;
     }
 }
 
+// Threads that deserialize layers during a schema load; 0 or 1 leaves
+// it all to the loading thread, which is the default: the edb_perf line
+// of loadSchemaInfo() shows whether more pay off for a schema.
+// > Layer constructors do NTL arithmetic (HOM_dec, OPE), so without
+//   NTL_THREADS the load stays on one thread whatever
+//   CRYPTDB_LOAD_THREADS says.
+static unsigned int
+loadThreads()
+{
+#ifndef NTL_THREADS
+    return 1;
+#else
+    static const unsigned int threads = [] () {
+        const char *const ev = getenv("CRYPTDB_LOAD_THREADS");
+        return ev ? static_cast<unsigned int>(strtoul(ev, NULL, 10)) : 1;
+    }();
+
+    return threads;
+#endif
+}
+
+// SchemaInfo, DatabaseMeta, TableMeta, FieldMeta and OnionMeta lie
+// above the layers.
+static const unsigned int layer_depth = 5;
+
+struct LayerJob {
+    unsigned long id;
+    const std::string *serial;
+    EncLayer *layer;
+};
+
+static void
+collectLayers(const MetaStore::ChildMap &children, unsigned long parent_id,
+              unsigned int depth, std::vector<LayerJob> *const out)
+{
+    const auto it = children.find(parent_id);
+    if (children.end() == it) {
+        return;
+    }
+
+    for (const auto &child : it->second) {
+        if (layer_depth == depth + 1) {
+            const LayerJob job = {child.id, &child.serial_object, NULL};
+            out->push_back(job);
+        } else {
+            collectLayers(children, child.id, depth + 1, out);
+        }
+    }
+}
+
+struct LayerJobs {
+    std::vector<LayerJob> *jobs;
+    size_t next;
+};
+
+static void *
+layerWorker(void *const arg)
+{
+    LayerJobs *const work = static_cast<LayerJobs *>(arg);
+    for (;;) {
+        const size_t i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+        if (i >= work->jobs->size()) {
+            return NULL;
+        }
+
+        LayerJob &job = (*work->jobs)[i];
+        try {
+            job.layer =
+                EncLayerFactory::deserializeLayer(job.id, *job.serial);
+        } catch (...) {
+            // OnionMeta::fetchChildren() tries again, and fails on the
+            // loading thread.
+        }
+    }
+}
+
+// Deserializes every layer in @rows ahead of the tree, which is where
+// the key setup happens, on up to loadThreads() threads.
+static unsigned int
+buildLayers(SchemaRows *const rows)
+{
+    std::vector<LayerJob> jobs;
+    collectLayers(rows->children, 0, 0, &jobs);
+
+    const unsigned int threads =
+        jobs.size() < loadThreads() ? jobs.size() : loadThreads();
+    LayerJobs work = {&jobs, 0};
+    std::vector<pthread_t> workers(threads > 1 ? threads - 1 : 0);
+    for (auto &it : workers) {
+        TEST_TextMessageError(0 == pthread_create(&it, NULL, layerWorker,
+                                                  &work),
+                              "failed to start a schema load thread");
+    }
+    layerWorker(&work);
+    for (auto it : workers) {
+        pthread_join(it, NULL);
+    }
+
+    for (const auto &job : jobs) {
+        if (job.layer) {
+            rows->layers[job.id].reset(job.layer);
+        }
+    }
+
+    return workers.size() + 1;
+}
+
 // This function will not build all of our tables when it is run
 // on an empty database.  If you don't have a parent, your table won't be
 // built.  We probably want to seperate our database logic into 3 parts.
@@ -508,11 +596,23 @@ loadSchemaInfo(const std::unique_ptr<Connect> &conn,
     // Must be done before loading the children.
     assert(deltaSanityCheck(conn, e_conn));
 
+    // The whole serialized tree in one read; the layers, which are the
+    // expensive part, are deserialized before the tree is put together.
+    timer t;
+    SchemaRows rows;
+    TEST_TextMessageError(MetaData::store().fetchAllChildren(e_conn,
+                                                             &rows.children),
+                          "failed to read the schema!");
+    const uint64_t fetch_usec = t.lap();
+    const unsigned int threads = buildLayers(&rows);
+    const size_t layers = rows.layers.size();
+    const uint64_t layer_usec = t.lap();
+
     SchemaInfo *const schema = new SchemaInfo();
     // Recursively rebuild the AbstractMeta<Whatever> and it's children.
     std::function<DBMeta *(DBMeta *const)> loadChildren =
-        [&loadChildren, &e_conn](DBMeta *const parent) {
-            auto kids = parent->fetchChildren(e_conn);
+        [&loadChildren, &rows](DBMeta *const parent) {
+            auto kids = parent->fetchChildren(&rows);
             for (auto it : kids) {
                 loadChildren(it);
             }
@@ -525,6 +625,16 @@ loadSchemaInfo(const std::unique_ptr<Connect> &conn,
     // But first we must decide on a place to create the database from.
     assert(sanityCheck(*schema));
 
+    size_t objects = 0;
+    for (const auto &it : rows.children) {
+        objects += it.second.size();
+    }
+    LOG(edb_perf) << "schema load: " << objects << " objects in "
+                  << fetch_usec / 1000 << " ms, " << layers
+                  << " layers on " << threads << " threads in "
+                  << layer_usec / 1000 << " ms, tree in "
+                  << t.lap() / 1000 << " ms";
+
     return schema;
 }
 
@@ -700,12 +810,15 @@ buildTypeTextTranslator()
     // Query Completions.
     const std::vector<std::string> completion_strings
     {
-        "DDLCompletion", "AdjustOnionCompletion"
+        "DDLCompletion", "AdjustOnionCompletion", "StaleOnionCompletion",
+        "CompactCompletion"
     };
     const std::vector<CompletionType> completion_types
     {
         CompletionType::DDLCompletion,
-        CompletionType::AdjustOnionCompletion
+        CompletionType::AdjustOnionCompletion,
+        CompletionType::StaleOnionCompletion,
+        CompletionType::CompactCompletion
     };
     RETURN_FALSE_IF_FALSE(completion_strings.size()
                             == completion_types.size());
@@ -725,82 +838,63 @@ buildTypeTextTranslatorHack()
     return true;
 }
 
-//l gets updated to the new level
-static std::string
-removeOnionLayer(const Analysis &a, const TableMeta &tm,
-                 const FieldMeta &fm,
-                 OnionMetaAdjustor *const om_adjustor,
-                 SECLEVEL *const new_level,
-                 std::vector<std::unique_ptr<Delta> > *const deltas)
-{
-    // Remove the EncLayer.
-    EncLayer const &back_el = om_adjustor->popBackEncLayer();
-
-    // Update the Meta.
-    deltas->push_back(std::unique_ptr<Delta>(
-                        new DeleteDelta(back_el,
-                                        om_adjustor->getOnionMeta())));
-    const SECLEVEL local_new_level = om_adjustor->getSecLevel();
-
-    //removes onion layer at the DB
-    const std::string dbname = a.getDatabaseName();
-    const std::string anon_table_name = tm.getAnonTableName();
-    Item_field *const salt =
-        new Item_field(NULL, dbname.c_str(), anon_table_name.c_str(),
-                       fm.getSaltName().c_str());
-
-    const std::string fieldanon = om_adjustor->getAnonOnionName();
-    Item_field *const field =
-        new Item_field(NULL, dbname.c_str(), anon_table_name.c_str(),
-                       fieldanon.c_str());
-
-    Item *const decUDF = back_el.decryptUDF(field, salt);
-
-    std::stringstream query;
-    query << " UPDATE " << dbname << "." << anon_table_name
-          << "    SET " << fieldanon  << " = " << *decUDF
-          << ";";
-
-    std::cerr << "\nADJUST: \n" << query.str() << std::endl;
-
-    //execute decryption query
-
-    LOG(cdb_v) << "adjust onions: \n" << query.str() << std::endl;
-
-    *new_level = local_new_level;
-    return query.str();
-}
-
 /*
- * Adjusts the onion for a field fm/itf to level: tolevel.
- *
- * Issues queries for decryption to the DBMS.
- *
- * Adjusts the schema metadata at the proxy about onion layers. Propagates the
- * changed schema to persistent storage.
+ * Adjusts several onions of the same table in one pass over the data.
  *
+ * The decryption UDFs of every removed layer are nested so that each
+ * onion column is rewritten exactly once, and all of the columns are
+ * rewritten by the same UPDATE.
  */
 static std::pair<std::vector<std::unique_ptr<Delta> >,
                  std::list<std::string>>
-adjustOnion(const Analysis &a, onion o, const TableMeta &tm,
-            const FieldMeta &fm, SECLEVEL tolevel)
+adjustOnions(const Analysis &a, const TableMeta &tm,
+             const std::list<OnionAdjustExcept> &adjustments)
 {
-    std::cout << "onion: " << TypeText<onion>::toText(o) << std::endl;
-    // Make a copy of the onion meta for the purpose of making
-    // modifications during removeOnionLayer(...)
-    OnionMetaAdjustor om_adjustor(*fm.getOnionMeta(o));
-    SECLEVEL newlevel = om_adjustor.getSecLevel();
-    assert(newlevel != SECLEVEL::INVALID);
+    const std::string dbname = a.getDatabaseName();
+    const std::string anon_table_name = tm.getAnonTableName();
 
-    std::list<std::string> adjust_queries;
     std::vector<std::unique_ptr<Delta> > deltas;
-    while (newlevel > tolevel) {
-        auto query =
-            removeOnionLayer(a, tm, fm, &om_adjustor, &newlevel,
-                             &deltas);
-        adjust_queries.push_back(query);
+    std::stringstream set_clauses;
+    for (const auto &it : adjustments) {
+        assert(&it.tm == &tm);
+
+        OnionMetaAdjustor om_adjustor(*it.fm.getOnionMeta(it.o));
+        SECLEVEL newlevel = om_adjustor.getSecLevel();
+        assert(newlevel != SECLEVEL::INVALID);
+        if (newlevel <= it.tolevel) {
+            continue;
+        }
+
+        Item_field *const salt =
+            new Item_field(NULL, dbname.c_str(), anon_table_name.c_str(),
+                           it.fm.getSaltName().c_str());
+        const std::string fieldanon = om_adjustor.getAnonOnionName();
+        Item *dec =
+            new Item_field(NULL, dbname.c_str(), anon_table_name.c_str(),
+                           fieldanon.c_str());
+        while (newlevel > it.tolevel) {
+            EncLayer const &back_el = om_adjustor.popBackEncLayer();
+            deltas.push_back(std::unique_ptr<Delta>(
+                                new DeleteDelta(back_el,
+                                            om_adjustor.getOnionMeta())));
+            dec = back_el.decryptUDF(dec, salt);
+            newlevel = om_adjustor.getSecLevel();
+        }
+        TEST_UnexpectedSecurityLevel(it.o, it.tolevel, newlevel);
+
+        set_clauses << (set_clauses.str().empty() ? "" : ", ")
+                    << fieldanon << " = " << *dec;
+    }
+
+    std::list<std::string> adjust_queries;
+    if (false == set_clauses.str().empty()) {
+        std::stringstream query;
+        query << " UPDATE " << dbname << "." << anon_table_name
+              << "    SET " << set_clauses.str()
+              << ";";
+        LOG(cdb_v) << "adjust onions: \n" << query.str() << std::endl;
+        adjust_queries.push_back(query.str());
     }
-    TEST_UnexpectedSecurityLevel(o, tolevel, newlevel);
 
     return make_pair(std::move(deltas), adjust_queries);
 }
@@ -915,15 +1009,51 @@ decrypt_item_layers(Item *const i, const FieldMeta *const fm, onion o,
 
     const OnionMeta *const om = fm->getOnionMeta(o);
     assert(om);
+    const OnionPipeline *const pipeline = om->getPipeline();
+    if (pipeline) {
+        Item *const fused = pipeline->decrypt(i, IV);
+        if (fused) {
+            return fused;
+        }
+    }
+
     const auto &enc_layers = om->layers;
     for (auto it = enc_layers.rbegin(); it != enc_layers.rend(); ++it) {
-        dec = (*it)->decrypt(dec, IV);
+        dec = (*it)->cachedDecrypt(dec, IV);
         LOG(cdb_v) << "dec okay";
     }
 
     return dec;
 }
 
+// decrypt_item_layers() on every value of a result column, one layer at
+// a time, so that layers with a batch path get all of the values at
+// once; through the onion's pipeline when it has one.
+void
+decrypt_column_layers(std::vector<Item *> *const items,
+                      const FieldMeta *const fm, onion o,
+                      const std::vector<uint64_t> &IVs)
+{
+    assert(items->size() == IVs.size());
+
+    const OnionMeta *const om = fm->getOnionMeta(o);
+    assert(om);
+    const OnionPipeline *const pipeline = om->getPipeline();
+    if (pipeline && pipeline->decryptColumn(items, IVs)) {
+        return;
+    }
+
+    const auto &enc_layers = om->layers;
+    for (auto it = enc_layers.rbegin(); it != enc_layers.rend(); ++it) {
+        if ((*it)->decryptBatch(items, IVs)) {
+            continue;
+        }
+        for (size_t i = 0; i < items->size(); ++i) {
+            (*items)[i] = (*it)->cachedDecrypt((*items)[i], IVs[i]);
+        }
+    }
+}
+
 
 // returns the intersection of the es and fm.encdesc
 // by also taking into account what onions are stale
@@ -971,7 +1101,8 @@ static class ANON : public CItemSubtypeIT<Item_subselect,
         // Gather subquery.
         std::unique_ptr<Analysis>
             subquery_analysis(new Analysis(a.getDatabaseName(),
-                                           a.getSchema()));
+                                           a.getSchema(),
+                                           a.sharedArena()));
         const st_select_lex *const select_lex =
             RiboldMYSQL::get_select_lex(i);
         process_select_lex(*select_lex, *subquery_analysis);
@@ -1019,7 +1150,7 @@ static class ANON : public CItemSubtypeIT<Item_subselect,
                 FAIL_TextMessageError("Unknown subquery type!");
         }
 
-        return new RewritePlanWithAnalysis(out_es, rsn,
+        return new (a.arena) RewritePlanWithAnalysis(out_es, rsn,
                                            std::move(subquery_analysis));
     }
 
@@ -1120,7 +1251,7 @@ static class ANON : public CItemSubtypeIT<Item_cache, Item::Type::CACHE_ITEM> {
         const EncSet out_es = PLAIN_EncSet;
         tr = reason(out_es, "is cache item", i);
 
-        return new RewritePlan(out_es, tr);
+        return new (a.arena) RewritePlan(out_es, tr);
         */
 
         /*
@@ -1203,6 +1334,54 @@ optimize_table_list(List<TABLE_LIST> *tll, Analysis &a)
     }
 }
 
+/*
+ * @first is the adjustment that stopped the rewrite of @query. Rewrite
+ * the query again, taking the adjustments found so far as done, until
+ * every onion it needs is known; so that each table is rewritten once
+ * for the query instead of once per layer.
+ */
+static std::list<OnionAdjustExcept>
+collectOnionAdjustments(Analysis &a, const ProxyState &ps,
+                        const SQLHandler &handler,
+                        const std::string &query,
+                        const OnionAdjustExcept &first)
+{
+    // Each query_parse makes its own THD current.
+    THD *const thd = current_thd;
+    auto restore_thd = cleanup([thd] {thd->store_globals();});
+
+    std::list<OnionAdjustExcept> adjustments({first});
+    std::map<const OnionMeta *, SECLEVEL> assumed_levels;
+    assumed_levels[first.fm.getOnionMeta(first.o)] = first.tolevel;
+
+    for (;;) {
+        const std::unique_ptr<query_parse>
+            p(new query_parse(a.getDatabaseName(), query));
+        LEX *const lex = p->lex();
+        Analysis retry(a.getDatabaseName(), a.getSchema());
+        retry.assumed_levels = assumed_levels;
+        try {
+            handler.transformLex(retry, lex, ps);
+            return adjustments;
+        } catch (OnionAdjustExcept e) {
+            const OnionMeta *const om = e.fm.getOnionMeta(e.o);
+            assert(assumed_levels.end() == assumed_levels.find(om)
+                   || e.tolevel < assumed_levels[om]);
+            assumed_levels[om] = e.tolevel;
+
+            // Keep only the lowest level for each onion.
+            adjustments.remove_if([&e](const OnionAdjustExcept &it) {
+                return &it.fm == &e.fm && it.o == e.o;
+            });
+            adjustments.push_back(e);
+        } catch (...) {
+            // Adjust what we know about; the reissued query will report
+            // the rest.
+            return adjustments;
+        }
+    }
+}
+
 static bool
 noRewrite(const LEX &lex) {
     switch (lex.sql_command) {
@@ -1225,6 +1404,86 @@ noRewrite(const LEX &lex) {
     return false;
 }
 
+// SET [SESSION] autocommit = <value>, in lower case. Values other than
+// 1, ON and TRUE, such as a variable, count as 0: that only costs the
+// session its caching.
+static CacheFootprint::Kind
+autocommitKind(const std::string &query)
+{
+    const std::string name = "autocommit";
+    const size_t at = query.find(name);
+    if (std::string::npos == at) {
+        return CacheFootprint::Kind::NONE;
+    }
+
+    const size_t begin =
+        query.find_first_not_of(" \t\r\n:='\"", at + name.size());
+    const std::string value =
+        std::string::npos == begin
+            ? ""
+            : query.substr(begin, query.find_first_of(" \t\r\n,;'\"",
+                                                      begin) - begin);
+    return "1" == value || "on" == value || "true" == value
+         ? CacheFootprint::Kind::AUTOCOMMIT_ON
+         : CacheFootprint::Kind::AUTOCOMMIT_OFF;
+}
+
+// Reads cached by the proxy must only depend on the tables they name,
+// which MySQL's own query cache also requires of them. Each table is
+// keyed by its own database; a query may name tables outside @db.
+static CacheFootprint
+cacheFootprint(const LEX &lex, const std::string &db,
+               const std::string &query)
+{
+    CacheFootprint out(db);
+    for (const TABLE_LIST *t = lex.query_tables; t; t = t->next_global) {
+        out.tables.insert(CacheFootprint::Table(
+            t->db ? std::string(t->db, t->db_length) : db,
+            std::string(t->table_name, t->table_name_length)));
+    }
+
+    switch (lex.sql_command) {
+    case SQLCOM_SELECT:
+        out.kind = lex.safe_to_cache_query && NULL == lex.result
+                   && 0 == lex.describe && false == out.tables.empty()
+                 ? CacheFootprint::Kind::READ
+                 : CacheFootprint::Kind::NONE;
+        break;
+    case SQLCOM_INSERT:
+    case SQLCOM_REPLACE:
+    case SQLCOM_UPDATE:
+    case SQLCOM_DELETE:
+    case SQLCOM_CREATE_TABLE:
+    case SQLCOM_ALTER_TABLE:
+    case SQLCOM_DROP_TABLE:
+        out.kind = CacheFootprint::Kind::WRITE;
+        break;
+    case SQLCOM_DROP_DB:
+        // No tables; every entry reading a table of the database goes.
+        out.kind = CacheFootprint::Kind::WRITE;
+        out.db = std::string(lex.name.str, lex.name.length);
+        out.tables.clear();
+        break;
+    case SQLCOM_BEGIN:
+        out.kind = CacheFootprint::Kind::TRANSACTION_BEGIN;
+        break;
+    case SQLCOM_COMMIT:
+    case SQLCOM_ROLLBACK:
+        out.kind = CacheFootprint::Kind::TRANSACTION_END;
+        break;
+    case SQLCOM_SET_OPTION:
+        out.kind = autocommitKind(toLowerCase(query));
+        break;
+    default:
+        // USE, SHOW and the like; anything else is replaced with a
+        // no-op.
+        out.kind = CacheFootprint::Kind::NONE;
+        break;
+    }
+
+    return out;
+}
+
 static std::string
 lex_to_query(LEX *const lex)
 {
@@ -1233,6 +1492,163 @@ lex_to_query(LEX *const lex)
     return o.str();
 }
 
+// Rebuild the onions of @fm that fell behind oAGG from the current HOM
+// ciphertexts. Only the rows an in-place increment touched are read:
+// it sets their salt to STALE_ROW_SALT, which no other row has (see
+// rewrite_field_value_pairs). Each gets a new salt; the new ciphertexts
+// go into a temporary table keyed by oAGG, and one joined UPDATE, led by
+// the marked rows, copies them over. Running the queries twice is
+// harmless, the second run finds no marked rows.
+// > Like SpecialUpdate this relies on nothing else writing the table
+//   between the SELECT and the UPDATE.
+static std::list<std::string>
+refreshStaleOnions(const Analysis &a, const ProxyState &ps,
+                   const TableMeta &tm, const FieldMeta &fm)
+{
+    static const unsigned int rows_per_insert = 500;
+
+    assert(fm.getHasSalt() && false == fm.getSharesSalt());
+    const std::string table =
+        a.getDatabaseName() + "." + tm.getAnonTableName();
+    const std::string agg_name = fm.getOnionMeta(oAGG)->getAnonOnionName();
+    const std::string salt_name = fm.getSaltName();
+    const std::string refresh_table =
+        a.getDatabaseName() + ".refresh_" + agg_name;
+    const std::string stale_salt = std::to_string(STALE_ROW_SALT);
+
+    std::vector<std::pair<onion, const OnionMeta *> > onions;
+    std::string columns = agg_name + ", " + salt_name;
+    for (auto it : fm.orderedOnionMetas()) {
+        if (oAGG != it.first->getValue()) {
+            onions.push_back(std::make_pair(it.first->getValue(),
+                                            it.second));
+            columns += ", " + it.second->getAnonOnionName();
+        }
+    }
+
+    std::unique_ptr<DBResult> dbres;
+    const std::string select_q =
+        " SELECT " + agg_name +
+        "   FROM " + table +
+        "  WHERE " + salt_name + " = " + stale_salt +
+        "    AND " + agg_name + " IS NOT NULL;";
+    TEST_TextMessageError(ps.getConn()->execute(select_q, &dbres),
+                          "failed to read HOM onion for refresh!");
+    const ResType res = dbres->unpack();
+    TEST_TextMessageError(res.success(),
+                          "failed to unpack HOM onion for refresh!");
+
+    std::list<std::string> queries;
+    if (0 == res.rows.size()) {
+        return queries;
+    }
+
+    // HOM ciphertexts are random, a short prefix finds the row.
+    queries.push_back(" DROP TEMPORARY TABLE IF EXISTS "
+                      + refresh_table + ";");
+    queries.push_back(" CREATE TEMPORARY TABLE " + refresh_table +
+                      " (INDEX (" + agg_name + "(16)))"
+                      " SELECT " + columns +
+                      "   FROM " + table + " LIMIT 0;");
+
+    std::ostringstream values;
+    unsigned int pending = 0;
+    for (const auto &row : res.rows) {
+        salt_type salt;
+        do {
+            salt = randomValue();
+        } while (STALE_ROW_SALT == salt);
+        // HOM takes no IV.
+        Item *const plain =
+            decrypt_item_layers(row[0].get(), &fm, oAGG, 0);
+
+        values << (0 == pending ? "" : ", ") << "(" << *row[0] << ", "
+               << salt;
+        for (const auto &it : onions) {
+            values << ", " << *encrypt_item_layers(*plain, it.first,
+                                                   *it.second, a, salt);
+        }
+        values << ")";
+
+        if (rows_per_insert == ++pending) {
+            queries.push_back(" INSERT INTO " + refresh_table +
+                              " VALUES " + values.str() + ";");
+            values.str("");
+            pending = 0;
+        }
+    }
+    if (pending > 0) {
+        queries.push_back(" INSERT INTO " + refresh_table +
+                          " VALUES " + values.str() + ";");
+    }
+
+    std::ostringstream update;
+    update << " UPDATE " << table << " t STRAIGHT_JOIN "
+           << refresh_table << " r"
+           << "     ON t." << agg_name << " = r." << agg_name
+           << "    SET t." << salt_name << " = r." << salt_name;
+    for (const auto &it : onions) {
+        const std::string &name = it.second->getAnonOnionName();
+        update << ", t." << name << " = r." << name;
+    }
+    update << "  WHERE t." << salt_name << " = " << stale_salt << ";";
+    queries.push_back(update.str());
+    queries.push_back(" DROP TEMPORARY TABLE " + refresh_table + ";");
+
+    return queries;
+}
+
+// Refreshes @fields of @tm, then has @query reissued. The stale flags
+// only change through the deltas; the cached schema is left alone.
+static RewriteOutput *
+refreshFields(const Analysis &a, const ProxyState &ps, const TableMeta &tm,
+              const std::vector<const FieldMeta *> &fields,
+              const std::string &query)
+{
+    std::vector<std::unique_ptr<Delta> > deltas;
+    std::list<std::string> refresh_queries;
+    for (const FieldMeta *const fm : fields) {
+        refresh_queries.splice(refresh_queries.end(),
+                               refreshStaleOnions(a, ps, tm, *fm));
+        deltas.push_back(std::unique_ptr<Delta>(
+            new ReplaceDelta(*fm, tm, fm->serializeStale(tm, false))));
+    }
+
+    return new StaleOnionOutput(query, std::move(deltas),
+                                refresh_queries);
+}
+
+// A query that needed an onion of a stale field gets that field
+// refreshed first; returns NULL if the query didn't ask a stale field
+// for anything, so the NoAvailableEncSet has another cause.
+static RewriteOutput *
+staleOnionRefresh(const Analysis &a, const ProxyState &ps, const LEX &lex,
+                  const std::string &query)
+{
+    // One table per pass; the reissue comes back for the others.
+    for (const TABLE_LIST *t = lex.query_tables; t; t = t->next_global) {
+        const std::string db = t->db ? t->db : a.getDatabaseName();
+        if (false == a.tableMetaExists(db, t->table_name)) {
+            continue;
+        }
+
+        const TableMeta &tm = a.getTableMeta(db, t->table_name);
+        std::vector<const FieldMeta *> fields;
+        for (const auto &it : tm.children) {
+            const FieldMeta *const fm = it.second.get();
+            if (a.stale_fields_asked.end()
+                != a.stale_fields_asked.find(fm)) {
+                fields.push_back(fm);
+            }
+        }
+        if (fields.size() > 0) {
+            return refreshFields(a, ps, tm, fields, query);
+        }
+    }
+
+    return NULL;
+}
+
 const bool Rewriter::translator_dummy = buildTypeTextTranslatorHack();
 const std::unique_ptr<SQLDispatcher> Rewriter::dml_dispatcher =
     std::unique_ptr<SQLDispatcher>(buildDMLDispatcher());
@@ -1255,6 +1671,7 @@ Rewriter::dispatchOnLex(Analysis &a, const ProxyState &ps,
     LEX *const lex = p->lex();
 
     LOG(cdb_v) << "pre-analyze " << *lex;
+    a.cache_footprint = cacheFootprint(*lex, a.getDatabaseName(), query);
 
     // optimization: do not process queries that we will not rewrite
     if (noRewrite(*lex)) {
@@ -1268,13 +1685,49 @@ Rewriter::dispatchOnLex(Analysis &a, const ProxyState &ps,
         } catch (OnionAdjustExcept e) {
             LOG(cdb_v) << "caught onion adjustment";
             std::cout << "Adjusting onion!" << std::endl;
-            std::pair<std::vector<std::unique_ptr<Delta> >,
-                      std::list<std::string>>
-                out_data = adjustOnion(a, e.o, e.tm, e.fm, e.tolevel);
-            std::vector<std::unique_ptr<Delta> > &deltas =
-                out_data.first;
-            const std::list<std::string>  &adjust_queries =
-                out_data.second;
+            const std::list<OnionAdjustExcept> adjustments =
+                collectOnionAdjustments(a, ps, handler, query, e);
+
+            // One UPDATE per table; the stored procedure takes
+            // adjust_onion_queries, any remaining tables are adjusted
+            // when the query is reissued.
+            std::vector<std::unique_ptr<Delta> > deltas;
+            std::list<std::string> adjust_queries;
+            std::list<const TableMeta *> tables;
+            for (const auto &it : adjustments) {
+                if (tables.end() == std::find(tables.begin(), tables.end(),
+                                              &it.tm)) {
+                    tables.push_back(&it.tm);
+                }
+            }
+            if (tables.size() > adjust_onion_queries) {
+                LOG(warn) << "adjusting " << adjust_onion_queries
+                          << " of " << tables.size() << " tables,"
+                          << " the rest on reissue of: " << query;
+                tables.resize(adjust_onion_queries);
+            }
+            for (auto tm : tables) {
+                std::list<OnionAdjustExcept> table_adjustments;
+                for (const auto &it : adjustments) {
+                    if (&it.tm == tm) {
+                        table_adjustments.push_back(it);
+                    }
+                }
+
+                std::pair<std::vector<std::unique_ptr<Delta> >,
+                          std::list<std::string>>
+                    out_data = adjustOnions(a, *tm, table_adjustments);
+                for (const auto &q : out_data.second) {
+                    TEST_TextMessageError(
+                        q.size() <= adjust_onion_query_bytes,
+                        "onion adjustment of " + tm->getAnonTableName()
+                        + " is longer than adjustOnion takes");
+                }
+                std::move(out_data.first.begin(), out_data.first.end(),
+                          std::back_inserter(deltas));
+                adjust_queries.splice(adjust_queries.end(),
+                                      out_data.second);
+            }
             std::function<std::string(const std::string &)>
                 hackEscape = [&ps](const std::string &s)
             {
@@ -1282,6 +1735,29 @@ Rewriter::dispatchOnLex(Analysis &a, const ProxyState &ps,
             };
             return new AdjustOnionOutput(query, std::move(deltas),
                                          adjust_queries, hackEscape);
+        } catch (NoAvailableEncSet &e) {
+            RewriteOutput *const refresh =
+                staleOnionRefresh(a, ps, *lex, query);
+            if (NULL == refresh) {
+                throw;
+            }
+            LOG(cdb_v) << "refreshing stale onions";
+            return refresh;
+        }
+
+        // The first in-place HOM increment of a field marks its other
+        // onions stale before the increment is issued.
+        if (false == a.special_update
+            && false == a.newly_stale_fields.empty()) {
+            std::vector<std::unique_ptr<Delta> > deltas;
+            for (auto it : a.newly_stale_fields) {
+                deltas.push_back(std::unique_ptr<Delta>(
+                    new ReplaceDelta(*it.first, *it.second,
+                                     it.first->serializeStale(*it.second,
+                                                              true))));
+            }
+            return new StaleOnionOutput(query, std::move(deltas),
+                                        std::list<std::string>());
         }
 
         // Return if it's a regular DML query.
@@ -1341,6 +1817,260 @@ struct DirectiveData {
     }
 };
 
+// Takes the onions of one table down to the given levels in a single
+// pass; cryptdblearn emits these as its adjustment plan.
+// SYNTAX
+// > DIRECTIVE ADJUST <table> <field> <onion> <level>
+//                            [<field> <onion> <level> ...]
+static RewriteOutput *
+handleAdjustDirective(Analysis &a, const ProxyState &ps,
+                      const std::string &query)
+{
+    std::list<std::string> tokens = split(query, " \t\n;");
+    TEST_TextMessageError(tokens.size() >= 6 && 0 == (tokens.size() % 3),
+                          "malformed ADJUST directive!");
+    tokens.pop_front();
+    tokens.pop_front();
+
+    const std::string table_name = tokens.front();
+    tokens.pop_front();
+    const TableMeta &tm = a.getTableMeta(a.getDatabaseName(), table_name);
+
+    std::list<OnionAdjustExcept> adjustments;
+    while (!tokens.empty()) {
+        const FieldMeta &fm = a.getFieldMeta(tm, tokens.front());
+        tokens.pop_front();
+        const onion o = TypeText<onion>::toType(tokens.front());
+        tokens.pop_front();
+        const SECLEVEL level = TypeText<SECLEVEL>::toType(tokens.front());
+        tokens.pop_front();
+
+        TEST_TextMessageError(fm.hasOnion(o), "field has no such onion!");
+        adjustments.push_back(OnionAdjustExcept(tm, fm, o, level));
+    }
+
+    std::pair<std::vector<std::unique_ptr<Delta> >, std::list<std::string>>
+        out_data = adjustOnions(a, tm, adjustments);
+    if (out_data.second.empty()) {
+        // Already at (or below) the requested levels.
+        return new SimpleOutput(mysql_noop());
+    }
+
+    std::function<std::string(const std::string &)>
+        hackEscape = [&ps](const std::string &s)
+    {
+        return escapeString(ps.getConn(), s);
+    };
+    return new AdjustOnionOutput(query, std::move(out_data.first),
+                                 out_data.second, hackEscape);
+}
+
+// Re-salts every salted field of @tm with the salt of the first one,
+// which becomes the row salt. Only onions still at RND depend on the
+// salt; each field's salt column is overwritten in the same UPDATE so
+// the rows stay readable under the old metadata, and rows already
+// re-salted are skipped.
+// > Like SpecialUpdate this relies on nothing else writing the table
+//   between the SELECT and the UPDATEs.
+static std::list<std::string>
+resaltRows(const Analysis &a, const ProxyState &ps, const TableMeta &tm,
+           const std::vector<FieldMeta *> &salted)
+{
+    assert(salted.size() > 0);
+    const std::string table =
+        a.getDatabaseName() + "." + tm.getAnonTableName();
+    const std::string row_salt_name = salted.front()->getSaltName();
+
+    // The columns to read for each of the other fields: its salt and
+    // then its RND onions.
+    std::vector<std::vector<const OnionMeta *> > rnd_onions;
+    std::string columns = row_salt_name;
+    std::string differ;
+    for (auto it = salted.begin() + 1; it != salted.end(); ++it) {
+        columns += ", " + (*it)->getSaltName();
+        differ += std::string(differ.empty() ? "" : " OR ") +
+                  (*it)->getSaltName() + " <> " + row_salt_name;
+
+        std::vector<const OnionMeta *> onions;
+        for (auto om_it : (*it)->orderedOnionMetas()) {
+            if (SECLEVEL::RND == a.getOnionLevel(*om_it.second)) {
+                onions.push_back(om_it.second);
+                columns += ", " + om_it.second->getAnonOnionName();
+            }
+        }
+        rnd_onions.push_back(onions);
+    }
+
+    std::list<std::string> queries;
+    if (1 == salted.size()) {
+        return queries;
+    }
+
+    std::unique_ptr<DBResult> dbres;
+    const std::string select_q =
+        " SELECT " + columns +
+        "   FROM " + table +
+        "  WHERE " + differ + ";";
+    TEST_TextMessageError(ps.getConn()->execute(select_q, &dbres),
+                          "failed to read salts for compaction!");
+    const ResType res = dbres->unpack();
+    TEST_TextMessageError(res.success(),
+                          "failed to unpack salts for compaction!");
+
+    for (const auto &row : res.rows) {
+        const uint64_t row_salt =
+            static_cast<Item_int *>(row[0].get())->value;
+
+        std::ostringstream set;
+        bool first = true;
+        std::ostringstream where;
+        where << row_salt_name << " = " << row_salt;
+        unsigned int col = 1;
+        for (unsigned int i = 1; i < salted.size(); ++i) {
+            const FieldMeta &fm = *salted[i];
+            const uint64_t salt =
+                static_cast<Item_int *>(row[col++].get())->value;
+            const std::vector<const OnionMeta *> &onions =
+                rnd_onions[i - 1];
+            if (salt == row_salt) {
+                col += onions.size();
+                continue;
+            }
+
+            for (const OnionMeta *const om : onions) {
+                Item *const ctext = row[col++].get();
+                if (RiboldMYSQL::is_null(*ctext)) {
+                    continue;
+                }
+                const EncLayer &rnd = a.getBackEncLayer(*om);
+                Item *const inner = rnd.decrypt(ctext, salt);
+                set << (first ? "" : ", ") << om->getAnonOnionName()
+                    << " = " << *rnd.encrypt(*inner, row_salt);
+                first = false;
+            }
+            set << (first ? "" : ", ") << fm.getSaltName() << " = "
+                << row_salt;
+            first = false;
+            where << " AND " << fm.getSaltName() << " = " << salt;
+        }
+        assert(row.size() == col);
+
+        queries.push_back(" UPDATE " + table + " SET " + set.str() +
+                          "  WHERE " + where.str() + ";");
+    }
+
+    return queries;
+}
+
+// The second half of a migration: drops the salt columns the fields
+// no longer use and narrows HOM onions to their exact width. Both are
+// found by asking the server so that this can be repeated.
+static RewriteOutput *
+compactCleanup(Analysis &a, const ProxyState &ps, const TableMeta &tm,
+               const std::string &query)
+{
+    const std::string &db = a.getDatabaseName();
+    std::unique_ptr<DBResult> dbres;
+    const std::string columns_q =
+        " SELECT COLUMN_NAME, DATA_TYPE, IS_NULLABLE "
+        "   FROM INFORMATION_SCHEMA.COLUMNS "
+        "  WHERE TABLE_SCHEMA = '" + escapeString(ps.getConn(), db) + "'"
+        "    AND TABLE_NAME = '"
+                 + escapeString(ps.getConn(), tm.getAnonTableName()) + "';";
+    TEST_TextMessageError(ps.getConn()->execute(columns_q, &dbres),
+                          "failed to read columns for compaction!");
+
+    std::set<std::string> hom_columns;
+    for (const auto &it : tm.children) {
+        const OnionMeta *const om = it.second->getOnionMeta(oAGG);
+        if (om) {
+            hom_columns.insert(om->getAnonOnionName());
+        }
+    }
+
+    std::list<std::string> changes;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(dbres->n))) {
+        const unsigned long *const l = mysql_fetch_lengths(dbres->n);
+        const std::string name(row[0], l[0]);
+        const std::string type(row[1], l[1]);
+        const bool nullable = std::string("YES") == std::string(row[2], l[2]);
+
+        if (0 == name.find(BASE_SALT_NAME) && name != tm.getSaltName()) {
+            changes.push_back("DROP COLUMN " + name);
+        } else if (hom_columns.end() != hom_columns.find(name)
+                   && false == equalsIgnoreCase("binary", type)) {
+            changes.push_back("MODIFY COLUMN " + name + " BINARY(" +
+                              std::to_string(HOM::ciphertextBytes()) +
+                              ")" + (nullable ? "" : " NOT NULL"));
+        }
+    }
+
+    if (changes.empty()) {
+        return new SimpleOutput(mysql_noop());
+    }
+
+    std::string alter = " ALTER TABLE " + db + "." + tm.getAnonTableName();
+    for (auto it = changes.begin(); it != changes.end(); ++it) {
+        alter += (changes.begin() == it ? " " : ", ") + *it;
+    }
+    return new DMLOutput(query, alter + ";");
+}
+
+// Moves a table to the compact storage format. The first pass re-salts
+// the rows and switches the metadata over; the query is then reissued
+// and the second pass cleans up the old columns. Issuing it again
+// finishes a migration that was interrupted.
+// > The cleanup is DDL and commits an open transaction.
+// SYNTAX
+// > DIRECTIVE COMPACT <table>
+static RewriteOutput *
+handleCompactDirective(Analysis &a, const ProxyState &ps,
+                       const std::string &query)
+{
+    const std::list<std::string> tokens = split(query, " \t\n;");
+    TEST_TextMessageError(3 == tokens.size(),
+                          "malformed COMPACT directive!");
+
+    TableMeta &tm = a.getTableMeta(a.getDatabaseName(), tokens.back());
+    if (tm.isCompact()) {
+        return compactCleanup(a, ps, tm, query);
+    }
+
+    std::vector<FieldMeta *> salted;
+    std::vector<const FieldMeta *> stale;
+    for (FieldMeta *const fm : tm.orderedFieldMetas()) {
+        if (fm->getHasSalt()) {
+            salted.push_back(fm);
+        }
+        if (fm->getOnionsStale()) {
+            stale.push_back(fm);
+        }
+    }
+    TEST_TextMessageError(salted.size() > 0,
+                          "table has no salted fields to compact!");
+    // Re-salting would lose the rows an increment marked.
+    if (stale.size() > 0) {
+        return refreshFields(a, ps, tm, stale, query);
+    }
+
+    const std::list<std::string> resalt_queries =
+        resaltRows(a, ps, tm, salted);
+
+    std::vector<std::unique_ptr<Delta> > deltas;
+    const std::string row_salt_name = salted.front()->getSaltName();
+    tm.setCompact(row_salt_name);
+    deltas.push_back(std::unique_ptr<Delta>(
+        new ReplaceDelta(tm, a.getDatabaseMeta(a.getDatabaseName()))));
+    for (FieldMeta *const fm : salted) {
+        fm->shareSalt(row_salt_name);
+        deltas.push_back(std::unique_ptr<Delta>(new ReplaceDelta(*fm, tm)));
+    }
+
+    return new CompactTableOutput(query, std::move(deltas),
+                                  resalt_queries);
+}
+
 // FIXME: Implement.
 // SYNTAX
 // > DIRECTIVE UPDATE cryptdb_metadata
@@ -1352,6 +2082,16 @@ RewriteOutput *
 Rewriter::handleDirective(Analysis &a, const ProxyState &ps,
                           const std::string &query)
 {
+    const std::list<std::string> tokens = split(query, " \t\n");
+    if (tokens.size() > 1
+        && equalsIgnoreCase("ADJUST", *std::next(tokens.begin()))) {
+        return handleAdjustDirective(a, ps, query);
+    }
+    if (tokens.size() > 1
+        && equalsIgnoreCase("COMPACT", *std::next(tokens.begin()))) {
+        return handleCompactDirective(a, ps, query);
+    }
+
     DirectiveData data(query);
     const FieldMeta &fm =
         a.getFieldMeta(a.getDatabaseName(), data.table_name,
@@ -1392,24 +2132,43 @@ Rewriter::rewrite(const ProxyState &ps, const std::string &q,
                   const std::string &default_db)
 {
     LOG(cdb_v) << "q " << q;
-    assert(0 == mysql_thread_init());
-    //assert(0 == create_embedded_thd(0));
+    embedded_thread_init();
 
     Analysis analysis(default_db, schema);
 
     RewriteOutput *output;
-    if (cryptdbDirective(q)) {
-        output = Rewriter::handleDirective(analysis, ps, q);
-    } else {
-        // NOTE: Care what data you try to read from Analysis
-        // at this height.
-        output = Rewriter::dispatchOnLex(analysis, ps, q);
-        if (!output) {
-            output = new SimpleOutput(mysql_noop());
+    try {
+        if (cryptdbDirective(q)) {
+            output = Rewriter::handleDirective(analysis, ps, q);
+        } else {
+            // NOTE: Care what data you try to read from Analysis
+            // at this height.
+            output = Rewriter::dispatchOnLex(analysis, ps, q);
+            if (!output) {
+                output = new SimpleOutput(mysql_noop());
+            }
         }
+    } catch (...) {
+        // A handler may have changed the cached metadata before it
+        // gave up.
+        SchemaCache::invalidateAll();
+        throw;
+    }
+
+    // DDL handlers edit the cached metadata as they build their deltas;
+    // if the statement then fails, DeltaOutput::afterQuery never runs
+    // and nothing else would make the cache reload.
+    if (output->stalesSchema()) {
+        SchemaCache::invalidateAll();
     }
 
-    return QueryRewrite(true, analysis.rmeta, output);
+    QueryRewrite qr(true, analysis.rmeta, output,
+                    indexCandidates(analysis));
+    qr.changes_default_db = analysis.changes_default_db;
+    qr.new_default_db = analysis.new_default_db;
+    qr.cache_footprint = analysis.cache_footprint;
+    qr.dropped_tables = analysis.dropped_tables;
+    return qr;
 }
 
 //TODO: replace stringify with <<
@@ -1470,6 +2229,11 @@ Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
         }
 
         FieldMeta *const fm = rf.getOLK().key;
+        // The rows with a value to decrypt, and the value and salt of
+        // each.
+        std::vector<unsigned int> enc_rows;
+        std::vector<Item *> items;
+        std::vector<uint64_t> salts;
         for (unsigned int r = 0; r < rows; r++) {
             if (!fm || dbres.rows[r][c]->is_null()) {
                 res.rows[r][col_index] = dbres.rows[r][c];
@@ -1483,10 +2247,17 @@ Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
                     salt = salt_item->value;
                 }
 
-                std::shared_ptr<Item> dec_item(
-                    decrypt_item_layers(dbres.rows[r][c].get(),
-                                        fm, rf.getOLK().o, salt));
-                res.rows[r][col_index] = dec_item;
+                enc_rows.push_back(r);
+                items.push_back(dbres.rows[r][c].get());
+                salts.push_back(salt);
+            }
+        }
+
+        if (false == items.empty()) {
+            decrypt_column_layers(&items, fm, rf.getOLK().o, salts);
+            for (size_t i = 0; i < enc_rows.size(); ++i) {
+                res.rows[enc_rows[i]][col_index] =
+                    std::shared_ptr<Item>(items[i]);
             }
         }
         col_index++;
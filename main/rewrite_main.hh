@@ -21,6 +21,7 @@
 #include "field.h"
 
 #include <main/Analysis.hh>
+#include <main/index_planner.hh>
 #include <main/dml_handler.hh>
 #include <main/ddl_handler.hh>
 #include <parser/Annotation.hh>
@@ -53,12 +54,30 @@ printRes(const ResType & r);
 // - data structure needed to decrypt results
 class QueryRewrite {
 public:
-    QueryRewrite(bool wasRes, ReturnMeta rmeta, RewriteOutput *output)
-        : rmeta(rmeta), output(std::unique_ptr<RewriteOutput>(output)) {}
+    QueryRewrite(bool wasRes, ReturnMeta rmeta, RewriteOutput *output,
+                 const std::vector<IndexCandidate> &index_candidates =
+                    std::vector<IndexCandidate>())
+        : rmeta(rmeta), output(std::unique_ptr<RewriteOutput>(output)),
+          index_candidates(index_candidates), changes_default_db(false) {}
     QueryRewrite(QueryRewrite &&other_qr) : rmeta(other_qr.rmeta),
-        output(std::move(other_qr.output)) {}
+        output(std::move(other_qr.output)),
+        index_candidates(std::move(other_qr.index_candidates)),
+        changes_default_db(other_qr.changes_default_db),
+        new_default_db(std::move(other_qr.new_default_db)),
+        cache_footprint(std::move(other_qr.cache_footprint)),
+        dropped_tables(std::move(other_qr.dropped_tables)) {}
     const ReturnMeta rmeta;
     std::unique_ptr<RewriteOutput> output;
+    // Handed to the IndexPlanner once the query went through.
+    std::vector<IndexCandidate> index_candidates;
+    // The session's default database once the query has succeeded, if
+    // it changes it; see Analysis::changes_default_db.
+    bool changes_default_db;
+    std::string new_default_db;
+    // See Analysis::cache_footprint.
+    CacheFootprint cache_footprint;
+    // Forgotten by the IndexPlanner once the query went through.
+    std::vector<std::pair<std::string, std::string> > dropped_tables;
 };
 
 // Main class processing rewriting
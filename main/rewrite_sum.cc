@@ -79,7 +79,7 @@ class CItemCount : public CItemSubtypeST<Item_sum_count, SFT> {
         const EncSet out_enc_set = PLAIN_EncSet;
         const reason rsn(out_enc_set, why, i);
 
-        return new RewritePlanOneOLK(out_enc_set, solution.chooseOne(),
+        return new (a.arena) RewritePlanOneOLK(out_enc_set, solution.chooseOne(),
                                      childr_rp, rsn);
     }
 
@@ -123,7 +123,7 @@ class CItemChooseOrder : public CItemSubtypeST<Item_sum_hybrid, SFT> {
         const reason rsn(out, why, i);
 
         // INVESTIGATE: Should 'out' be 'supported'?
-        return new RewritePlanOneOLK(out, olk, childr_rp, rsn);
+        return new (a.arena) RewritePlanOneOLK(out, olk, childr_rp, rsn);
     }
 
     virtual Item *
@@ -170,7 +170,7 @@ class CItemSum : public CItemSubtypeST<Item_sum_sum, SFT> {
         const EncSet return_es = EncSet(olk);
         const reason rsn(return_es, why, i);
 
-        return new RewritePlanOneOLK(return_es, olk, childr_rp, rsn);
+        return new (a.arena) RewritePlanOneOLK(return_es, olk, childr_rp, rsn);
     }
 
     virtual Item *
@@ -254,7 +254,7 @@ static class ANON : public CItemSubtypeIT<Item_ref, Item::Type::REF_ITEM> {
         const std::string why = "ref_item";
         reason rsn(out_es, why, i);
 
-        return new RewritePlanOneOLK(out_es, child_es.chooseOne(),
+        return new (a.arena) RewritePlanOneOLK(out_es, child_es.chooseOne(),
                                      childr_rp, rsn);
     }
     virtual Item *
@@ -284,7 +284,7 @@ static class ANON : public CItemSubtypeIT<Item_null, Item::Type::NULL_ITEM> {
     {
         const std::string why = "is null";
         reason rsn(FULL_EncSet, why, i);
-        return new RewritePlan(FULL_EncSet, rsn);
+        return new (a.arena) RewritePlan(FULL_EncSet, rsn);
     }
 
     virtual Item *
@@ -301,7 +301,7 @@ static class ANON : public CItemSubtypeIT<Item_null, Item::Type::NULL_ITEM> {
         for (uint j = 0; j < fm.children.size(); ++j) {
             l->push_back(RiboldMYSQL::clone_item(i));
         }
-        if (fm.getHasSalt()) {
+        if (fm.getHasSalt() && false == fm.getSharesSalt()) {
             const ulonglong salt = randomValue();
             l->push_back(new Item_int(static_cast<ulonglong>(salt)));
         }
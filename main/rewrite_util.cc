@@ -4,6 +4,9 @@
 #include <main/rewrite_main.hh>
 #include <main/macro_util.hh>
 #include <main/metadata_tables.hh>
+#include <main/metadata_store.hh>
+#include <main/index_planner.hh>
+#include <crypto/mope.hh>
 #include <parser/lex_util.hh>
 #include <parser/stringify.hh>
 #include <util/enum_text.hh>
@@ -141,7 +144,12 @@ rewrite_table_list(List<TABLE_LIST> tll, Analysis &a)
         }
 
         if (t->on_expr) {
+            const size_t first_rewrite = a.field_rewrites.size();
+            const bool lookup_constants = a.lookup_constants;
+            a.lookup_constants = true;
             new_t->on_expr = rewrite(*t->on_expr, PLAIN_EncSet, a);
+            a.lookup_constants = lookup_constants;
+            a.noteFilterOnions(first_rewrite);
         }
 
 	/* TODO: derived tables
@@ -188,7 +196,7 @@ commit_transaction_lex(const std::string &dbname)
 // and avoid this chaining and passing f as an argument
 static Create_field *
 get_create_field(const Analysis &a, Create_field * const f,
-                 const OnionMeta &om)
+                 const OnionMeta &om, bool compact)
 {
     const std::string name = om.getAnonOnionName();
     Create_field *new_cf = f;
@@ -201,7 +209,8 @@ get_create_field(const Analysis &a, Create_field * const f,
     assert(enc_layers.size() > 0);
     for (auto it = enc_layers.begin(); it != enc_layers.end(); it++) {
         const Create_field * const old_cf = new_cf;
-        new_cf = (*it)->newCreateField(old_cf, name);
+        new_cf = compact ? (*it)->newCompactCreateField(old_cf, name)
+                         : (*it)->newCreateField(old_cf, name);
     }
 
     // Restore the default so we don't memleak it.
@@ -209,11 +218,31 @@ get_create_field(const Analysis &a, Create_field * const f,
     return new_cf;
 }
 
+Create_field *
+salt_create_field(Create_field * const f, const std::string &name)
+{
+    THD * const thd         = current_thd;
+    Create_field * const f0 = f->clone(thd->mem_root);
+    f0->field_name          = thd->strdup(name.c_str());
+    // Salt is unsigned and is not AUTO_INCREMENT.
+    // > NOT_NULL_FLAG is useful for debugging if mysql strict mode
+    //   (ie, STRICT_ALL_TABLES) is turned on.
+    f0->flags               =
+        (f0->flags | UNSIGNED_FLAG | NOT_NULL_FLAG)
+        & ~AUTO_INCREMENT_FLAG;
+    f0->sql_type            = MYSQL_TYPE_LONGLONG;
+    f0->length              = 8;
+    f0->def                 = NULL;
+
+    return f0;
+}
+
 // NOTE: The fields created here should have NULL default pointers
 // as such is handled during INSERTion.
 std::vector<Create_field *>
 rewrite_create_field(const FieldMeta * const fm,
-                     Create_field * const f, const Analysis &a)
+                     Create_field * const f, const Analysis &a,
+                     bool compact)
 {
     LOG(cdb_v) << "in rewrite create field for " << *f;
 
@@ -228,26 +257,16 @@ rewrite_create_field(const FieldMeta * const fm,
     // create each onion column
     for (auto oit : fm->orderedOnionMetas()) {
         OnionMeta * const om = oit.second;
-        Create_field * const new_cf = get_create_field(a, f, *om);
+        Create_field * const new_cf =
+            get_create_field(a, f, *om, compact);
 
         output_cfields.push_back(new_cf);
     }
 
-    // create salt column
-    if (fm->getHasSalt()) {
-        THD * const thd         = current_thd;
-        Create_field * const f0 = f->clone(thd->mem_root);
-        f0->field_name          = thd->strdup(fm->getSaltName().c_str());
-        // Salt is unsigned and is not AUTO_INCREMENT.
-        // > NOT_NULL_FLAG is useful for debugging if mysql strict mode
-        //   (ie, STRICT_ALL_TABLES) is turned on.
-        f0->flags               =
-            (f0->flags | UNSIGNED_FLAG | NOT_NULL_FLAG)
-            & ~AUTO_INCREMENT_FLAG;
-        f0->sql_type            = MYSQL_TYPE_LONGLONG;
-        f0->length              = 8;
-
-        output_cfields.push_back(f0);
+    // create salt column; a shared salt is the table's row salt
+    if (fm->getHasSalt() && false == fm->getSharesSalt()) {
+        output_cfields.push_back(salt_create_field(f,
+                                                   fm->getSaltName()));
     }
 
     // Restore the default to the original Create_field parameter.
@@ -277,10 +296,34 @@ getOriginalKeyName(Key *const key)
 }
 
 std::vector<Key *>
-rewrite_key(const TableMeta &tm, Key *const key, const Analysis &a)
+rewrite_key(TableMeta &tm, Key *const key, const Analysis &a)
 {
     std::vector<Key *> output_keys;
 
+    // Plain indexes don't constrain anything so we only record them;
+    // the IndexPlanner builds the onions that queries actually use.
+    if (Key::MULTIPLE == key->type) {
+        IndexColumns columns;
+        auto col_it =
+            RiboldMYSQL::constList_iterator<Key_part_spec>(key->columns);
+        for (;;) {
+            const Key_part_spec *const key_part = col_it++;
+            if (NULL == key_part) {
+                break;
+            }
+
+            const std::string field_name =
+                convert_lex_str(key_part->field_name);
+            // Make sure the field exists.
+            a.getFieldMeta(tm, field_name);
+            columns.push_back(std::make_pair(field_name,
+                                             key_part->length));
+        }
+
+        tm.addLazyIndex(getOriginalKeyName(key), columns);
+        return output_keys;
+    }
+
     const std::vector<onion> key_onions = getOnionIndexTypes();
     for (auto onion_it : key_onions) {
         const onion o = onion_it;
@@ -367,11 +410,15 @@ createAndRewriteField(Analysis &a, const ProxyState &ps,
                              tm->leaseIncUniq());
     };
     std::unique_ptr<FieldMeta> fm(buildFieldMeta(name, cf, ps, tm));
+    if (tm->isCompact() && fm->getHasSalt()) {
+        fm->shareSalt(tm->getSaltName());
+    }
 
     // -----------------------------
     //         Rewrite FIELD       
     // -----------------------------
-    const auto new_fields = rewrite_create_field(fm.get(), cf, a);
+    const auto new_fields =
+        rewrite_create_field(fm.get(), cf, a, tm->isCompact());
     rewritten_cfield_list.concat(vectorToListWithTHD(new_fields));
 
     // -----------------------------
@@ -402,13 +449,20 @@ encrypt_item_layers(const Item &i, onion o, const OnionMeta &om,
 
     const auto &enc_layers = a.getEncLayers(om);
     assert_s(enc_layers.size() > 0, "onion must have at least one layer");
+    const OnionPipeline *const pipeline = om.getPipeline();
+    if (pipeline) {
+        return pipeline->encrypt(i, IV);
+    }
+
     const Item *enc = &i;
     Item *new_enc = NULL;
 
     for (auto it = enc_layers.begin(); it != enc_layers.end(); it++) {
         LOG(encl) << "encrypt layer "
                   << TypeText<SECLEVEL>::toText((*it)->level()) << "\n";
-        new_enc = (*it)->encrypt(*enc, IV);
+        new_enc = a.lookup_constants && enc_layers.begin() == it
+                ? (*it)->encryptForLookup(*enc, IV)
+                : (*it)->cachedEncrypt(*enc, IV);
         assert(new_enc);
         enc = new_enc;
     }
@@ -462,11 +516,14 @@ void
 typical_rewrite_insert_type(const Item &i, const FieldMeta &fm,
                             Analysis &a, std::vector<Item *> *l)
 {
-    const uint64_t salt = fm.getHasSalt() ? randomValue() : 0;
+    const uint64_t salt = !fm.getHasSalt() ? 0
+                        : fm.getSharesSalt() ? a.row_salt
+                        : randomValue();
 
     encrypt_item_all_onions(i, fm, salt, a, l);
 
-    if (fm.getHasSalt()) {
+    // The INSERT carries the row salt once for the whole row.
+    if (fm.getHasSalt() && false == fm.getSharesSalt()) {
         l->push_back(new Item_int(static_cast<ulonglong>(salt)));
     }
 }
@@ -531,6 +588,153 @@ retrieveDefaultDatabase(unsigned long long thread_id,
     return true;
 }
 
+// Labels rewritten per UPDATE when relabeling an onion at OPE.
+static const size_t RELABEL_CHUNK = 512;
+// Rewrites of one query that may see labels move under them.
+static const unsigned int RELABEL_RETRIES = 16;
+
+// Rewrites the ciphertexts of one onion that a relabel of its mutable
+// OPE dictionary moved. The new labels are disjoint from the old ones,
+// so a relabel that was cut short can be applied again.
+static void
+applyRelabel(const std::unique_ptr<Connect> &conn, const std::string &table,
+             const FieldMeta &fm, const OnionMeta &om,
+             const MutableOPE::Relabel &r)
+{
+    const std::string col = om.getAnonOnionName();
+    const EncLayer *const back = om.getLayerBack();
+    if (SECLEVEL::OPE == back->level()) {
+        for (size_t i = 0; i < r.moves.size(); i += RELABEL_CHUNK) {
+            const size_t end = std::min(r.moves.size(), i + RELABEL_CHUNK);
+            std::ostringstream q;
+            q << " UPDATE " << table
+              << "    SET " << col << " = CASE " << col;
+            for (size_t j = i; j < end; ++j) {
+                q << " WHEN " << r.moves[j].first
+                  << " THEN " << r.moves[j].second;
+            }
+            q << " ELSE " << col << " END"
+              << "  WHERE " << col << " BETWEEN " << r.moves[i].first
+              << " AND " << r.moves[end - 1].first << ";";
+            TEST_TextMessageError(conn->execute(q.str()),
+                                  "failed to relabel " + col + "!");
+        }
+        return;
+    }
+
+    // Under RND the labels can't be found by the server; every row is
+    // read and the moved ones re-encrypted with their salt. RND is
+    // deterministic given the salt, so the old ciphertext alone picks
+    // the new one: the pairs go into a temporary table keyed by the old
+    // ciphertext and one joined UPDATE copies them over.
+    TEST_TextMessageError(SECLEVEL::RND == back->level(),
+                          "unexpected layer over mutable OPE!");
+    const std::string salt_name = fm.getSaltName();
+    std::unique_ptr<DBResult> dbres;
+    TEST_TextMessageError(conn->execute(
+                              " SELECT " + salt_name + ", " + col +
+                              "   FROM " + table +
+                              "  WHERE " + col + " IS NOT NULL;",
+                              &dbres),
+                          "failed to read " + col + " for relabel!");
+    const ResType res = dbres->unpack();
+    TEST_TextMessageError(res.success(),
+                          "failed to unpack " + col + " for relabel!");
+
+    std::list<std::string> values;
+    std::ostringstream batch;
+    size_t pending = 0;
+    for (const auto &row : res.rows) {
+        const uint64_t salt =
+            static_cast<Item_int *>(row[0].get())->value;
+        Item *const ctext = row[1].get();
+        const ulonglong label =
+            static_cast<Item_int *>(back->decrypt(ctext, salt))->value;
+        if (label < r.lo || label > r.hi) {
+            continue;
+        }
+        const auto move =
+            std::lower_bound(r.moves.begin(), r.moves.end(),
+                             std::make_pair(static_cast<uint64_t>(label),
+                                            static_cast<uint64_t>(0)));
+        if (r.moves.end() == move || move->first != label) {
+            continue;
+        }
+
+        const Item_int moved(static_cast<ulonglong>(move->second));
+        batch << (0 == pending ? "" : ", ") << "(" << *ctext << ", "
+              << *back->encrypt(moved, salt) << ")";
+        if (RELABEL_CHUNK == ++pending) {
+            values.push_back(batch.str());
+            batch.str("");
+            pending = 0;
+        }
+    }
+    if (pending > 0) {
+        values.push_back(batch.str());
+    }
+    if (values.empty()) {
+        return;
+    }
+
+    const std::string relabel_table =
+        table.substr(0, table.find('.')) + ".relabel_" + col;
+    std::list<std::string> queries;
+    queries.push_back(" DROP TEMPORARY TABLE IF EXISTS "
+                      + relabel_table + ";");
+    queries.push_back(" CREATE TEMPORARY TABLE " + relabel_table +
+                      " (INDEX (old_label))"
+                      " SELECT " + col + " AS old_label, "
+                                 + col + " AS new_label"
+                      "   FROM " + table + " LIMIT 0;");
+    for (const auto &v : values) {
+        queries.push_back(" INSERT INTO " + relabel_table +
+                          " VALUES " + v + ";");
+    }
+    queries.push_back(" UPDATE " + table + " t STRAIGHT_JOIN "
+                                 + relabel_table + " r"
+                      "     ON t." + col + " = r.old_label"
+                      "    SET t." + col + " = r.new_label;");
+    queries.push_back(" DROP TEMPORARY TABLE " + relabel_table + ";");
+    for (const auto &q : queries) {
+        TEST_TextMessageError(conn->execute(q),
+                              "failed to relabel " + col + "!");
+    }
+}
+
+void
+applyRelabels(const std::unique_ptr<Connect> &conn,
+              const SchemaInfo &schema)
+{
+    if (false == MutableOPE::anyPending()) {
+        return;
+    }
+
+    for (const auto &db_it : schema.children) {
+        const std::string &db = db_it.first.getValue();
+        for (const auto &table_it : db_it.second->children) {
+            const TableMeta &tm = *table_it.second;
+            const std::string table = db + "." + tm.getAnonTableName();
+            for (const auto &field_it : tm.children) {
+                const FieldMeta &fm = *field_it.second;
+                const OnionMeta *const om = fm.getOnionMeta(oOPE);
+                if (!om || false == om->hasEncLayer(SECLEVEL::OPE)) {
+                    continue;
+                }
+                MutableOPE *const mope =
+                    om->getLayer(SECLEVEL::OPE)->mutableOPE();
+                if (!mope) {
+                    continue;
+                }
+                for (const auto &r : mope->pendingRelabels()) {
+                    applyRelabel(conn, table, fm, *om, r);
+                    mope->relabelApplied(r.id);
+                }
+            }
+        }
+    }
+}
+
 void
 queryPreamble(const ProxyState &ps, const std::string &q,
               std::unique_ptr<QueryRewrite> *const qr,
@@ -541,15 +745,24 @@ queryPreamble(const ProxyState &ps, const std::string &q,
     const SchemaInfo &schema =
         schema_cache->getSchema(ps.getConn(), ps.getEConn());
 
-    *qr = std::unique_ptr<QueryRewrite>(
-            new QueryRewrite(Rewriter::rewrite(ps, q, schema,
-                                               default_db)));
-
-    // We handle before any queries because a failed query
-    // may stale the database during recovery and then
-    // we'd have to handle there as well.
-    schema_cache->updateStaleness(ps.getEConn(),
-                                  (*qr)->output->stalesSchema());
+    // A mutable OPE layer may have moved labels the rewrite had
+    // already used; the values are all in place after one pass, so
+    // another one sees stable labels.
+    for (unsigned int attempt = 0; ; ++attempt) {
+        const uint64_t epoch = MutableOPE::relabelEpoch();
+        *qr = std::unique_ptr<QueryRewrite>(
+                new QueryRewrite(Rewriter::rewrite(ps, q, schema,
+                                                   default_db)));
+        if (MutableOPE::relabelEpoch() == epoch) {
+            break;
+        }
+        TEST_TextMessageError(attempt < RELABEL_RETRIES,
+                              "mutable OPE labels keep moving!");
+    }
+    // New labels must be on disk before they are in the database; a
+    // rewrite that only looked labels up has nothing to sync.
+    MutableOPE::syncAll();
+    applyRelabels(ps.getConn(), schema);
 
     // ASK bites again...
     // We want the embedded database to reflect the metadata for the
@@ -615,6 +828,14 @@ queryEpilogue(const ProxyState &ps, const QueryRewrite &qr,
     qr.output->afterQuery(ps.getEConn());
 
     const QueryAction action = qr.output->queryAction(ps.getConn());
+    if (QueryAction::VANILLA == action
+        && false == qr.index_candidates.empty()) {
+        ps.getIndexPlanner().observe(qr.index_candidates);
+    }
+    for (const auto &it : qr.dropped_tables) {
+        ps.getIndexPlanner().forget(it.first, it.second);
+    }
+
     if (QueryAction::AGAIN == action) {
         std::unique_ptr<SchemaCache> schema_cache(new SchemaCache());
         const EpilogueResult &epi_res =
@@ -643,23 +864,18 @@ queryEpilogue(const ProxyState &ps, const QueryRewrite &qr,
     return EpilogueResult(action, res);
 }
 
-static bool
-lowLevelGetCurrentStaleness(const std::unique_ptr<Connect> &e_conn,
-                            unsigned int cache_id)
-{
-    const std::string &query =
-        " SELECT stale FROM " + MetaData::Table::staleness() +
-        "  WHERE cache_id = " + std::to_string(cache_id) + ";";
-    std::unique_ptr<DBResult> db_res;
-    TEST_TextMessageError(e_conn->execute(query, &db_res),
-                          "failed to get schema!");
-    assert(1 == mysql_num_rows(db_res->n));
+static uint64_t schema_epoch = 1;
 
-    const MYSQL_ROW row = mysql_fetch_row(db_res->n);
-    const unsigned long *const l = mysql_fetch_lengths(db_res->n);
-    assert(l != NULL);
+uint64_t
+SchemaCache::epoch()
+{
+    return __atomic_load_n(&schema_epoch, __ATOMIC_ACQUIRE);
+}
 
-    return string_to_bool(std::string(row[0], l[0]));
+void
+SchemaCache::invalidateAll()
+{
+    __atomic_add_fetch(&schema_epoch, 1, __ATOMIC_RELEASE);
 }
 
 const SchemaInfo &
@@ -678,48 +894,24 @@ SchemaCache::getSchema(const std::unique_ptr<Connect> &conn,
                               " usage!");
         this->no_loads = false;
     }
-    const bool stale = lowLevelGetCurrentStaleness(e_conn, this->id);
 
-    if (true == stale) {
+    // Read the epoch first; a change that lands during the load
+    // leaves us stale for the next query rather than missed.
+    const uint64_t current = epoch();
+    if (!this->schema || current != this->loaded_epoch) {
         this->schema.reset(loadSchemaInfo(conn, e_conn));
+        this->loaded_epoch = current;
     }
 
     assert(this->schema);
     return *this->schema.get();
 }
 
-static void
-lowLevelAllStale(const std::unique_ptr<Connect> &e_conn)
-{
-    const std::string &query =
-        " UPDATE " + MetaData::Table::staleness() +
-        "    SET stale = TRUE;";
-
-    TEST_TextMessageError(e_conn->execute(query),
-                          "failed to all stale!");
-}
-
-void
-SchemaCache::updateStaleness(const std::unique_ptr<Connect> &e_conn,
-                             bool staleness)
-{
-    if (true == staleness) {
-        // Make everyone stale.
-        lowLevelAllStale(e_conn);
-    } else {
-        // We are no longer stale.
-        this->lowLevelCurrentUnstale(e_conn);
-    }
-}
-
 bool
 SchemaCache::initialStaleness(const std::unique_ptr<Connect> &e_conn)
 {
-    const std::string seed_staleness =
-        " INSERT INTO " + MetaData::Table::staleness() +
-        "   (cache_id, stale) VALUES " +
-        "   (" + std::to_string(this->id) + ", TRUE);";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(seed_staleness));
+    RETURN_FALSE_IF_FALSE(MetaData::store().seedStaleness(e_conn,
+                                                          this->id));
 
     return true;
 }
@@ -727,35 +919,8 @@ SchemaCache::initialStaleness(const std::unique_ptr<Connect> &e_conn)
 bool
 SchemaCache::cleanupStaleness(const std::unique_ptr<Connect> &e_conn)
 {
-    const std::string remove_staleness =
-        " DELETE FROM " + MetaData::Table::staleness() +
-        "       WHERE cache_id = " + std::to_string(this->id) + ";";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(remove_staleness));
+    RETURN_FALSE_IF_FALSE(MetaData::store().removeStaleness(e_conn,
+                                                            this->id));
 
     return true;
 }
-static void
-lowLevelToggleCurrentStaleness(const std::unique_ptr<Connect> &e_conn,
-                               unsigned int cache_id, bool staleness)
-{
-    const std::string &query =
-        " UPDATE " + MetaData::Table::staleness() +
-        "    SET stale = " + bool_to_string(staleness) +
-        "  WHERE cache_id = " + std::to_string(cache_id) + ";";
-
-    TEST_TextMessageError(e_conn->execute(query),
-                          "failed to unstale current!");
-}
-
-void
-SchemaCache::lowLevelCurrentStale(const std::unique_ptr<Connect> &e_conn)
-{
-    lowLevelToggleCurrentStaleness(e_conn, this->id, true);
-}
-
-void
-SchemaCache::lowLevelCurrentUnstale(const std::unique_ptr<Connect> &e_conn)
-{
-    lowLevelToggleCurrentStaleness(e_conn, this->id, false);
-}
-
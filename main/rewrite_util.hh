@@ -48,10 +48,14 @@ commit_transaction_lex(const std::string &dbname);
 
 std::vector<Create_field *>
 rewrite_create_field(const FieldMeta * const fm, Create_field * const f,
-                     const Analysis &a);
+                     const Analysis &a, bool compact);
+
+// A salt column named @name, cloned from @f.
+Create_field *
+salt_create_field(Create_field * const f, const std::string &name);
 
 std::vector<Key *>
-rewrite_key(const TableMeta &tm, Key * const key, const Analysis &a);
+rewrite_key(TableMeta &tm, Key * const key, const Analysis &a);
 
 std::string
 bool_to_string(bool b);
@@ -127,11 +131,21 @@ mysql_noop();
 std::string
 getDefaultDatabaseForConnection(const std::unique_ptr<Connect> &c);
 
+// Asks the server through PROCESSLIST. The proxy tracks each session's
+// default database itself and only uses this to recover or verify it.
 bool
 retrieveDefaultDatabase(unsigned long long thread_id,
                         const std::unique_ptr<Connect> &c,
                         std::string *const out_name);
 
+// Brings every onion with a mutable OPE layer up to date with the
+// relabels of its dictionary, before a query uses the new labels.
+// > Like SpecialUpdate this relies on nothing else writing the onion
+//   while it runs.
+void
+applyRelabels(const std::unique_ptr<Connect> &conn,
+              const SchemaInfo &schema);
+
 void
 queryPreamble(const ProxyState &ps, const std::string &q,
               std::unique_ptr<QueryRewrite> *qr,
@@ -160,23 +174,35 @@ queryEpilogue(const ProxyState &ps, const QueryRewrite &qr,
               const ResType &res, const std::string &query,
               const std::string &default_db, bool pp);
 
+// A cache is stale once the process wide schema epoch has moved past
+// the one it loaded at. The rewriter moves it for every statement that
+// changes the metadata, before the statement runs, and
+// DeltaOutput::afterQuery moves it again once the deltas have reached
+// the metadata, including at the end of an onion adjustment. A
+// statement that fails in between leaves no cache with the metadata its
+// handler edited in place. The metadata tables are only read to load a
+// schema, so changes made by another process are picked up by a new
+// cache or after invalidateAll().
 class SchemaCache {
 public:
-    SchemaCache() : no_loads(true), id(randomValue() % UINT_MAX) {}
+    SchemaCache() : no_loads(true), id(randomValue() % UINT_MAX),
+                    loaded_epoch(0) {}
 
     const SchemaInfo &getSchema(const std::unique_ptr<Connect> &conn,
                                 const std::unique_ptr<Connect> &e_conn);
-    void updateStaleness(const std::unique_ptr<Connect> &e_conn,
-                         bool staleness);
     bool initialStaleness(const std::unique_ptr<Connect> &e_conn);
     bool cleanupStaleness(const std::unique_ptr<Connect> &e_conn);
-    void lowLevelCurrentStale(const std::unique_ptr<Connect> &e_conn);
-    void lowLevelCurrentUnstale(const std::unique_ptr<Connect> &e_conn);
+
+    static uint64_t epoch();
+    // Every cache in the process reloads before its next query.
+    // Safe to call from a signal handler.
+    static void invalidateAll();
 
 private:
     std::unique_ptr<const SchemaInfo> schema;
     bool no_loads;
     const unsigned int id;
+    uint64_t loaded_epoch;
 };
 
 template <typename InType, typename InterimType, typename OutType>
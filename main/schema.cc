@@ -9,41 +9,26 @@
 #include <main/rewrite_util.hh>
 #include <main/dbobject.hh>
 #include <main/metadata_tables.hh>
+#include <main/metadata_store.hh>
 #include <main/macro_util.hh>
 
 std::vector<DBMeta *>
-DBMeta::doFetchChildren(const std::unique_ptr<Connect> &e_conn,
+DBMeta::doFetchChildren(const SchemaRows &rows,
                         std::function<DBMeta *(const std::string &,
                                                const std::string &,
                                                const std::string &)>
                             deserialHandler)
 {
-    const std::string table_name = MetaData::Table::metaObject();
-
-    // Now that we know the table exists, SELECT the data we want.
     std::vector<DBMeta *> out_vec;
-    std::unique_ptr<DBResult> db_res;
-    const std::string parent_id = std::to_string(this->getDatabaseID());
-    const std::string serials_query = 
-        " SELECT " + table_name + ".serial_object,"
-        "        " + table_name + ".serial_key,"
-        "        " + table_name + ".id"
-        " FROM " + table_name + 
-        " WHERE " + table_name + ".parent_id"
-        "   = " + parent_id + ";";
-    // FIXME: Throw exception.
-    assert(e_conn->execute(serials_query, &db_res));
-    MYSQL_ROW row;
-    while ((row = mysql_fetch_row(db_res->n))) {
-        unsigned long * const l = mysql_fetch_lengths(db_res->n);
-        assert(l != NULL);
-
-        const std::string child_serial_object(row[0], l[0]);
-        const std::string child_key(row[1], l[1]);
-        const std::string child_id(row[2], l[2]);
+    const auto children = rows.children.find(this->getDatabaseID());
+    if (rows.children.end() == children) {
+        return out_vec;
+    }
 
+    for (const auto &it : children->second) {
         DBMeta *const new_old_meta =
-            deserialHandler(child_key, child_serial_object, child_id);
+            deserialHandler(it.serial_key, it.serial_object,
+                            std::to_string(it.id));
         out_vec.push_back(new_old_meta);
     }
 
@@ -71,6 +56,8 @@ OnionMeta::OnionMeta(onion o, std::vector<SECLEVEL> levels,
 
         this->layers.push_back(std::move(el));
     }
+
+    this->pipeline.reset(OnionPipeline::build(this->layers));
 }
 
 std::unique_ptr<OnionMeta>
@@ -101,14 +88,14 @@ std::string OnionMeta::getAnonOnionName() const
 }
 
 std::vector<DBMeta *>
-OnionMeta::fetchChildren(const std::unique_ptr<Connect> &e_conn)
+OnionMeta::fetchChildren(SchemaRows *const rows)
 {
     std::function<DBMeta *(const std::string &,
                            const std::string &,
                            const std::string &)>
         deserialHelper =
-    [this] (const std::string &key, const std::string &serial,
-            const std::string &id) -> EncLayer *
+    [this, rows] (const std::string &key, const std::string &serial,
+                  const std::string &id) -> EncLayer *
     {
         // > Probably going to want to use indexes in AbstractMetaKey
         // for now, otherwise you will need to abstract and rederive
@@ -119,14 +106,22 @@ OnionMeta::fetchChildren(const std::unique_ptr<Connect> &e_conn)
         if (index >= this->layers.size()) {
             this->layers.resize(index + 1);
         }
-        std::unique_ptr<EncLayer>
-            layer(EncLayerFactory::deserializeLayer(atoi(id.c_str()),
-                                                    serial));
-        this->layers[index] = std::move(layer);
+        const auto built = rows->layers.find(atoi(id.c_str()));
+        if (rows->layers.end() != built) {
+            this->layers[index] = std::move(built->second);
+            rows->layers.erase(built);
+        } else {
+            this->layers[index].reset(
+                EncLayerFactory::deserializeLayer(atoi(id.c_str()),
+                                                  serial));
+        }
         return this->layers[index].get();
     };
 
-    return DBMeta::doFetchChildren(e_conn, deserialHelper);
+    const std::vector<DBMeta *> out =
+        DBMeta::doFetchChildren(*rows, deserialHelper);
+    this->pipeline.reset(OnionPipeline::build(this->layers));
+    return out;
 }
 
 bool
@@ -213,11 +208,16 @@ FieldMeta::deserialize(unsigned int id, const std::string &serial)
     const unsigned int counter = atoi(vec[6].c_str());
     const bool has_default = string_to_bool(vec[7]);
     const std::string default_value = vec[8];
+    // Older metadata predates the flag.
+    const bool onions_stale =
+        vec.size() > 9 ? string_to_bool(vec[9]) : false;
+    const bool shared_salt =
+        vec.size() > 10 ? string_to_bool(vec[10]) : false;
 
     return std::unique_ptr<FieldMeta>
         (new FieldMeta(id, fname, has_salt, salt_name, onion_layout,
                        sec_rating, uniq_count, counter, has_default,
-                       default_value));
+                       default_value, onions_stale, shared_salt));
 }
 
 // If mkey == NULL, the field is not encrypted
@@ -265,13 +265,20 @@ FieldMeta::FieldMeta(const std::string &name, Create_field * const field,
               && onion_layout != PLAIN_ONION_LAYOUT),
       sec_rating(sec_rating), uniq_count(uniq_count), counter(0),
       has_default(determineHasDefault(field)),
-      default_value(determineDefaultValue(has_default, field))
+      default_value(determineDefaultValue(has_default, field)),
+      onions_stale(false), shared_salt(false)
 {
     TEST_TextMessageError(init_onions_layout(m_key, this, field),
                           "Failed to build onions for new FieldMeta!");
 }
 
 std::string FieldMeta::serialize(const DBObject &parent) const
+{
+    return serializeStale(parent, onions_stale);
+}
+
+std::string FieldMeta::serializeStale(const DBObject &parent,
+                                      bool stale) const
 {
     const std::string &serialized_salt_name =
         true == this->has_salt ? serialize_string(getSaltName())
@@ -285,7 +292,9 @@ std::string FieldMeta::serialize(const DBObject &parent) const
         serialize_string(std::to_string(uniq_count)) +
         serialize_string(std::to_string(counter)) +
         serialize_string(bool_to_string(has_default)) +
-        serialize_string(default_value);
+        serialize_string(default_value) +
+        serialize_string(bool_to_string(stale)) +
+        serialize_string(bool_to_string(shared_salt));
 
    return serial;
 }
@@ -320,6 +329,13 @@ std::string FieldMeta::getSaltName() const
     return salt_name;
 }
 
+void FieldMeta::shareSalt(const std::string &row_salt_name)
+{
+    assert(has_salt);
+    salt_name = row_salt_name;
+    shared_salt = true;
+}
+
 SECLEVEL FieldMeta::getOnionLevel(onion o) const
 {
     const auto om = getChild(OnionMetaKey(o));
@@ -442,10 +458,28 @@ TableMeta::deserialize(unsigned int id, const std::string &serial)
     const bool has_salt = string_to_bool(vec[2]);
     const std::string salt_name = vec[3];
     const unsigned int counter = atoi(vec[4].c_str());
+    // Older metadata predates lazy indexes.
+    std::map<std::string, IndexColumns> lazy_indexes;
+    if (vec.size() > 5) {
+        const auto index_vec = unserialize_string(vec[5]);
+        assert(0 == index_vec.size() % 2);
+        for (unsigned int i = 0; i < index_vec.size(); i += 2) {
+            const auto column_vec = unserialize_string(index_vec[i + 1]);
+            assert(0 == column_vec.size() % 2);
+            IndexColumns columns;
+            for (unsigned int j = 0; j < column_vec.size(); j += 2) {
+                columns.push_back(
+                    std::make_pair(column_vec[j],
+                                   atoi(column_vec[j + 1].c_str())));
+            }
+            lazy_indexes[index_vec[i]] = columns;
+        }
+    }
+    const bool compact = vec.size() > 6 ? string_to_bool(vec[6]) : false;
 
     return std::unique_ptr<TableMeta>
         (new TableMeta(id, anon_table_name, hasSensitive, has_salt,
-                       salt_name, counter));
+                       salt_name, counter, lazy_indexes, compact));
 }
 
 std::string TableMeta::serialize(const DBObject &parent) const
@@ -457,7 +491,61 @@ std::string TableMeta::serialize(const DBObject &parent) const
         serialize_string(salt_name) +
         serialize_string(std::to_string(counter));
 
-    return serial;
+    std::string serial_indexes;
+    for (const auto &it : lazy_indexes) {
+        std::string serial_columns;
+        for (const auto &column : it.second) {
+            serial_columns +=
+                serialize_string(column.first) +
+                serialize_string(std::to_string(column.second));
+        }
+        serial_indexes +=
+            serialize_string(it.first) + serialize_string(serial_columns);
+    }
+
+    return serial + serialize_string(serial_indexes) +
+           serialize_string(bool_to_string(compact));
+}
+
+bool TableMeta::dropLazyIndex(const std::string &name,
+                              std::string *const declared_name)
+{
+    for (auto it = lazy_indexes.begin(); it != lazy_indexes.end(); ++it) {
+        // MySQL index names are case insensitive.
+        if (equalsIgnoreCase(it->first, name)) {
+            *declared_name = it->first;
+            lazy_indexes.erase(it);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool TableMeta::dropLazyIndexColumn(const std::string &field)
+{
+    bool changed = false;
+    for (auto it = lazy_indexes.begin(); it != lazy_indexes.end();) {
+        IndexColumns &columns = it->second;
+        const auto new_end =
+            std::remove_if(columns.begin(), columns.end(),
+                [&field] (const std::pair<std::string, unsigned int> &c)
+                {
+                    return equalsIgnoreCase(c.first, field);
+                });
+        if (columns.end() != new_end) {
+            columns.erase(new_end, columns.end());
+            changed = true;
+        }
+
+        if (columns.empty()) {
+            lazy_indexes.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    return changed;
 }
 
 // FIXME: May run into problems where a plaintext table expects the regular
@@ -54,13 +54,15 @@ public:
     std::string typeName() const {return type_name;}
     static std::string instanceTypeName() {return type_name;}
     std::vector<DBMeta *>
-        fetchChildren(const std::unique_ptr<Connect> &e_conn);
+        fetchChildren(SchemaRows *const rows);
     bool applyToChildren(std::function<bool(const DBMeta &)>) const;
     UIntMetaKey const &getKey(const DBMeta &child) const;
     EncLayer *getLayerBack() const;
     EncLayer *getLayer(const SECLEVEL &sl) const;
     bool hasEncLayer(const SECLEVEL &sl) const;
     unsigned long getUniq() const {return uniq_count;}
+    // The layers as one OnionPipeline; NULL if they can't be.
+    const OnionPipeline *getPipeline() const {return pipeline.get();}
 
     // Need access to layers.
     friend class Analysis;
@@ -69,10 +71,15 @@ public:
     friend bool sanityCheck(FieldMeta &);
     friend Item *decrypt_item_layers(Item *const, const FieldMeta *const,
                                      onion, uint64_t);
+    friend void decrypt_column_layers(std::vector<Item *> *const,
+                                      const FieldMeta *const, onion,
+                                      const std::vector<uint64_t> &);
 
 private:
     std::vector<std::unique_ptr<EncLayer>> layers; // first in list is
                                                    // lowest layer
+    // Built once the layers are all there; they don't change after.
+    std::unique_ptr<OnionPipeline> pipeline;
     constexpr static const char *type_name = "onionMeta";
     const std::string onionname;
     unsigned long uniq_count;
@@ -82,13 +89,17 @@ private:
 } OnionMeta;
 
 class TableMeta;
+
+// The salt an in-place HOM increment gives the rows whose other onions
+// it leaves behind; a random salt is 0 with chance 2^-64.
+const salt_type STALE_ROW_SALT = 0;
+
 //TODO: FieldMeta and TableMeta are partly duplicates with the original
 // FieldMetadata an TableMetadata
 // which contains data we want to add to this structure soon
 typedef class FieldMeta : public MappedDBMeta<OnionMeta, OnionMetaKey> {
 public:
     const std::string fname;
-    const std::string salt_name;
 
     // New.
     FieldMeta(const std::string &name, Create_field * const field,
@@ -102,15 +113,20 @@ public:
               const std::string &salt_name, onionlayout onion_layout,
               SECURITY_RATING sec_rating, unsigned long uniq_count,
               unsigned long counter, bool has_default,
-              const std::string &default_value)
+              const std::string &default_value, bool onions_stale,
+              bool shared_salt)
         : MappedDBMeta(id), fname(fname), salt_name(salt_name),
           onion_layout(onion_layout), has_salt(has_salt),
           sec_rating(sec_rating), uniq_count(uniq_count),
           counter(counter), has_default(has_default),
-          default_value(default_value) {}
+          default_value(default_value), onions_stale(onions_stale),
+          shared_salt(shared_salt) {}
     ~FieldMeta() {;}
 
     std::string serialize(const DBObject &parent) const;
+    // The serial with the stale flag set to @stale; the flag of a cached
+    // field only changes when the schema is reloaded.
+    std::string serializeStale(const DBObject &parent, bool stale) const;
     std::string stringify() const;
     std::vector<std::pair<const OnionMetaKey *, OnionMeta *>>
         orderedOnionMetas() const;
@@ -131,9 +147,18 @@ public:
     std::string defaultValue() const {return default_value;}
     const onionlayout &getOnionLayout() const {return onion_layout;}
     bool getHasSalt() const {return has_salt;}
+    // In-place HOM increments only touch oAGG; until the other onions
+    // are rebuilt from it, oAGG is the only one holding current values.
+    // The rows they touched carry STALE_ROW_SALT.
+    bool getOnionsStale() const {return onions_stale;}
+    // Fields of compact tables have no salt column of their own; their
+    // onions are salted with the row salt of the table.
+    bool getSharesSalt() const {return shared_salt;}
+    void shareSalt(const std::string &row_salt_name);
 
 private:
     constexpr static const char *type_name = "fieldMeta";
+    std::string salt_name;
     const onionlayout onion_layout;
     const bool has_salt; //whether this field has its own salt
     const SECURITY_RATING sec_rating;
@@ -141,6 +166,8 @@ private:
     unsigned long counter;
     const bool has_default;
     const std::string default_value;
+    bool onions_stale;
+    bool shared_salt;
 
     SECLEVEL getOnionLevel(onion o) const;
     static onionlayout determineOnionLayout(const AES_KEY *const m_key,
@@ -151,28 +178,33 @@ private:
                                              const Create_field *const cf);
 } FieldMeta;
 
+// Columns (and prefix lengths, 0 for none) of a user index.
+typedef std::vector<std::pair<std::string, unsigned int> > IndexColumns;
+
 typedef class TableMeta : public MappedDBMeta<FieldMeta, IdentityMetaKey> {
 public:
     const bool hasSensitive;
     const bool has_salt;
-    const std::string salt_name;
     const std::string anon_table_name;
 
     // New TableMeta.
-    TableMeta(bool has_sensitive, bool has_salt)
+    TableMeta(bool has_sensitive, bool has_salt, bool compact = false)
         : hasSensitive(has_sensitive), has_salt(has_salt),
-          salt_name("tableSalt_" + getpRandomName()),
           anon_table_name("table_" + getpRandomName()),
-          counter(0) {}
+          salt_name("tableSalt_" + getpRandomName()),
+          counter(0), compact(compact) {}
     // Restore.
     static std::unique_ptr<TableMeta>
         deserialize(unsigned int id, const std::string &serial);
     TableMeta(unsigned int id, const std::string &anon_table_name,
               bool has_sensitive, bool has_salt,
-              const std::string &salt_name, unsigned int counter)
+              const std::string &salt_name, unsigned int counter,
+              const std::map<std::string, IndexColumns> &lazy_indexes,
+              bool compact)
         : MappedDBMeta(id), hasSensitive(has_sensitive),
-          has_salt(has_salt), salt_name(salt_name),
-          anon_table_name(anon_table_name), counter(counter) {}
+          has_salt(has_salt), anon_table_name(anon_table_name),
+          salt_name(salt_name), counter(counter),
+          lazy_indexes(lazy_indexes), compact(compact) {}
     ~TableMeta() {;}
 
     std::string serialize(const DBObject &parent) const;
@@ -185,11 +217,36 @@ public:
     unsigned long leaseIncUniq() {return counter++;}
     unsigned long getCurrentUniqCounter() {return counter;}
 
+    // Plain (non unique) indexes are not built on every onion up front;
+    // the IndexPlanner builds them on the onions queries actually use.
+    void addLazyIndex(const std::string &name, const IndexColumns &columns)
+        {lazy_indexes[name] = columns;}
+    // @declared_name gets the name as it was declared.
+    bool dropLazyIndex(const std::string &name,
+                       std::string *const declared_name);
+    // Like MySQL, dropping a column removes it from its indexes.
+    bool dropLazyIndexColumn(const std::string &field);
+    const std::map<std::string, IndexColumns> &getLazyIndexes() const
+        {return lazy_indexes;}
+
+    // The compact storage format declares fixed width onions at their
+    // exact width and salts every field of a row with one row salt.
+    // > The row salt has no fixed position; INSERTs name every column.
+    bool isCompact() const {return compact;}
+    // @row_salt_name is an existing salt column when a table is
+    // migrated.
+    void setCompact(const std::string &row_salt_name)
+        {compact = true; salt_name = row_salt_name;}
+    const std::string &getSaltName() const {return salt_name;}
+
     friend class Analysis;
 
 private:
     constexpr static const char *type_name = "tableMeta";
+    std::string salt_name;
     unsigned int counter;
+    std::map<std::string, IndexColumns> lazy_indexes;
+    bool compact;
 
     std::string getAnonIndexName(const std::string &index_name,
                                  onion o) const;
@@ -15,6 +15,8 @@ getStoredProcedures()
         MetaData::Proc::adjustOnion();
     const std::string remote_completion_table =
         MetaData::Table::remoteQueryCompletion();
+    const std::string adjust_query_type =
+        "VARBINARY(" + std::to_string(adjust_onion_query_bytes) + ")";
 
     const std::vector<std::string> add_procs({
         // ---------------------------------------
@@ -89,11 +91,19 @@ getStoredProcedures()
         //         def adjustOnion(id)
         // ---------------------------------------
         // NOTE: If we need N queries, we will have to use an additional
-        // table + cursors.
+        // table + cursors. Until then a query that needs more than
+        // adjust_onion_queries tables adjusted gets the rest when it is
+        // reissued.
+        // > Each query is the UPDATE of one table, nesting the decryption
+        //   UDFs, keys included, of every layer it removes from each of
+        //   the table's onions: a few hundred bytes per onion, so the
+        //   500 bytes these once took held about one. They take what
+        //   homAdditionTransaction takes; longer queries are refused
+        //   before they are sent.
         " CREATE PROCEDURE " + adjust_onion + "\n"
         "       (IN completion_id INTEGER,\n"
-        "        IN adjust_query0 VARBINARY(500),\n"
-        "        IN adjust_query1 VARBINARY(500))\n"
+        "        IN adjust_query0 " + adjust_query_type + ",\n"
+        "        IN adjust_query1 " + adjust_query_type + ")\n"
         " BEGIN\n"
         "   DECLARE old_transaction_id VARCHAR(20);\n"
         "   DECLARE b_reissue BOOLEAN;\n\n"
@@ -114,12 +124,12 @@ getStoredProcedures()
             // start a new one for this proc call
         "   START TRANSACTION;\n\n"
 
-            // first onion adjustment
+            // first table adjustment
         "   SET @query = adjust_query0;\n"
         "   PREPARE aq0 FROM @query;\n"
         "   EXECUTE aq0;\n\n"
 
-            // (possibly) second onion adjustment
+            // (possibly) second table adjustment
         "   SET @query = adjust_query1;\n"
         "   PREPARE aq1 FROM @query;\n"
         "   EXECUTE aq1;\n\n"
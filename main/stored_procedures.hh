@@ -4,6 +4,11 @@
 
 #include <main/Connect.hh>
 
+// adjustOnion() runs this many adjustment queries per call, one per
+// table, each at most this long; see getStoredProcedures().
+const size_t adjust_onion_queries = 2;
+const size_t adjust_onion_query_bytes = 50000;
+
 bool
 loadStoredProcedures(const std::unique_ptr<Connect> &conn);
 
@@ -1,6 +1,7 @@
 #include <sstream>
 #include <fstream>
 #include <assert.h>
+#include <signal.h>
 #include <lua5.1/lua.hpp>
 
 #include <util/ctr.hh>
@@ -9,6 +10,7 @@
 
 #include <main/rewrite_main.hh>
 #include <main/rewrite_util.hh>
+#include <main/result_cache.hh>
 #include <parser/sql_utils.hh>
 
 // FIXME: Ownership semantics.
@@ -18,10 +20,25 @@ class WrapperState {
 
 public:
     std::string last_query;
+    // Tracked from the statements that change it; until it is known,
+    // as after COM_CHANGE_USER, the next query asks the server.
     std::string default_db;
+    bool default_db_known;
     std::ofstream * PLAIN_LOG;
-
-    WrapperState() {}
+    // Reads inside a transaction neither use nor fill the result cache,
+    // and what the transaction wrote is invalidated again once it ends,
+    // in case another session cached the old rows meanwhile. With
+    // autocommit off every statement is in one.
+    bool in_transaction;
+    bool autocommit_off;
+    std::vector<CacheFootprint> transaction_writes;
+    // The rewritten query of a read to store once it comes back, and
+    // the cache generation it was sent at; empty if it isn't stored.
+    std::string cache_query;
+    uint64_t cache_generation;
+
+    WrapperState() : default_db_known(false), in_transaction(false),
+                     autocommit_off(false), cache_generation(0) {}
     ~WrapperState() {}
 
     SchemaCache &getSchemaCache() {return schema_cache;}
@@ -57,8 +74,110 @@ static int counter = 0;
 
 static std::map<std::string, WrapperState*> clients;
 
+// NULL unless CRYPTDB_RESULT_CACHE_BYTES is set.
+static ResultCache *result_cache = NULL;
+
+// CRYPTDB_VERIFY_DEFAULT_DB=1 checks the tracked default database
+// against the server's before every query.
+static bool
+verifyDefaultDatabase()
+{
+    static const bool verify = [] () {
+        const char *const ev = getenv("CRYPTDB_VERIFY_DEFAULT_DB");
+        return ev && std::string("0") != ev;
+    }();
+
+    return verify;
+}
+
+// Another process changed the metadata (cryptdbimport, say); every
+// session reloads its schema: kill -USR1 <proxy>.
+static void
+invalidateSchemas(int)
+{
+    SchemaCache::invalidateAll();
+}
+
+static void
+pushResultSet(lua_State *const L, const ResType &rd);
+static void
+pushResultSet(lua_State *const L, const CachedResult &rd);
+template <typename Result>
 static int
-returnResultSet(lua_State *L, const ResType &res);
+returnResultSet(lua_State *L, const Result &res);
+
+// The read waiting for its result, if any, won't be stored.
+static void
+dropCachedRead(WrapperState *const c_wrapper)
+{
+    if (false == c_wrapper->cache_query.empty()) {
+        result_cache->endRead(c_wrapper->cache_generation);
+        c_wrapper->cache_query.clear();
+    }
+}
+
+// Before the query goes to the server: its result, if the cache has it.
+static std::shared_ptr<const CachedResult>
+cachedResult(WrapperState *const c_wrapper, const QueryRewrite &qr,
+             const std::list<std::string> &new_queries)
+{
+    const CacheFootprint &footprint = qr.cache_footprint;
+    dropCachedRead(c_wrapper);
+    if (CacheFootprint::Kind::TRANSACTION_BEGIN == footprint.kind) {
+        c_wrapper->in_transaction = true;
+    } else if (CacheFootprint::Kind::AUTOCOMMIT_OFF == footprint.kind) {
+        c_wrapper->autocommit_off = true;
+    }
+
+    if (CacheFootprint::Kind::READ != footprint.kind
+        || c_wrapper->in_transaction || c_wrapper->autocommit_off
+        || 1 != new_queries.size() || qr.output->stalesSchema()) {
+        return std::shared_ptr<const CachedResult>();
+    }
+
+    const uint64_t generation = result_cache->beginRead();
+    const std::shared_ptr<const CachedResult> out =
+        result_cache->lookup(footprint.db, new_queries.front());
+    if (out) {
+        result_cache->endRead(generation);
+    } else {
+        c_wrapper->cache_query = new_queries.front();
+        c_wrapper->cache_generation = generation;
+    }
+    return out;
+}
+
+static void
+endTransaction(WrapperState *const c_wrapper)
+{
+    for (const auto &it : c_wrapper->transaction_writes) {
+        result_cache->invalidate(it);
+    }
+    c_wrapper->transaction_writes.clear();
+    c_wrapper->in_transaction = false;
+}
+
+// The server ran the statement; whatever it changed is out of date.
+static void
+invalidateWrites(WrapperState *const c_wrapper, const QueryRewrite &qr)
+{
+    const CacheFootprint &footprint = qr.cache_footprint;
+    // Onion adjustments count as writes to their tables.
+    if (CacheFootprint::Kind::WRITE == footprint.kind
+        || qr.output->stalesSchema()) {
+        result_cache->invalidate(footprint);
+        if (c_wrapper->in_transaction || c_wrapper->autocommit_off) {
+            c_wrapper->transaction_writes.push_back(footprint);
+        }
+    } else if (CacheFootprint::Kind::TRANSACTION_END == footprint.kind) {
+        endTransaction(c_wrapper);
+    } else if (CacheFootprint::Kind::AUTOCOMMIT_ON == footprint.kind
+               && c_wrapper->autocommit_off) {
+        // Turning autocommit back on commits.
+        endTransaction(c_wrapper);
+        c_wrapper->autocommit_off = false;
+    }
+}
 
 static Item *
 make_item_by_type(const std::string &value, enum_field_types type)
@@ -127,7 +246,7 @@ connect(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
     scoped_lock l(&big_lock);
-    assert(0 == mysql_thread_init());
+    embedded_thread_init();
 
     const std::string client = xlua_tolstring(L, 1);
     const std::string server = xlua_tolstring(L, 2);
@@ -169,6 +288,9 @@ connect(lua_State *const L)
                                 SECURITY_RATING::BEST_EFFORT);
         }
 
+        signal(SIGUSR1, invalidateSchemas);
+        result_cache = ResultCache::fromEnvironment();
+
         //may need to do training
         ev = getenv("TRAIN_QUERY");
         if (ev) {
@@ -232,7 +354,7 @@ disconnect(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
     scoped_lock l(&big_lock);
-    assert(0 == mysql_thread_init());
+    embedded_thread_init();
 
     const std::string client = xlua_tolstring(L, 1);
     if (clients.find(client) == clients.end()) {
@@ -243,6 +365,9 @@ disconnect(lua_State *const L)
 
     auto ws = clients[client];
     clients[client] = NULL;
+    if (result_cache) {
+        dropCachedRead(ws);
+    }
 
     SchemaCache &schema_cache = ws->getSchemaCache();
     TEST_TextMessageError(schema_cache.cleanupStaleness(ps->getEConn()),
@@ -258,7 +383,7 @@ rewrite(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
     scoped_lock l(&big_lock);
-    assert(0 == mysql_thread_init());
+    embedded_thread_init();
 
     const std::string client = xlua_tolstring(L, 1);
     if (clients.find(client) == clients.end()) {
@@ -271,6 +396,7 @@ rewrite(lua_State *const L)
         strtoull(xlua_tolstring(L, 3).c_str(), NULL, 10);
 
     std::list<std::string> new_queries;
+    std::shared_ptr<const CachedResult> cached;
 
     c_wrapper->last_query = query;
     t.lap_ms();
@@ -280,13 +406,28 @@ rewrite(lua_State *const L)
 
             SchemaCache &schema_cache = c_wrapper->getSchemaCache();
             std::unique_ptr<QueryRewrite> qr;
-            TEST_TextMessageError(retrieveDefaultDatabase(_thread_id,
-                                                          ps->getConn(),
-                                            &c_wrapper->default_db),
+            if (false == c_wrapper->default_db_known
+                || verifyDefaultDatabase()) {
+                std::string remote_db;
+                TEST_TextMessageError(retrieveDefaultDatabase(_thread_id,
+                                                              ps->getConn(),
+                                                              &remote_db),
                             "proxy failed to retrieve default database!");
+                if (c_wrapper->default_db_known
+                    && remote_db != c_wrapper->default_db) {
+                    LOG(warn) << "client " << client << " is in database '"
+                              << remote_db << "', not '"
+                              << c_wrapper->default_db << "'";
+                }
+                c_wrapper->default_db = remote_db;
+                c_wrapper->default_db_known = true;
+            }
             queryPreamble(*ps, query, &qr, &new_queries, &schema_cache,
                           c_wrapper->default_db);
             assert(qr);
+            if (result_cache) {
+                cached = cachedResult(c_wrapper, *qr, new_queries);
+            }
 
             c_wrapper->setQueryRewrite(qr.release());
         } catch (const SynchronizationException &e) {
@@ -315,6 +456,13 @@ rewrite(lua_State *const L)
     lua_pushboolean(L, true);                       // status
     lua_pushnil(L);                                 // error message
 
+    // Answered from the result cache; nothing goes to the server.
+    if (cached) {
+        lua_createtable(L, 0, 0);                   // new queries
+        pushResultSet(L, *cached);                  // plaintext result
+        return 5;
+    }
+
     // NOTE: Potentially out of int range.
     assert(new_queries.size() < INT_MAX);
     lua_createtable(L, static_cast<int>(new_queries.size()), 0);
@@ -407,16 +555,8 @@ envoi(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
     scoped_lock l(&big_lock);
-    assert(0 == mysql_thread_init());
-
-    THD *const thd = static_cast<THD *>(create_embedded_thd(0));
-    auto thd_cleanup = cleanup([&thd]
-        {
-            thd->clear_data_list();
-            thd->store_globals();
-            thd->unlink();
-            delete thd;
-        });
+    THD *const thd = acquire_thd();
+    auto thd_cleanup = cleanup([thd] {release_thd(thd);});
 
     const std::string client = xlua_tolstring(L, 1);
     if (clients.find(client) == clients.end()) {
@@ -430,11 +570,28 @@ envoi(lua_State *const L)
     ResType res;
     getResTypeFromLuaTable(L, 2, 3, &res);
     const std::unique_ptr<QueryRewrite> &qr = c_wrapper->getQueryRewrite();
+    // Stored below if it can be, and not waited for after.
+    auto read_cleanup = cleanup([c_wrapper] {
+        if (result_cache) {
+            dropCachedRead(c_wrapper);
+        }
+    });
+    // The server ran the query, so the database it changed to is
+    // current even if the epilogue fails; the next query asks for it.
+    if (qr->changes_default_db) {
+        c_wrapper->default_db_known = false;
+    }
+    if (result_cache) {
+        invalidateWrites(c_wrapper, *qr.get());
+    }
     try {
         const EpilogueResult &epi_result =
             queryEpilogue(*ps, *qr.get(), res, c_wrapper->last_query,
                           c_wrapper->default_db, false);
         if (QueryAction::ROLLBACK == epi_result.action) {
+            if (result_cache) {
+                endTransaction(c_wrapper);
+            }
             lua_pushboolean(L, true);           // success
             lua_pushboolean(L, true);           // rollback
             lua_pushnil(L);                     // error message
@@ -444,7 +601,18 @@ envoi(lua_State *const L)
         }
 
         assert(QueryAction::VANILLA == epi_result.action);
-        return returnResultSet(L, epi_result.res_type);
+        if (qr->changes_default_db) {
+            c_wrapper->default_db = qr->new_default_db;
+            c_wrapper->default_db_known = true;
+        }
+        if (c_wrapper->cache_query.empty()) {
+            return returnResultSet(L, epi_result.res_type);
+        }
+        const std::shared_ptr<const CachedResult> result =
+            std::make_shared<const CachedResult>(epi_result.res_type);
+        result_cache->store(qr->cache_footprint, c_wrapper->cache_query,
+                            result, c_wrapper->cache_generation);
+        return returnResultSet(L, *result);
     } catch (const SynchronizationException &e) {
         lua_pushboolean(L, false);              // status
         lua_pushboolean(L, false);              // rollback
@@ -469,13 +637,44 @@ envoi(lua_State *const L)
     }
 }
 
+// The client's session changed without the proxy seeing the statement
+// (COM_CHANGE_USER); the next query asks the server for its database.
+static int
+reset_session(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+    scoped_lock l(&big_lock);
+
+    const std::string client = xlua_tolstring(L, 1);
+    if (clients.find(client) == clients.end()) {
+        return 0;
+    }
+    WrapperState *const c_wrapper = clients[client];
+    c_wrapper->default_db_known = false;
+    // The change rolled back any transaction and reset autocommit.
+    if (result_cache) {
+        endTransaction(c_wrapper);
+    }
+    c_wrapper->autocommit_off = false;
+
+    return 0;
+}
+
+template <typename Result>
 static int
-returnResultSet(lua_State *const L, const ResType &rd)
+returnResultSet(lua_State *const L, const Result &rd)
 {
     lua_pushboolean(L, true);                   // status
     lua_pushboolean(L, false);                  // rollback
     lua_pushnil(L);                             // error message
+    pushResultSet(L, rd);                       // plaintext result
+
+    return 5;
+}
 
+static void
+pushResultSet(lua_State *const L, const ResType &rd)
+{
     /* return decrypted result set */
     lua_createtable(L, (int)rd.names.size(), 0);
     int const t_fields = lua_gettop(L);
@@ -487,13 +686,6 @@ returnResultSet(lua_State *const L, const ResType &rd)
         xlua_pushlstring(L, rd.names[i]);       // plaintext fields
         lua_setfield(L, t_field, "name");
 
-/*
-        // FIXME.
-        // set type for field
-        lua_pushinteger(L, rd.types[i]);
-        lua_setfield(L, t_field, "type");
-*/
-
         /* insert field element into fields table at i+1 */
         lua_rawseti(L, t_fields, i+1);
     }
@@ -516,8 +708,51 @@ returnResultSet(lua_State *const L, const ResType &rd)
 
         lua_rawseti(L, t_rows, i+1);
     }
+}
 
-    return 5;
+static void
+pushResultSet(lua_State *const L, const CachedResult &rd)
+{
+    /* return decrypted result set */
+    lua_createtable(L, (int)rd.names.size(), 0);
+    int const t_fields = lua_gettop(L);
+    for (uint i = 0; i < rd.names.size(); i++) {
+        lua_createtable(L, 0, 1);
+        int const t_field = lua_gettop(L);
+
+        /* set name for field */
+        xlua_pushlstring(L, rd.names[i]);       // plaintext fields
+        lua_setfield(L, t_field, "name");
+
+/*
+        // FIXME.
+        // set type for field
+        lua_pushinteger(L, rd.types[i]);
+        lua_setfield(L, t_field, "type");
+*/
+
+        /* insert field element into fields table at i+1 */
+        lua_rawseti(L, t_fields, i+1);
+    }
+
+    lua_createtable(L, static_cast<int>(rd.rowCount()), 0);
+    int const t_rows = lua_gettop(L);
+    for (uint i = 0; i < rd.rowCount(); i++) {
+        lua_createtable(L, static_cast<int>(rd.names.size()), 0);
+        int const t_row = lua_gettop(L);
+
+        for (uint j = 0; j < rd.names.size(); j++) {
+            const std::string *const value = rd.value(i, j);
+            if (NULL == value) {
+                lua_pushnil(L);                 // plaintext rows
+            } else {
+                xlua_pushlstring(L, *value);    // plaintext rows
+            }
+            lua_rawseti(L, t_row, j+1);
+        }
+
+        lua_rawseti(L, t_rows, i+1);
+    }
 }
 
 static const struct luaL_reg
@@ -527,6 +762,7 @@ cryptdb_lib[] = {
     F(disconnect),
     F(rewrite),
     F(envoi),
+    F(reset_session),
     { 0, 0 },
 };
 
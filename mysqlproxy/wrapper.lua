@@ -69,7 +69,7 @@ function read_query_real(packet)
 
     if string.byte(packet) == proxy.COM_INIT_DB or
        string.byte(packet) == proxy.COM_QUERY then
-        status, error_msg, new_queries =
+        status, error_msg, new_queries, dfields, drows =
             CryptDB.rewrite(proxy.connection.client.src.name, query,
                             proxy.connection.server.thread_id)
 
@@ -79,6 +79,14 @@ function read_query_real(packet)
             return proxy.PROXY_SEND_RESULT
         end
 
+        -- Answered from the result cache.
+        if dfields then
+            proxy.response.type = proxy.MYSQLD_PACKET_OK
+            proxy.response.resultset = { fields = dfields,
+                                         rows = drows }
+            return proxy.PROXY_SEND_RESULT
+        end
+
         if table.maxn(new_queries) == 0 then
             proxy.response.type = proxy.MYSQLD_PACKET_OK
             return proxy.PROXY_SEND_RESULT
@@ -101,6 +109,9 @@ function read_query_real(packet)
         return proxy.PROXY_SEND_QUERY
     elseif string.byte(packet) == proxy.COM_QUIT then
         -- do nothing
+    elseif string.byte(packet) == proxy.COM_CHANGE_USER then
+        -- Resets the default database behind our back.
+        CryptDB.reset_session(proxy.connection.client.src.name)
     else
         print("unexpected packet type " .. string.byte(packet))
     end
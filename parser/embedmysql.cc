@@ -1,5 +1,10 @@
+#include <algorithm>
 #include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <map>
 #include <sstream>
+#include <vector>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -10,6 +15,7 @@
 #include <sql_insert.h>
 #include <sql_update.h>
 #include <sql_parse.h>
+#include <transaction.h>
 #include <handler.h>
 
 
@@ -65,10 +71,9 @@ embedmysql::conn()
 {
     /*
      * Need to call mysql_thread_init() in every thread that touches
-     * MySQL state.  mysql_server_init() calls it internally.  Safe
-     * to call mysql_thread_init() many times.
+     * MySQL state.  mysql_server_init() calls it internally.
      */
-    mysql_thread_init();
+    embedded_thread_init();
     return m;
 }
 
@@ -80,17 +85,181 @@ mysql_thrower::~mysql_thrower()
 
 extern "C" void *create_embedded_thd(int client_flag);
 
+static __thread bool thread_initialized = false;
+
+void
+embedded_thread_init()
+{
+    if (false == thread_initialized) {
+        if (mysql_thread_init()) {
+            fatal() << "mysql_thread_init failed";
+        }
+        thread_initialized = true;
+    }
+}
+
+namespace {
+
+struct ThdPool {
+    ~ThdPool();
+
+    std::vector<THD *> idle;
+    // Every THD of the pool that is handed out, and the THD that was
+    // current when it was.
+    std::map<THD *, THD *> busy;
+};
+
+}
+
+static size_t
+idle_limit()
+{
+    static const size_t limit = [] () {
+        const char *const ev = getenv("CRYPTDB_THD_POOL");
+        return ev ? strtoul(ev, NULL, 10) : 4UL;
+    }();
+
+    return limit;
+}
+
+static void
+destroy_thd(THD *const t)
+{
+    t->clear_data_list();
+    t->store_globals();
+    t->unlink();
+    delete t;
+}
+
+ThdPool::~ThdPool()
+{
+    for (THD *const t : idle) {
+        destroy_thd(t);
+    }
+}
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void
+delete_pool(void *const pool)
+{
+    delete static_cast<ThdPool *>(pool);
+}
+
+static void
+make_pool_key()
+{
+    if (0 != pthread_key_create(&pool_key, delete_pool)) {
+        fatal() << "pthread_key_create failed";
+    }
+}
+
+static __thread ThdPool *thd_pool = NULL;
+
+static ThdPool &
+thread_pool()
+{
+    if (NULL == thd_pool) {
+        pthread_once(&pool_key_once, make_pool_key);
+        thd_pool = new ThdPool();
+        if (0 != pthread_setspecific(pool_key, thd_pool)) {
+            fatal() << "pthread_setspecific failed";
+        }
+    }
+
+    return *thd_pool;
+}
+
+void
+embedded_thread_end()
+{
+    if (thd_pool) {
+        if (0 != pthread_setspecific(pool_key, NULL)) {
+            fatal() << "pthread_setspecific failed";
+        }
+        delete thd_pool;
+        thd_pool = NULL;
+    }
+    if (thread_initialized) {
+        mysql_thread_end();
+        thread_initialized = false;
+    }
+}
+
+THD *
+acquire_thd()
+{
+    embedded_thread_init();
+
+    ThdPool &pool = thread_pool();
+    THD *const previous = current_thd;
+    THD *t;
+    if (pool.idle.empty()) {
+        t = static_cast<THD *>(create_embedded_thd(0));
+        assert(t);
+    } else {
+        t = pool.idle.back();
+        pool.idle.pop_back();
+
+        // What create_embedded_thd() sets up for a new one.
+        t->thread_stack = reinterpret_cast<char *>(&t);
+        if (t->store_globals()) {
+            fatal() << "store_globals failed";
+        }
+        lex_start(t);
+        t->set_time();
+    }
+    pool.busy[t] = previous;
+
+    return t;
+}
+
+void
+release_thd(THD *const t)
+{
+    ThdPool &pool = thread_pool();
+    const auto it = pool.busy.find(t);
+    assert(pool.busy.end() != it);
+    THD *const previous = it->second;
+    pool.busy.erase(it);
+
+    if (pool.idle.size() < idle_limit()) {
+        t->store_globals();
+        t->clear_data_list();
+        t->cleanup_after_query();
+        close_thread_tables(t);
+        // The tables a parse names hold MDL_TRANSACTION locks, which
+        // close_thread_tables() leaves; an idle THD must not block the
+        // DROP or ALTER that follows on this thread.
+        trans_rollback_stmt(t);
+        trans_rollback(t);
+        t->mdl_context.release_transactional_locks();
+        // Keeps every block for the next query.
+        free_root(t->mem_root, MYF(MY_MARK_BLOCKS_FREE));
+        pool.idle.push_back(t);
+    } else {
+        destroy_thd(t);
+    }
+
+    // Only a THD the pool knows to be alive.
+    if (previous && (pool.busy.end() != pool.busy.find(previous)
+                     || std::find(pool.idle.begin(), pool.idle.end(),
+                                  previous) != pool.idle.end())) {
+        previous->store_globals();
+    }
+}
+
 void
 query_parse::cleanup()
 {
     if (annot) {
         delete annot;
+        annot = NULL;
     }
     if (t) {
         t->end_statement();
-        t->cleanup_after_query();
-        close_thread_tables(t);
-        delete t;
+        release_thd(t);
         t = 0;
     }
 }
@@ -117,9 +286,8 @@ cloneItemInOrder(ORDER * o) {
 */
 query_parse::query_parse(const std::string &db, const std::string &q)
 {
-    assert(create_embedded_thd(0));
-    t = current_thd;
-    assert(t != NULL);
+    t = acquire_thd();
+    assert(t == current_thd);
 
     //if first word of query is CRYPTDB, we can't use the embedded db
     //  set annotation to true and return
@@ -25,6 +25,26 @@ class mysql_thrower : public std::stringstream {
     ~mysql_thrower() __attribute__((noreturn));
 };
 
+/*
+ * Every thread keeps the THDs it is done with and hands them out again,
+ * with the mem_root emptied but its blocks kept, instead of building
+ * and freeing one per query. At most
+ * CRYPTDB_THD_POOL of them (4 by default; 0 turns pooling off) wait per
+ * thread; the rest are freed on release, and the waiting ones when the
+ * thread exits.
+ *
+ * acquire_thd() makes the THD current; release_thd() makes the THD that
+ * was current before it current again, if it was one of the pool's.
+ * Nothing allocated on a THD's mem_root may outlive its release.
+ */
+THD *acquire_thd();
+void release_thd(THD *const t);
+
+// mysql_thread_init(), once for the calling thread.
+void embedded_thread_init();
+// Frees the thread's waiting THDs and calls mysql_thread_end().
+void embedded_thread_end();
+
 class query_parse {
  public:
     query_parse(const std::string &db, const std::string &q);
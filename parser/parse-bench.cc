@@ -0,0 +1,97 @@
+/*
+ * Per-query fixed cost of the parser: a fresh THD against one from the
+ * thread's pool, then query_parse on each query read from stdin.
+ *
+ *   parse-bench schema-db [iterations] < queries
+ *
+ * Run it with CRYPTDB_THD_POOL=0 to time query_parse without pooling.
+ */
+
+#include <string>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <parser/embedmysql.hh>
+
+#include <sql_class.h>
+
+#include <util/errstream.hh>
+#include <util/timer.hh>
+
+using namespace std;
+
+extern "C" void *create_embedded_thd(int client_flag);
+
+static void
+bench_thd(unsigned int niter)
+{
+    timer t;
+    for (unsigned int i = 0; i < niter; i++) {
+        THD *const thd = static_cast<THD *>(create_embedded_thd(0));
+        thd->clear_data_list();
+        thd->store_globals();
+        thd->unlink();
+        delete thd;
+    }
+    const double fresh = static_cast<double>(t.lap()) / niter;
+
+    for (unsigned int i = 0; i < niter; i++) {
+        release_thd(acquire_thd());
+    }
+    const double pooled = static_cast<double>(t.lap()) / niter;
+
+    cout << "--- THD: " << fresh << " usec fresh, "
+         << pooled << " usec from the pool" << endl;
+}
+
+static void
+bench_parse(const std::string &db, const std::string &q,
+            unsigned int niter)
+{
+    timer t;
+    for (unsigned int i = 0; i < niter; i++) {
+        query_parse p(db, q);
+    }
+
+    cout << "--- " << static_cast<double>(t.lap()) / niter
+         << " usec per parse: " << q << endl;
+}
+
+int
+main(int ac, char **av)
+{
+    if (ac != 2 && ac != 3) {
+        cerr << "Usage: " << av[0] << " schema-db [iterations]" << endl;
+        exit(1);
+    }
+    const unsigned int niter = 3 == ac ? atoi(av[2]) : 10000;
+
+    char dir_arg[1024];
+    snprintf(dir_arg, sizeof(dir_arg), "--datadir=%s", av[1]);
+
+    const char *mysql_av[] =
+        { "progname",
+          "--skip-grant-tables",
+          dir_arg,
+          "--character-set-server=utf8",
+          "--language=" MYSQL_BUILD_DIR "/sql/share/"
+        };
+    assert(0 == mysql_server_init(sizeof(mysql_av) / sizeof(mysql_av[0]),
+                                  (char**) mysql_av, 0));
+    embedded_thread_init();
+
+    bench_thd(niter);
+    for (;;) {
+        string s;
+        getline(cin, s);
+        if (cin.eof())
+            break;
+
+        try {
+            bench_parse("my_db", s, niter);
+        } catch (std::runtime_error &e) {
+            cout << "ERROR: " << e.what() << " in query " << s << endl;
+        }
+    }
+}
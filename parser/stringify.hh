@@ -198,7 +198,12 @@ sql_type_to_string(enum_field_types tpe, CHARSET_INFO *charset)
             return "TEXT";
         }
     case MYSQL_TYPE_VAR_STRING  : ASSERT_NOT_REACHED();
-    case MYSQL_TYPE_STRING      : return "CHAR";
+    case MYSQL_TYPE_STRING      :
+        if (charset == &my_charset_bin) {
+            return "BINARY";
+        } else {
+            return "CHAR";
+        }
 
     /* don't bother to support */
     case MYSQL_TYPE_GEOMETRY    : ASSERT_NOT_REACHED();
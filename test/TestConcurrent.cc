@@ -0,0 +1,442 @@
+/*
+ * TestConcurrent.cc
+ *  -- concurrent clients through one ProxyState, checked against a
+ *     plaintext oracle
+ */
+
+#include <stdexcept>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <util/errstream.hh>
+#include <util/cleanup.hh>
+#include <util/scoped_lock.hh>
+#include <util/timer.hh>
+#include <util/cryptdb_log.hh>
+#include <parser/embedmysql.hh>
+#include <main/rewrite_main.hh>
+#include <main/Connect.hh>
+#include <main/rewrite_util.hh>
+#include <main/macro_util.hh>
+#include <main/error.hh>
+
+#include <test/TestConcurrent.hh>
+
+typedef std::vector<std::vector<std::string> > Rows;
+
+static const char *const words[] = {
+    "apple", "river", "stone", "cloud", "ember", "maple", "frost", "delta"
+};
+static const unsigned int nwords = sizeof(words) / sizeof(words[0]);
+
+struct Shared {
+    ProxyState *ps;
+    std::string db;
+    TestConfig tc;
+    unsigned int nclients;
+    unsigned int nops;
+    bool locked;
+    pthread_mutex_t lock;
+};
+
+struct Client {
+    Shared *shared;
+    unsigned int id;
+    unsigned int seed;
+    std::unique_ptr<Connect> oracle;
+    SchemaCache schema_cache;
+
+    // Ids of the client's rows in the stress table, and the next one.
+    std::vector<unsigned int> live;
+    unsigned int next_row;
+    unsigned int next_table;
+
+    uint64_t ops;
+    uint64_t failures;
+    uint64_t mismatches;
+};
+
+static Rows
+toRows(const ResType &res)
+{
+    Rows out;
+    for (auto &row : res.rows) {
+        std::vector<std::string> r;
+        for (auto &item : row) {
+            r.push_back(item && false == item->is_null()
+                        ? ItemToString(*item) : "NULL");
+        }
+        out.push_back(r);
+    }
+    return out;
+}
+
+// The rows the proxy returns for @q; false if it fails.
+static bool
+proxyQuery(Client *const c, const std::string &q, Rows *const out)
+{
+    Shared *const s = c->shared;
+    THD *const thd = acquire_thd();
+    auto thd_cleanup = cleanup([thd] {release_thd(thd);});
+
+    try {
+        ResType res(false);
+        if (s->locked) {
+            scoped_lock l(&s->lock);
+            res = executeQuery(*s->ps, q, s->db, &c->schema_cache).res_type;
+        } else {
+            res = executeQuery(*s->ps, q, s->db, &c->schema_cache).res_type;
+        }
+        if (false == res.success()) {
+            return false;
+        }
+        if (out) {
+            *out = toRows(res);
+        }
+        return true;
+    } catch (const AbstractException &e) {
+        LOG(test) << "proxy failed " << q << ": " << e;
+    } catch (const CryptDBError &e) {
+        LOG(test) << "proxy failed " << q << ": " << e.msg;
+    } catch (const std::runtime_error &e) {
+        LOG(test) << "proxy failed " << q << ": " << e.what();
+    }
+    return false;
+}
+
+static bool
+oracleQuery(Client *const c, const std::string &q, Rows *const out)
+{
+    THD *const thd = acquire_thd();
+    auto thd_cleanup = cleanup([thd] {release_thd(thd);});
+
+    std::unique_ptr<DBResult> dbres;
+    if (false == c->oracle->execute(q, &dbres)) {
+        return false;
+    }
+    if (out) {
+        *out = toRows(dbres->unpack());
+    }
+    return true;
+}
+
+// A write goes to the oracle only once the proxy has applied it; true
+// if both applied it.
+static bool
+clientWrite(Client *const c, const std::string &q)
+{
+    c->ops++;
+    if (false == proxyQuery(c, q, NULL)) {
+        c->failures++;
+        return false;
+    }
+    if (false == oracleQuery(c, q, NULL)) {
+        LOG(test) << "oracle failed " << q;
+        c->failures++;
+        return false;
+    }
+    return true;
+}
+
+static void
+clientRead(Client *const c, const std::string &q)
+{
+    c->ops++;
+    Rows got, expected;
+    if (false == proxyQuery(c, q, &got)
+        || false == oracleQuery(c, q, &expected)) {
+        c->failures++;
+        return;
+    }
+    if (got != expected) {
+        LOG(test) << "client " << c->id << " mismatch on " << q;
+        c->mismatches++;
+    }
+}
+
+static unsigned int
+pick(Client *const c, unsigned int n)
+{
+    return rand_r(&c->seed) % n;
+}
+
+static std::string
+randomWord(Client *const c)
+{
+    return words[pick(c, nwords)];
+}
+
+static std::string
+randomNote(Client *const c)
+{
+    std::string note = randomWord(c);
+    for (unsigned int i = pick(c, 4); i > 0; i--) {
+        note += " " + randomWord(c);
+    }
+    return note;
+}
+
+static void
+insertRow(Client *const c)
+{
+    const unsigned int row =
+        c->id + c->shared->nclients * c->next_row++;
+    if (clientWrite(c, "INSERT INTO stress VALUES ("
+                       + std::to_string(row) + ", "
+                       + std::to_string(c->id) + ", '"
+                       + randomWord(c) + "', "
+                       + std::to_string(pick(c, 1000)) + ", '"
+                       + randomNote(c) + "')")) {
+        c->live.push_back(row);
+    }
+}
+
+static unsigned int
+randomRow(Client *const c)
+{
+    return c->live.at(pick(c, c->live.size()));
+}
+
+// A table of the client's own, from creation to drop.
+static void
+tableCycle(Client *const c)
+{
+    const std::string t = "stress_p" + std::to_string(c->id) + "_"
+                          + std::to_string(c->next_table++);
+    clientWrite(c, "CREATE TABLE " + t + " (k integer, v varchar(20))");
+    for (unsigned int i = pick(c, 4) + 1; i > 0; i--) {
+        clientWrite(c, "INSERT INTO " + t + " VALUES ("
+                       + std::to_string(pick(c, 100)) + ", '"
+                       + randomWord(c) + "')");
+    }
+    clientRead(c, "SELECT k, v FROM " + t + " ORDER BY k, v");
+    clientWrite(c, "DROP TABLE " + t);
+}
+
+static void
+randomOp(Client *const c)
+{
+    const std::string owner = std::to_string(c->id);
+    if (c->live.empty()) {
+        insertRow(c);
+        return;
+    }
+
+    switch (pick(c, 10)) {
+    case 0:
+    case 1:
+        insertRow(c);
+        break;
+    case 2:
+        clientWrite(c, "UPDATE stress SET score = score + "
+                       + std::to_string(pick(c, 50)) + " WHERE id = "
+                       + std::to_string(randomRow(c)));
+        break;
+    case 3:
+        clientWrite(c, "UPDATE stress SET name = '" + randomWord(c)
+                       + "' WHERE owner = " + owner + " AND score > "
+                       + std::to_string(pick(c, 1000)));
+        break;
+    case 4: {
+        const unsigned int i = pick(c, c->live.size());
+        if (clientWrite(c, "DELETE FROM stress WHERE id = "
+                           + std::to_string(c->live[i]))) {
+            c->live.erase(c->live.begin() + i);
+        }
+        break;
+    }
+    case 5:
+        clientRead(c, "SELECT id, name, score FROM stress WHERE owner = "
+                      + owner + " AND name = '" + randomWord(c)
+                      + "' ORDER BY id");
+        break;
+    case 6:
+        clientRead(c, "SELECT SUM(score) FROM stress WHERE owner = " + owner);
+        break;
+    case 7:
+        clientRead(c, "SELECT id, score FROM stress WHERE owner = " + owner
+                      + " AND score < " + std::to_string(pick(c, 1000))
+                      + " ORDER BY score, id");
+        break;
+    case 8:
+        clientRead(c, "SELECT id FROM stress WHERE owner = " + owner
+                      + " AND note LIKE '%" + randomWord(c)
+                      + "%' ORDER BY id");
+        break;
+    case 9:
+        tableCycle(c);
+        break;
+    }
+}
+
+static void *
+clientThread(void *const arg)
+{
+    Client *const c = static_cast<Client *>(arg);
+    embedded_thread_init();
+
+    for (unsigned int i = 0; i < c->shared->nops; i++) {
+        randomOp(c);
+    }
+
+    Shared *const s = c->shared;
+    {
+        scoped_lock l(&s->lock);
+        c->schema_cache.cleanupStaleness(s->ps->getEConn());
+    }
+    embedded_thread_end();
+    return NULL;
+}
+
+static void
+mustRun(Client *const c, const std::string &q)
+{
+    if (false == proxyQuery(c, q, NULL) || false == oracleQuery(c, q, NULL)) {
+        FAIL_TextMessageError("could not run " + q);
+    }
+}
+
+static void
+runClients(Shared *const s, unsigned int nclients, Client *const setup)
+{
+    // Left over from a run that didn't finish, if any.
+    proxyQuery(setup, "DROP TABLE stress", NULL);
+    oracleQuery(setup, "DROP TABLE stress", NULL);
+
+    mustRun(setup, "CREATE TABLE stress (id integer, owner integer,"
+                   " name varchar(20), score integer, note text)");
+    auto drop = cleanup([setup] {
+        proxyQuery(setup, "DROP TABLE stress", NULL);
+        oracleQuery(setup, "DROP TABLE stress", NULL);
+    });
+
+    s->nclients = nclients;
+    std::vector<std::unique_ptr<Client> > clients;
+    for (unsigned int i = 0; i < nclients; i++) {
+        Client *const c = new Client();
+        c->shared = s;
+        c->id = i;
+        c->seed = 7919 * (i + 1) + nclients;
+        c->oracle.reset(new Connect(s->tc.host, s->tc.user, s->tc.pass,
+                                    s->tc.port));
+        TEST_TextMessageError(c->oracle->execute("USE " + s->db + "_oracle"),
+                              "could not use the oracle database");
+        c->next_row = 0;
+        c->next_table = 0;
+        c->ops = c->failures = c->mismatches = 0;
+        clients.push_back(std::unique_ptr<Client>(c));
+    }
+
+    timer t;
+    std::vector<pthread_t> threads(nclients);
+    for (unsigned int i = 0; i < nclients; i++) {
+        TEST_TextMessageError(0 == pthread_create(&threads[i], NULL,
+                                                  clientThread,
+                                                  clients[i].get()),
+                              "could not start a client");
+    }
+    for (unsigned int i = 0; i < nclients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    const double secs = t.lap() / 1000000.0;
+
+    uint64_t ops = 0, failures = 0, mismatches = 0;
+    for (auto &c : clients) {
+        ops += c->ops;
+        failures += c->failures;
+        mismatches += c->mismatches;
+    }
+
+    // Whatever the interleaving, the tables have to end up the same.
+    // The clients' own tables aren't compared here: tableCycle() reads
+    // each one back through both before dropping it, and a DROP that
+    // fails counts as a failure.
+    const std::string final_q =
+        "SELECT id, owner, name, score, note FROM stress ORDER BY id";
+    Rows got, expected;
+    const bool final_ok = proxyQuery(setup, final_q, &got)
+                          && oracleQuery(setup, final_q, &expected)
+                          && got == expected;
+
+    std::cout << nclients << " clients: " << ops << " ops in " << secs
+              << " s, " << ops / secs << " ops/s; " << failures
+              << " failed, " << mismatches << " mismatched, final tables "
+              << (final_ok ? "match" : "DIFFER") << std::endl;
+
+    TEST_TextMessageError(0 == failures && 0 == mismatches && final_ok,
+                          "concurrent clients diverged from the oracle");
+}
+
+void
+TestConcurrent::run(const TestConfig &tc, int argc, char ** argv)
+{
+    if (argc < 3) {
+        std::cerr << "Usage:" << std::endl
+             << "    .../tests/test concurrent ops-per-client num-clients... [unlocked]" << std::endl
+             << "runs ops-per-client random statements on each of num-clients threads," << std::endl
+             << "once per num-clients given; unlocked leaves out the lock around" << std::endl
+             << "executeQuery" << std::endl;
+        return;
+    }
+
+    Shared s;
+    s.tc = tc;
+    s.db = tc.db;
+    s.nops = atoi(argv[1]);
+    s.locked = true;
+    std::vector<unsigned int> counts;
+    for (int i = 2; i < argc; i++) {
+        if (std::string(argv[i]) == "unlocked") {
+            s.locked = false;
+        } else {
+            counts.push_back(atoi(argv[i]));
+        }
+    }
+    pthread_mutex_init(&s.lock, NULL);
+
+    bool passed = true;
+    try {
+        ConnectionInfo ci(tc.host, tc.user, tc.pass);
+        std::unique_ptr<ProxyState> ps(
+            new ProxyState(ci, tc.shadowdb_dir, "2392834"));
+        s.ps = ps.get();
+
+        // The setup client runs the DDL around each round on this thread.
+        Client setup;
+        setup.shared = &s;
+        setup.id = 0;
+        setup.seed = 1;
+        setup.next_row = setup.next_table = 0;
+        setup.ops = setup.failures = setup.mismatches = 0;
+        setup.oracle.reset(new Connect(tc.host, tc.user, tc.pass, tc.port));
+        TEST_TextMessageError(setup.oracle->execute(
+                                  "CREATE DATABASE IF NOT EXISTS " + tc.db
+                                  + "_oracle")
+                              && setup.oracle->execute("USE " + tc.db
+                                                       + "_oracle"),
+                              "could not set up the oracle database");
+        TEST_TextMessageError(
+            proxyQuery(&setup, "CREATE DATABASE IF NOT EXISTS " + tc.db,
+                       NULL)
+            && proxyQuery(&setup, "USE " + tc.db, NULL),
+            "could not set up the proxy database");
+        s.db = tc.db;
+
+        for (auto n : counts) {
+            runClients(&s, n, &setup);
+        }
+
+        setup.schema_cache.cleanupStaleness(s.ps->getEConn());
+    } catch (const AbstractException &e) {
+        std::cout << e << std::endl;
+        passed = false;
+    } catch (const CryptDBError &e) {
+        std::cout << "CryptDB error " << e.msg << std::endl;
+        passed = false;
+    }
+    pthread_mutex_destroy(&s.lock);
+
+    if (false == passed) {
+        exit(1);
+    }
+}
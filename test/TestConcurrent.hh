@@ -0,0 +1,28 @@
+#pragma once
+
+/*
+ * TestConcurrent.hh
+ *
+ * Clients on their own threads run random mixes of DML, queries that
+ * adjust onions, and DDL through one ProxyState, and the same
+ * statements in plaintext against an oracle database. A client only
+ * touches its own rows and its own tables, so the statements of
+ * different clients commute: whatever the interleaving, every read has
+ * to match the oracle, and so do the tables once the clients are done.
+ *
+ *   .../tests/test concurrent ops-per-client num-clients... [unlocked]
+ *
+ * runs the workload once per client count and reports the throughput
+ * of each. A statement that fails, a read that doesn't match, or a
+ * stress table that ends up different stops the run with exit status
+ * 1. The clients take one lock around executeQuery, as the proxy's
+ * big_lock does; 'unlocked' leaves it out, for checking a rewriter and
+ * ProxyState that no longer need it.
+ */
+
+#include <test/test_utils.hh>
+
+class TestConcurrent {
+ public:
+    static void run(const TestConfig &tc, int argc, char ** argv);
+};
@@ -0,0 +1,174 @@
+/*
+ * TestImport.cc
+ *  -- cryptdbimport's dump and CSV parsing, and its batching
+ */
+
+#include <iostream>
+#include <sstream>
+
+#include <util/util.hh>
+#include <tools/import/importparse.hh>
+
+#include <test/TestImport.hh>
+
+typedef ImportValue::Kind Kind;
+
+static void
+checkValue(const ImportValue &v, Kind kind, const std::string &text,
+           const std::string &what)
+{
+    assert_s(v.kind == kind && v.text == text,
+             what + ": got '" + v.text + "'");
+}
+
+static void
+testDump()
+{
+    std::istringstream dump(
+        "-- MySQL dump\n"
+        "\n"
+        "USE `shop`;\n"
+        "/*!40101 SET NAMES utf8 */;\n"
+        "LOCK TABLES `items` WRITE;\n"
+        "INSERT INTO `items` VALUES (1,'it''s','a\\\\b\\n'),\n"
+        "(-2.5e3,NULL,\"x;y\");\n"
+        "UNLOCK TABLES;\n"
+        "CREATE TABLE t (a int);\n");
+
+    std::string stmt;
+    std::string db;
+    assert_s(next_statement(dump, &stmt) && parse_use(stmt, &db)
+             && "shop" == db, "USE not read: " + stmt);
+    assert_s(next_statement(dump, &stmt) && skip_statement(stmt),
+             "session setting not skipped: " + stmt);
+    assert_s(next_statement(dump, &stmt) && skip_statement(stmt),
+             "LOCK TABLES not skipped: " + stmt);
+
+    // The statement spans two lines.
+    std::string table;
+    std::vector<std::string> fields;
+    std::vector<ImportRow> rows;
+    assert_s(next_statement(dump, &stmt)
+             && parse_insert(stmt, &table, &fields, &rows),
+             "INSERT not parsed: " + stmt);
+    assert_s("items" == table && fields.empty() && 2 == rows.size()
+             && 3 == rows[0].size() && 3 == rows[1].size(),
+             "INSERT parsed to the wrong shape");
+    checkValue(rows[0][0], Kind::BARE, "1", "integer");
+    checkValue(rows[0][1], Kind::QUOTED, "it's", "doubled quote");
+    checkValue(rows[0][2], Kind::QUOTED, "a\\b\n", "escapes");
+    checkValue(rows[1][0], Kind::BARE, "-2.5e3", "exponent");
+    checkValue(rows[1][1], Kind::NUL, "", "NULL");
+    checkValue(rows[1][2], Kind::QUOTED, "x;y", "';' in a string");
+
+    assert_s(next_statement(dump, &stmt) && skip_statement(stmt),
+             "UNLOCK TABLES not skipped: " + stmt);
+    rows.clear();
+    assert_s(next_statement(dump, &stmt) && false == skip_statement(stmt)
+             && false == parse_insert(stmt, &table, &fields, &rows),
+             "CREATE TABLE taken for data: " + stmt);
+    assert_s(false == next_statement(dump, &stmt), "read past the end");
+
+    // Field lists; what the parser can't do goes to the proxy.
+    fields.clear();
+    rows.clear();
+    assert_s(parse_insert("INSERT INTO t (`a`, b) VALUES (1, 'x');",
+                          &table, &fields, &rows)
+             && 2 == fields.size() && "a" == fields[0]
+             && "b" == fields[1] && 1 == rows.size(),
+             "field list not parsed");
+    const char *const proxied[] = {
+        "INSERT INTO db.t VALUES (1);",
+        "INSERT INTO t VALUES (0x1F);",
+        "INSERT INTO t VALUES (NOW());",
+        "INSERT INTO t VALUES (1) ON DUPLICATE KEY UPDATE a = 2;",
+        "INSERT INTO t VALUES ('unterminated);",
+    };
+    for (const char *const q : proxied) {
+        fields.clear();
+        rows.clear();
+        assert_s(false == parse_insert(q, &table, &fields, &rows),
+                 std::string("parsed what the proxy should get: ") + q);
+    }
+}
+
+static void
+testCSV()
+{
+    std::istringstream csv(
+        "1,plain,\\N\r\n"
+        "\n"
+        "2,\"a, \"\"quoted\"\" b\",\"\\N\"\n"
+        "3,\"two\n"
+        "lines\",\n");
+
+    ImportRow row;
+    assert_s(next_csv_row(csv, &row) && 3 == row.size(), "first row");
+    checkValue(row[0], Kind::BARE, "1", "bare");
+    checkValue(row[1], Kind::BARE, "plain", "bare text");
+    checkValue(row[2], Kind::NUL, "", "\\N");
+
+    assert_s(next_csv_row(csv, &row) && 3 == row.size(),
+             "empty line not skipped");
+    checkValue(row[1], Kind::QUOTED, "a, \"quoted\" b", "quoted comma");
+    checkValue(row[2], Kind::QUOTED, "\\N", "quoted \\N");
+
+    assert_s(next_csv_row(csv, &row) && 3 == row.size(),
+             "embedded newline");
+    checkValue(row[1], Kind::QUOTED, "two\nlines", "embedded newline");
+    checkValue(row[2], Kind::BARE, "", "trailing empty field");
+
+    assert_s(false == next_csv_row(csv, &row), "read past the end");
+}
+
+static void
+testBatches()
+{
+    std::vector<ImportRow> rows(7, ImportRow(1, ImportValue(Kind::BARE,
+                                                            "0")));
+    for (unsigned int i = 0; i < rows.size(); ++i) {
+        rows[i][0].text = std::to_string(i);
+    }
+
+    const std::vector<std::string> fields(1, "a");
+    const auto batches = make_batches("db", "t", fields, false, &rows, 3);
+    assert_s(rows.empty() && 3 == batches.size()
+             && 3 == batches[0]->rows.size()
+             && 3 == batches[1]->rows.size()
+             && 1 == batches[2]->rows.size(),
+             "dump rows split wrong");
+    unsigned int i = 0;
+    for (const auto &b : batches) {
+        assert_s("db" == b->db && "t" == b->table && fields == b->fields
+                 && false == b->typed_by_schema,
+                 "batch lost its table");
+        for (const auto &row : b->rows) {
+            assert_s(std::to_string(i++) == row[0].text,
+                     "rows out of order");
+        }
+    }
+
+    std::istringstream csv("1\n2\n3\n4\n5\n");
+    std::vector<size_t> sizes;
+    while (std::unique_ptr<ImportBatch> b =
+               next_csv_batch(csv, "db", "t", 2)) {
+        assert_s(b->fields.empty() && b->typed_by_schema,
+                 "CSV batch not typed by the schema");
+        sizes.push_back(b->rows.size());
+    }
+    assert_s(std::vector<size_t>({2, 2, 1}) == sizes,
+             "CSV rows split wrong");
+
+    std::istringstream empty("");
+    assert_s(!next_csv_batch(empty, "db", "t", 2), "batch from nothing");
+}
+
+void
+TestImport::run(const TestConfig &tc, int argc, char ** argv)
+{
+    testDump();
+    testCSV();
+    testBatches();
+
+    std::cerr << "import test succeeded" << std::endl;
+}
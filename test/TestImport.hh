@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * TestImport.hh
+ *
+ * The mysqldump and CSV readers of cryptdbimport and the batches they
+ * hand to the encryption pool; no database needed.
+ */
+
+#include <test/test_utils.hh>
+
+class TestImport {
+ public:
+    static void run(const TestConfig &tc, int argc, char ** argv);
+};
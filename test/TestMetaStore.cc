@@ -0,0 +1,241 @@
+/*
+ * TestMetaStore.cc
+ *  -- LogMetaStore replay, torn log tails and per-connection
+ *     transactions
+ */
+
+#include <iostream>
+#include <set>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <util/util.hh>
+#include <main/Connect.hh>
+#include <main/metadata_store.hh>
+
+#include <test/TestMetaStore.hh>
+
+typedef MetaStore::Table Table;
+
+// The store only tells connections apart; nothing is executed.
+static std::unique_ptr<Connect>
+newConn()
+{
+    return std::unique_ptr<Connect>(new Connect(static_cast<MYSQL *>(NULL)));
+}
+
+// serial_key of every committed object in the regular table.
+static std::set<std::string>
+keys(LogMetaStore *const store, const std::unique_ptr<Connect> &c)
+{
+    MetaStore::ChildMap children;
+    assert_s(store->fetchAllChildren(c, &children), "fetch failed");
+
+    std::set<std::string> out;
+    for (const auto &it : children) {
+        for (const auto &child : it.second) {
+            out.insert(child.serial_key);
+        }
+    }
+
+    return out;
+}
+
+static off_t
+fileSize(const std::string &path)
+{
+    struct stat st;
+    assert_s(0 == stat(path.c_str(), &st), "can't stat " + path);
+    return st.st_size;
+}
+
+static void
+testReplay(const std::string &dir)
+{
+    const std::string path = dir + "/replay.log";
+    const std::unique_ptr<Connect> c = newConn();
+
+    unsigned long a, b, q;
+    {
+        LogMetaStore store(path);
+        assert_s(store.insertObject(c, Table::REGULAR, "obj-a", "key-a", 0,
+                                    &a), "insert failed");
+        assert_s(store.begin(c), "begin failed");
+        assert_s(store.insertObject(c, Table::REGULAR, "obj-b", "key-b", a,
+                                    &b)
+                 && store.replaceObject(c, Table::REGULAR, a, "obj-a2",
+                                        "key-a2")
+                 && store.beginCompletion(c, "DROP TABLE t", "db", "DDL",
+                                          &q),
+                 "transactional writes failed");
+        assert_s(store.commit(c), "commit failed");
+        assert_s(store.copyTable(c, Table::REGULAR, Table::BLEEDING),
+                 "copy failed");
+    }
+
+    LogMetaStore store(path);
+    MetaStore::ChildMap children;
+    assert_s(store.fetchAllChildren(c, &children), "fetch failed");
+    assert_s(2 == children.size() && 1 == children[0].size()
+             && 1 == children[a].size(), "tree not replayed");
+    assert_s(a == children[0][0].id && "key-a2" == children[0][0].serial_key
+             && "obj-a2" == children[0][0].serial_object,
+             "replace not replayed");
+    assert_s(b == children[a][0].id && "key-b" == children[a][0].serial_key,
+             "child not replayed");
+
+    MetaStore::Completion completion;
+    assert_s(store.getCompletion(c, q, &completion)
+             && completion.begin && false == completion.complete
+             && "DROP TABLE t" == completion.original_query,
+             "completion not replayed");
+    std::vector<MetaStore::Completion> unfinished;
+    assert_s(store.unfinishedCompletions(c, &unfinished)
+             && 1 == unfinished.size() && q == unfinished[0].id,
+             "unfinished completions not replayed");
+
+    // Ids carry on past the replayed ones, in both tables.
+    unsigned long next;
+    assert_s(store.insertObject(c, Table::REGULAR, "obj-c", "key-c", 0,
+                                &next) && next > b,
+             "regular id reused after replay");
+    assert_s(store.insertObject(c, Table::BLEEDING, "obj-c", "key-c", 0,
+                                &next) && next > b,
+             "bleeding id reused after replay");
+}
+
+static void
+testTornTail(const std::string &dir)
+{
+    const std::string path = dir + "/torn.log";
+    const std::unique_ptr<Connect> c = newConn();
+
+    off_t one_frame;
+    off_t two_frames;
+    {
+        LogMetaStore store(path);
+        unsigned long id;
+        assert_s(store.insertObject(c, Table::REGULAR, "obj-a", "key-a", 0,
+                                    &id), "insert failed");
+        one_frame = fileSize(path);
+        assert_s(store.begin(c)
+                 && store.insertObject(c, Table::REGULAR, "obj-b", "key-b",
+                                       0, &id)
+                 && store.insertObject(c, Table::REGULAR, "obj-c", "key-c",
+                                       0, &id)
+                 && store.commit(c), "transaction failed");
+        two_frames = fileSize(path);
+    }
+
+    // A crash part way through writing the transaction's frame.
+    assert_s(0 == truncate(path.c_str(), two_frames - 3),
+             "truncate failed");
+    {
+        LogMetaStore store(path);
+        assert_s(std::set<std::string>({"key-a"}) == keys(&store, c),
+                 "torn transaction partly replayed");
+        assert_s(one_frame == fileSize(path), "torn frame left in the log");
+
+        // New frames go after the last good one.
+        unsigned long id;
+        assert_s(store.insertObject(c, Table::REGULAR, "obj-d", "key-d", 0,
+                                    &id), "insert after repair failed");
+    }
+
+    // A frame whose payload doesn't match its checksum.
+    const off_t good = fileSize(path);
+    {
+        const int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+        assert_s(fd >= 0, "can't open " + path);
+        // Length 5, checksum 0.
+        const char bogus[] = "\x05\0\0\0\0\0\0\0hello";
+        assert_s(13 == write(fd, bogus, 13), "write failed");
+        close(fd);
+    }
+    {
+        LogMetaStore store(path);
+        assert_s(std::set<std::string>({"key-a", "key-d"})
+                 == keys(&store, c), "bad frame replayed");
+        assert_s(good == fileSize(path), "bad frame left in the log");
+    }
+}
+
+static void
+testTransactions(const std::string &dir)
+{
+    const std::string path = dir + "/transactions.log";
+    const std::unique_ptr<Connect> a = newConn();
+    const std::unique_ptr<Connect> b = newConn();
+
+    {
+        LogMetaStore store(path);
+        unsigned long id;
+
+        assert_s(store.begin(a)
+                 && store.insertObject(a, Table::REGULAR, "obj-a", "key-a",
+                                       0, &id), "a's insert failed");
+        assert_s(store.begin(b)
+                 && store.insertObject(b, Table::REGULAR, "obj-b", "key-b",
+                                       0, &id), "b's insert failed");
+        assert_s(keys(&store, a).empty(), "uncommitted writes visible");
+
+        // b's begin() didn't commit a's transaction, nor does b's
+        // commit().
+        assert_s(store.commit(b), "b's commit failed");
+        assert_s(std::set<std::string>({"key-b"}) == keys(&store, a),
+                 "b's commit took the wrong writes");
+
+        unsigned long q;
+        assert_s(store.beginCompletion(a, "q", "db", "DDL", &q),
+                 "a's completion failed");
+        assert_s(store.rollback(a), "a's rollback failed");
+        assert_s(std::set<std::string>({"key-b"}) == keys(&store, b),
+                 "rolled back writes visible");
+        MetaStore::Completion completion;
+        assert_s(false == store.getCompletion(b, q, &completion),
+                 "rolled back completion visible");
+        assert_s(false == store.commit(a), "commit without a transaction");
+
+        // Without a transaction writes commit on their own; a second
+        // begin() commits the open transaction.
+        assert_s(store.insertObject(a, Table::REGULAR, "obj-c", "key-c", 0,
+                                    &id), "a's autocommit failed");
+        assert_s(store.begin(a)
+                 && store.insertObject(a, Table::REGULAR, "obj-d", "key-d",
+                                       0, &id)
+                 && store.begin(a), "a's implicit commit failed");
+        assert_s(store.rollback(a), "a's second rollback failed");
+
+        // A rollback leaves other connections' transactions alone.
+        assert_s(store.begin(b)
+                 && store.insertObject(b, Table::REGULAR, "obj-e", "key-e",
+                                       0, &id), "b's second insert failed");
+        assert_s(store.rollback(a) && store.commit(b),
+                 "b's second commit failed");
+    }
+
+    LogMetaStore store(path);
+    assert_s(std::set<std::string>({"key-b", "key-c", "key-d", "key-e"})
+             == keys(&store, a), "log holds the wrong transactions");
+}
+
+void
+TestMetaStore::run(const TestConfig &tc, int argc, char ** argv)
+{
+    char dir_template[] = "/tmp/cryptdb-metastore-XXXXXX";
+    const char *const dir = mkdtemp(dir_template);
+    assert_s(dir, "mkdtemp failed");
+
+    testReplay(dir);
+    testTornTail(dir);
+    testTransactions(dir);
+
+    for (auto name : {"replay.log", "torn.log", "transactions.log"}) {
+        unlink((std::string(dir) + "/" + name).c_str());
+    }
+    rmdir(dir);
+
+    std::cerr << "metastore test succeeded" << std::endl;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * TestMetaStore.hh
+ *
+ * LogMetaStore: replay on open, torn log tails and transactions of
+ * several connections; no database needed.
+ */
+
+#include <test/test_utils.hh>
+
+class TestMetaStore {
+ public:
+    static void run(const TestConfig &tc, int argc, char ** argv);
+};
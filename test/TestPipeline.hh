@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * TestPipeline.hh
+ *
+ * OnionPipeline against the layers applied one Item at a time, for
+ * every fixed onion layout; needs the embedded server for its THDs.
+ */
+
+#include <test/test_utils.hh>
+
+class TestPipeline {
+ public:
+    static void run(const TestConfig &tc, int argc, char ** argv);
+};
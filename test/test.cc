@@ -15,6 +15,7 @@
 #include <sys/wait.h>
 
 #include <main/Connect.hh>
+#include <parser/embedmysql.hh>
 
 #include <util/util.hh>
 #include <util/params.hh>
@@ -22,6 +23,10 @@
 
 #include <test/test_utils.hh>
 #include <test/TestQueries.hh>
+#include <test/TestConcurrent.hh>
+#include <test/TestImport.hh>
+#include <test/TestMetaStore.hh>
+#include <test/TestPipeline.hh>
 
 using namespace NTL;
 
@@ -2991,6 +2996,33 @@ testBench(const TestConfig & tc, int argc, char ** argv)
 
 
 
+// A parse on a pooled THD must not leave metadata locks behind; the
+// DROP on the same thread would wait for them until lock_wait_timeout.
+static void
+testThdPool(const TestConfig &tc, int ac, char **av)
+{
+    const std::unique_ptr<Connect>
+        e_conn(Connect::getEmbedded(tc.shadowdb_dir));
+    const std::string db = "thdpool_test";
+    assert_s(e_conn->execute("CREATE DATABASE IF NOT EXISTS " + db + ";")
+             && e_conn->execute("CREATE TABLE IF NOT EXISTS " + db
+                                + ".t (a integer);")
+             && e_conn->execute("SET SESSION lock_wait_timeout = 5;"),
+             "could not set up the thdpool table");
+
+    for (unsigned int i = 0; i < 2; i++) {
+        query_parse p(db, "SELECT a FROM t WHERE a = 1");
+        assert_s(p.lex()->sql_command == SQLCOM_SELECT, "bad parse");
+    }
+
+    assert_s(e_conn->execute("DROP TABLE " + db + ".t;"),
+             "DROP TABLE after a pooled parse failed: "
+             + e_conn->getError());
+    assert_s(e_conn->execute("DROP DATABASE " + db + ";"),
+             "DROP DATABASE failed");
+    std::cerr << "thdpool test succeeded" << std::endl;
+}
+
 static void
 test_PKCS(const TestConfig &tc, int ac, char **av)
 {
@@ -3037,8 +3069,13 @@ static struct {
     //{ "paillier",       "",                             &testPaillier },
     { "parseaccess",    "",                             &testParseAccess },
     { "pkcs",           "",                             &test_PKCS },
+    { "thdpool",        "parse, then DROP on one thread", &testThdPool },
     //{ "proxy",          "proxy",                        &TestProxy::run },
     { "queries",        "queries",                      &TestQueries::run },
+    { "concurrent",     "concurrent clients",           &TestConcurrent::run },
+    { "import",         "cryptdbimport parsing",        &TestImport::run },
+    { "metastore",      "metadata log replay",          &TestMetaStore::run },
+    { "pipeline",       "onion pipelines vs layers",    &TestPipeline::run },
     //{ "single",         "integration - single principal",&TestSinglePrinc::run },
     { "gen_enc_tables", "",                             &generateEncTables },
     { "test_enc_tables","",                             &testEncTables },
@@ -0,0 +1,271 @@
+/*
+ * Moves the tables of a database to the compact storage format (see
+ * DIRECTIVE COMPACT) and reports the row widths before and after, per
+ * table and summed over the database.
+ *
+ * Compaction changes two things: the salt columns, one per salted
+ * field, become one salt per row, and HOM columns shrink to their exact
+ * ciphertext width. The other onions keep their columns; they are
+ * already as wide as their ciphertexts, which are whole blowfish blocks
+ * for integers and whole AES blocks for strings.
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <assert.h>
+#include <rewrite_main.hh>
+#include <rewrite_util.hh>
+#include <macro_util.hh>
+#include <errstream.hh>
+
+static void help(const char *prog)
+{
+    std::cout << "Usage: " << prog <<
+        " -u user -p password -d database [-t table] [-n]" << "\n";
+    std::cout << "-t: only compact <table>" << "\n";
+    std::cout << "-n: only report the row widths" << "\n";
+    std::cout << "Salts and HOM columns are compacted; other onions"
+                 " are already exact width." << "\n";
+}
+
+/*
+ * Declared bytes per row of a table as InnoDB/MyISAM would lay out the
+ * fixed part of it; variable length columns count at their maximum and
+ * BLOB/TEXT only count their pointer.
+ */
+static bool
+declaredRowBytes(const std::unique_ptr<Connect> &conn,
+                 const std::string &db, const std::string &table,
+                 unsigned long long *const out)
+{
+    *out = 0;
+
+    std::unique_ptr<DBResult> dbres;
+    const std::string q =
+        " SELECT DATA_TYPE, CHARACTER_OCTET_LENGTH, NUMERIC_PRECISION "
+        "   FROM INFORMATION_SCHEMA.COLUMNS "
+        "  WHERE TABLE_SCHEMA = '" + escapeString(conn, db) + "'"
+        "    AND TABLE_NAME = '" + escapeString(conn, table) + "';";
+    RETURN_FALSE_IF_FALSE(conn->execute(q, &dbres));
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(dbres->n))) {
+        const std::string type(row[0]);
+        const unsigned long long octets =
+            row[1] ? strtoull(row[1], NULL, 10) : 0;
+        const unsigned long long precision =
+            row[2] ? strtoull(row[2], NULL, 10) : 0;
+
+        if ("tinyint" == type || "year" == type) {
+            *out += 1;
+        } else if ("smallint" == type) {
+            *out += 2;
+        } else if ("mediumint" == type || "date" == type
+                   || "time" == type) {
+            *out += 3;
+        } else if ("int" == type || "float" == type
+                   || "timestamp" == type) {
+            *out += 4;
+        } else if ("bigint" == type || "double" == type
+                   || "datetime" == type) {
+            *out += 8;
+        } else if ("decimal" == type) {
+            *out += precision / 2 + 1;
+        } else if ("char" == type || "binary" == type) {
+            *out += octets;
+        } else if ("varchar" == type || "varbinary" == type) {
+            *out += octets + (octets > 255 ? 2 : 1);
+        } else {
+            // BLOB, TEXT and friends live off the row.
+            *out += 12;
+        }
+    }
+
+    return true;
+}
+
+static bool
+averageRowBytes(const std::unique_ptr<Connect> &conn,
+                const std::string &db, const std::string &table,
+                unsigned long long *const out)
+{
+    std::unique_ptr<DBResult> dbres;
+    const std::string q =
+        " SELECT AVG_ROW_LENGTH FROM INFORMATION_SCHEMA.TABLES "
+        "  WHERE TABLE_SCHEMA = '" + escapeString(conn, db) + "'"
+        "    AND TABLE_NAME = '" + escapeString(conn, table) + "';";
+    RETURN_FALSE_IF_FALSE(conn->execute(q, &dbres));
+
+    const MYSQL_ROW row = mysql_fetch_row(dbres->n);
+    *out = (row && row[0]) ? strtoull(row[0], NULL, 10) : 0;
+    return true;
+}
+
+struct RowWidths {
+    unsigned long long plain;
+    unsigned long long declared;
+    unsigned long long average;
+};
+
+static RowWidths
+measure(ProxyState &ps, const std::string &db, const std::string &table,
+        const std::string &anon_table)
+{
+    RowWidths widths;
+    TEST_TextMessageError(declaredRowBytes(ps.getEConn(), db, table,
+                                           &widths.plain)
+                          && declaredRowBytes(ps.getConn(), db,
+                                              anon_table,
+                                              &widths.declared)
+                          && averageRowBytes(ps.getConn(), db,
+                                             anon_table,
+                                             &widths.average),
+                          "failed to measure " + table);
+    return widths;
+}
+
+static void
+report(const std::string &table, const RowWidths &before,
+       const RowWidths &after)
+{
+    std::cout << std::left << std::setw(20) << table << std::right
+              << std::setw(8) << before.plain
+              << std::setw(10) << before.declared
+              << std::setw(10) << after.declared
+              << std::setw(10) << before.average
+              << std::setw(10) << after.average << "\n";
+}
+
+int main(int argc, char **argv)
+{
+    int c, optind = 0;
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"username", required_argument, 0, 'u'},
+        {"password", required_argument, 0, 'p'},
+        {"dbname", required_argument, 0, 'd'},
+        {"table", required_argument, 0, 't'},
+        {"dry-run", no_argument, 0, 'n'},
+        {NULL, 0, 0, 0},
+    };
+
+    std::string username("");
+    std::string password("");
+    std::string dbname("");
+    std::string tablename("");
+    bool dry_run = false;
+
+    while(1)
+    {
+        c = getopt_long(argc, argv, "hu:p:d:t:n", long_options, &optind);
+        if(c == -1)
+            break;
+
+        switch(c)
+        {
+            case 'h':
+                help(argv[0]);
+                exit(0);
+            case 'p':
+                password = optarg;
+                break;
+            case 'u':
+                username = optarg;
+                break;
+            case 'd':
+                dbname = optarg;
+                break;
+            case 't':
+                tablename = optarg;
+                break;
+            case 'n':
+                dry_run = true;
+                break;
+            case '?':
+                break;
+            default:
+                break;
+        }
+    }
+
+    assert(username != "");
+    assert(password != "");
+    assert(dbname != "");
+
+    ConnectionInfo ci("localhost", username, password);
+    const std::string master_key = "2392834";
+    ProxyState ps(ci, "/var/lib/shadow-mysql", master_key);
+
+    std::unique_ptr<SchemaInfo>
+        schema(loadSchemaInfo(ps.getConn(), ps.getEConn()));
+    const DatabaseMeta *const dm =
+        schema->getChild(IdentityMetaKey(dbname));
+    if (!dm) {
+        std::cerr << "unknown database " << dbname << "\n";
+        return 1;
+    }
+
+    std::vector<std::pair<std::string, std::string> > tables;
+    for (const auto &it : dm->children) {
+        const std::string &name = it.first.getValue();
+        if (tablename.empty() || tablename == name) {
+            tables.push_back(std::make_pair(name,
+                                 it.second->getAnonTableName()));
+        }
+    }
+    if (tables.empty()) {
+        std::cerr << "no table to compact" << "\n";
+        return 1;
+    }
+
+    std::cout << std::left << std::setw(20) << "-- table" << std::right
+              << std::setw(8) << "plain"
+              << std::setw(10) << "enc"
+              << std::setw(10) << "compact"
+              << std::setw(10) << "avg"
+              << std::setw(10) << "avg'" << "\n";
+
+    SchemaCache schema_cache;
+    unsigned int errors = 0;
+    RowWidths total_before = {0, 0, 0};
+    RowWidths total_after = {0, 0, 0};
+    for (const auto &it : tables) {
+        const RowWidths before = measure(ps, dbname, it.first, it.second);
+        if (false == dry_run) {
+            try {
+                executeQuery(ps, "DIRECTIVE COMPACT " + it.first + ";",
+                             dbname, &schema_cache);
+            } catch (const SynchronizationException &e) {
+                std::cerr << e << "\n";
+                ++errors;
+            } catch (const AbstractException &e) {
+                std::cerr << e << "\n";
+                ++errors;
+            } catch (const CryptDBError &e) {
+                std::cerr << e.msg << "\n";
+                ++errors;
+            }
+        }
+
+        const RowWidths after =
+            dry_run ? before : measure(ps, dbname, it.first, it.second);
+        report(it.first, before, after);
+
+        for (auto sum : {std::make_pair(&total_before, &before),
+                         std::make_pair(&total_after, &after)}) {
+            sum.first->plain += sum.second->plain;
+            sum.first->declared += sum.second->declared;
+            sum.first->average += sum.second->average;
+        }
+    }
+    // One row of every table.
+    report("-- total", total_before, total_after);
+
+    TEST_TextMessageError(schema_cache.cleanupStaleness(ps.getEConn()),
+                          "Failed to cleanup staleness!");
+
+    return errors > 0 ? 1 : 0;
+}
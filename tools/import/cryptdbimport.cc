@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <iterator>
 #include <string>
 #include <stdio.h>
 #include <iostream>
@@ -9,7 +10,17 @@
 #include <pthread.h>
 #include <getopt.h>
 #include <rewrite_main.hh>
+#include <rewrite_util.hh>
+#include <macro_util.hh>
 #include <cryptdbimport.hh>
+#include <crypto/mope.hh>
+#include <parser/lex_util.hh>
+#include <util/cleanup.hh>
+#include <util/scoped_lock.hh>
+#include <util/timer.hh>
+
+// Keep each multi-row INSERT comfortably below max_allowed_packet.
+static const size_t MAX_QUERY_BYTES = 1 << 20;
 
 static void __attribute__((noreturn))
 do_display_help(const char *arg)
@@ -21,20 +32,403 @@ do_display_help(const char *arg)
     std::cout << "-p<password>: MySQL server password" << std::endl;
     std::cout << "-n: Do not execute queries. Only show stdout." << std::endl;
     std::cout << "-f <file>: MySQL's .sql dump file, originated from \"mysqldump\" tool." << std::endl;
+    std::cout << "-d <database>: Default database (required with -c)." << std::endl;
+    std::cout << "-c <table>: <file> is CSV data for <table> instead of a dump." << std::endl;
+    std::cout << "-t <threads>: Number of encryption threads (default 1)." << std::endl;
+    std::cout << "-b <rows>: Rows per encryption batch (default 1000)." << std::endl;
     std::cout << "To generate DB's dump file use mysqldump, e.g.:" << std::endl;
     std::cout << "$ mysqldump -u user -ppassword --all-databases >dumpfile.sql" << std::endl;
+    std::cout << "CSV fields are separated by ',' and may be quoted with '\"';"
+                 " \\N is NULL." << std::endl;
     exit(0);
 }
 
 
-static bool 
-ignore_line(const std::string& line)
+// ---------------------------------------------
+//              Encryption workers
+// ---------------------------------------------
+
+static bool
+isNumericLayout(const FieldMeta &fm)
+{
+    return NUM_ONION_LAYOUT == fm.getOnionLayout()
+           || BEST_EFFORT_NUM_ONION_LAYOUT == fm.getOnionLayout();
+}
+
+// Build the Item the parser would have produced for this literal.
+static Item *
+make_import_item(const ImportValue &v, const FieldMeta &fm,
+                 bool typed_by_schema)
+{
+    if (ImportValue::Kind::NUL == v.kind) {
+        return new (current_thd->mem_root) Item_null();
+    }
+
+    const bool numeric =
+        typed_by_schema ? isNumericLayout(fm)
+                        : ImportValue::Kind::BARE == v.kind;
+    if (numeric) {
+        char *const s = make_thd_string(v.text);
+        if (std::string::npos == v.text.find_first_of(".eE")) {
+            return new (current_thd->mem_root)
+                Item_int(s, static_cast<uint>(v.text.length()));
+        }
+        return new (current_thd->mem_root)
+            Item_decimal(s, static_cast<uint>(v.text.length()),
+                         &my_charset_bin);
+    }
+
+    return new (current_thd->mem_root)
+        Item_string(make_thd_string(v.text), v.text.length(),
+                    &my_charset_bin);
+}
+
+static std::string
+render_item(const std::unique_ptr<Connect> &conn, const Item &i)
+{
+    if (RiboldMYSQL::is_null(i)) {
+        return "NULL";
+    }
+    if (Item::Type::STRING_ITEM != i.type()) {
+        return ItemToString(i);
+    }
+
+    return "'" + escapeString(conn, ItemToString(i)) + "'";
+}
+
+/*
+ * Encrypts the batch into one or more multi-row INSERTs against the
+ * anonymized table. Uses the same CItemType dispatch as InsertHandler so
+ * the onion keys and the per-row salt are exactly those of the online
+ * path.
+ */
+static void
+encrypt_batch(const ImportBatch &batch, const SchemaInfo &schema,
+              const std::unique_ptr<Connect> &conn,
+              std::list<std::string> *const out_queries)
+{
+    THD *const thd = acquire_thd();
+    auto thd_cleanup = cleanup([thd] {release_thd(thd);});
+
+    Analysis a(batch.db, schema);
+    const TableMeta &tm = a.getTableMeta(batch.db, batch.table);
+
+    std::vector<FieldMeta *> fmVec;
+    std::vector<FieldMeta *> implicit_fms;
+    if (batch.fields.empty()) {
+        fmVec = tm.orderedFieldMetas();
+    } else {
+        for (auto it : batch.fields) {
+            fmVec.push_back(&a.getFieldMeta(batch.db, batch.table, it));
+        }
+        implicit_fms = vectorDifference(tm.defaultedFieldMetas(), fmVec);
+    }
+
+    std::vector<std::string> columns;
+    std::vector<Item *> implicit_defaults;
+    const auto add_columns = [&columns](const FieldMeta &fm) {
+        for (auto it : fm.orderedOnionMetas()) {
+            columns.push_back(it.second->getAnonOnionName());
+        }
+        if (fm.getHasSalt() && false == fm.getSharesSalt()) {
+            columns.push_back(fm.getSaltName());
+        }
+    };
+    // Compact tables lead with the row salt; see InsertHandler.
+    if (tm.isCompact()) {
+        columns.push_back(tm.getSaltName());
+    }
+    for (auto it : fmVec) {
+        add_columns(*it);
+    }
+    for (auto it : implicit_fms) {
+        add_columns(*it);
+        if (false == tm.isCompact()) {
+            itemTypes.do_rewrite_insert(
+                *make_item_string(it->defaultValue()), *it, a,
+                &implicit_defaults);
+        }
+    }
+
+    std::string prefix = "INSERT INTO `" + batch.db + "`.`"
+                         + tm.getAnonTableName() + "` (";
+    for (auto it = columns.begin(); it != columns.end(); ++it) {
+        prefix += (columns.begin() == it ? "`" : ", `") + *it + "`";
+    }
+    prefix += ") VALUES ";
+
+    // The whole column goes to the innermost layers first, as it does
+    // for a multi-row INSERT through the proxy; a mutable OPE layer
+    // labels the new values of the batch at once.
+    std::vector<std::vector<const Item *> > items(batch.rows.size());
+    std::vector<std::vector<const Item *> > by_field(fmVec.size());
+    for (size_t r = 0; r < batch.rows.size(); ++r) {
+        const ImportRow &row = batch.rows[r];
+        TEST_TextMessageError(row.size() == fmVec.size(),
+                              "size mismatch between fields and values!");
+        for (unsigned int i = 0; i < row.size(); ++i) {
+            const Item *const item =
+                make_import_item(row[i], *fmVec[i], batch.typed_by_schema);
+            items[r].push_back(item);
+            by_field[i].push_back(item);
+        }
+    }
+    for (unsigned int i = 0; i < fmVec.size(); ++i) {
+        for (const auto &it : fmVec[i]->orderedOnionMetas()) {
+            const auto &layers = a.getEncLayers(*it.second);
+            if (false == layers.empty()) {
+                layers.front()->prepareEncrypt(by_field[i]);
+            }
+        }
+    }
+
+    std::string values;
+    for (const auto &row : items) {
+        std::vector<Item *> l;
+        if (tm.isCompact()) {
+            a.row_salt = randomValue();
+            l.push_back(new Item_int(static_cast<ulonglong>(a.row_salt)));
+        }
+        for (unsigned int i = 0; i < row.size(); ++i) {
+            itemTypes.do_rewrite_insert(*row[i], *fmVec[i], a, &l);
+        }
+        l.insert(l.end(), implicit_defaults.begin(),
+                 implicit_defaults.end());
+        if (tm.isCompact()) {
+            for (auto it : implicit_fms) {
+                itemTypes.do_rewrite_insert(
+                    *make_item_string(it->defaultValue()), *it, a, &l);
+            }
+        }
+        assert(l.size() == columns.size());
+
+        values += values.empty() ? "(" : ", (";
+        for (auto it = l.begin(); it != l.end(); ++it) {
+            if (l.begin() != it) {
+                values += ", ";
+            }
+            values += render_item(conn, **it);
+        }
+        values += ")";
+
+        if (values.size() >= MAX_QUERY_BYTES) {
+            out_queries->push_back(prefix + values + ";");
+            values.clear();
+        }
+    }
+    if (!values.empty()) {
+        out_queries->push_back(prefix + values + ";");
+    }
+}
+
+ImportPool::ImportPool(const ProxyState &ps, const ConnectionInfo &ci,
+                       unsigned int threads, unsigned int max_queued)
+    : ps(ps), ci(ci), max_queued(max_queued), busy(0), done(false),
+      schema_generation(0), rows_imported(0), rows_failed(0)
+{
+    assert(threads > 0 && max_queued > 0);
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&schema_lock, NULL);
+    pthread_mutex_init(&ntl_lock, NULL);
+    pthread_cond_init(&not_empty, NULL);
+    pthread_cond_init(&not_full, NULL);
+    pthread_cond_init(&idle, NULL);
+
+    // Workers keep coming for read locks; a relabel must not wait on
+    // them forever.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&label_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    for (unsigned int i = 0; i < threads; ++i) {
+        pthread_t t;
+        if (0 != pthread_create(&t, NULL, workerMain, this)) {
+            stop();
+            FAIL_TextMessageError("failed to start an import thread!");
+        }
+        workers.push_back(t);
+    }
+}
+
+ImportPool::~ImportPool()
+{
+    stop();
+
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&not_full);
+    pthread_cond_destroy(&not_empty);
+    pthread_rwlock_destroy(&label_lock);
+    pthread_mutex_destroy(&ntl_lock);
+    pthread_mutex_destroy(&schema_lock);
+    pthread_mutex_destroy(&lock);
+}
+
+void
+ImportPool::stop()
+{
+    {
+        scoped_lock l(&lock);
+        done = true;
+        pthread_cond_broadcast(&not_empty);
+    }
+    for (auto it : workers) {
+        pthread_join(it, NULL);
+    }
+    workers.clear();
+}
+
+void
+ImportPool::push(std::unique_ptr<ImportBatch> batch)
+{
+    scoped_lock l(&lock);
+    while (queue.size() >= max_queued) {
+        pthread_cond_wait(&not_full, &lock);
+    }
+    queue.push_back(std::move(batch));
+    pthread_cond_signal(&not_empty);
+}
+
+void
+ImportPool::drain()
+{
+    scoped_lock l(&lock);
+    while (!queue.empty() || busy > 0) {
+        pthread_cond_wait(&idle, &lock);
+    }
+}
+
+void
+ImportPool::schemaChanged()
+{
+    scoped_lock l(&lock);
+    ++schema_generation;
+}
+
+std::unique_ptr<ImportBatch>
+ImportPool::pop(unsigned long *const generation)
+{
+    scoped_lock l(&lock);
+    while (queue.empty() && false == done) {
+        pthread_cond_wait(&not_empty, &lock);
+    }
+    if (queue.empty()) {
+        return nullptr;
+    }
+
+    std::unique_ptr<ImportBatch> batch = std::move(queue.front());
+    queue.pop_front();
+    ++busy;
+    *generation = schema_generation;
+    pthread_cond_signal(&not_full);
+
+    return batch;
+}
+
+void
+ImportPool::finished(const ImportBatch &batch, bool success)
+{
+    scoped_lock l(&lock);
+    if (success) {
+        rows_imported += batch.rows.size();
+    } else {
+        rows_failed += batch.rows.size();
+    }
+    if (0 == --busy && queue.empty()) {
+        pthread_cond_broadcast(&idle);
+    }
+}
+
+void *
+ImportPool::workerMain(void *const arg)
+{
+    embedded_thread_init();
+    static_cast<ImportPool *>(arg)->work();
+    embedded_thread_end();
+
+    return NULL;
+}
+
+void
+ImportPool::work()
 {
-    static const std::string begin_match("--");
+    const std::unique_ptr<Connect>
+        conn(new Connect(ci.server, ci.user, ci.passwd, ci.port));
+    std::unique_ptr<SchemaInfo> schema;
+    unsigned long loaded_generation = 0;
+
+    for (;;) {
+        unsigned long generation;
+        const std::unique_ptr<ImportBatch> batch = pop(&generation);
+        if (!batch) {
+            return;
+        }
+
+        bool success = false;
+        try {
+            // Labels of a mutable OPE layer that a relabel moves stay in
+            // the rows until the relabel is applied, which waits for
+            // every batch holding labels to be written.
+            {
+                scoped_rdlock labels(&label_lock);
+                std::list<std::string> queries;
+                {
+#ifndef NTL_THREADS
+                    // NTL keeps global state; OPE and HOM layers, and
+                    // the layers of a schema load, on one worker at a
+                    // time.
+                    scoped_lock ntl(&ntl_lock);
+#endif
+                    if (!schema || loaded_generation != generation) {
+                        scoped_lock l(&schema_lock);
+                        schema.reset(loadSchemaInfo(ps.getConn(),
+                                                    ps.getEConn()));
+                        loaded_generation = generation;
+                    }
+                    encrypt_batch(*batch, *schema, conn, &queries);
+                }
+                // New labels must be on disk before they are in the
+                // database.
+                MutableOPE::syncAll();
+
+                success = true;
+                for (auto it : queries) {
+                    if (false == conn->execute(it)) {
+                        std::cerr << "failed to import into " << batch->db
+                                  << "." << batch->table << ": "
+                                  << conn->getError() << std::endl;
+                        success = false;
+                        break;
+                    }
+                }
+            }
+            if (MutableOPE::anyPending()) {
+                scoped_wrlock labels(&label_lock);
+                applyRelabels(conn, *schema);
+            }
+        } catch (const AbstractException &e) {
+            std::cerr << "failed to encrypt rows for " << batch->db << "."
+                      << batch->table << ": " << e.to_string()
+                      << std::endl;
+        } catch (const CryptDBError &e) {
+            std::cerr << "failed to encrypt rows for " << batch->db << "."
+                      << batch->table << ": " << e.msg << std::endl;
+        } catch (const std::runtime_error &e) {
+            std::cerr << "failed to encrypt rows for " << batch->db << "."
+                      << batch->table << ": " << e.what() << std::endl;
+        }
 
-    return(line.compare(0,2,begin_match) == 0); 
+        finished(*batch, success);
+    }
 }
 
+// ---------------------------------------------
+//                  Import
+// ---------------------------------------------
+
 void
 Import::printOutOnly(void)
 {
@@ -42,7 +436,7 @@ Import::printOutOnly(void)
     std::string s("");
     std::ifstream input(this->filename);
 
-    assert(input.is_open() == true); 
+    assert(input.is_open() == true);
 
     while(std::getline(input, line )){
         if(ignore_line(line))
@@ -60,42 +454,86 @@ Import::printOutOnly(void)
     }
 }
 
+/*
+ * Data INSERTs are split into batches for the pool; every other statement
+ * is a barrier: the pool is drained, the statement goes through the proxy
+ * so the metadata is updated, and the workers reload their schema.
+ */
 void
-Import::executeQueries(ProxyState& ps)
+Import::executeQueries(ProxyState &ps, ImportPool &pool,
+                       const std::string &default_db,
+                       unsigned int batch_rows)
 {
-    std::string line;
-    std::string s("");
     std::ifstream input(this->filename);
+    assert(input.is_open() == true);
 
-    assert(input.is_open() == true); 
+    SchemaCache schema_cache;
+    std::string db(default_db);
+    std::string stmt;
+    while (next_statement(input, &stmt)) {
+        if (skip_statement(stmt)) {
+            continue;
+        }
 
-    while(std::getline(input, line )){
-        if(ignore_line(line))
+        std::string use_db;
+        if (parse_use(stmt, &use_db)) {
+            db = use_db;
             continue;
+        }
 
-        if (!line.empty()){
-            char lastChar = *line.rbegin();
-            if(lastChar == ';'){
-                s += line;
-                std::cout << s << std::endl;
-                // FIXME
-                assert(false);
-                /*
-                const EpilogueResult &epi_res = executeQuery(ps, s);
-                assert(epi_res.res_type.success());
-                s.clear();
-                continue;
-                */
+        std::string table;
+        std::vector<std::string> fields;
+        std::vector<ImportRow> rows;
+        if (!db.empty() && parse_insert(stmt, &table, &fields, &rows)) {
+            for (auto &it : make_batches(db, table, fields, false, &rows,
+                                         batch_rows)) {
+                pool.push(std::move(it));
             }
-            s += line;
+            continue;
+        }
+
+        pool.drain();
+        try {
+            executeQuery(ps, stmt, db, &schema_cache, false);
+        } catch (const SynchronizationException &e) {
+            std::cerr << e.to_string() << " in query " << stmt
+                      << std::endl;
+        } catch (const AbstractException &e) {
+            std::cerr << e.to_string() << " in query " << stmt
+                      << std::endl;
+        } catch (const CryptDBError &e) {
+            std::cerr << e.msg << " in query " << stmt << std::endl;
+        }
+        pool.schemaChanged();
+    }
+    pool.drain();
+
+    TEST_TextMessageError(schema_cache.cleanupStaleness(ps.getEConn()),
+                          "Failed to cleanup staleness!");
+}
+
+void
+Import::importCSV(ImportPool &pool, const std::string &db,
+                  const std::string &table, unsigned int batch_rows)
+{
+    std::ifstream input(this->filename);
+    assert(input.is_open() == true);
+
+    for (;;) {
+        std::unique_ptr<ImportBatch> batch =
+            next_csv_batch(input, db, table, batch_rows);
+        if (!batch) {
+            break;
         }
+        pool.push(std::move(batch));
     }
+    pool.drain();
 }
 
 
 int main(int argc, char **argv)
 {
-    int c, threads = 1, optind = 0;
+    int c, threads = 1, batch_rows = 1000, optind = 0;
 
     static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
@@ -104,16 +542,23 @@ int main(int argc, char **argv)
         {"user", required_argument, 0, 'u'},
         {"noexec", required_argument, 0, 'n'},
         {"threads", required_argument, 0, 't'},
+        {"database", required_argument, 0, 'd'},
+        {"csv", required_argument, 0, 'c'},
+        {"batch", required_argument, 0, 'b'},
         {NULL, 0, 0, 0},
     };
 
     std::string username("");
     std::string password("");
+    std::string filename("");
+    std::string database("");
+    std::string csv_table("");
     bool exec = true;
 
     while(1)
     {
-        c = getopt_long(argc, argv, "hf:p:u:t:n", long_options, &optind);
+        c = getopt_long(argc, argv, "hf:p:u:t:nd:c:b:", long_options,
+                        &optind);
         if(c == -1)
             break;
 
@@ -122,20 +567,7 @@ int main(int argc, char **argv)
             case 'h':
                 do_display_help(argv[0]);
             case 'f':
-                {
-                    Import import(optarg);
-                    if(exec == true){
-                        ConnectionInfo ci("localhost", username, password);
-                        const std::string master_key = "2392834";
-                        ProxyState ps(ci, "/var/lib/shadow-mysql",
-                                      master_key);
-
-                        // Execute queries
-                        import.executeQueries(ps);
-                    } else {
-                        import.printOutOnly();
-                    }
-                }
+                filename = optarg;
                 break;
             case 'p':
                 password = optarg;
@@ -145,11 +577,19 @@ int main(int argc, char **argv)
                 break;
             case 't':
                 threads = atoi(optarg);
-                (void)threads;
                 break;
             case 'n':
                 exec = false;
                 break;
+            case 'd':
+                database = optarg;
+                break;
+            case 'c':
+                csv_table = optarg;
+                break;
+            case 'b':
+                batch_rows = atoi(optarg);
+                break;
             case '?':
                 break;
             default:
@@ -157,5 +597,35 @@ int main(int argc, char **argv)
 
         }
     }
-    return 0;
+
+    if (filename.empty() || threads < 1 || batch_rows < 1
+        || (!csv_table.empty() && database.empty())) {
+        do_display_help(argv[0]);
+    }
+
+    Import import(filename.c_str());
+    if (false == exec) {
+        import.printOutOnly();
+        return 0;
+    }
+
+    ConnectionInfo ci("localhost", username, password);
+    const std::string master_key = "2392834";
+    ProxyState ps(ci, "/var/lib/shadow-mysql", master_key);
+
+    timer t;
+    ImportPool pool(ps, ci, threads, 4 * threads);
+    if (csv_table.empty()) {
+        import.executeQueries(ps, pool, database, batch_rows);
+    } else {
+        import.importCSV(pool, database, csv_table, batch_rows);
+    }
+
+    const double secs = t.lap() / 1000000.0;
+    std::cerr << "imported " << pool.rowsImported() << " rows in "
+              << secs << "s (" << pool.rowsImported() / std::max(secs, 1e-6)
+              << " rows/s), " << pool.rowsFailed() << " failed"
+              << std::endl;
+
+    return pool.rowsFailed() > 0 ? 1 : 0;
 }
@@ -1,7 +1,75 @@
 #pragma once
 
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include <tools/import/importparse.hh>
+
 namespace {
 
+/**
+ * Pool of worker threads that encrypt batches with the onion layers of
+ * the table and write them to the remote server as multi-row INSERTs.
+ *
+ * Each worker owns its own SchemaInfo (EncLayers such as OPE and HOM
+ * keep mutable state) and its own connection to the remote server.
+ * Unless NTL was built with NTL_THREADS the encryption itself is
+ * serialized; the workers still overlap it with the writes.
+ */
+class ImportPool
+{
+    public:
+        ImportPool(const ProxyState &ps, const ConnectionInfo &ci,
+                   unsigned int threads, unsigned int max_queued);
+        ~ImportPool();
+
+        // Blocks while the queue is full.
+        void push(std::unique_ptr<ImportBatch> batch);
+        // Blocks until every queued batch has been written.
+        void drain();
+        // Workers reload their schema before the next batch.
+        void schemaChanged();
+
+        unsigned long long rowsImported() const {return rows_imported;}
+        unsigned long long rowsFailed() const {return rows_failed;}
+
+    private:
+        const ProxyState &ps;
+        const ConnectionInfo ci;
+        const unsigned int max_queued;
+
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+        pthread_cond_t idle;
+        std::deque<std::unique_ptr<ImportBatch>> queue;
+        unsigned int busy;
+        bool done;
+        unsigned long schema_generation;
+        unsigned long long rows_imported;
+        unsigned long long rows_failed;
+
+        // Serializes schema loads over the proxy's shared connections.
+        pthread_mutex_t schema_lock;
+        // Without NTL_THREADS, one worker at a time encrypts or loads
+        // its schema.
+        pthread_mutex_t ntl_lock;
+        // Read while a batch holds mutable OPE labels, written while
+        // their relabels are applied.
+        pthread_rwlock_t label_lock;
+        std::vector<pthread_t> workers;
+
+        static void *workerMain(void *arg);
+        // Stops and joins the workers.
+        void stop();
+        void work();
+        std::unique_ptr<ImportBatch> pop(unsigned long *generation);
+        void finished(const ImportBatch &batch, bool success);
+};
+
 /**
  * Import database tool class.
  */
@@ -11,7 +79,11 @@ class Import
         Import(const char *fname) : filename(fname){}
         ~Import(){}
 
-        void executeQueries(ProxyState& ps);
+        void executeQueries(ProxyState &ps, ImportPool &pool,
+                            const std::string &default_db,
+                            unsigned int batch_rows);
+        void importCSV(ImportPool &pool, const std::string &db,
+                       const std::string &table, unsigned int batch_rows);
         void printOutOnly(void);
 
     private:
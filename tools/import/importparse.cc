@@ -0,0 +1,370 @@
+/*
+ * Reading mysqldump files and CSV for cryptdbimport, apart from the
+ * encryption so the tests can reach it.
+ */
+
+#include <algorithm>
+#include <iterator>
+
+#include <main/macro_util.hh>
+#include <util/util.hh>
+#include <tools/import/importparse.hh>
+
+bool
+ignore_line(const std::string& line)
+{
+    static const std::string begin_match("--");
+
+    return(line.compare(0,2,begin_match) == 0);
+}
+
+// Reads the next ';' terminated statement from a dump file.
+bool
+next_statement(std::istream &input, std::string *const out)
+{
+    std::string line;
+    out->clear();
+    while (std::getline(input, line)) {
+        if (ignore_line(line) || line.empty()) {
+            continue;
+        }
+
+        if (!out->empty()) {
+            *out += " ";
+        }
+        *out += line;
+        if (*line.rbegin() == ';') {
+            return true;
+        }
+    }
+
+    return !out->empty();
+}
+
+// ---------------------------------------------
+//      Parsing of mysqldump INSERTs and CSV
+// ---------------------------------------------
+// Anything this parser does not understand is sent through the proxy
+// instead, so it only needs to cover what mysqldump emits for data.
+
+static void
+skip_space(const std::string &s, size_t *const pos)
+{
+    while (*pos < s.size() && isspace(s[*pos])) {
+        ++*pos;
+    }
+}
+
+static bool
+match_keyword(const std::string &s, size_t *const pos,
+              const std::string &keyword)
+{
+    skip_space(s, pos);
+    if (s.size() - *pos < keyword.size()
+        || false == equalsIgnoreCase(s.substr(*pos, keyword.size()),
+                                     keyword)) {
+        return false;
+    }
+    const size_t end = *pos + keyword.size();
+    if (end < s.size() && (isalnum(s[end]) || '_' == s[end])) {
+        return false;
+    }
+
+    *pos = end;
+    return true;
+}
+
+static bool
+match_char(const std::string &s, size_t *const pos, char c)
+{
+    skip_space(s, pos);
+    if (*pos >= s.size() || s[*pos] != c) {
+        return false;
+    }
+
+    ++*pos;
+    return true;
+}
+
+static bool
+parse_identifier(const std::string &s, size_t *const pos,
+                 std::string *const out)
+{
+    skip_space(s, pos);
+    out->clear();
+    if (*pos < s.size() && '`' == s[*pos]) {
+        for (++*pos; *pos < s.size(); ++*pos) {
+            if ('`' == s[*pos]) {
+                if (*pos + 1 < s.size() && '`' == s[*pos + 1]) {
+                    ++*pos;
+                } else {
+                    ++*pos;
+                    return !out->empty();
+                }
+            }
+            out->push_back(s[*pos]);
+        }
+        return false;
+    }
+
+    while (*pos < s.size() && (isalnum(s[*pos]) || '_' == s[*pos]
+                               || '$' == s[*pos])) {
+        out->push_back(s[(*pos)++]);
+    }
+    return !out->empty();
+}
+
+// Single quoted string literal with the MySQL backslash escapes.
+static bool
+parse_quoted(const std::string &s, size_t *const pos,
+             std::string *const out)
+{
+    const char quote = s[*pos];
+    out->clear();
+    for (++*pos; *pos < s.size(); ++*pos) {
+        char c = s[*pos];
+        if ('\\' == c) {
+            if (++*pos >= s.size()) {
+                return false;
+            }
+            switch (s[*pos]) {
+                case '0': c = '\0'; break;
+                case 'b': c = '\b'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'Z': c = '\032'; break;
+                case '%': case '_':
+                    out->push_back('\\');
+                    c = s[*pos];
+                    break;
+                default: c = s[*pos]; break;
+            }
+        } else if (quote == c) {
+            if (*pos + 1 < s.size() && quote == s[*pos + 1]) {
+                ++*pos;
+            } else {
+                ++*pos;
+                return true;
+            }
+        }
+        out->push_back(c);
+    }
+
+    return false;
+}
+
+static bool
+parse_value(const std::string &s, size_t *const pos,
+            ImportRow *const row)
+{
+    skip_space(s, pos);
+    if (*pos >= s.size()) {
+        return false;
+    }
+
+    if ('\'' == s[*pos] || '"' == s[*pos]) {
+        std::string text;
+        RETURN_FALSE_IF_FALSE(parse_quoted(s, pos, &text));
+        row->push_back(ImportValue(ImportValue::Kind::QUOTED, text));
+        return true;
+    }
+
+    if (match_keyword(s, pos, "NULL")) {
+        row->push_back(ImportValue(ImportValue::Kind::NUL, ""));
+        return true;
+    }
+
+    // Plain numbers only; hex literals, functions and the like go
+    // through the proxy.
+    const size_t start = *pos;
+    while (*pos < s.size() && (isdigit(s[*pos]) || '-' == s[*pos]
+                               || '+' == s[*pos] || '.' == s[*pos]
+                               || 'e' == s[*pos] || 'E' == s[*pos])) {
+        ++*pos;
+    }
+    if (start == *pos || false == isdigit(s[*pos - 1])) {
+        return false;
+    }
+    row->push_back(ImportValue(ImportValue::Kind::BARE,
+                               s.substr(start, *pos - start)));
+    return true;
+}
+
+/*
+ * INSERT INTO <table> [(<field>, ...)] VALUES (<value>, ...), ...;
+ */
+bool
+parse_insert(const std::string &stmt, std::string *const table,
+             std::vector<std::string> *const fields,
+             std::vector<ImportRow> *const rows)
+{
+    size_t pos = 0;
+    RETURN_FALSE_IF_FALSE(match_keyword(stmt, &pos, "INSERT"));
+    RETURN_FALSE_IF_FALSE(match_keyword(stmt, &pos, "INTO"));
+    RETURN_FALSE_IF_FALSE(parse_identifier(stmt, &pos, table));
+    // Qualified names would need a database switch; leave them to the
+    // proxy.
+    skip_space(stmt, &pos);
+    RETURN_FALSE_IF_FALSE(pos < stmt.size() && '.' != stmt[pos]);
+
+    if (match_char(stmt, &pos, '(')) {
+        do {
+            std::string field;
+            RETURN_FALSE_IF_FALSE(parse_identifier(stmt, &pos, &field));
+            fields->push_back(field);
+        } while (match_char(stmt, &pos, ','));
+        RETURN_FALSE_IF_FALSE(match_char(stmt, &pos, ')'));
+    }
+
+    RETURN_FALSE_IF_FALSE(match_keyword(stmt, &pos, "VALUES"));
+    do {
+        RETURN_FALSE_IF_FALSE(match_char(stmt, &pos, '('));
+        ImportRow row;
+        do {
+            RETURN_FALSE_IF_FALSE(parse_value(stmt, &pos, &row));
+        } while (match_char(stmt, &pos, ','));
+        RETURN_FALSE_IF_FALSE(match_char(stmt, &pos, ')'));
+        rows->push_back(std::move(row));
+    } while (match_char(stmt, &pos, ','));
+
+    RETURN_FALSE_IF_FALSE(match_char(stmt, &pos, ';'));
+    skip_space(stmt, &pos);
+    return stmt.size() == pos;
+}
+
+bool
+parse_use(const std::string &stmt, std::string *const db)
+{
+    size_t pos = 0;
+    RETURN_FALSE_IF_FALSE(match_keyword(stmt, &pos, "USE"));
+    RETURN_FALSE_IF_FALSE(parse_identifier(stmt, &pos, db));
+    RETURN_FALSE_IF_FALSE(match_char(stmt, &pos, ';'));
+
+    return true;
+}
+
+// Session settings and table locks from the dump have no meaning for the
+// encrypted tables, and the locks would serialize the workers.
+bool
+skip_statement(const std::string &stmt)
+{
+    size_t pos = 0;
+    skip_space(stmt, &pos);
+    return 0 == stmt.compare(pos, 3, "/*!")
+           || match_keyword(stmt, &pos, "LOCK")
+           || match_keyword(stmt, &pos, "UNLOCK");
+}
+
+// One CSV record; quoted fields may span lines.
+bool
+next_csv_row(std::istream &input, ImportRow *const row)
+{
+    std::string line;
+    row->clear();
+    do {
+        if (!std::getline(input, line)) {
+            return false;
+        }
+    } while (line.empty());
+
+    std::string text;
+    bool quoted = false;
+    bool in_quotes = false;
+    for (size_t pos = 0;; ++pos) {
+        if (pos >= line.size()) {
+            if (in_quotes) {
+                // Embedded newline.
+                std::string more;
+                if (!std::getline(input, more)) {
+                    return false;
+                }
+                line += "\n" + more;
+            } else {
+                break;
+            }
+        }
+
+        const char c = line[pos];
+        if (in_quotes) {
+            if ('"' == c) {
+                if (pos + 1 < line.size() && '"' == line[pos + 1]) {
+                    text.push_back(c);
+                    ++pos;
+                } else {
+                    in_quotes = false;
+                }
+            } else {
+                text.push_back(c);
+            }
+        } else if ('"' == c && text.empty()) {
+            in_quotes = quoted = true;
+        } else if (',' == c) {
+            if (false == quoted && "\\N" == text) {
+                row->push_back(ImportValue(ImportValue::Kind::NUL, ""));
+            } else {
+                row->push_back(ImportValue(quoted
+                                             ? ImportValue::Kind::QUOTED
+                                             : ImportValue::Kind::BARE,
+                                           text));
+            }
+            text.clear();
+            quoted = false;
+        } else if ('\r' != c) {
+            text.push_back(c);
+        }
+    }
+
+    if (false == quoted && "\\N" == text) {
+        row->push_back(ImportValue(ImportValue::Kind::NUL, ""));
+    } else {
+        row->push_back(ImportValue(quoted ? ImportValue::Kind::QUOTED
+                                          : ImportValue::Kind::BARE,
+                                   text));
+    }
+    return true;
+}
+
+std::vector<std::unique_ptr<ImportBatch> >
+make_batches(const std::string &db, const std::string &table,
+             const std::vector<std::string> &fields, bool typed_by_schema,
+             std::vector<ImportRow> *const rows, unsigned int batch_rows)
+{
+    assert(batch_rows > 0);
+
+    std::vector<std::unique_ptr<ImportBatch> > batches;
+    for (size_t i = 0; i < rows->size(); i += batch_rows) {
+        std::unique_ptr<ImportBatch>
+            batch(new ImportBatch(db, table, fields, typed_by_schema));
+        const size_t end = std::min(rows->size(), i + batch_rows);
+        std::move(rows->begin() + i, rows->begin() + end,
+                  std::back_inserter(batch->rows));
+        batches.push_back(std::move(batch));
+    }
+    rows->clear();
+
+    return batches;
+}
+
+std::unique_ptr<ImportBatch>
+next_csv_batch(std::istream &input, const std::string &db,
+               const std::string &table, unsigned int batch_rows)
+{
+    assert(batch_rows > 0);
+
+    const std::vector<std::string> no_fields;
+    std::unique_ptr<ImportBatch> batch;
+    ImportRow row;
+    while (next_csv_row(input, &row)) {
+        if (!batch) {
+            batch.reset(new ImportBatch(db, table, no_fields, true));
+            batch->rows.reserve(batch_rows);
+        }
+        batch->rows.push_back(std::move(row));
+        if (batch->rows.size() >= batch_rows) {
+            break;
+        }
+    }
+
+    return batch;
+}
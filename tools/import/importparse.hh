@@ -0,0 +1,73 @@
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A single value as it was read from the input. The workers decide
+ * which Item to build for it, the same way the parser would for a
+ * literal in an INSERT.
+ */
+struct ImportValue
+{
+    enum class Kind {NUL, BARE, QUOTED};
+
+    ImportValue(Kind kind, const std::string &text)
+        : kind(kind), text(text) {}
+
+    Kind kind;
+    std::string text;
+};
+
+typedef std::vector<ImportValue> ImportRow;
+
+/**
+ * Unit of work for the encryption pool: a slice of rows bound for one
+ * plaintext table.
+ */
+struct ImportBatch
+{
+    ImportBatch(const std::string &db, const std::string &table,
+                const std::vector<std::string> &fields,
+                bool typed_by_schema)
+        : db(db), table(table), fields(fields),
+          typed_by_schema(typed_by_schema) {}
+
+    const std::string db;
+    const std::string table;
+    // Empty if the values are in table order.
+    const std::vector<std::string> fields;
+    // CSV values carry no literal type; use the column's onion layout.
+    const bool typed_by_schema;
+    std::vector<ImportRow> rows;
+};
+
+// Lines of a dump file that are comments.
+bool ignore_line(const std::string &line);
+// The next ';' terminated statement of a dump file.
+bool next_statement(std::istream &input, std::string *const out);
+
+// INSERT INTO <table> [(<field>, ...)] VALUES (<value>, ...), ...;
+// False for anything else, which goes through the proxy instead.
+bool parse_insert(const std::string &stmt, std::string *const table,
+                  std::vector<std::string> *const fields,
+                  std::vector<ImportRow> *const rows);
+bool parse_use(const std::string &stmt, std::string *const db);
+// Session settings and table locks.
+bool skip_statement(const std::string &stmt);
+
+// One CSV record; quoted fields may span lines, and an unquoted \N is
+// NULL.
+bool next_csv_row(std::istream &input, ImportRow *const row);
+
+// Moves @rows into batches of at most @batch_rows rows each.
+std::vector<std::unique_ptr<ImportBatch> >
+make_batches(const std::string &db, const std::string &table,
+             const std::vector<std::string> &fields, bool typed_by_schema,
+             std::vector<ImportRow> *const rows, unsigned int batch_rows);
+// The next at most @batch_rows CSV records of @input; NULL at the end.
+std::unique_ptr<ImportBatch>
+next_csv_batch(std::istream &input, const std::string &db,
+               const std::string &table, unsigned int batch_rows);
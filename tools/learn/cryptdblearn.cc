@@ -12,12 +12,21 @@
 #include <onions.hh> //layout
 #include <Analysis.hh> //for intersect()
 #include <rewrite_main.hh>
+#include <rewrite_util.hh>
+#include <macro_util.hh>
 #include <parser/sql_utils.hh>
 
 static void help(const char *prog)
 {
     std::cout << "Usage: " << prog << 
-        " -u user -p password -d database [-f input file]" << "\n";
+        " -u user -p password -d database [-f input file]"
+        " [-o plan file] [-a plan file]" << "\n";
+    std::cout << "-f: learn the onion levels needed by the queries in"
+                 " <input file>" << "\n";
+    std::cout << "-o: write the adjustment plan to <plan file> instead"
+                 " of stdout" << "\n";
+    std::cout << "-a: apply a plan written by -f (maintenance window)"
+              << "\n";
 }
 
 static bool 
@@ -33,6 +42,81 @@ Learn::status()
 {
     std::cout << "Total queries: " << this->m_totalnum << "\n";
     std::cout << "Number of successfully executed queries: " << this->m_success_num << "\n";
+    std::cout << "Number of skipped (non DML) queries: " << this->m_skipnum << "\n";
+    std::cout << "Number of failed queries: " << this->m_errnum << "\n";
+    std::cout << "Onions to adjust: " << this->m_requirements.size() << "\n";
+}
+
+/*
+ * Rewrites @query against the schema alone, the way the proxy would, and
+ * records every onion adjustment it asks for. The levels found so far are
+ * assumed to be in place so that a query needing several adjustments
+ * reports all of them.
+ */
+bool
+Learn::replayQuery(ProxyState &ps, const std::string &query)
+{
+    static const std::unique_ptr<SQLDispatcher>
+        dml_dispatcher(buildDMLDispatcher());
+
+    // Every adjustment removes at least one layer, so this bounds the
+    // number of retries.
+    for (unsigned int attempt = 0; attempt < 64; ++attempt) {
+        std::unique_ptr<query_parse> p;
+        try {
+            p.reset(new query_parse(m_dbname, query));
+        } catch (std::runtime_error &e) {
+            std::cerr << "bad query: " << query << ": " << e.what() << "\n";
+            return false;
+        }
+
+        LEX *const lex = p->lex();
+        if (p->annot || !dml_dispatcher->canDo(lex)) {
+            // DDL would change the metadata itself; nothing to learn.
+            this->m_skipnum++;
+            return true;
+        }
+
+        Analysis a(m_dbname, *m_schema);
+        for (auto it : m_requirements) {
+            a.assumed_levels[it.first] = it.second.required;
+        }
+
+        try {
+            dml_dispatcher->dispatch(lex).transformLex(a, lex, ps);
+            return true;
+        } catch (OnionAdjustExcept e) {
+            const OnionMeta *const om = e.fm.getOnionMeta(e.o);
+            auto it = m_requirements.find(om);
+            if (m_requirements.end() == it) {
+                const DatabaseMeta &dm = a.getDatabaseMeta(m_dbname);
+                const onion_requirement_t r =
+                    {dm.getKey(e.tm).getValue(), &e.fm, e.o,
+                     a.getOnionLevel(*om), e.tolevel};
+                m_requirements.insert(std::make_pair(om, r));
+            } else {
+                assert(e.tolevel < it->second.required);
+                it->second.required = e.tolevel;
+            }
+        } catch (const AbstractException &e) {
+            std::cerr << "can not rewrite: " << query << ": " << e
+                      << "\n";
+            return false;
+        } catch (const CryptDBError &e) {
+            std::cerr << "can not rewrite: " << query << ": " << e.msg
+                      << "\n";
+            return false;
+        }
+    }
+
+    std::cerr << "too many adjustments for: " << query << "\n";
+    return false;
+}
+
+void
+Learn::loadSchema(ProxyState &ps)
+{
+    m_schema.reset(loadSchemaInfo(ps.getConn(), ps.getEConn()));
 }
 
 void
@@ -43,6 +127,7 @@ Learn::trainFromFile(ProxyState &ps)
     std::ifstream input(this->m_filename);
     assert(input.is_open() == true); 
 
+    loadSchema(ps);
     while(std::getline(input, line )){
         if(ignore_line(line))
             continue;
@@ -50,32 +135,17 @@ Learn::trainFromFile(ProxyState &ps)
         if (!line.empty()){
             char lastChar = *line.rbegin();
             if(lastChar == ';'){
-                throw CryptDBError("fix Learn::trainFromFile!");
-                /*
-                // FIXME: Use executeQuery.
-                this->m_totalnum++;
                 s += line;
-                Rewriter r;
-                SchemaInfo *out_schema;
-                QueryRewrite qr = r.rewrite(ps, s, &out_schema);
-                // FIXME.
-                ResType *res =
-                    qr.output->doQuery(ps.conn, ps.e_conn);
-                if(res){
-                    if(res->ok)
-                        this->m_success_num++;
-                    delete res;
-                }
-                if (true == qr.output->queryAgain()){ 
-                    this->m_totalnum++;
-                    assert(executeQuery(ps, s));
+                this->m_totalnum++;
+                if (replayQuery(ps, s)) {
                     this->m_success_num++;
-                } 
-                */
+                } else {
+                    this->m_errnum++;
+                }
                 s.clear();
                 continue;
             }
-            s += line;
+            s += line + " ";
         }
     }
 }
@@ -83,12 +153,97 @@ Learn::trainFromFile(ProxyState &ps)
 void 
 Learn::trainFromScratch(ProxyState &ps)
 {
-    //TODO: implement this
     /*
-     *
      * OK, here we have no queries tracing file at all and we should 
      * train using as most secure onions layout as possible.
+     *
+     * The most secure layout is the one the proxy starts with, so the
+     * plan is empty; we only report where every onion currently is.
      */
+    loadSchema(ps);
+    const DatabaseMeta *const dm =
+        m_schema->getChild(IdentityMetaKey(m_dbname));
+    if (!dm) {
+        std::cerr << "unknown database " << m_dbname << "\n";
+        return;
+    }
+
+    Analysis a(m_dbname, *m_schema);
+    for (const auto &table : dm->children) {
+        for (const auto fm : table.second->orderedFieldMetas()) {
+            for (const auto &om : fm->orderedOnionMetas()) {
+                std::cout << "-- " << table.first.getValue() << "."
+                          << fm->fname << " "
+                          << TypeText<onion>::toText(om.first->getValue())
+                          << " "
+                          << TypeText<SECLEVEL>::toText(
+                                a.getOnionLevel(*om.second))
+                          << "\n";
+            }
+        }
+    }
+}
+
+/*
+ * One directive per table; the proxy peels all of the listed onions in a
+ * single UPDATE.
+ */
+void
+Learn::writePlan(std::ostream &out) const
+{
+    std::map<std::string, std::list<const onion_requirement_t *>> tables;
+    for (const auto &it : m_requirements) {
+        tables[it.second.table_name].push_back(&it.second);
+    }
+
+    for (const auto &table : tables) {
+        for (auto r : table.second) {
+            out << "-- " << table.first << "." << r->fm->fname << " "
+                << TypeText<onion>::toText(r->o) << ": "
+                << TypeText<SECLEVEL>::toText(r->current) << " -> "
+                << TypeText<SECLEVEL>::toText(r->required) << "\n";
+        }
+
+        out << "DIRECTIVE ADJUST " << table.first;
+        for (auto r : table.second) {
+            out << " " << r->fm->fname << " "
+                << TypeText<onion>::toText(r->o) << " "
+                << TypeText<SECLEVEL>::toText(r->required);
+        }
+        out << ";\n";
+    }
+}
+
+void
+Learn::applyPlan(ProxyState &ps, const std::string &planfile)
+{
+    std::string line;
+    std::ifstream input(planfile);
+    assert(input.is_open() == true);
+
+    SchemaCache schema_cache;
+    while (std::getline(input, line)) {
+        if (ignore_line(line) || line.empty())
+            continue;
+
+        this->m_totalnum++;
+        try {
+            executeQuery(ps, line, m_dbname, &schema_cache);
+            this->m_success_num++;
+        } catch (const SynchronizationException &e) {
+            std::cerr << e << "\n";
+            this->m_errnum++;
+        } catch (const AbstractException &e) {
+            std::cerr << e << "\n";
+            this->m_errnum++;
+        } catch (const CryptDBError &e) {
+            std::cerr << e.msg << "\n";
+            this->m_errnum++;
+        }
+    }
+
+    TEST_TextMessageError(schema_cache.cleanupStaleness(ps.getEConn()),
+                          "Failed to cleanup staleness!");
 }
 
 int main(int argc, char **argv)
@@ -101,6 +256,8 @@ int main(int argc, char **argv)
         {"password", required_argument, 0, 'p'},
         {"dbname", required_argument, 0, 'd'},
         {"file", required_argument, 0, 'f'},
+        {"output", required_argument, 0, 'o'},
+        {"apply", required_argument, 0, 'a'},
         {NULL, 0, 0, 0},
     };
 
@@ -108,10 +265,12 @@ int main(int argc, char **argv)
     std::string password("");
     std::string dbname("");
     std::string filename("");
+    std::string planfile("");
+    std::string applyfile("");
 
     while(1)
     {
-        c = getopt_long(argc, argv, "hf:u:p:d:", long_options, &optind);
+        c = getopt_long(argc, argv, "hf:u:p:d:o:a:", long_options, &optind);
         if(c == -1)
             break;
 
@@ -132,6 +291,12 @@ int main(int argc, char **argv)
             case 'd':
                 dbname = optarg;
                 break;
+            case 'o':
+                planfile = optarg;
+                break;
+            case 'a':
+                applyfile = optarg;
+                break;
             case '?':
                 break;
             default:
@@ -150,10 +315,22 @@ int main(int argc, char **argv)
 
     Learn *learn; 
     
-    if(filename != "")
+    if(applyfile != "")
+    {
+        learn = new Learn(MODE_FILE, ps, dbname, "");
+        learn->applyPlan(ps, applyfile);
+        learn->status();
+    }else if(filename != "")
     {
         learn = new Learn(MODE_FILE, ps, dbname, filename);
         learn->trainFromFile(ps);
+        if(planfile != ""){
+            std::ofstream plan(planfile);
+            assert(plan.is_open() == true);
+            learn->writePlan(plan);
+        }else{
+            learn->writePlan(std::cout);
+        }
         learn->status();
     }else{
         learn = new Learn(MODE_FROM_SCRATCH, ps, dbname, "");
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <iostream>
+#include <map>
 #include <rewrite_main.hh>
 
 // Anonymous namespace
@@ -26,6 +27,19 @@ static learn_mode_t __attribute__((unused))modes[]=
     {MODE_INVALID, "FALSE"},
 };
 
+/*
+ * Lowest level an onion must be brought to for the training queries to
+ * run without triggering an adjustment.
+ */
+typedef struct _onion_requirement_t
+{
+    std::string table_name;
+    const FieldMeta *fm;
+    onion o;
+    SECLEVEL current;
+    SECLEVEL required;
+} onion_requirement_t;
+
 class Learn
 {
     public:
@@ -33,12 +47,15 @@ class Learn
         Learn(mode_e mode, ProxyState& ps, const std::string &dbname,
               const std::string &filename)
             : m_totalnum(0), m_success_num(0), m_errnum(0),
-            m_mode(mode), m_ps(ps), m_dbname(dbname), m_filename(filename){}
+            m_skipnum(0), m_mode(mode), m_ps(ps), m_dbname(dbname),
+            m_filename(filename){}
 
         ~Learn(){}
 
         void trainFromFile(ProxyState &ps);
         void trainFromScratch(ProxyState &ps);
+        void writePlan(std::ostream &out) const;
+        void applyPlan(ProxyState &ps, const std::string &planfile);
 
         void status();
 
@@ -46,12 +63,17 @@ class Learn
         int m_totalnum;
         int m_success_num;
         int m_errnum;
+        int m_skipnum;
         mode_e m_mode;
         ProxyState& m_ps;
         std::string m_dbname;
         std::string m_filename;
-        std::vector<query_parse*>qvec;
 
+        std::unique_ptr<SchemaInfo> m_schema;
+        std::map<const OnionMeta *, onion_requirement_t> m_requirements;
+
+        void loadSchema(ProxyState &ps);
+        bool replayQuery(ProxyState &ps, const std::string &query);
 };
 
 };
@@ -72,6 +72,8 @@
 CREATE FUNCTION cryptdb_decrypt_int_sem RETURNS INTEGER SONAME 'edb.so';
 CREATE FUNCTION cryptdb_decrypt_text_sem RETURNS STRING SONAME 'edb.so';
 CREATE FUNCTION cryptdb_decrypt_int_det RETURNS INTEGER SONAME 'edb.so';
+CREATE FUNCTION cryptdb_decrypt_int_sem_ffx RETURNS INTEGER SONAME 'edb.so';
+CREATE FUNCTION cryptdb_decrypt_int_det_ffx RETURNS INTEGER SONAME 'edb.so';
 CREATE FUNCTION cryptdb_decrypt_text_det RETURNS STRING SONAME 'edb.so';
 CREATE FUNCTION cryptdb_func_add_set RETURNS STRING SONAME 'edb.so';
 CREATE AGGREGATE FUNCTION cryptdb_agg RETURNS STRING SONAME 'edb.so';
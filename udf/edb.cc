@@ -11,6 +11,8 @@
 
 #include <crypto/BasicCrypto.hh>
 #include <crypto/blowfish.hh>
+#include <crypto/ffx64.hh>
+#include <crypto/aes_cmc.hh>
 #include <crypto/SWPSearch.hh>
 #include <crypto/paillier.hh>
 #include <util/params.hh>
@@ -40,6 +42,24 @@ my_bool   cryptdb_decrypt_int_det_init(UDF_INIT *const initid,
 ulonglong cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
                                   char *const is_null, char *const error);
 
+my_bool   cryptdb_decrypt_int_sem_ffx_init(UDF_INIT *const initid,
+                                           UDF_ARGS *const args,
+                                           char *const message);
+void      cryptdb_decrypt_int_sem_ffx_deinit(UDF_INIT *const initid);
+ulonglong cryptdb_decrypt_int_sem_ffx(UDF_INIT *const initid,
+                                      UDF_ARGS *const args,
+                                      char *const is_null,
+                                      char *const error);
+
+my_bool   cryptdb_decrypt_int_det_ffx_init(UDF_INIT *const initid,
+                                           UDF_ARGS *const args,
+                                           char *const message);
+void      cryptdb_decrypt_int_det_ffx_deinit(UDF_INIT *const initid);
+ulonglong cryptdb_decrypt_int_det_ffx(UDF_INIT *const initid,
+                                      UDF_ARGS *const args,
+                                      char *const is_null,
+                                      char *const error);
+
 my_bool   cryptdb_decrypt_text_sem_init(UDF_INIT *const initid,
                                         UDF_ARGS *const args, char *const message);
 void      cryptdb_decrypt_text_sem_deinit(UDF_INIT *const initid);
@@ -256,6 +276,135 @@ cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
 
 
 
+/*
+ * The FFX integer UDFs keep the cipher of the last key in initid->ptr,
+ * since the key is the same for every row of a query.
+ */
+struct FFXKey {
+    FFXKey(const std::string &key) : key(key), ffx(key) {}
+
+    const std::string key;
+    const ffx64_aes ffx;
+};
+
+static const ffx64_aes &
+ffx_for_key(UDF_INIT *const initid, UDF_ARGS *const args, int i)
+{
+    uint64_t keyLen;
+    char *const keyBytes = getba(args, i, keyLen);
+
+    FFXKey *k = reinterpret_cast<FFXKey *>(initid->ptr);
+    if (NULL == k
+        || k->key.size() != keyLen
+        || 0 != memcmp(k->key.data(), keyBytes, keyLen)) {
+        delete k;
+        initid->ptr = NULL;
+        k = new FFXKey(std::string(keyBytes, keyLen));
+        initid->ptr = reinterpret_cast<char *>(k);
+    }
+
+    return k->ffx;
+}
+
+static void
+ffx_deinit(UDF_INIT *const initid)
+{
+    delete reinterpret_cast<FFXKey *>(initid->ptr);
+}
+
+my_bool
+cryptdb_decrypt_int_sem_ffx_init(UDF_INIT *const initid, UDF_ARGS *const args,
+                                 char *const message)
+{
+    if (args->arg_count != 3 ||
+        args->arg_type[0] != INT_RESULT ||
+        args->arg_type[1] != STRING_RESULT ||
+        args->arg_type[2] != INT_RESULT)
+    {
+        strcpy(message, "Usage: cryptdb_decrypt_int_sem_ffx(int ciphertext, string key, int salt)");
+        return 1;
+    }
+
+    initid->maybe_null = 1;
+    return 0;
+}
+
+void
+cryptdb_decrypt_int_sem_ffx_deinit(UDF_INIT *const initid)
+{
+    ffx_deinit(initid);
+}
+
+ulonglong
+cryptdb_decrypt_int_sem_ffx(UDF_INIT *const initid, UDF_ARGS *const args,
+                            char *const is_null, char *const error)
+{
+    AssignFirst<uint64_t> value;
+    if (NULL == args->args[0]) {
+        value = 0;
+        *is_null = 1;
+    } else {
+        try {
+            const uint64_t eValue = getui(args, 0);
+            const uint64_t salt = getui(args, 2);
+
+            value = ffx_for_key(initid, args, 1).decrypt(eValue) ^ salt;
+        } catch (const CryptoError &e) {
+            std::cerr << e.msg << std::endl;
+            value = 0;
+        }
+    }
+
+    return static_cast<ulonglong>(value.get());
+}
+
+my_bool
+cryptdb_decrypt_int_det_ffx_init(UDF_INIT *const initid, UDF_ARGS *const args,
+                                 char *const message)
+{
+    if (args->arg_count != 3 ||
+        args->arg_type[0] != INT_RESULT ||
+        args->arg_type[1] != STRING_RESULT ||
+        args->arg_type[2] != INT_RESULT)
+    {
+        strcpy(message, "Usage: cryptdb_decrypt_int_det_ffx(int ciphertext, string key, int shift)");
+        return 1;
+    }
+
+    initid->maybe_null = 1;
+    return 0;
+}
+
+void
+cryptdb_decrypt_int_det_ffx_deinit(UDF_INIT *const initid)
+{
+    ffx_deinit(initid);
+}
+
+ulonglong
+cryptdb_decrypt_int_det_ffx(UDF_INIT *const initid, UDF_ARGS *const args,
+                            char *const is_null, char *const error)
+{
+    AssignFirst<uint64_t> value;
+    if (NULL == args->args[0]) {
+        value = 0;
+        *is_null = 1;
+    } else {
+        try {
+            const uint64_t eValue = getui(args, 0);
+            const uint64_t shift = getui(args, 2);
+
+            value = ffx_for_key(initid, args, 1).decrypt(eValue) - shift;
+        } catch (const CryptoError &e) {
+            std::cerr << e.msg << std::endl;
+            value = 0;
+        }
+    }
+
+    return static_cast<ulonglong>(value.get());
+}
+
+
 my_bool
 cryptdb_decrypt_text_sem_init(UDF_INIT *const initid, UDF_ARGS *const args,
                               char *const message)
@@ -325,6 +474,37 @@ cryptdb_decrypt_text_sem(UDF_INIT *const initid, UDF_ARGS *const args,
 }
 
 
+/*
+ * Likewise, cryptdb_decrypt_text_det keeps the CMC cipher of the last key,
+ * and the value it returns for the row.
+ */
+struct CMCKey {
+    CMCKey(const std::string &key) : key(key), cmc(key) {}
+
+    const std::string key;
+    const aes_cmc cmc;
+    std::string result;
+};
+
+static CMCKey *
+cmc_for_key(UDF_INIT *const initid, UDF_ARGS *const args, int i)
+{
+    uint64_t keyLen;
+    char *const keyBytes = getba(args, i, keyLen);
+
+    CMCKey *k = reinterpret_cast<CMCKey *>(initid->ptr);
+    if (NULL == k
+        || k->key.size() != keyLen
+        || 0 != memcmp(k->key.data(), keyBytes, keyLen)) {
+        delete k;
+        initid->ptr = NULL;
+        k = new CMCKey(std::string(keyBytes, keyLen));
+        initid->ptr = reinterpret_cast<char *>(k);
+    }
+
+    return k;
+}
+
 my_bool
 cryptdb_decrypt_text_det_init(UDF_INIT *const initid, UDF_ARGS *const args,
                               char *const message)
@@ -344,12 +524,7 @@ cryptdb_decrypt_text_det_init(UDF_INIT *const initid, UDF_ARGS *const args,
 void
 cryptdb_decrypt_text_det_deinit(UDF_INIT *const initid)
 {
-    /*
-     * in mysql-server/sql/item_func.cc, udf_handler::fix_fields
-     * initializes initid.ptr=0 for us.
-     */
-    if (initid->ptr)
-        delete[] initid->ptr;
+    delete reinterpret_cast<CMCKey *>(initid->ptr);
 }
 
 char *
@@ -366,26 +541,24 @@ cryptdb_decrypt_text_det(UDF_INIT *const initid, UDF_ARGS *const args,
             uint64_t eValueLen;
             char *const eValueBytes = getba(args, 0, eValueLen);
 
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string key = std::string(keyBytes, keyLen);
-
-            const std::unique_ptr<AES_KEY> aesKey(get_AES_dec_key(key));
-            value =
-                decrypt_AES_CMC(std::string(eValueBytes,
-                                    static_cast<unsigned int>(eValueLen)),
-                                aesKey.get(), true);
+            value = cmc_for_key(initid, args, 1)->cmc.decrypt(
+                        std::string(eValueBytes,
+                                    static_cast<unsigned int>(eValueLen)));
         } catch (const CryptoError &e) {
             std::cerr << e.msg << std::endl;
             value = "";
         }
     }
 
-    char *const res = new char[value.get().length()];
-    initid->ptr = res;
-    memcpy(res, value.get().data(), value.get().length());
-    *length = value.get().length();
-    return initid->ptr;
+    // NULL until a row has a value.
+    CMCKey *const k = reinterpret_cast<CMCKey *>(initid->ptr);
+    if (NULL == k) {
+        *length = 0;
+        return result;
+    }
+    k->result = value.get();
+    *length = k->result.length();
+    return &k->result[0];
 }
 
 /*
@@ -533,7 +706,7 @@ cryptdb_agg(UDF_INIT *const initid, UDF_ARGS *const args, char *const result,
 }
 
 // for update with increment
-// > UNUSED
+// > UPDATE t SET x = x + c on oAGG; the other onions of x go stale.
 
 my_bool
 cryptdb_func_add_set_init(UDF_INIT *const initid, UDF_ARGS *const args,
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <new>
+#include <utility>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Bump allocator for objects that all die at once, such as the rewrite
+ * state of a query. Nothing is given back before the arena is
+ * destroyed, and destroying it frees every block in one pass; the
+ * destructors of what lives in it still have to run before then.
+ *
+ * An arena that isn't @pooled takes a block of its own for every
+ * allocation, as the heap would, so that the two can be compared.
+ * Blocks come from operator new, where allocation counters see them.
+ */
+class Arena {
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+
+public:
+    explicit Arena(size_t first_block = 8192, bool pooled = true)
+        : last(NULL), next(NULL), end(NULL), block_size(first_block),
+          used(0), blocks(0), pooled(pooled) {}
+    ~Arena()
+    {
+        while (last) {
+            Block *const prev = last->prev;
+            ::operator delete(last);
+            last = prev;
+        }
+    }
+
+    void *allocate(size_t size, size_t align = max_align)
+    {
+        assert(align && 0 == (align & (align - 1)) && align <= max_align);
+
+        char *p = alignUp(next, align);
+        if (!last || p + size > end || false == pooled) {
+            grow(size);
+            p = alignUp(next, align);
+        }
+        next = p + size;
+        used += size;
+        return p;
+    }
+
+    // Bytes handed out, and the blocks they came from.
+    size_t bytesUsed() const {return used;}
+    size_t blockCount() const {return blocks;}
+
+    static const size_t max_align = 16;
+
+private:
+    struct Block {
+        Block *prev;
+    };
+
+    // The first block starts at block_size and each one after doubles,
+    // so a query that needs a lot allocates a few times at most.
+    void grow(size_t size)
+    {
+        const size_t header = (sizeof(Block) + max_align - 1)
+                              & ~(max_align - 1);
+        if (false == pooled) {
+            block_size = size + header;
+        }
+        while (block_size < size + header) {
+            block_size *= 2;
+        }
+
+        Block *const b = static_cast<Block *>(::operator new(block_size));
+        b->prev = last;
+        last = b;
+        next = reinterpret_cast<char *>(b) + header;
+        end = reinterpret_cast<char *>(b) + block_size;
+        block_size *= 2;
+        ++blocks;
+    }
+
+    static char *alignUp(char *p, size_t align)
+    {
+        return reinterpret_cast<char *>(
+                   (reinterpret_cast<uintptr_t>(p) + align - 1)
+                   & ~static_cast<uintptr_t>(align - 1));
+    }
+
+    Block *last;
+    char *next;
+    char *end;
+    size_t block_size;
+    size_t used;
+    size_t blocks;
+    const bool pooled;
+};
+
+// Lets standard containers take their nodes from an Arena; deallocate
+// does nothing.
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef ArenaAllocator<U> other;
+    };
+
+    ArenaAllocator(Arena &arena) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_type n, const void * = 0)
+    {
+        return static_cast<T *>(arena->allocate(n * sizeof(T),
+                                                __alignof__(T)));
+    }
+    void deallocate(T *, size_type) {}
+
+    size_type max_size() const {return static_cast<size_type>(-1)
+                                       / sizeof(T);}
+    T *address(T &x) const {return &x;}
+    const T *address(const T &x) const {return &x;}
+
+    template <typename U, typename... Args>
+    void construct(U *const p, Args &&... args)
+    {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+    template <typename U>
+    void destroy(U *const p) {p->~U();}
+
+    Arena *arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+    return a.arena != b.arena;
+}
+
+// std::map whose nodes live in an Arena; construct it with
+// (std::less<K>(), arena).
+template <typename K, typename V>
+struct ArenaMap {
+    typedef std::map<K, V, std::less<K>,
+                     ArenaAllocator<std::pair<const K, V> > > type;
+};
@@ -1,4 +1,10 @@
 #include <util/cryptdb_log.hh>
+#include <util/scoped_lock.hh>
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <pthread.h>
 
 uint64_t cryptdb_logger::enable_mask = //0;
 //    cryptdb_logger::mask(log_group::log_debug) |
@@ -10,3 +16,183 @@ uint64_t cryptdb_logger::enable_mask = //0;
     // cryptdb_logger::mask(log_group::log_test) |
     cryptdb_logger::mask(log_group::log_warn);
 
+
+/*
+ * Bounded multi-producer queue of formatted records (Vyukov): a
+ * producer claims a cell by advancing enqueue_pos and publishes it by
+ * bumping the cell's sequence number; there are no locks on the
+ * producer side. One consumer at a time (the writer thread, or flush())
+ * empties it under consumer_lock.
+ *
+ * The writer sleeps on a condition variable once the queue is empty;
+ * a producer only takes wake_lock to signal it when writer_idle says
+ * it is asleep.
+ */
+namespace {
+
+struct log_cell {
+    size_t seq;
+    std::string record;
+};
+
+const size_t ring_size = 1 << 13;
+log_cell ring[ring_size];
+size_t enqueue_pos = 0;
+size_t dequeue_pos = 0;
+unsigned long long dropped = 0;
+
+pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t has_records = PTHREAD_COND_INITIALIZER;
+bool writer_idle = false;
+
+bool
+enqueue(std::string &&record)
+{
+    size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        log_cell &cell = ring[pos & (ring_size - 1)];
+        const size_t seq = __atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE);
+        const intptr_t dif =
+            static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (0 == dif) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                cell.record = std::move(record);
+                __atomic_store_n(&cell.seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+bool
+queue_empty()
+{
+    scoped_lock l(&consumer_lock);
+    const log_cell &cell = ring[dequeue_pos & (ring_size - 1)];
+    return __atomic_load_n(&cell.seq, __ATOMIC_SEQ_CST) != dequeue_pos + 1;
+}
+
+void
+wake_writer()
+{
+    // Pairs with the store of writer_idle in wait_for_records(): either
+    // the writer sees the new record or we see it idle.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writer_idle, __ATOMIC_SEQ_CST)) {
+        scoped_lock l(&wake_lock);
+        pthread_cond_signal(&has_records);
+    }
+}
+
+void
+wait_for_records()
+{
+    scoped_lock l(&wake_lock);
+    __atomic_store_n(&writer_idle, true, __ATOMIC_SEQ_CST);
+    while (queue_empty()) {
+        pthread_cond_wait(&has_records, &wake_lock);
+    }
+    __atomic_store_n(&writer_idle, false, __ATOMIC_SEQ_CST);
+}
+
+// Requires consumer_lock.
+size_t
+drain()
+{
+    size_t n = 0;
+    std::string out;
+    for (;;) {
+        log_cell &cell = ring[dequeue_pos & (ring_size - 1)];
+        const size_t seq = __atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE);
+        if (seq != dequeue_pos + 1) {
+            break;
+        }
+
+        out += cell.record;
+        cell.record.clear();
+        __atomic_store_n(&cell.seq, dequeue_pos + ring_size,
+                         __ATOMIC_RELEASE);
+        ++dequeue_pos;
+        ++n;
+    }
+
+    const unsigned long long lost =
+        __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        out += "cryptdb_log: dropped " + std::to_string(lost) +
+               " records\n";
+    }
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), stderr);
+        fflush(stderr);
+    }
+
+    return n;
+}
+
+void *
+writer_main(void *) __attribute__((noreturn));
+
+void *
+writer_main(void *)
+{
+    for (;;) {
+        size_t n;
+        {
+            scoped_lock l(&consumer_lock);
+            n = drain();
+        }
+        if (0 == n) {
+            wait_for_records();
+        }
+    }
+}
+
+void
+start_writer()
+{
+    for (size_t i = 0; i < ring_size; ++i) {
+        ring[i].seq = i;
+    }
+    atexit(cryptdb_logger::flush);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t writer;
+    if (0 != pthread_create(&writer, &attr, writer_main, NULL)) {
+        std::cerr << "cryptdb_log: no writer thread; records are"
+                     " written at exit" << std::endl;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+}
+
+void
+cryptdb_logger::emit(std::string &&record)
+{
+    pthread_once(&writer_once, start_writer);
+    if (false == enqueue(std::move(record))) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    wake_writer();
+}
+
+void
+cryptdb_logger::flush()
+{
+    pthread_once(&writer_once, start_writer);
+
+    scoped_lock l(&consumer_lock);
+    drain();
+}
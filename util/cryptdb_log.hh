@@ -25,6 +25,15 @@
     m(wrapper)              \
     m(all)
 
+/*
+ * Groups whose LOG() statements are compiled in; the others are dead
+ * code. Build with e.g. -DCRYPTDB_LOG_COMPILED_MASK=1 (LOG_COMPILED_MASK
+ * in config.mk) to keep nothing but warn.
+ */
+#ifndef CRYPTDB_LOG_COMPILED_MASK
+#define CRYPTDB_LOG_COMPILED_MASK (~0ULL)
+#endif
+
 enum class log_group {
 #define __temp_m(n) log_ ## n,
 LOG_GROUPS(__temp_m)
@@ -47,10 +56,12 @@ class cryptdb_logger : public std::stringstream {
 
     ~cryptdb_logger()
     {
-        if (enable_mask & m)
-            std::cerr << file << ":" << line
-                      << " (" << func << "): "
-                      << str() << std::endl;
+        if (enable_mask & m) {
+            std::stringstream record;
+            record << file << ":" << line << " (" << func << "): "
+                   << str() << "\n";
+            emit(record.str());
+        }
     }
 
     static void
@@ -77,12 +88,21 @@ class cryptdb_logger : public std::stringstream {
         return enable_mask & mask(g);
     }
 
-    static uint64_t
+    static constexpr bool
+    compiled(log_group g)
+    {
+        return CRYPTDB_LOG_COMPILED_MASK & mask(g);
+    }
+
+    static constexpr uint64_t
     mask(log_group g)
     {
         return 1ULL << ((int) g);
     }
 
+    // Write out the records queued so far.
+    static void flush();
+
     static std::string
     getConf()
     {
@@ -106,8 +126,27 @@ class cryptdb_logger : public std::stringstream {
 
     static uint64_t enable_mask;
 
+    // Hands @record to the writer thread; drops it if the queue is full.
+    static void emit(std::string &&record);
+};
+
+// Swallows the stream so that LOG() is an expression of type void.
+class cryptdb_log_voidify {
+ public:
+    void operator&(const std::ostream &) {}
 };
 
-#define LOG(g) \
-    (cryptdb_logger(log_group::log_ ## g, __FILE__, __LINE__, __func__))
+/*
+ * The group is checked before the logger is built or any of the
+ * streamed arguments are evaluated; a disabled LOG() costs one load and
+ * a branch, and none at all if the group isn't compiled in. Records go
+ * to a lock-free queue drained by a writer thread, so logging never
+ * blocks the caller.
+ */
+#define LOG(g)                                                          \
+    !(cryptdb_logger::compiled(log_group::log_ ## g)                    \
+      && cryptdb_logger::enabled(log_group::log_ ## g))                 \
+        ? (void) 0                                                      \
+        : cryptdb_log_voidify() &                                       \
+          cryptdb_logger(log_group::log_ ## g, __FILE__, __LINE__, __func__)
 
@@ -15,3 +15,31 @@ class scoped_lock {
  private:
     pthread_mutex_t *mu;
 };
+
+class scoped_rdlock {
+ public:
+    scoped_rdlock(pthread_rwlock_t *lkarg) : lk(lkarg) {
+        pthread_rwlock_rdlock(lk);
+    }
+
+    ~scoped_rdlock() {
+        pthread_rwlock_unlock(lk);
+    }
+
+ private:
+    pthread_rwlock_t *lk;
+};
+
+class scoped_wrlock {
+ public:
+    scoped_wrlock(pthread_rwlock_t *lkarg) : lk(lkarg) {
+        pthread_rwlock_wrlock(lk);
+    }
+
+    ~scoped_wrlock() {
+        pthread_rwlock_unlock(lk);
+    }
+
+ private:
+    pthread_rwlock_t *lk;
+};
@@ -286,8 +286,8 @@ roll(typename std::list<T>::iterator & it,  int count)
     }
 }
 
-template<typename A, typename B>
-const B &constGetAssert(const std::map<A, B> &m, const A &x,
+template<typename A, typename B, typename C, typename D>
+const B &constGetAssert(const std::map<A, B, C, D> &m, const A &x,
                         const std::string &str = "")
 {
     auto it = m.find(x);
@@ -299,8 +299,8 @@ const B &constGetAssert(const std::map<A, B> &m, const A &x,
     return it->second;
 }
 
-template<typename A, typename B>
-B &getAssert(std::map<A, B> &m, const A &x,
+template<typename A, typename B, typename C, typename D>
+B &getAssert(std::map<A, B, C, D> &m, const A &x,
              const std::string &str = "")
 {
     return const_cast<B &>(constGetAssert(m, x, str));